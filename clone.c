@@ -0,0 +1,57 @@
+#include "myfs_ioctl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s <source> <destination>\n"
+			"\n"
+			"Copy a file on a mounted filesystem by sharing its data blocks.\n"
+			"Both files must be on the same filesystem.\n"
+			, name);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	int src = open(argv[1], O_RDONLY);
+	if (src == -1) {
+		perror(argv[1]);
+		return 1;
+	}
+	struct stat st;
+	if (fstat(src, &st) != 0) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	int dest = open(argv[2], O_WRONLY | O_CREAT, st.st_mode & 0777);
+	if (dest == -1) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	// Cached writes to the source must reach the filesystem first
+	fsync(src);
+
+	uint64_t ino = st.st_ino;
+	if (ioctl(dest, MYFS_IOC_CLONE, &ino) != 0) {
+		perror("Failed to clone");
+		return 1;
+	}
+
+	close(dest);
+	close(src);
+	return 0;
+}
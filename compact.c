@@ -0,0 +1,148 @@
+#include "myfs.h"
+#include "journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+static int fd = -1;
+static struct fsinfo_t fs;
+static int recursive = 0;
+
+static uint64_t compact(const char *path, uint32_t dir_inode_num, struct inode_t *dir_inode);
+
+struct subdirs_data
+{
+	const char *path;
+	uint64_t saved;
+};
+
+static int compact_subdir_cb(void *data, uint32_t inode_num, const char *name, uint16_t name_len,
+		uint64_t pos, uint64_t next_pos)
+{
+	struct subdirs_data *d = (struct subdirs_data *)data;
+
+	struct inode_t inode;
+	read_inode(fd, &fs, inode_num, &inode);
+	if ((inode.mode & mode_ftype_mask) != mode_ftype_dir)
+		return 0;
+
+	size_t path_len = strlen(d->path);
+	char *path = (char *)malloc(path_len + name_len + 2);
+	memcpy(path, d->path, path_len);
+	if (path_len == 0 || path[path_len - 1] != '/')
+		path[path_len++] = '/';
+	memcpy(path + path_len, name, name_len);
+	path[path_len + name_len] = '\0';
+
+	d->saved += compact(path, inode_num, &inode);
+	free(path);
+	return 0;
+}
+
+/* returns: the number of bytes saved */
+static uint64_t compact(const char *path, uint32_t dir_inode_num, struct inode_t *dir_inode)
+{
+	const uint64_t size = dir_inode->size;
+	const uint64_t saved = compact_dir(fd, &fs, dir_inode_num, dir_inode);
+	if (saved > 0)
+		printf("%s: %lu -> %lu bytes\n", path, (unsigned long)size, (unsigned long)dir_inode->size);
+
+	if (!recursive)
+		return saved;
+
+	// Compacting doesn't change the entries, only where they are, so the
+	// directory can be walked afterwards
+	struct subdirs_data d = { path, saved };
+	read_dir(fd, &fs, dir_inode, 0, compact_subdir_cb, &d);
+	return d.saved;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s [-r] <device> [directory...]\n"
+			"\n"
+			"Rewrite directories densely and shrink them. The filesystem must not be mounted.\n"
+			"    -r    Also compact all subdirectories\n"
+			, name);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "r")) != -1) {
+		switch (opt) {
+		case 'r':
+			recursive = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[optind], O_RDWR);
+	if (fd == -1) {
+		perror("Failed to open device:");
+		return 1;
+	}
+
+	read_fsinfo(fd, &fs);
+	if (fs.main_block.features & ~MYFS_FEATURES_SUPPORTED) {
+		fprintf(stderr, "The filesystem uses unsupported features\n");
+		return 1;
+	}
+	// Directories are rewritten in place, after what the journal holds
+	const int replayed = journal_replay(fd, &fs);
+	if (replayed < 0) {
+		fprintf(stderr, "The journal is invalid\n");
+		return 1;
+	}
+	if (replayed > 0)
+		read_fsinfo(fd, &fs);
+	if (fs.main_block.state != MYFS_STATE_CLEAN)
+		rescan_allocator(fd, &fs);
+	write_fs_state(fd, &fs, MYFS_STATE_DIRTY);
+
+	const char *root = "/";
+	char **dirs = argv + optind + 1;
+	int dir_count = argc - optind - 1;
+	if (dir_count == 0) {
+		dirs = (char **)&root;
+		dir_count = 1;
+	}
+
+	int ret = 0;
+	uint64_t saved = 0;
+	for (int i = 0; i < dir_count; ++i) {
+		uint32_t inode_num;
+		struct inode_t inode;
+		if (!get_path_inode(fd, &fs, dirs[i], &inode_num, &inode, NULL, NULL, NULL)) {
+			fprintf(stderr, "%s: No such file or directory\n", dirs[i]);
+			ret = 1;
+			continue;
+		}
+		if ((inode.mode & mode_ftype_mask) != mode_ftype_dir) {
+			fprintf(stderr, "%s: Not a directory\n", dirs[i]);
+			ret = 1;
+			continue;
+		}
+		saved += compact(dirs[i], inode_num, &inode);
+	}
+
+	write_fs_state(fd, &fs, MYFS_STATE_CLEAN);
+	printf("%lu bytes saved\n", (unsigned long)saved);
+
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,106 @@
+#include "myfs.h"
+#include "journal.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Inodes read at once */
+#define INODE_CHUNK 16384
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s [-m] [-v] <device>\n"
+			"\n"
+			"Move each fragmented file to contiguous free space. The filesystem must not be mounted.\n"
+			"    -m    Also move directories, and indirect blocks next to the data they map\n"
+			"    -v    Print the files moved\n"
+			, name);
+}
+
+int main(int argc, char **argv)
+{
+	int metadata = 0, verbose = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "mv")) != -1) {
+		switch (opt) {
+		case 'm':
+			metadata = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	int fd = open(argv[optind], O_RDWR);
+	if (fd == -1) {
+		perror("Failed to open device:");
+		return 1;
+	}
+
+	struct fsinfo_t fs;
+	read_fsinfo(fd, &fs);
+	if (fs.main_block.features & ~MYFS_FEATURES_SUPPORTED) {
+		fprintf(stderr, "The filesystem uses unsupported features\n");
+		return 1;
+	}
+	// Blocks are moved in place, after what the journal holds
+	const int replayed = journal_replay(fd, &fs);
+	if (replayed < 0) {
+		fprintf(stderr, "The journal is invalid\n");
+		return 1;
+	}
+	if (replayed > 0)
+		read_fsinfo(fd, &fs);
+	if (fs.main_block.state != MYFS_STATE_CLEAN)
+		rescan_allocator(fd, &fs);
+	write_fs_state(fd, &fs, MYFS_STATE_DIRTY);
+
+	// Files are laid out in inode order from the beginning of the data blocks
+	const uint32_t limit = fs.main_block.inode_count_limit;
+	struct inode_t *inodes = (struct inode_t *)malloc(INODE_CHUNK * sizeof(struct inode_t));
+	uint8_t bitmap[INODE_CHUNK / 8];
+	uint64_t goal = 0, moved = 0, no_space = 0;
+	for (uint32_t first = 0; first < limit; first += INODE_CHUNK) {
+		const uint32_t count = MIN(INODE_CHUNK, limit - first);
+		dev_read(fd, &fs, bitmap, CEIL_DIV(count, 8), fs.inode_bitmap_pos + first / 8);
+		read_inode_range(fd, &fs, first, count, inodes);
+		for (uint32_t i = 0; i < count; ++i) {
+			if (!(bitmap[i / 8] & (1 << (i % 8))))
+				continue;
+			if (!metadata && (inodes[i].mode & mode_ftype_mask) == mode_ftype_dir)
+				continue;
+			const int r = defrag_file(fd, &fs, first + i, &inodes[i], metadata, &goal);
+			if (r > 0) {
+				++moved;
+				if (verbose)
+					printf("inode %u: %lu blocks moved\n", first + i, (unsigned long)inodes[i].blocks);
+			} else if (r < 0) {
+				++no_space;
+				if (verbose)
+					printf("inode %u: no free space to move it to\n", first + i);
+			}
+		}
+	}
+	free(inodes);
+
+	write_fs_state(fd, &fs, MYFS_STATE_CLEAN);
+	printf("%lu files moved, %lu left fragmented for lack of free space\n", (unsigned long)moved, (unsigned long)no_space);
+
+	close(fd);
+	return 0;
+}
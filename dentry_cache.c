@@ -0,0 +1,195 @@
+#include "dentry_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Expected average memory used by a single entry; used to size the hash table
+#define AVERAGE_ENTRY_SIZE 64
+#define MIN_TABLE_SIZE 64
+
+static uint32_t hash_name(uint32_t parent, const char *name, uint16_t name_len)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < 4; ++i) {
+		h ^= (parent >> (8 * i)) & 0xFF;
+		h *= 16777619u;
+	}
+	for (uint16_t i = 0; i < name_len; ++i) {
+		h ^= (uint8_t)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static size_t node_size(uint16_t name_len)
+{
+	return sizeof(struct dentry_cache_node_t) + name_len;
+}
+
+static void lru_unlink(struct dentry_cache_t *dc, struct dentry_cache_node_t *node)
+{
+	if (node->lru_prev)
+		node->lru_prev->lru_next = node->lru_next;
+	else
+		dc->lru_head = node->lru_next;
+
+	if (node->lru_next)
+		node->lru_next->lru_prev = node->lru_prev;
+	else
+		dc->lru_tail = node->lru_prev;
+
+	node->lru_prev = node->lru_next = NULL;
+}
+
+static void lru_push_front(struct dentry_cache_t *dc, struct dentry_cache_node_t *node)
+{
+	node->lru_prev = NULL;
+	node->lru_next = dc->lru_head;
+	if (dc->lru_head)
+		dc->lru_head->lru_prev = node;
+	else
+		dc->lru_tail = node;
+	dc->lru_head = node;
+}
+
+/* Unlink node from the hash table and the LRU list and free it */
+static void remove_node(struct dentry_cache_t *dc, struct dentry_cache_node_t *node)
+{
+	struct dentry_cache_node_t **link = &dc->nodes[node->hash % dc->table_size];
+	while (*link != node)
+		link = &(*link)->next;
+	*link = node->next;
+
+	lru_unlink(dc, node);
+	dc->used_bytes -= node_size(node->name_len);
+	free(node);
+}
+
+static struct dentry_cache_node_t *find_node(const struct dentry_cache_t *dc, uint32_t hash,
+		uint32_t parent, const char *name, uint16_t name_len)
+{
+	struct dentry_cache_node_t *node = dc->nodes[hash % dc->table_size];
+	while (node) {
+		if (node->hash == hash && node->parent == parent && node->name_len == name_len &&
+				memcmp(node->name, name, name_len) == 0)
+			return node;
+		node = node->next;
+	}
+	return NULL;
+}
+
+void dentry_cache_initialize(struct dentry_cache_t *dc, size_t max_bytes)
+{
+	uint32_t table_size = MIN_TABLE_SIZE;
+	while (table_size < max_bytes / AVERAGE_ENTRY_SIZE)
+		table_size *= 2;
+
+	dc->nodes = (struct dentry_cache_node_t **)calloc(table_size, sizeof(struct dentry_cache_node_t *));
+	dc->table_size = table_size;
+	dc->lru_head = dc->lru_tail = NULL;
+	dc->used_bytes = 0;
+	dc->max_bytes = max_bytes;
+	dc->hits = 0;
+	dc->negative_hits = 0;
+	dc->misses = 0;
+	pthread_mutex_init(&dc->lock, NULL);
+}
+
+void dentry_cache_destroy(struct dentry_cache_t *dc)
+{
+	struct dentry_cache_node_t *node = dc->lru_head;
+	while (node) {
+		struct dentry_cache_node_t *n = node->lru_next;
+		free(node);
+		node = n;
+	}
+	free(dc->nodes);
+	dc->nodes = NULL;
+	dc->lru_head = dc->lru_tail = NULL;
+	dc->used_bytes = 0;
+	pthread_mutex_destroy(&dc->lock);
+}
+
+int dentry_cache_get(struct dentry_cache_t *dc, uint32_t parent, const char *name, uint16_t name_len, uint32_t *inode_num)
+{
+	uint32_t hash = hash_name(parent, name, name_len);
+	pthread_mutex_lock(&dc->lock);
+	struct dentry_cache_node_t *node = find_node(dc, hash, parent, name, name_len);
+	if (!node) {
+		++dc->misses;
+		pthread_mutex_unlock(&dc->lock);
+		return 0;
+	}
+
+	if (node->inode_num == DENTRY_NEGATIVE)
+		++dc->negative_hits;
+	else
+		++dc->hits;
+
+	lru_unlink(dc, node);
+	lru_push_front(dc, node);
+	*inode_num = node->inode_num;
+	pthread_mutex_unlock(&dc->lock);
+	return 1;
+}
+
+void dentry_cache_insert(struct dentry_cache_t *dc, uint32_t parent, const char *name, uint16_t name_len, uint32_t inode_num)
+{
+	uint32_t hash = hash_name(parent, name, name_len);
+	const size_t size = node_size(name_len);
+	if (size > dc->max_bytes)
+		return;
+
+	pthread_mutex_lock(&dc->lock);
+	struct dentry_cache_node_t *node = find_node(dc, hash, parent, name, name_len);
+	if (node) {
+		node->inode_num = inode_num;
+		lru_unlink(dc, node);
+		lru_push_front(dc, node);
+		pthread_mutex_unlock(&dc->lock);
+		return;
+	}
+
+	// Evict the least recently used entries until the new one fits
+	while (dc->used_bytes + size > dc->max_bytes)
+		remove_node(dc, dc->lru_tail);
+
+	node = (struct dentry_cache_node_t *)malloc(size);
+	node->parent = parent;
+	node->inode_num = inode_num;
+	node->hash = hash;
+	node->name_len = name_len;
+	memcpy(node->name, name, name_len);
+
+	struct dentry_cache_node_t **bucket = &dc->nodes[hash % dc->table_size];
+	node->next = *bucket;
+	*bucket = node;
+	lru_push_front(dc, node);
+	dc->used_bytes += size;
+	pthread_mutex_unlock(&dc->lock);
+}
+
+void dentry_cache_remove(struct dentry_cache_t *dc, uint32_t parent, const char *name, uint16_t name_len)
+{
+	uint32_t hash = hash_name(parent, name, name_len);
+	pthread_mutex_lock(&dc->lock);
+	struct dentry_cache_node_t *node = find_node(dc, hash, parent, name, name_len);
+	if (node)
+		remove_node(dc, node);
+	pthread_mutex_unlock(&dc->lock);
+}
+
+void dentry_cache_remove_parent(struct dentry_cache_t *dc, uint32_t parent)
+{
+	// The entries of a directory are spread all over the table, so walk the LRU list
+	pthread_mutex_lock(&dc->lock);
+	struct dentry_cache_node_t *node = dc->lru_head;
+	while (node) {
+		struct dentry_cache_node_t *n = node->lru_next;
+		if (node->parent == parent)
+			remove_node(dc, node);
+		node = n;
+	}
+	pthread_mutex_unlock(&dc->lock);
+}
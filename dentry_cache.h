@@ -0,0 +1,56 @@
+#ifndef DENTRY_CACHE_H_INCLUDED
+#define DENTRY_CACHE_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/* Inode number stored for negative entries (names known not to exist) */
+#define DENTRY_NEGATIVE ((uint32_t)(-1))
+
+/* Cache of (parent inode, name) -> inode lookups
+ *
+ * Entries live both in a hash table and in an LRU list. When the memory
+ * used by the entries exceeds max_bytes the least recently used ones are
+ * evicted. All functions may be called from multiple threads.
+ */
+struct dentry_cache_node_t
+{
+	uint32_t parent;
+	uint32_t inode_num;
+	uint32_t hash;
+	uint16_t name_len;
+	struct dentry_cache_node_t *next;
+	struct dentry_cache_node_t *lru_prev, *lru_next;
+	char name[];
+};
+
+struct dentry_cache_t
+{
+	struct dentry_cache_node_t **nodes;
+	uint32_t table_size;
+	struct dentry_cache_node_t *lru_head, *lru_tail; /* head is the most recently used */
+	size_t used_bytes;
+	size_t max_bytes;
+	pthread_mutex_t lock;
+
+	uint64_t hits;
+	uint64_t negative_hits;
+	uint64_t misses;
+};
+
+void dentry_cache_initialize(struct dentry_cache_t *dc, size_t max_bytes);
+void dentry_cache_destroy(struct dentry_cache_t *dc);
+
+/* returns: 1 and sets inode_num (possibly to DENTRY_NEGATIVE) on a hit; 0 on a miss */
+int dentry_cache_get(struct dentry_cache_t *dc, uint32_t parent, const char *name, uint16_t name_len, uint32_t *inode_num);
+
+/* Add or replace the entry for (parent, name) */
+void dentry_cache_insert(struct dentry_cache_t *dc, uint32_t parent, const char *name, uint16_t name_len, uint32_t inode_num);
+
+void dentry_cache_remove(struct dentry_cache_t *dc, uint32_t parent, const char *name, uint16_t name_len);
+
+/* Remove all entries of the directory parent */
+void dentry_cache_remove_parent(struct dentry_cache_t *dc, uint32_t parent);
+
+#endif
@@ -0,0 +1,347 @@
+#include "dir_filter.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Counters per name; with 5 hashes this gives a false positive rate of about 2%
+#define COUNTERS_PER_NAME 8
+#define HASH_COUNT 5
+#define MIN_FILTER_SIZE 64
+#define TABLE_SIZE 1024
+
+#define FILE_MAGIC 0x544C464Du /* "MFLT" */
+
+static uint64_t hash_name(const char *name, uint16_t name_len)
+{
+	// FNV-1a
+	uint64_t h = 14695981039346656037u;
+	for (uint16_t i = 0; i < name_len; ++i) {
+		h ^= (uint8_t)name[i];
+		h *= 1099511628211u;
+	}
+	return h;
+}
+
+/* Positions of the counters of a name, using double hashing */
+static void counter_positions(const struct dir_filter_t *filter, const char *name, uint16_t name_len,
+		uint32_t pos[HASH_COUNT])
+{
+	const uint64_t h = hash_name(name, name_len);
+	const uint32_t h1 = (uint32_t)h;
+	const uint32_t h2 = (uint32_t)(h >> 32) | 1;
+	for (int i = 0; i < HASH_COUNT; ++i)
+		pos[i] = (h1 + i * h2) & (filter->size - 1);
+}
+
+static size_t filter_bytes(uint32_t size)
+{
+	return sizeof(struct dir_filter_t) + size;
+}
+
+static void lru_unlink(struct dir_filter_map_t *map, struct dir_filter_t *filter)
+{
+	if (filter->lru_prev)
+		filter->lru_prev->lru_next = filter->lru_next;
+	else
+		map->lru_head = filter->lru_next;
+
+	if (filter->lru_next)
+		filter->lru_next->lru_prev = filter->lru_prev;
+	else
+		map->lru_tail = filter->lru_prev;
+
+	filter->lru_prev = filter->lru_next = NULL;
+}
+
+static void lru_push_front(struct dir_filter_map_t *map, struct dir_filter_t *filter)
+{
+	filter->lru_prev = NULL;
+	filter->lru_next = map->lru_head;
+	if (map->lru_head)
+		map->lru_head->lru_prev = filter;
+	else
+		map->lru_tail = filter;
+	map->lru_head = filter;
+}
+
+static struct dir_filter_t *find_filter(const struct dir_filter_map_t *map, uint32_t dir_inode_num)
+{
+	struct dir_filter_t *filter = map->filters[dir_inode_num % map->table_size];
+	while (filter && filter->dir_inode_num != dir_inode_num)
+		filter = filter->next;
+	return filter;
+}
+
+/* Unlink a filter from the hash table and the LRU list and free it */
+static void remove_filter(struct dir_filter_map_t *map, struct dir_filter_t *filter)
+{
+	struct dir_filter_t **link = &map->filters[filter->dir_inode_num % map->table_size];
+	while (*link != filter)
+		link = &(*link)->next;
+	*link = filter->next;
+
+	lru_unlink(map, filter);
+	map->used_bytes -= filter_bytes(filter->size);
+	free(filter);
+}
+
+static struct dir_filter_t *alloc_filter(uint32_t dir_inode_num, uint32_t size)
+{
+	struct dir_filter_t *filter = (struct dir_filter_t *)calloc(1, filter_bytes(size));
+	filter->dir_inode_num = dir_inode_num;
+	filter->count = 0;
+	filter->size = size;
+	return filter;
+}
+
+/* Make room for a filter and insert it, replacing the old filter of the directory
+ *
+ * returns: 1 on success; 0 if it doesn't fit in the memory limit
+ */
+static int insert_filter(struct dir_filter_map_t *map, struct dir_filter_t *filter)
+{
+	struct dir_filter_t *old = find_filter(map, filter->dir_inode_num);
+	if (old)
+		remove_filter(map, old);
+
+	const size_t bytes = filter_bytes(filter->size);
+	if (bytes > map->max_bytes)
+		return 0;
+
+	// Drop the least recently used filters until the new one fits
+	while (map->used_bytes + bytes > map->max_bytes)
+		remove_filter(map, map->lru_tail);
+
+	struct dir_filter_t **bucket = &map->filters[filter->dir_inode_num % map->table_size];
+	filter->next = *bucket;
+	*bucket = filter;
+	lru_push_front(map, filter);
+	map->used_bytes += bytes;
+	return 1;
+}
+
+void dir_filter_map_initialize(struct dir_filter_map_t *map, size_t max_bytes)
+{
+	map->filters = (struct dir_filter_t **)calloc(TABLE_SIZE, sizeof(struct dir_filter_t *));
+	map->table_size = TABLE_SIZE;
+	map->lru_head = map->lru_tail = NULL;
+	map->used_bytes = 0;
+	map->max_bytes = max_bytes;
+	map->negatives = 0;
+	map->false_positives = 0;
+	map->builds = 0;
+	pthread_mutex_init(&map->lock, NULL);
+}
+
+void dir_filter_map_destroy(struct dir_filter_map_t *map)
+{
+	struct dir_filter_t *filter = map->lru_head;
+	while (filter) {
+		struct dir_filter_t *f = filter->lru_next;
+		free(filter);
+		filter = f;
+	}
+	free(map->filters);
+	map->filters = NULL;
+	map->lru_head = map->lru_tail = NULL;
+	map->used_bytes = 0;
+	pthread_mutex_destroy(&map->lock);
+}
+
+struct dir_filter_t *dir_filter_get(struct dir_filter_map_t *map, uint32_t dir_inode_num)
+{
+	pthread_mutex_lock(&map->lock);
+	struct dir_filter_t *filter = find_filter(map, dir_inode_num);
+	pthread_mutex_unlock(&map->lock);
+	return filter;
+}
+
+struct dir_filter_t *dir_filter_new(uint32_t dir_inode_num, uint32_t expected_count)
+{
+	// Leave room for the directory to double in size
+	uint32_t size = MIN_FILTER_SIZE;
+	while (size < 2 * (uint64_t)expected_count * COUNTERS_PER_NAME && size < (1u << 31))
+		size *= 2;
+
+	return alloc_filter(dir_inode_num, size);
+}
+
+void dir_filter_add_name(struct dir_filter_t *filter, const char *name, uint16_t name_len)
+{
+	uint32_t pos[HASH_COUNT];
+	counter_positions(filter, name, name_len, pos);
+	for (int i = 0; i < HASH_COUNT; ++i)
+		if (filter->counters[pos[i]] < UINT8_MAX)
+			++filter->counters[pos[i]];
+	++filter->count;
+}
+
+void dir_filter_publish(struct dir_filter_map_t *map, struct dir_filter_t *filter)
+{
+	pthread_mutex_lock(&map->lock);
+	if (insert_filter(map, filter))
+		++map->builds;
+	else
+		free(filter);
+	pthread_mutex_unlock(&map->lock);
+}
+
+void dir_filter_drop(struct dir_filter_map_t *map, uint32_t dir_inode_num)
+{
+	pthread_mutex_lock(&map->lock);
+	struct dir_filter_t *filter = find_filter(map, dir_inode_num);
+	if (filter)
+		remove_filter(map, filter);
+	pthread_mutex_unlock(&map->lock);
+}
+
+int dir_filter_check(struct dir_filter_map_t *map, uint32_t dir_inode_num, const char *name, uint16_t name_len)
+{
+	pthread_mutex_lock(&map->lock);
+	int ret = -1;
+	struct dir_filter_t *filter = find_filter(map, dir_inode_num);
+	if (filter) {
+		lru_unlink(map, filter);
+		lru_push_front(map, filter);
+		ret = dir_filter_may_contain(filter, name, name_len);
+		if (!ret)
+			++map->negatives;
+	}
+	pthread_mutex_unlock(&map->lock);
+	return ret;
+}
+
+void dir_filter_count_false_positive(struct dir_filter_map_t *map)
+{
+	pthread_mutex_lock(&map->lock);
+	++map->false_positives;
+	pthread_mutex_unlock(&map->lock);
+}
+
+int dir_filter_may_contain(const struct dir_filter_t *filter, const char *name, uint16_t name_len)
+{
+	uint32_t pos[HASH_COUNT];
+	counter_positions(filter, name, name_len, pos);
+	for (int i = 0; i < HASH_COUNT; ++i)
+		if (filter->counters[pos[i]] == 0)
+			return 0;
+	return 1;
+}
+
+void dir_filter_add(struct dir_filter_map_t *map, uint32_t dir_inode_num, const char *name, uint16_t name_len)
+{
+	pthread_mutex_lock(&map->lock);
+	struct dir_filter_t *filter = find_filter(map, dir_inode_num);
+	if (filter) {
+		if ((uint64_t)(filter->count + 1) * COUNTERS_PER_NAME > filter->size)
+			// Too full to be useful, a bigger one is built on the next search
+			remove_filter(map, filter);
+		else
+			dir_filter_add_name(filter, name, name_len);
+	}
+	pthread_mutex_unlock(&map->lock);
+}
+
+void dir_filter_remove(struct dir_filter_map_t *map, uint32_t dir_inode_num, const char *name, uint16_t name_len)
+{
+	pthread_mutex_lock(&map->lock);
+	struct dir_filter_t *filter = find_filter(map, dir_inode_num);
+	if (!filter) {
+		pthread_mutex_unlock(&map->lock);
+		return;
+	}
+
+	uint32_t pos[HASH_COUNT];
+	counter_positions(filter, name, name_len, pos);
+	for (int i = 0; i < HASH_COUNT; ++i) {
+		// A saturated counter may be shared by more names than it can count
+		if (filter->counters[pos[i]] > 0 && filter->counters[pos[i]] < UINT8_MAX)
+			--filter->counters[pos[i]];
+	}
+	if (filter->count > 0)
+		--filter->count;
+	pthread_mutex_unlock(&map->lock);
+}
+
+double dir_filter_false_positive_rate(const struct dir_filter_map_t *map)
+{
+	const uint64_t missing = map->negatives + map->false_positives;
+	return missing == 0 ? 0.0 : (double)map->false_positives / (double)missing;
+}
+
+/*
+ * File format:
+ * u32 magic, u64 id, u32 filter count;
+ * for each filter: u32 dir inode, u32 name count, u32 size, `size` counters
+ */
+
+int dir_filter_map_save(const struct dir_filter_map_t *map, FILE *f, uint64_t id)
+{
+	uint32_t filter_count = 0;
+	for (const struct dir_filter_t *filter = map->lru_head; filter; filter = filter->lru_next)
+		++filter_count;
+
+	uint8_t header[16];
+	util_write_u32(header, FILE_MAGIC);
+	util_write_u64(header + 0x4, id);
+	util_write_u32(header + 0xC, filter_count);
+	if (fwrite(header, sizeof(header), 1, f) != 1)
+		return -1;
+
+	// Least recently used first, so that they end up in the same order when loaded
+	for (const struct dir_filter_t *filter = map->lru_tail; filter; filter = filter->lru_prev) {
+		uint8_t buf[12];
+		util_write_u32(buf, filter->dir_inode_num);
+		util_write_u32(buf + 0x4, filter->count);
+		util_write_u32(buf + 0x8, filter->size);
+		if (fwrite(buf, sizeof(buf), 1, f) != 1 || fwrite(filter->counters, filter->size, 1, f) != 1)
+			return -1;
+	}
+
+	return 0;
+}
+
+int dir_filter_map_load(struct dir_filter_map_t *map, FILE *f, uint64_t id)
+{
+	uint8_t header[16];
+	if (fread(header, sizeof(header), 1, f) != 1)
+		return -1;
+
+	uint32_t magic, filter_count;
+	uint64_t file_id;
+	util_read_u32(header, &magic);
+	util_read_u64(header + 0x4, &file_id);
+	util_read_u32(header + 0xC, &filter_count);
+	if (magic != FILE_MAGIC || file_id != id)
+		return -1;
+
+	for (uint32_t i = 0; i < filter_count; ++i) {
+		uint8_t buf[12];
+		uint32_t dir_inode_num, count, size;
+		if (fread(buf, sizeof(buf), 1, f) != 1)
+			goto fail;
+		util_read_u32(buf, &dir_inode_num);
+		util_read_u32(buf + 0x4, &count);
+		util_read_u32(buf + 0x8, &size);
+		if (size < MIN_FILTER_SIZE || (size & (size - 1)) != 0)
+			goto fail;
+
+		struct dir_filter_t *filter = alloc_filter(dir_inode_num, size);
+		filter->count = count;
+		if (fread(filter->counters, size, 1, f) != 1) {
+			free(filter);
+			goto fail;
+		}
+		// Filters that don't fit with the current memory limit are skipped
+		if (!insert_filter(map, filter))
+			free(filter);
+	}
+
+	return 0;
+
+fail:
+	while (map->lru_head)
+		remove_filter(map, map->lru_head);
+	return -1;
+}
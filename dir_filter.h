@@ -0,0 +1,107 @@
+#ifndef DIR_FILTER_H_INCLUDED
+#define DIR_FILTER_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/* Counting Bloom filter of the names in a directory
+ *
+ * A name the filter doesn't contain is known not to exist in the directory,
+ * so the directory doesn't have to be read. Counters make it possible to
+ * remove names; saturated counters are never decremented.
+ */
+struct dir_filter_t
+{
+	uint32_t dir_inode_num;
+	uint32_t count; /* Number of names in the filter */
+	uint32_t size;  /* Number of counters, a power of 2 */
+	struct dir_filter_t *next;
+	struct dir_filter_t *lru_prev, *lru_next;
+	uint8_t counters[];
+};
+
+/* Filters of the directories, keyed by inode number
+ *
+ * When the memory used by the filters exceeds max_bytes the least recently
+ * used ones are dropped. They are rebuilt the next time the directory is
+ * searched.
+ *
+ * All functions taking the map may be called from multiple threads. Filters
+ * are built privately with dir_filter_new() and dir_filter_add_name() and
+ * then published, so a partially built filter is never used.
+ */
+struct dir_filter_map_t
+{
+	struct dir_filter_t **filters;
+	uint32_t table_size;
+	struct dir_filter_t *lru_head, *lru_tail; /* head is the most recently used */
+	size_t used_bytes;
+	size_t max_bytes;
+	pthread_mutex_t lock;
+
+	uint64_t negatives;       /* Lookups answered without reading the directory */
+	uint64_t false_positives; /* Lookups of missing names the filter didn't rule out */
+	uint64_t builds;          /* Number of filters built */
+};
+
+void dir_filter_map_initialize(struct dir_filter_map_t *map, size_t max_bytes);
+void dir_filter_map_destroy(struct dir_filter_map_t *map);
+
+/* returns: the filter of the directory; NULL if there is none
+ *
+ * The filter may be freed as soon as another thread uses the map.
+ */
+struct dir_filter_t *dir_filter_get(struct dir_filter_map_t *map, uint32_t dir_inode_num);
+
+/* Allocate an empty filter for a directory of about `expected_count` names */
+struct dir_filter_t *dir_filter_new(uint32_t dir_inode_num, uint32_t expected_count);
+
+/* Add a name to a filter that hasn't been published yet */
+void dir_filter_add_name(struct dir_filter_t *filter, const char *name, uint16_t name_len);
+
+/* Hand a filter built with dir_filter_new() over to the map, replacing the old filter of the directory */
+void dir_filter_publish(struct dir_filter_map_t *map, struct dir_filter_t *filter);
+
+void dir_filter_drop(struct dir_filter_map_t *map, uint32_t dir_inode_num);
+
+/* returns: 0 if the name is definitely not in the filter; 1 if it might be */
+int dir_filter_may_contain(const struct dir_filter_t *filter, const char *name, uint16_t name_len);
+
+/* Test a name against the filter of a directory
+ *
+ * returns: -1 if the directory has no filter; otherwise like dir_filter_may_contain()
+ */
+int dir_filter_check(struct dir_filter_map_t *map, uint32_t dir_inode_num, const char *name, uint16_t name_len);
+
+/* Account for a name dir_filter_check() didn't rule out, but which doesn't exist */
+void dir_filter_count_false_positive(struct dir_filter_map_t *map);
+
+/* Add a name to the filter of a directory, if it has one
+ *
+ * Filters that get too full to be useful are dropped.
+ */
+void dir_filter_add(struct dir_filter_map_t *map, uint32_t dir_inode_num, const char *name, uint16_t name_len);
+
+/* Remove a name previously added to the filter of a directory, if it has one */
+void dir_filter_remove(struct dir_filter_map_t *map, uint32_t dir_inode_num, const char *name, uint16_t name_len);
+
+/* returns: the fraction of lookups of missing names that the filters didn't rule out */
+double dir_filter_false_positive_rate(const struct dir_filter_map_t *map);
+
+/* Save all filters to `f`, tagged with `id`
+ *
+ * id identifies the state of the filesystem; filters are only loaded back
+ * if it matches.
+ * returns: 0 on success; -1 on failure
+ */
+int dir_filter_map_save(const struct dir_filter_map_t *map, FILE *f, uint64_t id);
+
+/* Load filters saved by dir_filter_map_save()
+ *
+ * returns: 0 on success; -1 if the file is invalid or `id` doesn't match, in which case nothing is loaded
+ */
+int dir_filter_map_load(struct dir_filter_map_t *map, FILE *f, uint64_t id);
+
+#endif
@@ -0,0 +1,200 @@
+#include "myfs.h"
+#include "dump.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+static int fd = -1;
+static struct fsinfo_t fs;
+static FILE *out;
+static uint8_t *buffer;  /* DUMP_CHUNK bytes */
+static uint64_t dumped;  /* Bytes of the device written out */
+
+static void write_record(uint64_t pos, uint64_t len, const uint8_t *data)
+{
+	uint8_t header[DUMP_RECORD_SIZE];
+	util_write_u64(header, pos);
+	util_write_u64(header + 8, len);
+	fwrite(header, sizeof(header), 1, out);
+	fwrite(data, len, 1, out);
+	dumped += len;
+}
+
+static int is_zero(const uint8_t *data, uint64_t len)
+{
+	return data[0] == 0 && memcmp(data, data + 1, len - 1) == 0;
+}
+
+/* Dump a range of the device
+ *
+ * With skip_zeros, the blocks of it that are all zeros are left out.
+ */
+static void dump_range(uint64_t pos, uint64_t len, int skip_zeros)
+{
+	const uint16_t bs = fs.main_block.block_size;
+	while (len > 0) {
+		const uint64_t n = MIN(len, DUMP_CHUNK);
+		pread(fd, buffer, n, pos);
+		if (!skip_zeros) {
+			write_record(pos, n, buffer);
+		} else {
+			// A record for each run of blocks with data in them
+			uint64_t start = 0;
+			int in_run = 0;
+			for (uint64_t i = 0; i < n; ) {
+				const uint64_t piece = MIN(n - i, bs - (pos + i) % bs);
+				const int zero = is_zero(buffer + i, piece);
+				if (zero && in_run)
+					write_record(pos + start, i - start, buffer + start);
+				else if (!zero && !in_run)
+					start = i;
+				in_run = !zero;
+				i += piece;
+			}
+			if (in_run)
+				write_record(pos + start, n - start, buffer + start);
+		}
+		pos += n;
+		len -= n;
+	}
+}
+
+/* Call cb for each run of set bits of a bitmap of `count` bits */
+static void for_each_run(uint64_t bitmap_pos, uint64_t count, void (*cb)(uint64_t first, uint64_t n))
+{
+	const uint64_t bytes = CEIL_DIV(count, 8);
+	uint8_t *bitmap = (uint8_t *)malloc(MIN(bytes, DUMP_CHUNK));
+	uint64_t run = 0;
+	for (uint64_t pos = 0; pos < bytes; pos += DUMP_CHUNK) {
+		const uint64_t len = MIN(DUMP_CHUNK, bytes - pos);
+		pread(fd, bitmap, len, bitmap_pos + pos);
+		for (uint64_t i = 0; i < len; ++i) {
+			const uint64_t bit = (pos + i) * 8;
+			// Whole bytes at once where they are all set or all clear
+			if (bitmap[i] == 0xFF && bit + 8 <= count) {
+				run += 8;
+				continue;
+			}
+			if (bitmap[i] == 0 && run == 0)
+				continue;
+			for (int j = 0; j < 8 && bit + j < count; ++j) {
+				if (bitmap[i] & (1 << j)) {
+					++run;
+				} else if (run > 0) {
+					cb(bit + j - run, run);
+					run = 0;
+				}
+			}
+		}
+	}
+	if (run > 0)
+		cb(count - run, run);
+	free(bitmap);
+}
+
+static void dump_inodes(uint64_t first, uint64_t n)
+{
+	dump_range(fs.inodes_pos + first * fs.inode_size, n * fs.inode_size, 0);
+}
+
+static void dump_blocks(uint64_t first, uint64_t n)
+{
+	const uint16_t bs = fs.main_block.block_size;
+	dump_range(fs.blocks_pos + first * bs, n * bs, 1);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s [-f] <device> [output]\n"
+			"\n"
+			"Write the metadata and the used blocks of a filesystem to output, or to the\n"
+			"standard output, for restore.myfs. The filesystem must not be mounted.\n"
+			"    -f    Dump it even if it wasn't unmounted cleanly; what is only in the\n"
+			"          journal may be missing\n"
+			, name);
+}
+
+int main(int argc, char **argv)
+{
+	int force = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "f")) != -1) {
+		switch (opt) {
+		case 'f':
+			force = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 && optind != argc - 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd == -1) {
+		perror("Failed to open device:");
+		return 1;
+	}
+	read_fsinfo(fd, &fs);
+	if (fs.main_block.features & ~MYFS_FEATURES_SUPPORTED) {
+		fprintf(stderr, "The filesystem uses unsupported features\n");
+		return 1;
+	}
+	// The bitmaps are only up to date once the journal has been written to its place
+	if (fs.main_block.state != MYFS_STATE_CLEAN && !force) {
+		fprintf(stderr, "The filesystem wasn't unmounted cleanly; check it with fsck.myfs -y first\n");
+		return 1;
+	}
+
+	out = stdout;
+	if (optind == argc - 2 && strcmp(argv[optind + 1], "-") != 0) {
+		out = fopen(argv[optind + 1], "wb");
+		if (!out) {
+			perror(argv[optind + 1]);
+			return 1;
+		}
+	}
+	setvbuf(out, NULL, _IOFBF, DUMP_CHUNK);
+	buffer = (uint8_t *)malloc(DUMP_CHUNK);
+
+	const uint64_t size = lseek(fd, 0, SEEK_END);
+	uint8_t header[DUMP_HEADER_SIZE];
+	util_write_u64(header, DUMP_MAGIC);
+	util_write_u32(header + 8, DUMP_VERSION);
+	util_write_u32(header + 12, fs.main_block.block_size);
+	util_write_u64(header + 16, size);
+	fwrite(header, sizeof(header), 1, out);
+
+	// Everything before the inode table, then the inodes and data blocks in use
+	dump_range(0, fs.inodes_pos, 1);
+	for_each_run(fs.inode_bitmap_pos, fs.main_block.inode_count_limit, dump_inodes);
+	for_each_run(fs.data_blocks_bitmap_pos, fs.main_block.data_block_count, dump_blocks);
+
+	uint8_t end[DUMP_RECORD_SIZE];
+	util_write_u64(end, DUMP_END);
+	util_write_u64(end + 8, dumped);
+	fwrite(end, sizeof(end), 1, out);
+
+	int ret = 0;
+	if (fflush(out) != 0 || ferror(out)) {
+		perror("Failed to write the dump");
+		ret = 1;
+	}
+	if (out != stdout)
+		fclose(out);
+	fprintf(stderr, "%lu of %lu bytes dumped\n", (unsigned long)dumped, (unsigned long)size);
+
+	free(buffer);
+	close(fd);
+	return ret;
+}
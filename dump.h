@@ -0,0 +1,22 @@
+#ifndef DUMP_H_INCLUDED
+#define DUMP_H_INCLUDED
+
+/* Stream written by dump.myfs and read by restore.myfs
+ *
+ * header: u64 magic, u32 version, u32 block size, u64 device size
+ * records: u64 position on the device, u64 length, then that many bytes
+ * end: u64 DUMP_END, u64 total length of the records
+ *
+ * Records are in increasing position order and don't overlap. What they
+ * don't cover reads as zeros. Numbers are little-endian.
+ */
+#define DUMP_MAGIC 0x504D55445346594Dull /* "MYFSDUMP" */
+#define DUMP_VERSION 1
+#define DUMP_HEADER_SIZE 24
+#define DUMP_RECORD_SIZE 16
+#define DUMP_END UINT64_MAX
+
+/* Largest read or write of the tools */
+#define DUMP_CHUNK (1024 * 1024)
+
+#endif
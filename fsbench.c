@@ -0,0 +1,396 @@
+#include "myfs.h"
+#include "util.h"
+#include "dentry_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Microbenchmarks of the core, on an image that should be on a tmpfs so that
+ * the device doesn't dominate the results
+ *
+ * Each benchmark prints a JSON object with its throughput, operations per
+ * second and the read and write system calls it made, from /proc/self/io.
+ */
+
+static int fd = -1;
+static struct fsinfo_t fs;
+static uint64_t rng = 88172645463325252ull;
+
+static uint64_t next_random(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+/* A measurement, accumulated over one or more timed sections */
+struct bench_t
+{
+	const char *name;
+	uint32_t io_size;   /* Bytes per operation; 0 if it doesn't apply */
+	uint64_t ops;
+	uint64_t bytes;
+	double seconds;
+	uint64_t read_calls, write_calls;
+
+	struct timespec start;
+	uint64_t start_read_calls, start_write_calls;
+};
+
+static int first_result = 1;
+
+static void count_syscalls(uint64_t *read_calls, uint64_t *write_calls)
+{
+	*read_calls = *write_calls = 0;
+	FILE *f = fopen("/proc/self/io", "r");
+	if (!f)
+		return;
+	char line[64];
+	unsigned long long n;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "syscr: %llu", &n) == 1)
+			*read_calls = n;
+		else if (sscanf(line, "syscw: %llu", &n) == 1)
+			*write_calls = n;
+	}
+	fclose(f);
+}
+
+static void bench_init(struct bench_t *b, const char *name, uint32_t io_size)
+{
+	memset(b, 0, sizeof(*b));
+	b->name = name;
+	b->io_size = io_size;
+}
+
+static void bench_start(struct bench_t *b)
+{
+	// Reading /proc/self/io is a read too; it is left out by counting before the clock starts
+	count_syscalls(&b->start_read_calls, &b->start_write_calls);
+	b->start_read_calls += 1;
+	clock_gettime(CLOCK_MONOTONIC, &b->start);
+}
+
+static void bench_stop(struct bench_t *b)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	uint64_t read_calls, write_calls;
+	count_syscalls(&read_calls, &write_calls);
+	b->seconds += (end.tv_sec - b->start.tv_sec) + (end.tv_nsec - b->start.tv_nsec) / 1e9;
+	b->read_calls += read_calls - b->start_read_calls;
+	b->write_calls += write_calls - b->start_write_calls;
+}
+
+static void bench_report(const struct bench_t *b)
+{
+	const double seconds = b->seconds > 0 ? b->seconds : 1e-9;
+	printf("%s    {\"name\": \"%s\", \"io_size\": %u, \"ops\": %lu, \"bytes\": %lu, \"seconds\": %.6f, "
+			"\"mb_per_s\": %.2f, \"ops_per_s\": %.1f, \"read_syscalls\": %lu, \"write_syscalls\": %lu}",
+			first_result ? "" : ",\n", b->name, b->io_size, (unsigned long)b->ops, (unsigned long)b->bytes,
+			b->seconds, b->bytes / seconds / (1024 * 1024), b->ops / seconds,
+			(unsigned long)b->read_calls, (unsigned long)b->write_calls);
+	first_result = 0;
+	fflush(stdout);
+}
+
+static void new_file(uint32_t *inode_num, struct inode_t *inode)
+{
+	initialize_inode(inode, 0, 0, 0644 | mode_ftype_file);
+	create_inode(fd, &fs, inode, inode_num);
+}
+
+/* Sequential and random reads and writes of a file_size file, io_size bytes at a time */
+static void bench_read_write(uint64_t file_size, uint32_t io_size)
+{
+	uint32_t num;
+	struct inode_t inode;
+	new_file(&num, &inode);
+	uint8_t *buffer = (uint8_t *)malloc(io_size);
+	for (uint32_t i = 0; i < io_size; ++i)
+		buffer[i] = i * 13;
+	const uint64_t count = file_size / io_size;
+	const uint64_t random_count = MAX(count / 4, 256);
+	struct bench_t b;
+
+	// Every write updates the inode, like one through the daemon
+	bench_init(&b, "seq_write", io_size);
+	bench_start(&b);
+	for (uint64_t i = 0; i < count; ++i) {
+		inode_data_write(fd, &fs, &inode, buffer, io_size, i * io_size);
+		write_inode(fd, &fs, num, &inode);
+	}
+	bench_stop(&b);
+	b.ops = count;
+	b.bytes = count * io_size;
+	bench_report(&b);
+
+	bench_init(&b, "seq_read", io_size);
+	bench_start(&b);
+	for (uint64_t i = 0; i < count; ++i)
+		inode_data_read(fd, &fs, &inode, buffer, io_size, i * io_size);
+	bench_stop(&b);
+	b.ops = count;
+	b.bytes = count * io_size;
+	bench_report(&b);
+
+	bench_init(&b, "rand_read", io_size);
+	bench_start(&b);
+	for (uint64_t i = 0; i < random_count; ++i)
+		inode_data_read(fd, &fs, &inode, buffer, io_size, next_random() % count * io_size);
+	bench_stop(&b);
+	b.ops = random_count;
+	b.bytes = random_count * io_size;
+	bench_report(&b);
+
+	bench_init(&b, "rand_write", io_size);
+	bench_start(&b);
+	for (uint64_t i = 0; i < random_count; ++i) {
+		inode_data_write(fd, &fs, &inode, buffer, io_size, next_random() % count * io_size);
+		write_inode(fd, &fs, num, &inode);
+	}
+	bench_stop(&b);
+	b.ops = random_count;
+	b.bytes = random_count * io_size;
+	bench_report(&b);
+
+	remove_file(fd, &fs, num, &inode);
+	free(buffer);
+}
+
+/* Truncating a file_size file to nothing and growing it back, `rounds` times */
+static void bench_truncate(uint64_t file_size, uint32_t rounds)
+{
+	uint32_t num;
+	struct inode_t inode;
+	new_file(&num, &inode);
+	const uint32_t chunk = 1024 * 1024;
+	uint8_t *buffer = (uint8_t *)calloc(1, chunk);
+	struct bench_t down, up;
+	bench_init(&down, "truncate_down", 0);
+	bench_init(&up, "truncate_up", 0);
+	for (uint32_t r = 0; r < rounds; ++r) {
+		// Shrinking frees the blocks of the data written in between
+		for (uint64_t pos = 0; pos < file_size; pos += chunk)
+			inode_data_write(fd, &fs, &inode, buffer, MIN(chunk, file_size - pos), pos);
+		bench_start(&down);
+		resize_file(fd, &fs, &inode, 0);
+		write_inode(fd, &fs, num, &inode);
+		bench_stop(&down);
+
+		bench_start(&up);
+		resize_file(fd, &fs, &inode, file_size);
+		write_inode(fd, &fs, num, &inode);
+		bench_stop(&up);
+		resize_file(fd, &fs, &inode, 0);
+	}
+	down.ops = up.ops = rounds;
+	bench_report(&down);
+	bench_report(&up);
+
+	remove_file(fd, &fs, num, &inode);
+	free(buffer);
+}
+
+static void make_dir(uint32_t parent_num, struct inode_t *parent, const char *name,
+		uint32_t *inode_num, struct inode_t *inode)
+{
+	initialize_inode(inode, 0, 0, 0755 | mode_ftype_dir);
+	create_inode(fd, &fs, inode, inode_num);
+	add_inode_to_dir(fd, &fs, parent_num, parent, *inode_num, inode, name);
+}
+
+/* Creating `count` files in a directory, then unlinking them in random order */
+static void bench_create_unlink(uint32_t count)
+{
+	uint32_t root_num = 0, dir_num, num;
+	struct inode_t root, dir, inode;
+	read_inode(fd, &fs, root_num, &root);
+	make_dir(root_num, &root, "many", &dir_num, &dir);
+	struct bench_t b;
+	char name[32];
+
+	bench_init(&b, "create", 0);
+	bench_start(&b);
+	for (uint32_t i = 0; i < count; ++i) {
+		snprintf(name, sizeof(name), "file%u", i);
+		new_file(&num, &inode);
+		add_inode_to_dir(fd, &fs, dir_num, &dir, num, &inode, name);
+	}
+	bench_stop(&b);
+	b.ops = count;
+	bench_report(&b);
+
+	uint32_t *order = (uint32_t *)malloc(count * sizeof(uint32_t));
+	for (uint32_t i = 0; i < count; ++i)
+		order[i] = i;
+	for (uint32_t i = count - 1; i > 0; --i) {
+		const uint32_t j = next_random() % (i + 1);
+		const uint32_t t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+	bench_init(&b, "unlink", 0);
+	bench_start(&b);
+	for (uint32_t i = 0; i < count; ++i) {
+		const int len = snprintf(name, sizeof(name), "file%u", order[i]);
+		if (!lookup_dir_entry(fd, &fs, dir_num, &dir, name, len, &num))
+			continue;
+		read_inode(fd, &fs, num, &inode);
+		remove_inode_from_dir(fd, &fs, dir_num, &dir, num, &inode);
+		write_inode(fd, &fs, dir_num, &dir);
+	}
+	bench_stop(&b);
+	b.ops = count;
+	bench_report(&b);
+	free(order);
+}
+
+/* Time `count` lookups of paths made by path_cb, with and without the dentry cache */
+static void bench_lookup(const char *name, uint32_t count, void (*path_cb)(char *path, size_t size))
+{
+	char path[4096];
+	uint32_t num;
+	struct inode_t inode;
+	struct dentry_cache_t dcache;
+	struct bench_t b;
+	char cached_name[64];
+	snprintf(cached_name, sizeof(cached_name), "%s_dcache", name);
+	for (int cached = 0; cached < 2; ++cached) {
+		if (cached) {
+			dentry_cache_initialize(&dcache, 64 * 1024 * 1024);
+			fs.dcache = &dcache;
+		}
+		bench_init(&b, cached ? cached_name : name, 0);
+		bench_start(&b);
+		for (uint32_t i = 0; i < count; ++i) {
+			path_cb(path, sizeof(path));
+			get_path_inode(fd, &fs, path, &num, &inode, NULL, NULL, NULL);
+		}
+		bench_stop(&b);
+		b.ops = count;
+		bench_report(&b);
+		if (cached) {
+			fs.dcache = NULL;
+			dentry_cache_destroy(&dcache);
+		}
+	}
+}
+
+#define DEEP_LEVELS 32
+static uint32_t wide_count;
+
+static void deep_path(char *path, size_t size)
+{
+	size_t len = 0;
+	path[0] = '\0';
+	for (int i = 0; i < DEEP_LEVELS && len < size; ++i)
+		len += snprintf(path + len, size - len, "/dir%d", i);
+}
+
+static void wide_path(char *path, size_t size)
+{
+	snprintf(path, size, "/wide/file%u", (uint32_t)(next_random() % wide_count));
+}
+
+static void bench_lookups(uint32_t entries, uint32_t count)
+{
+	uint32_t parent_num = 0, num;
+	struct inode_t parent, inode;
+	read_inode(fd, &fs, parent_num, &parent);
+	char name[32];
+	for (int i = 0; i < DEEP_LEVELS; ++i) {
+		snprintf(name, sizeof(name), "dir%d", i);
+		make_dir(parent_num, &parent, name, &num, &inode);
+		parent_num = num;
+		parent = inode;
+	}
+	bench_lookup("lookup_deep", count, deep_path);
+
+	uint32_t dir_num;
+	struct inode_t dir;
+	read_inode(fd, &fs, 0, &parent);
+	make_dir(0, &parent, "wide", &dir_num, &dir);
+	for (uint32_t i = 0; i < entries; ++i) {
+		snprintf(name, sizeof(name), "file%u", i);
+		new_file(&num, &inode);
+		add_inode_to_dir(fd, &fs, dir_num, &dir, num, &inode, name);
+	}
+	wide_count = entries;
+	bench_lookup("lookup_wide", count, wide_path);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s [-q] [-s size-in-MiB] <image>\n"
+			"\n"
+			"Make a filesystem in image, which is overwritten, and time the core operations\n"
+			"on it. Put the image on a tmpfs to leave the device out. The results are printed\n"
+			"as JSON.\n"
+			"    -q    Quick run, with an eighth of the data and files\n"
+			"    -s    Size of the image (default: 1024)\n"
+			, name);
+}
+
+int main(int argc, char **argv)
+{
+	int quick = 0;
+	long size_mib = 1024;
+	int opt;
+	while ((opt = getopt(argc, argv, "qs:")) != -1) {
+		switch (opt) {
+		case 'q':
+			quick = 1;
+			break;
+		case 's':
+			size_mib = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || size_mib < 64) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		perror("Failed to open the image");
+		return 1;
+	}
+	const uint64_t size = (uint64_t)size_mib * 1024 * 1024;
+	if (ftruncate(fd, size) != 0) {
+		perror("Failed to size the image");
+		return 1;
+	}
+	write_blank_fs(fd, &fs, MYFS_FEATURES_DEFAULT);
+
+	// The data sets take at most a quarter of the image
+	const uint32_t scale = quick ? 8 : 1;
+	const uint64_t file_size = MIN(256ull * 1024 * 1024 / scale, size / 4);
+	const uint32_t files = 5000 / scale;
+	const uint32_t lookups = 100000 / scale;
+
+	printf("{\n  \"image_size\": %lu,\n  \"block_size\": %hu,\n  \"file_size\": %lu,\n  \"results\": [\n",
+			(unsigned long)size, fs.main_block.block_size, (unsigned long)file_size);
+	const uint32_t io_sizes[] = { 4096, 65536, 1024 * 1024 };
+	for (size_t i = 0; i < sizeof(io_sizes) / sizeof(io_sizes[0]); ++i)
+		bench_read_write(file_size, io_sizes[i]);
+	bench_truncate(file_size, 4);
+	bench_create_unlink(files);
+	bench_lookups(files, lookups);
+	printf("\n  ]\n}\n");
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,598 @@
+#include "myfs.h"
+#include "helpers.h"
+#include "journal.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Exit codes, as those of e2fsck */
+#define EXIT_CLEAN 0
+#define EXIT_CORRECTED 1
+#define EXIT_UNCORRECTED 4
+#define EXIT_FAILED 8
+
+/* Inodes read and checked by a thread at once */
+#define INODES_PER_SHARD 16384
+/* Most indirect blocks read with a single read */
+#define RUN_BLOCKS 256
+/* Problems of each kind printed before they are only counted */
+#define MAX_PRINTED 100
+
+enum {
+	INODE_ALLOCATED = 1 << 0,
+	INODE_BAD       = 1 << 1, /* Its blocks can't all be found, so it is left alone */
+	INODE_LOST      = 1 << 2, /* Free and not a valid inode, but directories refer to it */
+};
+
+static int fd = -1;
+static struct fsinfo_t fs;
+static int repair = 0;
+
+/*
+ * What the inodes were found to use, filled in by the scanning threads
+ */
+static _Atomic uint32_t *block_refs;   /* References to each data block */
+static _Atomic uint16_t *entry_counts; /* Directory entries referring to each inode */
+static _Atomic uint64_t *block_counts; /* Blocks each inode uses; only on sparse filesystems */
+static uint16_t *nlinks;               /* nlinks of each inode, as stored */
+static uint8_t *inode_flags;           /* INODE_* of each inode */
+static int cross_linked = 0;           /* Some block is used twice without reflink */
+static int lost_entries = 0;           /* Some directory refers to an INODE_LOST inode */
+static atomic_uint next_shard;
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t problems = 0;
+static uint64_t unfixed = 0;
+static uint64_t hidden = 0;
+
+/* Print a problem; fixable: whether it is fixed when repairing */
+static void report(uint64_t *printed, int fixable, const char *format, ...)
+{
+	pthread_mutex_lock(&report_lock);
+	++problems;
+	if (!fixable || !repair)
+		++unfixed;
+	if (*printed < MAX_PRINTED) {
+		va_list args;
+		va_start(args, format);
+		vprintf(format, args);
+		va_end(args);
+		printf(repair && fixable ? " (fixed)\n" : "\n");
+	} else {
+		++hidden;
+	}
+	++*printed;
+	pthread_mutex_unlock(&report_lock);
+}
+
+static uint64_t printed_inodes, printed_entries, printed_links, printed_blocks, printed_refcounts;
+
+/*
+ * Scanning
+ *
+ * Each thread takes shards of the inode table in turn, reads their part of
+ * the inode bitmap and the table with one read each and walks the block
+ * trees of the allocated inodes. The indirect blocks of a whole shard are
+ * read a level at a time, sorted, so that blocks next to each other on the
+ * device are read together.
+ */
+
+/* An indirect block to read */
+struct pending_t
+{
+	uint64_t block;
+	uint32_t inode_num;
+	uint32_t level;       /* 1 if it points to data blocks, 2 if to singly-indirect blocks... */
+	uint64_t file_blocks; /* Blocks of the file below it */
+};
+
+struct pending_list_t
+{
+	struct pending_t *items;
+	uint32_t count, size;
+};
+
+static void push_pending(struct pending_list_t *list, struct pending_t item)
+{
+	if (list->count == list->size) {
+		list->size = MAX(64, list->size * 2);
+		list->items = (struct pending_t *)realloc(list->items, list->size * sizeof(struct pending_t));
+	}
+	list->items[list->count++] = item;
+}
+
+static int compare_pending(const void *a, const void *b)
+{
+	const uint64_t x = ((const struct pending_t *)a)->block, y = ((const struct pending_t *)b)->block;
+	return (x > y) - (x < y);
+}
+
+/* Count a reference of an inode to a block
+ *
+ * returns: 1 if the block exists; 0 if it is a hole or out of range
+ */
+static int reference_block(uint32_t inode_num, uint64_t block)
+{
+	if (block == 0 && (fs.main_block.features & MYFS_FEATURE_SPARSE))
+		return 0;
+	if (block >= fs.main_block.data_block_count) {
+		report(&printed_inodes, 0, "inode %u: block %lu is out of range", inode_num, (unsigned long)block);
+		inode_flags[inode_num] |= INODE_BAD;
+		return 0;
+	}
+	atomic_fetch_add_explicit(&block_refs[block], 1, memory_order_relaxed);
+	if (block_counts)
+		atomic_fetch_add_explicit(&block_counts[inode_num], 1, memory_order_relaxed);
+	return 1;
+}
+
+/* Blocks of a file below a pointer of a level-`level` indirect block */
+static uint64_t blocks_per_pointer(uint32_t level)
+{
+	const uint64_t c = pointers_per_block(&fs);
+	uint64_t n = 1;
+	for (uint32_t i = 1; i < level; ++i)
+		n *= c;
+	return n;
+}
+
+/* Account for the pointers of an indirect block and queue the indirect blocks it points to */
+static void walk_indirect(const struct pending_t *item, const uint8_t *data, struct pending_list_t *next)
+{
+	const uint64_t per_pointer = blocks_per_pointer(item->level);
+	const uint32_t pointers = CEIL_DIV(item->file_blocks, per_pointer);
+	for (uint32_t i = 0; i < pointers; ++i) {
+		const uint64_t block = decode_pointer(&fs, data, i);
+		if (!reference_block(item->inode_num, block) || item->level == 1)
+			continue;
+		const struct pending_t child = {
+			block, item->inode_num, item->level - 1,
+			MIN(per_pointer, item->file_blocks - i * per_pointer)
+		};
+		push_pending(next, child);
+	}
+}
+
+/* Read and walk the queued indirect blocks, and those they point to */
+static void walk_pending(struct pending_list_t *list)
+{
+	const uint16_t bs = fs.main_block.block_size;
+	uint8_t *buffer = (uint8_t *)malloc(RUN_BLOCKS * (uint64_t)bs);
+	struct pending_list_t next = { NULL, 0, 0 };
+	while (list->count > 0) {
+		qsort(list->items, list->count, sizeof(struct pending_t), compare_pending);
+		uint32_t i = 0;
+		while (i < list->count) {
+			// A run of blocks that follow each other
+			const uint64_t first = list->items[i].block;
+			uint32_t j = i + 1;
+			while (j < list->count && list->items[j].block - first < RUN_BLOCKS &&
+					list->items[j].block - list->items[j - 1].block <= 1)
+				++j;
+			const uint64_t blocks = list->items[j - 1].block - first + 1;
+			pread(fd, buffer, blocks * bs, fs.blocks_pos + first * bs);
+			for (; i < j; ++i)
+				walk_indirect(&list->items[i], buffer + (list->items[i].block - first) * (uint64_t)bs, &next);
+		}
+
+		struct pending_list_t t = *list;
+		*list = next;
+		next = t;
+		next.count = 0;
+	}
+	free(next.items);
+	free(buffer);
+}
+
+/* Check the size of an inode and account for its direct blocks and queue its indirect blocks */
+static void walk_inode(uint32_t inode_num, const struct inode_t *inode, struct pending_list_t *pending)
+{
+	const uint64_t c = pointers_per_block(&fs);
+	const uint64_t max_blocks = INODE_BLKS0 + c + c * c + c * c * c;
+	const uint64_t file_blocks = file_block_count(&fs, inode);
+	// On sparse filesystems it counts the blocks allocated, checked by check_block_count()
+	if (file_blocks > max_blocks || (!block_counts && inode->blocks != file_blocks)) {
+		report(&printed_inodes, 0, "inode %u: %lu blocks don't match the size %lu",
+				inode_num, (unsigned long)inode->blocks, (unsigned long)inode->size);
+		inode_flags[inode_num] |= INODE_BAD;
+		return;
+	}
+
+	uint64_t remaining = file_blocks;
+	for (uint32_t i = 0; i < INODE_BLKS0 && remaining > 0; ++i, --remaining)
+		reference_block(inode_num, inode->blockpos[i]);
+	for (uint32_t level = 1; level <= 3 && remaining > 0; ++level) {
+		const uint64_t below = MIN(remaining, blocks_per_pointer(level) * c);
+		const uint64_t block = inode->blockpos[INODE_BLKS0 + level - 1];
+		if (reference_block(inode_num, block)) {
+			const struct pending_t item = { block, inode_num, level, below };
+			push_pending(pending, item);
+		}
+		remaining -= below;
+	}
+}
+
+/* Compare the block count of a walked inode to the blocks found, on sparse filesystems */
+static void check_block_count(uint32_t inode_num, struct inode_t *inode)
+{
+	if (!block_counts || inode_flags[inode_num] != INODE_ALLOCATED)
+		return;
+	const uint64_t found = block_counts[inode_num];
+	if (inode->blocks == found)
+		return;
+	report(&printed_inodes, 1, "inode %u: counts %lu blocks but uses %lu",
+			inode_num, (unsigned long)inode->blocks, (unsigned long)found);
+	inode->blocks = found;
+	if (repair)
+		write_inode(fd, &fs, inode_num, inode);
+}
+
+static int count_entry_cb(void *data, uint32_t inode_num, const char *name, uint16_t name_len,
+		uint64_t pos, uint64_t next_pos)
+{
+	const uint32_t dir_inode_num = *(const uint32_t *)data;
+	if (inode_num >= fs.main_block.inode_count_limit)
+		report(&printed_entries, 0, "directory %u: entry '%.*s' refers to inode %u, which is out of range",
+				dir_inode_num, (int)name_len, name, inode_num);
+	else
+		atomic_fetch_add_explicit(&entry_counts[inode_num], 1, memory_order_relaxed);
+	return 0;
+}
+
+static void *scan_thread(void *data)
+{
+	const uint32_t limit = fs.main_block.inode_count_limit;
+	struct inode_t *inodes = (struct inode_t *)malloc(INODES_PER_SHARD * sizeof(struct inode_t));
+	uint8_t bitmap[INODES_PER_SHARD / 8];
+	struct pending_list_t pending = { NULL, 0, 0 };
+
+	for (;;) {
+		const uint32_t first = atomic_fetch_add(&next_shard, 1) * INODES_PER_SHARD;
+		if (first >= limit)
+			break;
+		const uint32_t count = MIN(INODES_PER_SHARD, limit - first);
+		pread(fd, bitmap, CEIL_DIV(count, 8), fs.inode_bitmap_pos + first / 8);
+		read_inode_range(fd, &fs, first, count, inodes);
+
+		for (uint32_t i = 0; i < count; ++i) {
+			if (!(bitmap[i / 8] & (1 << (i % 8))))
+				continue;
+			inode_flags[first + i] = INODE_ALLOCATED;
+			nlinks[first + i] = inodes[i].nlinks;
+			walk_inode(first + i, &inodes[i], &pending);
+		}
+		walk_pending(&pending);
+
+		// Only directories whose blocks were all found can be read
+		for (uint32_t i = 0; i < count; ++i) {
+			check_block_count(first + i, &inodes[i]);
+			if (inode_flags[first + i] != INODE_ALLOCATED ||
+					(inodes[i].mode & mode_ftype_mask) != mode_ftype_dir)
+				continue;
+			uint32_t dir_inode_num = first + i;
+			read_dir(fd, &fs, &inodes[i], 0, count_entry_cb, &dir_inode_num);
+		}
+	}
+
+	free(pending.items);
+	free(inodes);
+	return NULL;
+}
+
+/*
+ * Checking and repairing
+ */
+
+/* Whether a free inode looks like the file a directory entry takes it for
+ *
+ * Removed inodes are written with no links before they are freed.
+ */
+static int is_valid_inode(const struct inode_t *inode)
+{
+	return inode->nlinks > 0 && !(inode->mode & ~(mode_mask | mode_ftype_mask | mode_shared));
+}
+
+/* Take back the free inodes that directories refer to, as a damaged inode bitmap leaves them
+ *
+ * They are scanned like the others; the entries of such a directory
+ * would otherwise go uncounted, and everything in it would look removed.
+ * Reading them may find more of them, so this goes on until it doesn't.
+ */
+static void rescue_inodes(void)
+{
+	const uint32_t limit = fs.main_block.inode_count_limit;
+	int found;
+	do {
+		found = 0;
+		for (uint32_t i = 1; i < limit; ++i) {
+			if (inode_flags[i] != 0 || entry_counts[i] == 0)
+				continue;
+			struct inode_t inode;
+			read_inode(fd, &fs, i, &inode);
+			if (!is_valid_inode(&inode)) {
+				inode_flags[i] = INODE_LOST;
+				lost_entries = 1;
+				continue;
+			}
+
+			// The main block still counts it
+			report(&printed_links, 1, "inode %u is in %u directories but marked free", i, entry_counts[i]);
+			if (repair) {
+				uint8_t bits;
+				pread(fd, &bits, 1, fs.inode_bitmap_pos + i / 8);
+				bits |= 1 << (i % 8);
+				pwrite(fd, &bits, 1, fs.inode_bitmap_pos + i / 8);
+			}
+			inode_flags[i] = INODE_ALLOCATED;
+			nlinks[i] = inode.nlinks;
+			struct pending_list_t pending = { NULL, 0, 0 };
+			walk_inode(i, &inode, &pending);
+			walk_pending(&pending);
+			free(pending.items);
+			check_block_count(i, &inode);
+			if (inode_flags[i] == INODE_ALLOCATED && (inode.mode & mode_ftype_mask) == mode_ftype_dir)
+				read_dir(fd, &fs, &inode, 0, count_entry_cb, &i);
+			found = 1;
+		}
+	} while (found);
+}
+
+/* Compare the data block bitmap and reference counts to what the inodes use */
+static void check_blocks(void)
+{
+	const uint16_t bs = fs.main_block.block_size;
+	const uint64_t block_count = fs.main_block.data_block_count;
+	const int sparse = fs.main_block.features & MYFS_FEATURE_SPARSE;
+	uint8_t buffer[bs];
+
+	const uint64_t bitmap_bytes = CEIL_DIV(block_count, 8);
+	for (uint64_t pos = 0; pos < bitmap_bytes; pos += bs) {
+		const uint64_t len = MIN(bs, bitmap_bytes - pos);
+		pread(fd, buffer, len, fs.data_blocks_bitmap_pos + pos);
+		int changed = 0;
+		for (uint64_t i = 0; i < len; ++i) {
+			for (int j = 0; j < 8; ++j) {
+				const uint64_t block = (pos + i) * 8 + j;
+				if (block >= block_count)
+					break;
+				const uint32_t refs = block_refs[block];
+				const int used = refs > 0 || (sparse && block == 0);
+				const int marked = (buffer[i] >> j) & 1;
+				if (used == marked)
+					continue;
+				// The block may belong to an inode that couldn't be taken back
+				const int fixable = used || !lost_entries;
+				report(&printed_blocks, fixable, used ? "block %lu is used but marked free" :
+						"block %lu is marked used but no inode uses it", (unsigned long)block);
+				if (!fixable)
+					continue;
+				buffer[i] ^= 1 << j;
+				changed = 1;
+			}
+		}
+		if (changed && repair)
+			pwrite(fd, buffer, len, fs.data_blocks_bitmap_pos + pos);
+	}
+
+	if (!fs.refcounts_pos) {
+		for (uint64_t block = 0; block < block_count; ++block)
+			if (block_refs[block] > 1) {
+				report(&printed_refcounts, 0, "block %lu is used %u times", (unsigned long)block, block_refs[block]);
+				cross_linked = 1;
+			}
+		return;
+	}
+
+	// Two bytes per block
+	const uint64_t table_bytes = block_count * 2;
+	for (uint64_t pos = 0; pos < table_bytes; pos += bs) {
+		const uint64_t len = MIN(bs, table_bytes - pos);
+		pread(fd, buffer, len, fs.refcounts_pos + pos);
+		int changed = 0;
+		for (uint64_t i = 0; i < len; i += 2) {
+			const uint64_t block = (pos + i) / 2;
+			const uint32_t refs = block_refs[block];
+			const uint16_t expected = refs > 0 ? MIN(refs - 1, 0xFFFF) : 0;
+			uint16_t stored;
+			util_read_u16(buffer + i, &stored);
+			if (stored == expected)
+				continue;
+			report(&printed_refcounts, 1, "block %lu: reference count is %u, should be %u",
+					(unsigned long)block, stored, expected);
+			util_write_u16(buffer + i, expected);
+			changed = 1;
+		}
+		if (changed && repair)
+			pwrite(fd, buffer, len, fs.refcounts_pos + pos);
+	}
+}
+
+/* Compare nlinks to the directory entries and free the inodes no directory refers to */
+static void check_links(void)
+{
+	const uint32_t limit = fs.main_block.inode_count_limit;
+	if (!(inode_flags[0] & INODE_ALLOCATED))
+		report(&printed_links, 0, "the root directory is not allocated");
+	else if (entry_counts[0] > 0)
+		report(&printed_links, 0, "the root directory is in %u directories", entry_counts[0]);
+
+	for (uint32_t i = 1; i < limit; ++i) {
+		const uint32_t entries = entry_counts[i];
+		const int allocated = inode_flags[i] & INODE_ALLOCATED;
+		const int bad = inode_flags[i] & INODE_BAD;
+		if (!allocated) {
+			if (entries > 0)
+				report(&printed_links, 0, "inode %u is free but in %u directories", i, entries);
+			continue;
+		}
+		if (entries == nlinks[i])
+			continue;
+
+		struct inode_t inode;
+		read_inode(fd, &fs, i, &inode);
+		// Its entries were counted, so removing it would leave them with too many links
+		const int lost_dir = entries == 0 && (inode.mode & mode_ftype_mask) == mode_ftype_dir && inode.size > 0;
+		// Without reference counts its blocks may be freed from under another file, and the
+		// entries of a directory that couldn't be taken back may be the ones referring to it
+		const int fixable = !bad && !lost_dir && !(entries == 0 && (cross_linked || lost_entries));
+		if (entries == 0)
+			report(&printed_links, fixable, "inode %u is not in any directory", i);
+		else
+			report(&printed_links, fixable, "inode %u has %u links but is in %u directories", i, nlinks[i], entries);
+		if (!repair || !fixable)
+			continue;
+
+		inode.nlinks = entries;
+		// The blocks, bitmaps and reference counts agree by now, so blocks
+		// another file uses too only lose a reference
+		if (entries == 0) {
+			inode.mode |= mode_shared;
+			remove_file(fd, &fs, i, &inode);
+		}
+		write_inode(fd, &fs, i, &inode);
+	}
+}
+
+/* Compare the counts of the main block to the bitmaps */
+static void check_counts(void)
+{
+	struct fsinfo_t scanned = fs;
+	pthread_mutex_init(&scanned.alloc_lock, NULL);
+	rescan_allocator(fd, &scanned);
+	uint64_t printed = 0;
+	if (scanned.main_block.inode_count != fs.main_block.inode_count)
+		report(&printed, 1, "main block: %u inodes, counted %u",
+				fs.main_block.inode_count, scanned.main_block.inode_count);
+	if (scanned.main_block.free_data_block_count != fs.main_block.free_data_block_count)
+		report(&printed, 1, "main block: %lu free blocks, counted %lu",
+				(unsigned long)fs.main_block.free_data_block_count,
+				(unsigned long)scanned.main_block.free_data_block_count);
+	pthread_mutex_destroy(&scanned.alloc_lock);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s [-y] [-j threads] <device>\n"
+			"\n"
+			"Check the filesystem, which must not be mounted.\n"
+			"    -y    Repair the problems that can be repaired\n"
+			"    -j    Number of threads scanning the inodes (default: one per CPU)\n"
+			"\n"
+			"Exits with 0 if there were no problems, 1 if they were all repaired,\n"
+			"4 if some are left and 8 if the check failed.\n"
+			, name);
+}
+
+int main(int argc, char **argv)
+{
+	long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while ((opt = getopt(argc, argv, "yj:")) != -1) {
+		switch (opt) {
+		case 'y':
+			repair = 1;
+			break;
+		case 'j':
+			thread_count = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILED;
+		}
+	}
+	if (optind != argc - 1 || thread_count < 1) {
+		usage(argv[0]);
+		return EXIT_FAILED;
+	}
+
+	fd = open(argv[optind], repair ? O_RDWR : O_RDONLY);
+	if (fd == -1) {
+		perror("Failed to open device:");
+		return EXIT_FAILED;
+	}
+
+	read_fsinfo(fd, &fs);
+	if (fs.main_block.block_size < 64 || fs.main_block.data_block_count == 0) {
+		fprintf(stderr, "Not a myfs filesystem\n");
+		return EXIT_FAILED;
+	}
+	if (fs.main_block.features & ~MYFS_FEATURES_SUPPORTED) {
+		fprintf(stderr, "The filesystem uses unsupported features\n");
+		return EXIT_FAILED;
+	}
+	if (repair) {
+		const int replayed = journal_replay(fd, &fs);
+		if (replayed < 0) {
+			fprintf(stderr, "The journal is invalid\n");
+			return EXIT_FAILED;
+		}
+		if (replayed > 0) {
+			printf("%d transactions replayed from the journal\n", replayed);
+			read_fsinfo(fd, &fs);
+		}
+	} else if (fs.journal_pos && fs.main_block.state != MYFS_STATE_CLEAN) {
+		printf("Not unmounted cleanly; the journal is only replayed with -y\n");
+	}
+
+	const uint32_t inode_limit = fs.main_block.inode_count_limit;
+	block_refs = (_Atomic uint32_t *)calloc(fs.main_block.data_block_count, sizeof(uint32_t));
+	entry_counts = (_Atomic uint16_t *)calloc(inode_limit, sizeof(uint16_t));
+	nlinks = (uint16_t *)calloc(inode_limit, sizeof(uint16_t));
+	inode_flags = (uint8_t *)calloc(inode_limit, 1);
+	const int sparse = fs.main_block.features & MYFS_FEATURE_SPARSE;
+	if (sparse)
+		block_counts = (_Atomic uint64_t *)calloc(inode_limit, sizeof(uint64_t));
+	if (!block_refs || !entry_counts || !nlinks || !inode_flags || (sparse && !block_counts)) {
+		fprintf(stderr, "Not enough memory\n");
+		return EXIT_FAILED;
+	}
+
+	atomic_init(&next_shard, 0);
+	pthread_t threads[thread_count];
+	for (long i = 0; i < thread_count; ++i)
+		pthread_create(&threads[i], NULL, scan_thread, NULL);
+	for (long i = 0; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+
+	// The data bitmap and reference counts may have moved to data blocks when the filesystem grew
+	const uint64_t metadata_blocks = metadata_block_count(&fs);
+	for (uint64_t i = 0; i < metadata_blocks; ++i)
+		if (fs.main_block.metadata_block + i < fs.main_block.data_block_count)
+			++block_refs[fs.main_block.metadata_block + i];
+
+	rescue_inodes();
+	// The blocks first, so that freeing unreferenced inodes releases what they really use
+	check_blocks();
+	check_links();
+	check_counts();
+
+	if (repair) {
+		rescan_allocator(fd, &fs);
+		write_fs_state(fd, &fs, MYFS_STATE_CLEAN);
+	}
+
+	if (hidden > 0)
+		printf("(%lu more not shown)\n", (unsigned long)hidden);
+	printf("%lu problems, %lu left\n", (unsigned long)problems, (unsigned long)unfixed);
+
+	free(block_refs);
+	free(entry_counts);
+	free(block_counts);
+	free(nlinks);
+	free(inode_flags);
+	close(fd);
+
+	if (problems == 0)
+		return EXIT_CLEAN;
+	return unfixed == 0 ? EXIT_CORRECTED : EXIT_UNCORRECTED;
+}
@@ -1,43 +1,359 @@
 #include "myfs.h"
+#include "libmyfs.h"
+#include "util.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
-#include <fcntl.h>
+#include <getopt.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
-int main(int argc, char **argv)
+/* Bytes of the data bitmap scanned at once */
+#define BITMAP_CHUNK (1024 * 1024)
+/* Inodes read at once */
+#define INODE_CHUNK 16384
+/* Block IDs of a file read at once */
+#define FILE_BLOCKS_CHUNK 65536
+/* Most fragmented files listed */
+#define WORST_FILES 10
+/* Free extent size classes: powers of 2 up to 2^63 blocks */
+#define SIZE_CLASSES 64
+
+struct worst_file_t
 {
-	if (argc != 2) {
-		return 1;
+	uint32_t inode_num;
+	uint64_t extents;
+	uint64_t blocks;
+};
+
+struct analysis_t
+{
+	uint64_t free_extents;
+	uint64_t largest_free_extent;
+	uint64_t free_sizes[SIZE_CLASSES]; /* Free extents of 2^i to 2^(i+1) - 1 blocks */
+
+	uint64_t files;            /* Inodes with at least one data block */
+	uint64_t fragmented_files; /* Files with more than one extent */
+	uint64_t file_extents;
+	uint64_t file_blocks;      /* Data blocks of the files, not counting holes */
+	struct worst_file_t worst[WORST_FILES]; /* Sorted by extents, most first */
+	uint32_t worst_count;
+};
+
+static void add_free_extent(struct analysis_t *a, uint64_t len)
+{
+	if (len == 0)
+		return;
+	++a->free_extents;
+	a->largest_free_extent = MAX(a->largest_free_extent, len);
+	++a->free_sizes[63 - __builtin_clzll(len)];
+}
+
+/* Find the runs of clear bits in the data bitmap, a word at a time where it is all free or all used */
+static void scan_free_space(int fd, const struct fsinfo_t *fs, struct analysis_t *a)
+{
+	const uint64_t block_count = fs->main_block.data_block_count;
+	const uint64_t bitmap_bytes = CEIL_DIV(block_count, 8);
+	uint8_t *buffer = (uint8_t *)malloc(BITMAP_CHUNK + 8);
+	uint64_t run = 0;
+	for (uint64_t pos = 0; pos < bitmap_bytes; pos += BITMAP_CHUNK) {
+		const uint64_t len = MIN(BITMAP_CHUNK, bitmap_bytes - pos);
+		dev_read(fd, fs, buffer, len, fs->data_blocks_bitmap_pos + pos);
+		// The bits past the last block aren't blocks, nor are the bytes past the bitmap
+		if (pos + len == bitmap_bytes && block_count % 8)
+			buffer[len - 1] |= 0xFF << (block_count % 8);
+		memset(buffer + len, 0xFF, 8);
+
+		for (uint64_t i = 0; i < len; i += 8) {
+			uint64_t word;
+			memcpy(&word, buffer + i, 8);
+			if (word == 0) {
+				run += 64;
+			} else if (word == UINT64_MAX) {
+				add_free_extent(a, run);
+				run = 0;
+			} else {
+				for (int j = 0; j < 64; ++j) {
+					if (buffer[i + j / 8] & (1 << (j % 8))) {
+						add_free_extent(a, run);
+						run = 0;
+					} else {
+						++run;
+					}
+				}
+			}
+		}
 	}
+	add_free_extent(a, run);
+	free(buffer);
+}
 
-	int fd = open(argv[1], O_RDONLY);
-	if (fd == -1) {
-		perror("Failed to open device:");
-		return 1;
+static void add_file(struct analysis_t *a, uint32_t inode_num, uint64_t extents, uint64_t blocks)
+{
+	if (blocks == 0)
+		return;
+	++a->files;
+	a->fragmented_files += extents > 1;
+	a->file_extents += extents;
+	a->file_blocks += blocks;
+
+	// Insert it into the worst files, if it belongs there
+	uint32_t i = a->worst_count;
+	if (i == WORST_FILES) {
+		if (a->worst[i - 1].extents >= extents)
+			return;
+		--i;
+	} else {
+		++a->worst_count;
 	}
+	for (; i > 0 && a->worst[i - 1].extents < extents; --i)
+		a->worst[i] = a->worst[i - 1];
+	const struct worst_file_t w = { inode_num, extents, blocks };
+	a->worst[i] = w;
+}
 
-	struct fsinfo_t fs;
-	read_fsinfo(fd, &fs);
+/* Count the runs of a file's data blocks that are contiguous on the device */
+static void scan_file(int fd, struct fsinfo_t *fs, uint32_t inode_num, const struct inode_t *inode,
+		uint64_t *blocks, struct analysis_t *a)
+{
+	const int sparse = fs->main_block.features & MYFS_FEATURE_SPARSE;
+	uint64_t extents = 0, data_blocks = 0;
+	uint64_t prev = 0;
+	int in_extent = 0;
+	const uint64_t block_count = file_block_count(fs, inode);
+	for (uint64_t first = 0; first < block_count; first += FILE_BLOCKS_CHUNK) {
+		const uint64_t count = MIN(FILE_BLOCKS_CHUNK, block_count - first);
+		read_file_blocks(fd, fs, inode, first, count, blocks);
+		for (uint64_t i = 0; i < count; ++i) {
+			if (sparse && blocks[i] == 0) {
+				in_extent = 0;
+				continue;
+			}
+			if (!in_extent || blocks[i] != prev + 1)
+				++extents;
+			in_extent = 1;
+			prev = blocks[i];
+			++data_blocks;
+		}
+	}
+	add_file(a, inode_num, extents, data_blocks);
+}
 
+static void scan_files(int fd, struct fsinfo_t *fs, struct analysis_t *a)
+{
+	const uint32_t limit = fs->main_block.inode_count_limit;
+	struct inode_t *inodes = (struct inode_t *)malloc(INODE_CHUNK * sizeof(struct inode_t));
+	uint64_t *blocks = (uint64_t *)malloc(FILE_BLOCKS_CHUNK * sizeof(uint64_t));
+	uint8_t bitmap[INODE_CHUNK / 8];
+	for (uint32_t first = 0; first < limit; first += INODE_CHUNK) {
+		const uint32_t count = MIN(INODE_CHUNK, limit - first);
+		dev_read(fd, fs, bitmap, CEIL_DIV(count, 8), fs->inode_bitmap_pos + first / 8);
+		read_inode_range(fd, fs, first, count, inodes);
+		for (uint32_t i = 0; i < count; ++i)
+			if (bitmap[i / 8] & (1 << (i % 8)))
+				scan_file(fd, fs, first + i, &inodes[i], blocks, a);
+	}
+	free(blocks);
+	free(inodes);
+}
+
+static double average_extent(const struct analysis_t *a)
+{
+	return a->file_extents > 0 ? (double)a->file_blocks / a->file_extents : 0.0;
+}
+
+static void print_info(const struct fsinfo_t *fs)
+{
 	printf(
 			"Max number of inodes:      %u\n"
 			"Number of inodes:          %u\n"
-			"Total number of blocks:    %u\n"
-			"Number of data blocks:     %u\n"
-			"Number of free blocks:     %u\n"
+			"Total number of blocks:    %lu\n"
+			"Number of data blocks:     %lu\n"
+			"Number of free blocks:     %lu\n"
+			"Reserved blocks:           %lu\n"
 			"Block size:                %hu\n"
 			"Used space:                %.2f%%\n"
-			, fs.main_block.inode_count_limit
-			, fs.main_block.inode_count
-			, fs.main_block.block_count
-			, fs.main_block.data_block_count
-			, fs.main_block.free_data_block_count
-			, fs.main_block.block_size
-			, 100.0 * ((double)fs.main_block.data_block_count - (double)fs.main_block.free_data_block_count) / (double)fs.main_block.data_block_count
+			"Features:                  %s%s%s%s%s%s\n"
+			"Journal blocks:            %u\n"
+			"State:                     %s\n"
+			, fs->main_block.inode_count_limit
+			, fs->main_block.inode_count
+			, (unsigned long)fs->main_block.block_count
+			, (unsigned long)fs->main_block.data_block_count
+			, (unsigned long)fs->main_block.free_data_block_count
+			, (unsigned long)fs->main_block.reserved_blocks
+			, fs->main_block.block_size
+			, 100.0 * ((double)fs->main_block.data_block_count - (double)fs->main_block.free_data_block_count) / (double)fs->main_block.data_block_count
+			, fs->main_block.magic != MYFS_MAGIC ? "none (legacy format)" : ""
+			, fs->main_block.features & MYFS_FEATURE_REFLINK ? "reflink " : ""
+			, fs->main_block.features & MYFS_FEATURE_SPARSE ? "sparse " : ""
+			, fs->main_block.features & MYFS_FEATURE_JOURNAL ? "journal " : ""
+			, fs->main_block.features & MYFS_FEATURE_64BIT ? "64bit " : ""
+			, fs->main_block.features & MYFS_FEATURE_RESIZED ? "resized" : ""
+			, fs->main_block.journal_blocks
+			, fs->main_block.state == MYFS_STATE_CLEAN ? "clean" : "not clean"
 		  );
+}
+
+static void print_analysis(const struct analysis_t *a)
+{
+	printf(
+			"Free extents:              %lu\n"
+			"Largest free extent:       %lu blocks\n"
+			"Free extent sizes:\n"
+			, (unsigned long)a->free_extents
+			, (unsigned long)a->largest_free_extent
+		  );
+	for (int i = 0; i < SIZE_CLASSES; ++i) {
+		if (a->free_sizes[i] == 0)
+			continue;
+		char range[48];
+		if (i == 0)
+			snprintf(range, sizeof(range), "1 block");
+		else
+			snprintf(range, sizeof(range), "%lu-%lu blocks", 1UL << i, (2UL << i) - 1);
+		printf("    %-22s %lu\n", range, (unsigned long)a->free_sizes[i]);
+	}
+	printf(
+			"Files with data:           %lu\n"
+			"Fragmented files:          %lu\n"
+			"File extents:              %lu\n"
+			"Average extent length:     %.2f blocks\n"
+			, (unsigned long)a->files
+			, (unsigned long)a->fragmented_files
+			, (unsigned long)a->file_extents
+			, average_extent(a)
+		  );
+	if (a->worst_count > 0 && a->worst[0].extents > 1) {
+		printf("Most fragmented files:\n");
+		for (uint32_t i = 0; i < a->worst_count && a->worst[i].extents > 1; ++i)
+			printf("    inode %-16u %lu extents, %lu blocks\n", a->worst[i].inode_num,
+					(unsigned long)a->worst[i].extents, (unsigned long)a->worst[i].blocks);
+	}
+}
+
+static void print_json(const struct fsinfo_t *fs, const struct analysis_t *a)
+{
+	const struct main_block_t *mb = &fs->main_block;
+	printf("{\n");
+	printf("  \"inode_count_limit\": %u,\n", mb->inode_count_limit);
+	printf("  \"inode_count\": %u,\n", mb->inode_count);
+	printf("  \"block_count\": %lu,\n", (unsigned long)mb->block_count);
+	printf("  \"data_block_count\": %lu,\n", (unsigned long)mb->data_block_count);
+	printf("  \"free_data_block_count\": %lu,\n", (unsigned long)mb->free_data_block_count);
+	printf("  \"reserved_blocks\": %lu,\n", (unsigned long)mb->reserved_blocks);
+	printf("  \"block_size\": %hu,\n", mb->block_size);
+	printf("  \"legacy\": %s,\n", mb->magic != MYFS_MAGIC ? "true" : "false");
+	printf("  \"features\": [");
+	const char *names[] = { "reflink", "sparse", "journal", "64bit", "resized" };
+	const char *sep = "";
+	for (int i = 0; i < 5; ++i) {
+		if (mb->features & (1u << i)) {
+			printf("%s\"%s\"", sep, names[i]);
+			sep = ", ";
+		}
+	}
+	printf("],\n");
+	printf("  \"journal_blocks\": %u,\n", mb->journal_blocks);
+	printf("  \"clean\": %s%s\n", mb->state == MYFS_STATE_CLEAN ? "true" : "false", a ? "," : "");
+	if (a) {
+		printf("  \"free_space\": {\n");
+		printf("    \"extents\": %lu,\n", (unsigned long)a->free_extents);
+		printf("    \"largest_extent\": %lu,\n", (unsigned long)a->largest_free_extent);
+		printf("    \"histogram\": [");
+		sep = "";
+		for (int i = 0; i < SIZE_CLASSES; ++i) {
+			if (a->free_sizes[i] == 0)
+				continue;
+			printf("%s\n      { \"min_blocks\": %lu, \"max_blocks\": %lu, \"extents\": %lu }", sep,
+					1UL << i, (2UL << i) - 1, (unsigned long)a->free_sizes[i]);
+			sep = ",";
+		}
+		printf("%s]\n", *sep ? "\n    " : "");
+		printf("  },\n");
+		printf("  \"files\": {\n");
+		printf("    \"count\": %lu,\n", (unsigned long)a->files);
+		printf("    \"fragmented\": %lu,\n", (unsigned long)a->fragmented_files);
+		printf("    \"extents\": %lu,\n", (unsigned long)a->file_extents);
+		printf("    \"average_extent_blocks\": %.2f,\n", average_extent(a));
+		printf("    \"most_fragmented\": [");
+		sep = "";
+		for (uint32_t i = 0; i < a->worst_count && a->worst[i].extents > 1; ++i) {
+			printf("%s\n      { \"inode\": %u, \"extents\": %lu, \"blocks\": %lu }", sep, a->worst[i].inode_num,
+					(unsigned long)a->worst[i].extents, (unsigned long)a->worst[i].blocks);
+			sep = ",";
+		}
+		printf("%s]\n", *sep ? "\n    " : "");
+		printf("  }\n");
+	}
+	printf("}\n");
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s [-a] [-j] <device>\n"
+			"\n"
+			"Print information about the filesystem.\n"
+			"    -a, --analyze    Also scan the free space and the files for fragmentation\n"
+			"    -j, --json       Print it as JSON\n"
+			, name);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option long_options[] = {
+		{ "analyze", no_argument, NULL, 'a' },
+		{ "json",    no_argument, NULL, 'j' },
+		{ NULL, 0, NULL, 0 },
+	};
+	int analyze = 0, json = 0;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "aj", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'a':
+			analyze = 1;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	struct libmyfs_t *lfs;
+	const int err = libmyfs_open(argv[optind], LIBMYFS_RDONLY, &lfs);
+	if (err) {
+		fprintf(stderr, "Failed to open the filesystem: %s\n", strerror(-err));
+		return 1;
+	}
+	// The scans read the bitmaps and the inode table in large chunks, below the API
+	const int fd = libmyfs_device_fd(lfs);
+	struct fsinfo_t *fs = libmyfs_fsinfo(lfs);
+
+	struct analysis_t analysis;
+	if (analyze) {
+		memset(&analysis, 0, sizeof(analysis));
+		scan_free_space(fd, fs, &analysis);
+		scan_files(fd, fs, &analysis);
+	}
+
+	if (json) {
+		print_json(fs, analyze ? &analysis : NULL);
+	} else {
+		print_info(fs);
+		if (analyze)
+			print_analysis(&analysis);
+	}
 
+	libmyfs_close(lfs);
 	return 0;
 }
@@ -1,14 +1,16 @@
+#define _XOPEN_SOURCE 500
+
 #include "helpers.h"
 #include "util.h"
 
 #include <unistd.h>
 
-struct indirect_block_count_t calc_indirect_block_count(uint16_t block_size, uint32_t block_count)
+struct indirect_block_count_t calc_indirect_block_count(const struct fsinfo_t *fs, uint64_t block_count)
 {
-	const uint16_t c = block_size / 4; // blocks per indirect block
-	uint32_t b = block_count;
+	const uint64_t c = pointers_per_block(fs); // blocks per indirect block
+	uint64_t b = block_count;
 	// singly, doubly and triply-indirect blocks
-	uint32_t s = 0, d = 0, t = 0;
+	uint64_t s = 0, d = 0, t = 0;
 	if (b > 12) {
 		// We'll need a singly-indirect block for every c blocks
 		s = CEIL_DIV(b - 12, c);
@@ -31,24 +33,40 @@ struct indirect_block_count_t calc_indirect_block_count(uint16_t block_size, uin
 	return bcnt;
 }
 
-void read_u32_from_block(int fd, struct fsinfo_t *fs, uint32_t block_id, uint16_t pos, uint32_t *value)
+uint64_t decode_pointer(const struct fsinfo_t *fs, const uint8_t *buffer, uint32_t index)
+{
+	if (fs->pointer_size == 8) {
+		uint64_t value;
+		util_read_u64(buffer + index * (uint64_t)8, &value);
+		return value;
+	}
+	uint32_t value;
+	util_read_u32(buffer + index * (uint64_t)4, &value);
+	return value;
+}
+
+void encode_pointer(const struct fsinfo_t *fs, uint8_t *buffer, uint32_t index, uint64_t value)
+{
+	if (fs->pointer_size == 8)
+		util_write_u64(buffer + index * (uint64_t)8, value);
+	else
+		util_write_u32(buffer + index * (uint64_t)4, value);
+}
+
+void read_pointer_from_block(int fd, struct fsinfo_t *fs, uint64_t block_id, uint32_t pos, uint64_t *value)
 {
 	uint64_t blocks_pos = fs->blocks_pos;
 	uint16_t bsize = fs->main_block.block_size;
-	lseek(fd, blocks_pos + block_id * (uint64_t)bsize + pos * 4, SEEK_SET);
-	uint8_t buf[4];
-	read(fd, buf, 4);
-	util_read_u32(buf, value);
+	uint8_t buf[8];
+	dev_read(fd, fs, buf, fs->pointer_size, blocks_pos + block_id * bsize + pos * (uint64_t)fs->pointer_size);
+	*value = decode_pointer(fs, buf, 0);
 }
 
-#include <stdio.h>
-void write_u32_to_block(int fd, struct fsinfo_t *fs, uint32_t block_id, uint16_t pos, uint32_t value)
+void write_pointer_to_block(int fd, struct fsinfo_t *fs, uint64_t block_id, uint32_t pos, uint64_t value)
 {
 	uint64_t blocks_pos = fs->blocks_pos;
 	uint16_t bsize = fs->main_block.block_size;
-	lseek(fd, blocks_pos + block_id * (uint64_t)bsize + pos * 4, SEEK_SET);
-	//printf("HELPER: Write %u to %lu\n", value, blocks_pos + block_id * (uint64_t)bsize + pos * 4);
-	uint8_t buf[4];
-	util_write_u32(buf, value);
-	write(fd, buf, 4);
+	uint8_t buf[8];
+	encode_pointer(fs, buf, 0, value);
+	dev_write(fd, fs, buf, fs->pointer_size, blocks_pos + block_id * bsize + pos * (uint64_t)fs->pointer_size);
 }
@@ -6,18 +6,30 @@
 
 struct indirect_block_count_t
 {
-	uint32_t singly_indirect;
-	uint32_t doubly_indirect;
-	uint32_t triply_indirect;
-	uint32_t total_indirect;
+	uint64_t singly_indirect;
+	uint64_t doubly_indirect;
+	uint64_t triply_indirect;
+	uint64_t total_indirect;
 };
 
-struct indirect_block_count_t calc_indirect_block_count(uint16_t block_size, uint32_t block_count);
+struct indirect_block_count_t calc_indirect_block_count(const struct fsinfo_t *fs, uint64_t block_count);
 
-/* Read the pos-th u32 from the block_id-th block in fd */
-void read_u32_from_block(int fd, struct fsinfo_t *fs, uint32_t block_id, uint16_t pos, uint32_t *value);
+/* Number of block IDs an indirect block holds */
+static inline uint32_t pointers_per_block(const struct fsinfo_t *fs)
+{
+	return fs->main_block.block_size / fs->pointer_size;
+}
+
+/* Decode the index-th block ID of an indirect block loaded in buffer */
+uint64_t decode_pointer(const struct fsinfo_t *fs, const uint8_t *buffer, uint32_t index);
+
+/* Encode value as the index-th block ID of an indirect block loaded in buffer */
+void encode_pointer(const struct fsinfo_t *fs, uint8_t *buffer, uint32_t index, uint64_t value);
+
+/* Read the pos-th block ID from the block_id-th block in fd */
+void read_pointer_from_block(int fd, struct fsinfo_t *fs, uint64_t block_id, uint32_t pos, uint64_t *value);
 
-/* Write the pos-th u32 to the block_id-th block in fd */
-void write_u32_to_block(int fd, struct fsinfo_t *fs, uint32_t block_id, uint16_t pos, uint32_t value);
+/* Write the pos-th block ID to the block_id-th block in fd */
+void write_pointer_to_block(int fd, struct fsinfo_t *fs, uint64_t block_id, uint32_t pos, uint64_t value);
 
 #endif
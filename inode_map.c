@@ -18,6 +18,7 @@ void inode_map_destroy(struct inode_map_t *im)
 		struct inode_map_node_t *node = im->nodes[i];
 		while (node) {
 			struct inode_map_node_t *n = node->next;
+			pthread_rwlock_destroy(&node->lock);
 			free(node);
 			node = n;
 		}
@@ -25,7 +26,7 @@ void inode_map_destroy(struct inode_map_t *im)
 	free(im->nodes);
 }
 
-void inode_map_insert(struct inode_map_t *im, uint32_t key, uint32_t inode_num, const struct inode_t *inode)
+struct inode_map_node_t *inode_map_insert(struct inode_map_t *im, uint32_t key, uint32_t inode_num, const struct inode_t *inode)
 {
 	uint32_t hash = (key % TABLE_SIZE);
 
@@ -33,12 +34,20 @@ void inode_map_insert(struct inode_map_t *im, uint32_t key, uint32_t inode_num,
 	new_node->key = key;
 	new_node->inode_num = inode_num;
 	new_node->inode = *inode;
+	new_node->nlookup = 0;
+	new_node->refs = 0;
+	pthread_rwlock_init(&new_node->lock, NULL);
+	new_node->open_dirs = 0;
+	new_node->open_files = 0;
+	new_node->orphan = 0;
+	new_node->compact_pending = 0;
+	new_node->dirty_handles = NULL;
 	new_node->prev = new_node->next = NULL;
 
 	struct inode_map_node_t *node = im->nodes[hash];
 	if (node == NULL) {
 		im->nodes[hash] = new_node;
-		return;
+		return new_node;
 	}
 	struct inode_map_node_t *next = node->next;
 	while (next) {
@@ -46,6 +55,8 @@ void inode_map_insert(struct inode_map_t *im, uint32_t key, uint32_t inode_num,
 		next = next->next;
 	}
 	node->next = new_node;
+	new_node->prev = node;
+	return new_node;
 }
 
 void inode_map_remove(struct inode_map_t *im, uint32_t key)
@@ -66,27 +77,42 @@ void inode_map_remove(struct inode_map_t *im, uint32_t key)
 			if (node->next)
 				node->next->prev = node->prev;
 
+			pthread_rwlock_destroy(&node->lock);
 			free(node);
 			return;
 		}
+		node = node->next;
 	}
 }
 
 int inode_map_get(const struct inode_map_t *im, uint32_t key, uint32_t *inode_num, struct inode_t **inode)
+{
+	struct inode_map_node_t *node = inode_map_find(im, key);
+	if (!node)
+		return 0;
+
+	*inode_num = node->inode_num;
+	*inode = &(node->inode);
+	return 1;
+}
+
+struct inode_map_node_t *inode_map_find(const struct inode_map_t *im, uint32_t key)
 {
 	uint32_t hash = (key % TABLE_SIZE);
 
 	struct inode_map_node_t *node = im->nodes[hash];
-	EXPECT(node);
-
 	while (node) {
-		if (node->key == key) {
-			*inode_num = node->inode_num;
-			*inode = &(node->inode);
-			return 1;
-		}
+		if (node->key == key)
+			return node;
 		node = node->next;
 	}
 
-	return 0;
+	return NULL;
+}
+
+void inode_map_for_each(struct inode_map_t *im, void (*cb)(struct inode_map_node_t *node, void *data), void *data)
+{
+	for (uint32_t i = 0; i < TABLE_SIZE; ++i)
+		for (struct inode_map_node_t *node = im->nodes[i]; node; node = node->next)
+			cb(node, data);
 }
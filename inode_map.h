@@ -3,14 +3,27 @@
 
 #include "myfs.h"
 
+#include <pthread.h>
+
+struct file_handle_t;
+
 struct inode_map_node_t
 {
 	uint32_t key;
 	uint32_t inode_num;
 	struct inode_t inode;
+	uint64_t nlookup; /* Number of references the kernel holds to the inode */
+	uint32_t refs; /* Number of requests using the node */
+	pthread_rwlock_t lock; /* Held for writing to modify the inode or the entries of the directory */
+	uint32_t open_dirs; /* Number of open handles of the directory */
+	uint32_t open_files; /* Number of open handles of the file */
+	uint8_t orphan; /* Has no links left; removed once the node is dropped */
+	uint8_t compact_pending; /* Compaction of the directory was deferred while it was open */
+	struct file_handle_t *dirty_handles; /* Open handles of the file with buffered writes */
 	struct inode_map_node_t *prev, *next;
 };
 
+/* The map itself is not thread-safe */
 struct inode_map_t
 {
 	struct inode_map_node_t **nodes;
@@ -18,8 +31,12 @@ struct inode_map_t
 
 void inode_map_initialize(struct inode_map_t *im);
 void inode_map_destroy(struct inode_map_t *im);
-void inode_map_insert(struct inode_map_t *im, uint32_t key, uint32_t inode_num, const struct inode_t *inode);
+struct inode_map_node_t *inode_map_insert(struct inode_map_t *im, uint32_t key, uint32_t inode_num, const struct inode_t *inode);
 void inode_map_remove(struct inode_map_t *im, uint32_t key);
 int inode_map_get(const struct inode_map_t *im, uint32_t key, uint32_t *inode_num, struct inode_t **inode);
+struct inode_map_node_t *inode_map_find(const struct inode_map_t *im, uint32_t key);
+
+/* Call cb for each node; cb must not insert or remove nodes */
+void inode_map_for_each(struct inode_map_t *im, void (*cb)(struct inode_map_node_t *node, void *data), void *data);
 
 #endif
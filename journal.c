@@ -0,0 +1,639 @@
+#define _GNU_SOURCE
+
+#include "journal.h"
+#include "util.h"
+#include "stats.h"
+#include "asserts.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+/*
+ * On-disk format, in blocks of the filesystem:
+ * block 0: header: u32 magic, u32 unused, u64 sequence number of the first transaction
+ * then the transactions, one after another:
+ *   descriptor: u32 magic, u32 chunk count, u64 sequence number, u32 revoke count, u32 unused,
+ *               then a u64 position per chunk and per revoked chunk, over as many blocks as needed
+ *   the content of each chunk, a block each
+ *   commit: u32 magic, u32 unused, u64 sequence number, u64 checksum of the descriptor and chunks
+ * The first transaction that doesn't follow, or is incomplete, ends the journal.
+ */
+#define HEADER_MAGIC 0x4C4A594Du     /* "MYJL" */
+#define DESCRIPTOR_MAGIC 0x444A594Du /* "MYJD" */
+#define COMMIT_MAGIC 0x434A594Du     /* "MYJC" */
+#define DESCRIPTOR_HEADER_SIZE 24
+
+#define TABLE_SIZE 4096
+
+// Operations in progress in this thread, to allow nesting journal_start()
+static _Thread_local uint32_t handle_depth = 0;
+
+static uint64_t checksum(const uint8_t *data, uint64_t len)
+{
+	// FNV-1a
+	uint64_t h = 14695981039346656037u;
+	for (uint64_t i = 0; i < len; ++i) {
+		h ^= data[i];
+		h *= 1099511628211u;
+	}
+	return h;
+}
+
+void journal_chunk(const struct fsinfo_t *fs, uint64_t pos, uint64_t *chunk_pos, uint32_t *chunk_len)
+{
+	const uint16_t bs = fs->main_block.block_size;
+	if (pos >= fs->blocks_pos) {
+		*chunk_pos = fs->blocks_pos + (pos - fs->blocks_pos) / bs * bs;
+		*chunk_len = bs;
+	} else {
+		*chunk_pos = pos / bs * bs;
+		*chunk_len = MIN(bs, fs->blocks_pos - *chunk_pos);
+	}
+}
+
+static uint32_t descriptor_blocks(uint16_t bs, uint32_t count, uint32_t revoked_count)
+{
+	return CEIL_DIV(DESCRIPTOR_HEADER_SIZE + ((uint64_t)count + revoked_count) * 8, bs);
+}
+
+static uint64_t block_pos(const struct fsinfo_t *fs, uint32_t block)
+{
+	return fs->journal_pos + block * (uint64_t)fs->main_block.block_size;
+}
+
+static void write_header(int fd, const struct fsinfo_t *fs, uint64_t seq)
+{
+	const uint16_t bs = fs->main_block.block_size;
+	uint8_t buffer[bs];
+	memset(buffer, 0, bs);
+	util_write_u32(buffer, HEADER_MAGIC);
+	util_write_u64(buffer + 0x8, seq);
+	counted_pwrite(fd, buffer, bs, block_pos(fs, 0));
+}
+
+void journal_format(int fd, const struct fsinfo_t *fs)
+{
+	if (!fs->journal_pos)
+		return;
+	write_header(fd, fs, 1);
+	// So that nothing left on the device looks like a transaction
+	const uint16_t bs = fs->main_block.block_size;
+	uint8_t buffer[bs];
+	memset(buffer, 0, bs);
+	counted_pwrite(fd, buffer, bs, block_pos(fs, 1));
+}
+
+/* returns: the sequence number of the first transaction; 0 if the header is invalid */
+static uint64_t read_header(int fd, const struct fsinfo_t *fs)
+{
+	uint8_t buffer[16];
+	counted_pread(fd, buffer, sizeof(buffer), block_pos(fs, 0));
+	uint32_t magic;
+	uint64_t seq;
+	util_read_u32(buffer, &magic);
+	util_read_u64(buffer + 0x8, &seq);
+	return magic == HEADER_MAGIC ? seq : 0;
+}
+
+struct replay_tx_t
+{
+	uint8_t *data; /* Descriptor and chunks */
+	uint32_t count;
+	uint32_t revoked_count;
+	uint32_t desc_blocks;
+	uint64_t seq;
+};
+
+static int is_revoked_later(const struct replay_tx_t *txs, uint32_t tx_count, uint32_t tx, uint64_t pos)
+{
+	for (uint32_t t = tx + 1; t < tx_count; ++t) {
+		const uint8_t *entries = txs[t].data + DESCRIPTOR_HEADER_SIZE + txs[t].count * (uint64_t)8;
+		for (uint32_t i = 0; i < txs[t].revoked_count; ++i) {
+			uint64_t p;
+			util_read_u64(entries + i * (uint64_t)8, &p);
+			if (p == pos)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+int journal_replay(int fd, const struct fsinfo_t *fs)
+{
+	if (!fs->journal_pos)
+		return 0;
+
+	const uint16_t bs = fs->main_block.block_size;
+	const uint32_t journal_blocks = fs->main_block.journal_blocks;
+	uint64_t seq = read_header(fd, fs);
+	if (seq == 0)
+		return -1;
+
+	// Find the complete transactions
+	struct replay_tx_t *txs = NULL;
+	uint32_t tx_count = 0;
+	uint32_t block = 1;
+	uint8_t desc[bs];
+	while (block < journal_blocks) {
+		counted_pread(fd, desc, bs, block_pos(fs, block));
+		uint32_t magic, count, revoked_count;
+		uint64_t tx_seq;
+		util_read_u32(desc, &magic);
+		util_read_u32(desc + 0x4, &count);
+		util_read_u64(desc + 0x8, &tx_seq);
+		util_read_u32(desc + 0x10, &revoked_count);
+		if (magic != DESCRIPTOR_MAGIC || tx_seq != seq)
+			break;
+
+		const uint32_t desc_blocks = descriptor_blocks(bs, count, revoked_count);
+		const uint64_t blocks = (uint64_t)desc_blocks + count + 1;
+		if (block + blocks > journal_blocks)
+			break;
+
+		uint8_t *data = (uint8_t *)malloc(blocks * bs);
+		counted_pread(fd, data, blocks * bs, block_pos(fs, block));
+		const uint8_t *commit = data + (blocks - 1) * bs;
+		uint64_t commit_seq, sum;
+		util_read_u32(commit, &magic);
+		util_read_u64(commit + 0x8, &commit_seq);
+		util_read_u64(commit + 0x10, &sum);
+		if (magic != COMMIT_MAGIC || commit_seq != seq || sum != checksum(data, (blocks - 1) * bs)) {
+			free(data);
+			break;
+		}
+
+		txs = (struct replay_tx_t *)realloc(txs, (tx_count + 1) * sizeof(struct replay_tx_t));
+		struct replay_tx_t tx = { data, count, revoked_count, desc_blocks, seq };
+		txs[tx_count++] = tx;
+		block += blocks;
+		++seq;
+	}
+
+	// Write the chunks to their place, skipping those revoked by a later transaction
+	for (uint32_t t = 0; t < tx_count; ++t) {
+		for (uint32_t i = 0; i < txs[t].count; ++i) {
+			uint64_t pos, chunk_pos;
+			uint32_t chunk_len;
+			util_read_u64(txs[t].data + DESCRIPTOR_HEADER_SIZE + i * (uint64_t)8, &pos);
+			if (is_revoked_later(txs, tx_count, t, pos))
+				continue;
+			journal_chunk(fs, pos, &chunk_pos, &chunk_len);
+			counted_pwrite(fd, txs[t].data + (txs[t].desc_blocks + (uint64_t)i) * bs, chunk_len, chunk_pos);
+		}
+	}
+	for (uint32_t t = 0; t < tx_count; ++t)
+		free(txs[t].data);
+	free(txs);
+
+	if (tx_count > 0) {
+		counted_fdatasync(fd);
+		write_header(fd, fs, seq);
+		counted_fdatasync(fd);
+	}
+	return tx_count;
+}
+
+static uint32_t hash_pos(uint64_t pos)
+{
+	return (uint32_t)((pos * 0x9E3779B97F4A7C15u) >> 40) % TABLE_SIZE;
+}
+
+static struct journal_chunk_t *find_chunk(const struct journal_t *j, uint64_t pos)
+{
+	struct journal_chunk_t *chunk = j->chunks[hash_pos(pos)];
+	while (chunk && chunk->pos != pos)
+		chunk = chunk->next;
+	return chunk;
+}
+
+static void free_chunk(struct journal_chunk_t *chunk)
+{
+	free(chunk->data);
+	free(chunk->committed);
+	free(chunk);
+}
+
+static void remove_chunk(struct journal_t *j, struct journal_chunk_t *chunk)
+{
+	struct journal_chunk_t **link = &j->chunks[hash_pos(chunk->pos)];
+	while (*link != chunk)
+		link = &(*link)->next;
+	*link = chunk->next;
+	--j->chunk_count;
+	free_chunk(chunk);
+}
+
+static void append_pos(uint64_t **array, uint32_t *count, uint32_t *size, uint64_t pos)
+{
+	if (*count == *size) {
+		*size = MAX(64, *size * 2);
+		*array = (uint64_t *)realloc(*array, *size * sizeof(uint64_t));
+	}
+	(*array)[(*count)++] = pos;
+}
+
+/* The running transaction is committed early once it has this many chunks */
+static uint32_t max_transaction(const struct journal_t *j)
+{
+	return MAX(1, (j->fs->main_block.journal_blocks - 1) / 4);
+}
+
+/* Write all committed chunks to their place and empty the journal
+ *
+ * next_seq: sequence number of the next transaction written to the journal
+ */
+static void checkpoint(struct journal_t *j, uint64_t next_seq)
+{
+	// The lock keeps revoked chunks from being written over the data of their new owner
+	pthread_mutex_lock(&j->lock);
+	for (uint32_t i = 0; i < TABLE_SIZE; ++i)
+		for (struct journal_chunk_t *chunk = j->chunks[i]; chunk; chunk = chunk->next)
+			if (chunk->committed)
+				counted_pwrite(j->fd, chunk->committed, chunk->len, chunk->pos);
+	pthread_mutex_unlock(&j->lock);
+
+	counted_fdatasync(j->fd);
+	write_header(j->fd, j->fs, next_seq);
+	counted_fdatasync(j->fd);
+
+	// Chunks that are now up to date in their place are no longer needed
+	pthread_mutex_lock(&j->lock);
+	for (uint32_t i = 0; i < TABLE_SIZE; ++i) {
+		struct journal_chunk_t *chunk = j->chunks[i];
+		while (chunk) {
+			struct journal_chunk_t *next = chunk->next;
+			// Not if it is part of the transaction being committed
+			const int up_to_date = !chunk->dirty && chunk->seq > 0 && chunk->seq < next_seq;
+			free(chunk->committed);
+			chunk->committed = NULL;
+			if (up_to_date)
+				remove_chunk(j, chunk);
+			chunk = next;
+		}
+	}
+	j->head = 1;
+	++j->checkpoints;
+	pthread_mutex_unlock(&j->lock);
+}
+
+/* Close the running transaction and write it to the journal
+ *
+ * j->lock must be held; it is released while writing.
+ */
+static void commit_transaction(struct journal_t *j)
+{
+	// Wait for the operations in progress, and keep new ones from starting
+	j->frozen = 1;
+	while (j->handles > 0)
+		pthread_cond_wait(&j->cond, &j->lock);
+
+	const uint16_t bs = j->fs->main_block.block_size;
+	const uint64_t seq = j->seq++;
+
+	// The same position may be listed twice if its chunk was revoked and then written again
+	struct journal_chunk_t **chunks = (struct journal_chunk_t **)malloc(
+			MAX(1, j->dirty_count) * sizeof(struct journal_chunk_t *));
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < j->dirty_count; ++i) {
+		struct journal_chunk_t *chunk = find_chunk(j, j->dirty[i]);
+		if (chunk && chunk->dirty) {
+			chunk->dirty = 0;
+			chunk->seq = seq;
+			chunks[count++] = chunk;
+		}
+	}
+
+	const uint32_t desc_blocks = descriptor_blocks(bs, count, j->revoked_count);
+	const uint64_t blocks = (uint64_t)desc_blocks + count + 1;
+	uint8_t *data = (uint8_t *)calloc(blocks, bs);
+	util_write_u32(data, DESCRIPTOR_MAGIC);
+	util_write_u32(data + 0x4, count);
+	util_write_u64(data + 0x8, seq);
+	util_write_u32(data + 0x10, j->revoked_count);
+	uint64_t *positions = (uint64_t *)malloc(MAX(1, count) * sizeof(uint64_t));
+	for (uint32_t i = 0; i < count; ++i) {
+		positions[i] = chunks[i]->pos;
+		util_write_u64(data + DESCRIPTOR_HEADER_SIZE + i * (uint64_t)8, chunks[i]->pos);
+		memcpy(data + (desc_blocks + (uint64_t)i) * bs, chunks[i]->data, chunks[i]->len);
+	}
+	for (uint32_t i = 0; i < j->revoked_count; ++i)
+		util_write_u64(data + DESCRIPTOR_HEADER_SIZE + (count + (uint64_t)i) * 8, j->revoked[i]);
+	j->dirty_count = 0;
+	j->revoked_count = 0;
+	free(chunks);
+	// Blocks it frees become free once it is in the journal
+	uint64_t *freed = j->freed;
+	const uint32_t freed_count = j->freed_count;
+	j->freed = NULL;
+	j->freed_count = j->freed_size = 0;
+
+	j->frozen = 0;
+	pthread_cond_broadcast(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+
+	uint8_t *commit = data + (blocks - 1) * bs;
+	util_write_u32(commit, COMMIT_MAGIC);
+	util_write_u64(commit + 0x8, seq);
+	util_write_u64(commit + 0x10, checksum(data, (blocks - 1) * bs));
+
+	const uint32_t journal_blocks = j->fs->main_block.journal_blocks;
+	if (1 + blocks > journal_blocks) {
+		// Too big for the journal: written in place, which isn't atomic
+		checkpoint(j, seq);
+		for (uint32_t i = 0; i < count; ++i) {
+			uint64_t chunk_pos;
+			uint32_t chunk_len;
+			journal_chunk(j->fs, positions[i], &chunk_pos, &chunk_len);
+			counted_pwrite(j->fd, data + (desc_blocks + (uint64_t)i) * bs, chunk_len, chunk_pos);
+		}
+		counted_fdatasync(j->fd);
+		write_header(j->fd, j->fs, seq + 1);
+		counted_fdatasync(j->fd);
+	} else {
+		if (j->head + blocks > journal_blocks)
+			checkpoint(j, seq);
+		counted_pwrite(j->fd, data, blocks * bs, block_pos(j->fs, j->head));
+		counted_fdatasync(j->fd);
+		j->head += blocks;
+
+		// Chunks revoked in the meantime are skipped
+		pthread_mutex_lock(&j->lock);
+		for (uint32_t i = 0; i < count; ++i) {
+			struct journal_chunk_t *chunk = find_chunk(j, positions[i]);
+			if (!chunk)
+				continue;
+			if (!chunk->committed)
+				chunk->committed = (uint8_t *)malloc(chunk->len);
+			memcpy(chunk->committed, data + (desc_blocks + (uint64_t)i) * bs, chunk->len);
+		}
+		pthread_mutex_unlock(&j->lock);
+	}
+	free(positions);
+	free(data);
+
+	pthread_mutex_lock(&j->lock);
+	for (uint32_t i = 0; i < freed_count; ++i)
+		append_pos(&j->releasable, &j->releasable_count, &j->releasable_size, freed[i]);
+	free(freed);
+	j->committed_seq = seq;
+	++j->commits;
+	j->committed_chunks += count;
+	pthread_cond_broadcast(&j->cond);
+}
+
+static int transaction_is_empty(const struct journal_t *j)
+{
+	return j->dirty_count == 0 && j->revoked_count == 0 && j->freed_count == 0;
+}
+
+/* Mark the blocks freed by committed transactions free, in the running one
+ *
+ * j->lock must be held; it is released meanwhile.
+ */
+static void release_freed_blocks(struct journal_t *j)
+{
+	if (j->releasable_count == 0)
+		return;
+	uint64_t *blocks = j->releasable;
+	const uint32_t count = j->releasable_count;
+	j->releasable = NULL;
+	j->releasable_count = j->releasable_size = 0;
+	pthread_mutex_unlock(&j->lock);
+
+	journal_start(j);
+	free_data_blocks(j->fd, j->fs, blocks, count);
+	journal_stop(j);
+	free(blocks);
+
+	pthread_mutex_lock(&j->lock);
+}
+
+static void *commit_thread(void *data)
+{
+	struct journal_t *j = (struct journal_t *)data;
+	pthread_mutex_lock(&j->lock);
+	while (!j->stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += j->commit_interval;
+		while (!j->stop && j->commit_request <= j->committed_seq && j->dirty_count < max_transaction(j))
+			if (pthread_cond_timedwait(&j->cond, &j->lock, &deadline) == ETIMEDOUT)
+				break;
+		if (j->stop || transaction_is_empty(j))
+			continue;
+
+		commit_transaction(j);
+		release_freed_blocks(j);
+		// Checkpoint lazily, before the journal runs out of room
+		if (j->head > j->fs->main_block.journal_blocks / 4 * 3) {
+			const uint64_t next_seq = j->committed_seq + 1;
+			pthread_mutex_unlock(&j->lock);
+			checkpoint(j, next_seq);
+			pthread_mutex_lock(&j->lock);
+		}
+	}
+	pthread_mutex_unlock(&j->lock);
+	return NULL;
+}
+
+struct journal_t *journal_open(int fd, struct fsinfo_t *fs, unsigned int commit_interval)
+{
+	if (!fs->journal_pos)
+		return NULL;
+
+	const int replayed = journal_replay(fd, fs);
+	if (replayed < 0)
+		return NULL;
+	if (replayed > 0)
+		read_fsinfo(fd, fs);
+
+	struct journal_t *j = (struct journal_t *)calloc(1, sizeof(struct journal_t));
+	j->fd = fd;
+	j->fs = fs;
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->cond, NULL);
+	j->chunks = (struct journal_chunk_t **)calloc(TABLE_SIZE, sizeof(struct journal_chunk_t *));
+	j->table_size = TABLE_SIZE;
+	j->seq = read_header(fd, fs);
+	j->committed_seq = j->seq - 1;
+	j->commit_request = j->committed_seq;
+	j->head = 1;
+	j->commit_interval = MAX(1, commit_interval);
+	pthread_create(&j->thread, NULL, commit_thread, j);
+
+	fs->journal = j;
+	return j;
+}
+
+void journal_close(struct journal_t *j)
+{
+	pthread_mutex_lock(&j->lock);
+	j->stop = 1;
+	pthread_cond_broadcast(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+	pthread_join(j->thread, NULL);
+
+	pthread_mutex_lock(&j->lock);
+	if (!transaction_is_empty(j))
+		commit_transaction(j);
+	// Freeing the blocks of the last transaction takes one more
+	release_freed_blocks(j);
+	if (!transaction_is_empty(j))
+		commit_transaction(j);
+	const uint64_t next_seq = j->committed_seq + 1;
+	pthread_mutex_unlock(&j->lock);
+	checkpoint(j, next_seq);
+
+	for (uint32_t i = 0; i < TABLE_SIZE; ++i) {
+		struct journal_chunk_t *chunk = j->chunks[i];
+		while (chunk) {
+			struct journal_chunk_t *next = chunk->next;
+			free_chunk(chunk);
+			chunk = next;
+		}
+	}
+	j->fs->journal = NULL;
+	free(j->chunks);
+	free(j->dirty);
+	free(j->revoked);
+	free(j->freed);
+	free(j->releasable);
+	pthread_cond_destroy(&j->cond);
+	pthread_mutex_destroy(&j->lock);
+	free(j);
+}
+
+void journal_start(struct journal_t *j)
+{
+	if (handle_depth++ > 0)
+		return;
+	pthread_mutex_lock(&j->lock);
+	while (j->frozen)
+		pthread_cond_wait(&j->cond, &j->lock);
+	++j->handles;
+	pthread_mutex_unlock(&j->lock);
+}
+
+void journal_stop(struct journal_t *j)
+{
+	EXPECT(handle_depth > 0);
+	if (--handle_depth > 0)
+		return;
+	pthread_mutex_lock(&j->lock);
+	--j->handles;
+	if (j->handles == 0)
+		pthread_cond_broadcast(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+}
+
+int journal_sync(struct journal_t *j)
+{
+	EXPECT(handle_depth == 0);
+	pthread_mutex_lock(&j->lock);
+	// A transaction closed before it may still be on its way to the journal
+	const int running = !transaction_is_empty(j);
+	const uint64_t target = running ? j->seq : j->seq - 1;
+	if (target > j->commit_request)
+		j->commit_request = target;
+	pthread_cond_broadcast(&j->cond);
+	while (j->committed_seq < target)
+		pthread_cond_wait(&j->cond, &j->lock);
+	pthread_mutex_unlock(&j->lock);
+
+	// Committing the running transaction flushed the data written before too
+	if (!running && counted_fdatasync(j->fd) == -1)
+		return errno;
+	return 0;
+}
+
+uint64_t journal_read(struct journal_t *j, uint8_t *buffer, uint64_t len, uint64_t pos)
+{
+	// Chunks may be checkpointed in the meantime, so the device is read with the lock held too
+	pthread_mutex_lock(&j->lock);
+	counted_pread(j->fd, buffer, len, pos);
+	uint64_t p = pos;
+	while (p < pos + len) {
+		uint64_t chunk_pos;
+		uint32_t chunk_len;
+		journal_chunk(j->fs, p, &chunk_pos, &chunk_len);
+		const uint64_t end = MIN(pos + len, chunk_pos + chunk_len);
+		const struct journal_chunk_t *chunk = find_chunk(j, chunk_pos);
+		if (chunk) {
+			memcpy(buffer + (p - pos), chunk->data + (p - chunk_pos), end - p);
+			stats_add(STAT_JOURNAL_HITS, 1);
+		}
+		p = end;
+	}
+	pthread_mutex_unlock(&j->lock);
+	return len;
+}
+
+void journal_write(struct journal_t *j, const uint8_t *buffer, uint64_t len, uint64_t pos)
+{
+	EXPECT(handle_depth > 0);
+	pthread_mutex_lock(&j->lock);
+	uint64_t p = pos;
+	while (p < pos + len) {
+		uint64_t chunk_pos;
+		uint32_t chunk_len;
+		journal_chunk(j->fs, p, &chunk_pos, &chunk_len);
+		const uint64_t end = MIN(pos + len, chunk_pos + chunk_len);
+
+		struct journal_chunk_t *chunk = find_chunk(j, chunk_pos);
+		if (!chunk) {
+			chunk = (struct journal_chunk_t *)malloc(sizeof(struct journal_chunk_t));
+			chunk->pos = chunk_pos;
+			chunk->len = chunk_len;
+			chunk->dirty = 0;
+			chunk->seq = 0;
+			chunk->data = (uint8_t *)malloc(chunk_len);
+			chunk->committed = NULL;
+			if (p > chunk_pos || end < chunk_pos + chunk_len)
+				counted_pread(j->fd, chunk->data, chunk_len, chunk_pos);
+			struct journal_chunk_t **bucket = &j->chunks[hash_pos(chunk_pos)];
+			chunk->next = *bucket;
+			*bucket = chunk;
+			++j->chunk_count;
+		}
+		memcpy(chunk->data + (p - chunk_pos), buffer + (p - pos), end - p);
+		if (!chunk->dirty) {
+			chunk->dirty = 1;
+			append_pos(&j->dirty, &j->dirty_count, &j->dirty_size, chunk_pos);
+		}
+		p = end;
+	}
+	if (j->dirty_count >= max_transaction(j))
+		pthread_cond_broadcast(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+}
+
+void journal_revoke(struct journal_t *j, uint64_t pos, uint64_t len)
+{
+	pthread_mutex_lock(&j->lock);
+	uint64_t p = pos;
+	while (p < pos + len) {
+		uint64_t chunk_pos;
+		uint32_t chunk_len;
+		journal_chunk(j->fs, p, &chunk_pos, &chunk_len);
+		struct journal_chunk_t *chunk = find_chunk(j, chunk_pos);
+		if (chunk) {
+			// Older copies in the journal must not be replayed
+			append_pos(&j->revoked, &j->revoked_count, &j->revoked_size, chunk_pos);
+			remove_chunk(j, chunk);
+		}
+		p = chunk_pos + chunk_len;
+	}
+	pthread_mutex_unlock(&j->lock);
+}
+
+void journal_free_blocks(struct journal_t *j, const uint64_t *blocks, uint64_t block_count)
+{
+	pthread_mutex_lock(&j->lock);
+	for (uint64_t i = 0; i < block_count; ++i)
+		append_pos(&j->freed, &j->freed_count, &j->freed_size, blocks[i]);
+	pthread_mutex_unlock(&j->lock);
+}
@@ -0,0 +1,129 @@
+#ifndef JOURNAL_H_INCLUDED
+#define JOURNAL_H_INCLUDED
+
+#include "myfs.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Write-ahead journal of the metadata
+ *
+ * Metadata written with dev_write() while a journal is open doesn't go to
+ * its place on the device right away. The chunks it touches (blocks of the
+ * device, see journal_chunk()) are kept in memory and belong to the running
+ * transaction, which gathers the changes of all operations since the last
+ * commit. A commit writes the chunks of the transaction to the journal in a
+ * single write followed by a single flush. Committed chunks are written to
+ * their place later, when the journal fills up or when it is closed; until
+ * then dev_read() returns them from memory.
+ *
+ * File data doesn't go through the journal. Blocks freed while their
+ * metadata is in the journal are revoked, so that replaying the journal
+ * doesn't overwrite the data of their next owner. Freed blocks are also
+ * kept in use until the transaction freeing them is committed: if they were
+ * written by a new owner before that, a crash would leave the old one
+ * pointing to its data. Their bits are cleared in a later transaction, so a
+ * crash in between leaks them until fsck.myfs runs.
+ *
+ * Operations that write metadata must be enclosed in journal_start() and
+ * journal_stop(), so that a commit never sees half of one.
+ */
+struct journal_chunk_t
+{
+	uint64_t pos;
+	uint32_t len;
+	uint8_t dirty;       /* Modified in the running transaction */
+	uint64_t seq;        /* Last transaction it was part of; 0 if none */
+	uint8_t *data;       /* Current content */
+	uint8_t *committed;  /* Content in the journal; NULL if not written there since the last checkpoint */
+	struct journal_chunk_t *next;
+};
+
+struct journal_t
+{
+	int fd;
+	struct fsinfo_t *fs;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct journal_chunk_t **chunks;
+	uint32_t table_size;
+	uint32_t chunk_count;
+
+	/* The running transaction */
+	uint64_t seq;
+	uint64_t *dirty;     /* Positions of its chunks */
+	uint32_t dirty_count, dirty_size;
+	uint64_t *revoked;   /* Positions of the chunks it revokes */
+	uint32_t revoked_count, revoked_size;
+	uint64_t *freed;     /* Data blocks it frees */
+	uint32_t freed_count, freed_size;
+	uint32_t handles;    /* Operations in progress */
+	int frozen;          /* Set while the transaction is being closed; no operation may start */
+
+	uint64_t committed_seq; /* Last transaction in the journal */
+	uint64_t commit_request;
+	uint32_t head;       /* Next free block of the journal */
+	uint64_t *releasable; /* Data blocks freed by committed transactions, not marked free yet */
+	uint32_t releasable_count, releasable_size;
+
+	unsigned int commit_interval; /* Seconds */
+	int stop;
+	pthread_t thread;
+
+	uint64_t commits;
+	uint64_t committed_chunks;
+	uint64_t checkpoints;
+};
+
+/* Position and length of the chunk holding the byte at pos
+ *
+ * Data blocks are chunks of their own. Before them the device is split at
+ * multiples of the block size, and the last chunk ends where they start.
+ */
+void journal_chunk(const struct fsinfo_t *fs, uint64_t pos, uint64_t *chunk_pos, uint32_t *chunk_len);
+
+/* Write an empty journal, for a new filesystem */
+void journal_format(int fd, const struct fsinfo_t *fs);
+
+/* Bring the metadata up to date with the transactions committed to the journal
+ *
+ * Needed before anything else reads a filesystem that wasn't unmounted.
+ * returns: the number of transactions replayed; -1 on failure
+ */
+int journal_replay(int fd, const struct fsinfo_t *fs);
+
+/* Replay the journal and start journaling the metadata of fs
+ *
+ * fs is read again if the replay changed it. Commits happen every
+ * commit_interval seconds, on journal_sync() and when the running
+ * transaction gets big.
+ * returns: the journal, also set as fs->journal; NULL if fs has none or it is invalid
+ */
+struct journal_t *journal_open(int fd, struct fsinfo_t *fs, unsigned int commit_interval);
+
+/* Commit everything, write it all to its place and stop journaling */
+void journal_close(struct journal_t *j);
+
+/* Enclose an operation that writes metadata; may be nested in a thread */
+void journal_start(struct journal_t *j);
+void journal_stop(struct journal_t *j);
+
+/* Make everything written so far durable, data included
+ *
+ * Must not be called inside journal_start(). Concurrent calls share a commit.
+ * returns: 0 on success; an errno value otherwise
+ */
+int journal_sync(struct journal_t *j);
+
+/* Used by dev_read() and dev_write() */
+uint64_t journal_read(struct journal_t *j, uint8_t *buffer, uint64_t len, uint64_t pos);
+void journal_write(struct journal_t *j, const uint8_t *buffer, uint64_t len, uint64_t pos);
+
+/* Forget the metadata in a range of the device, which is now free */
+void journal_revoke(struct journal_t *j, uint64_t pos, uint64_t len);
+
+/* Free data blocks with free_data_blocks() once the running transaction is committed */
+void journal_free_blocks(struct journal_t *j, const uint64_t *blocks, uint64_t block_count);
+
+#endif
@@ -0,0 +1,323 @@
+#include "myfs.h"
+#include "libmyfs.h"
+#include "util.h"
+#include "helpers.h"
+#include "journal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+/* Seconds between journal commits, as in the daemon by default */
+#define COMMIT_INTERVAL 5
+
+struct libmyfs_t
+{
+	int fd;
+	int writable;
+	struct fsinfo_t fs;
+	/* Held for reading by lookups and reads, for writing by anything that modifies the filesystem */
+	pthread_rwlock_t lock;
+};
+
+void libmyfs_default_params(struct libmyfs_params_t *params)
+{
+	struct fs_params_t p;
+	default_fs_params(&p, MYFS_FEATURES_DEFAULT);
+	params->block_size = p.block_size;
+	params->bytes_per_inode = p.bytes_per_inode;
+	params->reserved_percent = p.reserved_percent;
+}
+
+int libmyfs_format(const char *device, const struct libmyfs_params_t *params)
+{
+	struct fs_params_t p;
+	default_fs_params(&p, MYFS_FEATURES_DEFAULT);
+	if (params) {
+		if (params->block_size < MIN_BLOCK_SIZE || params->block_size > MAX_BLOCK_SIZE ||
+				(params->block_size & (params->block_size - 1)) ||
+				params->bytes_per_inode < params->block_size || params->reserved_percent > 50)
+			return -EINVAL;
+		p.block_size = params->block_size;
+		p.bytes_per_inode = params->bytes_per_inode;
+		p.reserved_percent = params->reserved_percent;
+	}
+
+	int fd = open(device, O_RDWR);
+	if (fd == -1)
+		return -errno;
+	struct fsinfo_t fs;
+	format_fs(fd, &fs, &p);
+	int err = 0;
+	if (fsync(fd) != 0)
+		err = -errno;
+	close(fd);
+	return err;
+}
+
+int libmyfs_open(const char *device, int flags, struct libmyfs_t **fsp)
+{
+	const int writable = (flags & LIBMYFS_RDWR) != 0;
+	int fd = open(device, writable ? O_RDWR : O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	struct libmyfs_t *h = (struct libmyfs_t *)calloc(1, sizeof(struct libmyfs_t));
+	h->fd = fd;
+	h->writable = writable;
+	struct fsinfo_t *fs = &h->fs;
+	read_fsinfo(fd, fs);
+	const uint16_t bs = fs->main_block.block_size;
+	int err = 0;
+	if (bs < MIN_BLOCK_SIZE || bs > MAX_BLOCK_SIZE || (bs & (bs - 1)))
+		err = -EINVAL;
+	else if (fs->main_block.features & ~MYFS_FEATURES_SUPPORTED)
+		err = -EOPNOTSUPP;
+	else if (writable && (fs->main_block.features & MYFS_FEATURE_JOURNAL) &&
+			!journal_open(fd, fs, COMMIT_INTERVAL))
+		err = -EIO;
+	if (err) {
+		close(fd);
+		free(h);
+		return err;
+	}
+	if (writable) {
+		if (fs->main_block.state != MYFS_STATE_CLEAN)
+			rescan_allocator(fd, fs);
+		write_fs_state(fd, fs, MYFS_STATE_DIRTY);
+	}
+	pthread_rwlock_init(&h->lock, NULL);
+	*fsp = h;
+	return 0;
+}
+
+int libmyfs_close(struct libmyfs_t *h)
+{
+	int err = 0;
+	if (h->writable) {
+		if (h->fs.journal)
+			journal_close(h->fs.journal);
+		write_fs_state(h->fd, &h->fs, MYFS_STATE_CLEAN);
+		if (fsync(h->fd) != 0)
+			err = -errno;
+	}
+	close(h->fd);
+	pthread_rwlock_destroy(&h->lock);
+	free(h);
+	return err;
+}
+
+int libmyfs_sync(struct libmyfs_t *h)
+{
+	if (!h->writable)
+		return 0;
+	if (h->fs.journal)
+		return -journal_sync(h->fs.journal);
+	return fsync(h->fd) == 0 ? 0 : -errno;
+}
+
+/* Begin and end a modification of the filesystem */
+static int begin_write(struct libmyfs_t *h)
+{
+	if (!h->writable)
+		return -EROFS;
+	pthread_rwlock_wrlock(&h->lock);
+	if (h->fs.journal)
+		journal_start(h->fs.journal);
+	return 0;
+}
+
+static void end_write(struct libmyfs_t *h)
+{
+	if (h->fs.journal)
+		journal_stop(h->fs.journal);
+	pthread_rwlock_unlock(&h->lock);
+}
+
+/* Read an inode that must be in use; the handle must be locked */
+static int get_inode(struct libmyfs_t *h, uint32_t inode_num, struct inode_t *inode)
+{
+	if (inode_num >= h->fs.main_block.inode_count_limit || !get_inode_state(h->fd, &h->fs, inode_num))
+		return -ENOENT;
+	read_inode(h->fd, &h->fs, inode_num, inode);
+	return 0;
+}
+
+static int is_dir(const struct inode_t *inode)
+{
+	return (inode->mode & mode_ftype_mask) == mode_ftype_dir;
+}
+
+/* Whether the free blocks are enough for a file to hold `end` bytes, indirect
+ * blocks included; only root may take the reserved ones */
+static int has_space(const struct fsinfo_t *fs, const struct inode_t *inode, uint64_t end)
+{
+	const uint16_t bs = fs->main_block.block_size;
+	const uint64_t old_blocks = CEIL_DIV(inode->size, bs);
+	const uint64_t new_blocks = CEIL_DIV(end, bs);
+	if (new_blocks <= old_blocks)
+		return 1;
+	const uint64_t needed = new_blocks - old_blocks +
+		calc_indirect_block_count(fs, new_blocks).total_indirect -
+		calc_indirect_block_count(fs, old_blocks).total_indirect;
+	const uint64_t reserved = geteuid() == 0 ? 0 : fs->main_block.reserved_blocks;
+	return fs->main_block.free_data_block_count >= reserved + needed;
+}
+
+int libmyfs_lookup(struct libmyfs_t *h, const char *path, uint32_t *inode_num)
+{
+	struct inode_t inode;
+	pthread_rwlock_rdlock(&h->lock);
+	const int found = get_path_inode(h->fd, &h->fs, path, inode_num, &inode, NULL, NULL, NULL);
+	pthread_rwlock_unlock(&h->lock);
+	return found ? 0 : -ENOENT;
+}
+
+int libmyfs_stat(struct libmyfs_t *h, uint32_t inode_num, struct stat *st)
+{
+	struct inode_t inode;
+	pthread_rwlock_rdlock(&h->lock);
+	const int err = get_inode(h, inode_num, &inode);
+	pthread_rwlock_unlock(&h->lock);
+	if (!err)
+		inode_stat(&h->fs, inode_num, &inode, st);
+	return err;
+}
+
+int libmyfs_stat_path(struct libmyfs_t *h, const char *path, struct stat *st)
+{
+	uint32_t inode_num;
+	struct inode_t inode;
+	pthread_rwlock_rdlock(&h->lock);
+	const int found = get_path_inode(h->fd, &h->fs, path, &inode_num, &inode, NULL, NULL, NULL);
+	pthread_rwlock_unlock(&h->lock);
+	if (!found)
+		return -ENOENT;
+	inode_stat(&h->fs, inode_num, &inode, st);
+	return 0;
+}
+
+int libmyfs_create(struct libmyfs_t *h, const char *path, mode_t mode, uint32_t *inode_num)
+{
+	if (!S_ISREG(mode) && !S_ISDIR(mode))
+		return -EINVAL;
+	// Split the path into the parent directory and the name
+	const char *slash = strrchr(path, '/');
+	if (path[0] != '/' || slash[1] == '\0')
+		return -EINVAL;
+	const char *name = slash + 1;
+	if (strlen(name) > MAX_FILE_NAME_LENGTH)
+		return -ENAMETOOLONG;
+	const size_t dir_len = MAX(slash - path, 1);
+	char *dir_path = (char *)malloc(dir_len + 1);
+	memcpy(dir_path, path, dir_len);
+	dir_path[dir_len] = '\0';
+
+	int err = begin_write(h);
+	if (err) {
+		free(dir_path);
+		return err;
+	}
+	struct fsinfo_t *fs = &h->fs;
+	uint32_t dir_num, num;
+	struct inode_t dir;
+	if (!get_path_inode(h->fd, fs, dir_path, &dir_num, &dir, NULL, NULL, NULL))
+		err = -ENOENT;
+	else if (!is_dir(&dir))
+		err = -ENOTDIR;
+	else if (lookup_dir_entry(h->fd, fs, dir_num, &dir, name, strlen(name), &num))
+		err = -EEXIST;
+	// The directory may need another block for the entry
+	else if (fs->main_block.inode_count >= fs->main_block.inode_count_limit ||
+			!has_space(fs, &dir, dir.size + MAX_FILE_NAME_LENGTH + DIR_ENTRY_PADDING + 16))
+		err = -ENOSPC;
+	if (!err) {
+		struct inode_t inode;
+		initialize_inode(&inode, getuid(), getgid(),
+				(mode & mode_mask) | (S_ISDIR(mode) ? mode_ftype_dir : mode_ftype_file));
+		create_inode(h->fd, fs, &inode, &num);
+		add_inode_to_dir(h->fd, fs, dir_num, &dir, num, &inode, name);
+		write_main_block(h->fd, fs);
+		if (inode_num)
+			*inode_num = num;
+	}
+	end_write(h);
+	free(dir_path);
+	return err;
+}
+
+int64_t libmyfs_read(struct libmyfs_t *h, uint32_t inode_num, void *buffer, uint64_t len, uint64_t pos)
+{
+	struct inode_t inode;
+	pthread_rwlock_rdlock(&h->lock);
+	int64_t res = get_inode(h, inode_num, &inode);
+	if (!res && is_dir(&inode))
+		res = -EISDIR;
+	if (!res && pos < inode.size)
+		res = inode_data_read(h->fd, &h->fs, &inode, (uint8_t *)buffer, MIN(len, inode.size - pos), pos);
+	pthread_rwlock_unlock(&h->lock);
+	return res;
+}
+
+int64_t libmyfs_write(struct libmyfs_t *h, uint32_t inode_num, const void *buffer, uint64_t len, uint64_t pos)
+{
+	int64_t res = begin_write(h);
+	if (res)
+		return res;
+	struct inode_t inode;
+	res = get_inode(h, inode_num, &inode);
+	if (!res && is_dir(&inode))
+		res = -EISDIR;
+	else if (!res && !has_space(&h->fs, &inode, pos + len))
+		res = -ENOSPC;
+	if (!res && len > 0) {
+		res = inode_data_write(h->fd, &h->fs, &inode, (const uint8_t *)buffer, len, pos);
+		write_inode(h->fd, &h->fs, inode_num, &inode);
+		write_main_block(h->fd, &h->fs);
+	}
+	end_write(h);
+	return res;
+}
+
+struct readdir_state_t
+{
+	libmyfs_dir_cb_t cb;
+	void *data;
+	char name[MAX_FILE_NAME_LENGTH + 1];
+};
+
+static int readdir_cb(void *data, uint32_t inode_num, const char *name, uint16_t name_len,
+		uint64_t pos, uint64_t next_pos)
+{
+	struct readdir_state_t *st = (struct readdir_state_t *)data;
+	memcpy(st->name, name, name_len);
+	st->name[name_len] = '\0';
+	return st->cb(st->data, st->name, inode_num);
+}
+
+int libmyfs_readdir(struct libmyfs_t *h, uint32_t inode_num, libmyfs_dir_cb_t cb, void *data)
+{
+	struct inode_t inode;
+	struct readdir_state_t st = { .cb = cb, .data = data };
+	pthread_rwlock_rdlock(&h->lock);
+	int err = get_inode(h, inode_num, &inode);
+	if (!err && !is_dir(&inode))
+		err = -ENOTDIR;
+	if (!err)
+		read_dir(h->fd, &h->fs, &inode, 0, readdir_cb, &st);
+	pthread_rwlock_unlock(&h->lock);
+	return err;
+}
+
+int libmyfs_device_fd(struct libmyfs_t *h)
+{
+	return h->fd;
+}
+
+struct fsinfo_t *libmyfs_fsinfo(struct libmyfs_t *h)
+{
+	return &h->fs;
+}
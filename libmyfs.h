@@ -0,0 +1,99 @@
+#ifndef LIBMYFS_H_INCLUDED
+#define LIBMYFS_H_INCLUDED
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Access to a myfs filesystem from within a program, without mounting it
+ *
+ * A filesystem is opened into a handle that all the other functions take.
+ * Files are referred to by inode number; libmyfs_lookup() gives the one of
+ * a path, and the functions with a path argument do it themselves. The root
+ * directory is inode 0.
+ *
+ * Functions return 0 (or a number of bytes) on success and a negative errno
+ * value on failure. A handle may be used by several threads at once: reads
+ * run concurrently, writes one at a time. The device must not be used by
+ * anything else while it is open for writing.
+ */
+struct libmyfs_t;
+struct fsinfo_t;
+
+enum {
+	LIBMYFS_RDONLY = 0,
+	LIBMYFS_RDWR   = 1,
+};
+
+/* Geometry of a new filesystem; see mkfs.myfs */
+struct libmyfs_params_t
+{
+	uint16_t block_size;
+	uint32_t bytes_per_inode;
+	uint32_t reserved_percent;
+};
+
+/* 4KiB blocks, an inode per block and no reserved blocks */
+void libmyfs_default_params(struct libmyfs_params_t *params);
+
+/* Make a new filesystem taking the whole device, with the default features
+ *
+ * params may be NULL for the defaults.
+ */
+int libmyfs_format(const char *device, const struct libmyfs_params_t *params);
+
+/* Open the filesystem on a device or image file
+ *
+ * For writing, the journal of a filesystem that wasn't unmounted cleanly is
+ * replayed first. Read-only, it is read as it is on the device.
+ */
+int libmyfs_open(const char *device, int flags, struct libmyfs_t **fs);
+
+/* Write everything out, mark the filesystem clean and free the handle
+ *
+ * The handle is freed even if writing fails.
+ */
+int libmyfs_close(struct libmyfs_t *fs);
+
+/* Make everything written so far durable */
+int libmyfs_sync(struct libmyfs_t *fs);
+
+/* Find the inode of an absolute path */
+int libmyfs_lookup(struct libmyfs_t *fs, const char *path, uint32_t *inode_num);
+
+/* st_ino is the inode number; times have a resolution of a second */
+int libmyfs_stat(struct libmyfs_t *fs, uint32_t inode_num, struct stat *st);
+int libmyfs_stat_path(struct libmyfs_t *fs, const char *path, struct stat *st);
+
+/* Create an empty file or directory (S_IFREG or S_IFDIR in mode) at path, whose parent must exist
+ *
+ * inode_num may be NULL.
+ */
+int libmyfs_create(struct libmyfs_t *fs, const char *path, mode_t mode, uint32_t *inode_num);
+
+/* Read or write len bytes of a file at pos; writes past the end grow it
+ *
+ * returns: the number of bytes read, short at the end of the file; the
+ * number of bytes written; or a negative errno value
+ */
+int64_t libmyfs_read(struct libmyfs_t *fs, uint32_t inode_num, void *buffer, uint64_t len, uint64_t pos);
+int64_t libmyfs_write(struct libmyfs_t *fs, uint32_t inode_num, const void *buffer, uint64_t len, uint64_t pos);
+
+/* Called by libmyfs_readdir() for each entry, with a null-terminated name
+ *
+ * Must not call into the library.
+ * returns: nonzero to stop
+ */
+typedef int (*libmyfs_dir_cb_t)(void *data, const char *name, uint32_t inode_num);
+
+int libmyfs_readdir(struct libmyfs_t *fs, uint32_t inode_num, libmyfs_dir_cb_t cb, void *data);
+
+/* The device and the state of an open filesystem, for tools that use the functions of myfs.h
+ *
+ * They are only valid until libmyfs_close(). The lock of the handle isn't
+ * taken, so nothing may write through the handle meanwhile.
+ */
+int libmyfs_device_fd(struct libmyfs_t *fs);
+struct fsinfo_t *libmyfs_fsinfo(struct libmyfs_t *fs);
+
+#endif
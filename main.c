@@ -7,9 +7,14 @@
 #include "util.h"
 #include "helpers.h"
 #include "inode_map.h"
+#include "dentry_cache.h"
+#include "dir_filter.h"
+#include "journal.h"
+#include "stats.h"
+#include "myfs_ioctl.h"
 #include "asserts.h"
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,16 +22,105 @@
 #include <fcntl.h>
 #include <stddef.h>
 #include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
-#include <fcntl.h>
+#include <sys/statvfs.h>
+
+/* FUSE reserves inode number 1 for the root directory, while ours is 0 */
+#define TO_FUSE_INO(inode_num) ((fuse_ino_t)(inode_num) + 1)
+#define FROM_FUSE_INO(ino) ((uint32_t)((ino) - 1))
+
+/* The hidden directory /.myfs and its read-only file /.myfs/stats, which
+ * shows the counters of the daemon. Their inode numbers are past those of
+ * the real inodes. */
+#define STATS_DIR_NAME  ".myfs"
+#define STATS_FILE_NAME "stats"
+#define STATS_DIR_INO   ((fuse_ino_t)UINT32_MAX + 2)
+#define STATS_FILE_INO  (STATS_DIR_INO + 1)
 
 static FILE *log = NULL;
 
+static struct fuse_session *session = NULL;
+
 static struct fsinfo_t fs;
 static int fd = -1;
 
+/* Inodes the kernel holds references to or requests use, keyed by inode number */
 static struct inode_map_t inode_map;
-static uint32_t file_key_counter = 1;
+
+/* Protects inode_map and the counters of its nodes; never held while waiting for an inode lock */
+static pthread_mutex_t inode_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct dentry_cache_t dentry_cache;
+
+static struct dir_filter_map_t dir_filters;
+
+/* Requests counted in the stats file, after the counters of the core */
+enum {
+	OP_LOOKUP,
+	OP_FORGET,
+	OP_GETATTR,
+	OP_SETATTR,
+	OP_STATFS,
+	OP_READDIR,
+	OP_READDIRPLUS,
+	OP_OPENDIR,
+	OP_RELEASEDIR,
+	OP_OPEN,
+	OP_RELEASE,
+	OP_FLUSH,
+	OP_FSYNC,
+	OP_READ,
+	OP_WRITE,
+	OP_COPY_FILE_RANGE,
+	OP_IOCTL,
+	OP_LSEEK,
+	OP_MKNOD,
+	OP_MKDIR,
+	OP_UNLINK,
+	OP_RMDIR,
+	OP_RENAME,
+	OP_COUNT
+};
+
+static const char *const op_names[OP_COUNT] = {
+	"lookup", "forget", "getattr", "setattr", "statfs", "readdir", "readdirplus", "opendir",
+	"releasedir", "open", "release", "flush", "fsync", "read", "write", "copy_file_range",
+	"ioctl", "lseek", "mknod", "mkdir", "unlink", "rmdir", "rename",
+};
+
+/* Each request has a count of calls and of the bytes of file data or directory listings it moved */
+#define OP_CALLS(op) (STAT_CORE_COUNT + 2 * (op))
+#define OP_BYTES(op) (STAT_CORE_COUNT + 2 * (op) + 1)
+_Static_assert(OP_BYTES(OP_COUNT - 1) < STATS_MAX, "not enough counters for the requests");
+
+static void count_op(int op)
+{
+	stats_add(OP_CALLS(op), 1);
+}
+
+static void count_op_bytes(int op, uint64_t bytes)
+{
+	stats_add(OP_BYTES(op), bytes);
+}
+
+/* State of an open file, fi->fh points to it */
+struct file_handle_t
+{
+	uint32_t inode_num;
+	pthread_mutex_t lock;   /* Protects the readahead state */
+	uint64_t next_pos;      /* Where a sequential read would continue */
+	uint64_t ra_window;     /* Bytes to prefetch ahead of the reader; 0 while reads look random */
+	uint64_t ra_end;        /* End of the range already prefetched */
+
+	/* Buffered writes, protected by the lock of the inode */
+	uint8_t *wbuf;          /* WRITE_BUFFER_SIZE bytes, allocated on first use */
+	uint64_t wpos;          /* Position of the buffered data in the file */
+	uint32_t wlen;
+	struct file_handle_t *next_dirty; /* In the dirty_handles list of the inode while wlen > 0 */
+};
 
 /*
  * Command line options
@@ -37,21 +131,875 @@ static uint32_t file_key_counter = 1;
  */
 static struct options {
 	const char *devpath;
-	int show_help;
+	unsigned int dcache_size;
+	unsigned int dir_compact;
+	unsigned int bloom_size;
+	const char *bloom_file;
+	double attr_timeout;     /* How long (in seconds) the kernel may cache attributes */
+	double entry_timeout;    /* ... names */
+	double negative_timeout; /* ... missing names */
+	int writeback;
+	int keep_cache;
+	unsigned int max_write;  /* KiB */
+	unsigned int max_background;
+	unsigned int readahead;  /* KiB */
+	unsigned int commit_interval; /* Seconds */
+	int grow;
 } options;
 
 #define OPTION(t, p)                           \
     { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt option_spec[] = {
 	OPTION("--dev=%s", devpath),
-	OPTION("-h", show_help),
-	OPTION("--help", show_help),
+	OPTION("--dcache-size=%u", dcache_size),
+	OPTION("--dir-compact=%u", dir_compact),
+	OPTION("--bloom-size=%u", bloom_size),
+	OPTION("--bloom-file=%s", bloom_file),
+	OPTION("--attr-timeout=%lf", attr_timeout),
+	OPTION("--entry-timeout=%lf", entry_timeout),
+	OPTION("--negative-timeout=%lf", negative_timeout),
+	OPTION("--writeback", writeback),
+	OPTION("--keep-cache", keep_cache),
+	OPTION("--max-write=%u", max_write),
+	OPTION("--max-background=%u", max_background),
+	OPTION("--readahead=%u", readahead),
+	OPTION("--commit-interval=%u", commit_interval),
+	OPTION("--grow", grow),
 	FUSE_OPT_END
 };
 
-static void *myfs_init(struct fuse_conn_info *conn,
-		struct fuse_config *cfg)
+/*
+ * Locking
+ *
+ * Every request works on the in-memory copies of the inodes in inode_map,
+ * obtained with acquire_inode(). An inode is modified with its lock held
+ * for writing, which for a directory also covers its entries; readers hold
+ * it for reading. A directory is always locked before its entries, and
+ * inodes at the same level in increasing inode number order. The allocator
+ * and the caches have their own locks.
+ *
+ * Requests that write metadata are enclosed in begin_op() and end_op(),
+ * outside of any inode lock: a commit of the journal waits for the
+ * operations in progress while new ones wait for the commit.
+ */
+
+/* Get the in-memory copy of an inode, reading it if needed
+ *
+ * release_inode() must be called once done with it.
+ */
+static struct inode_map_node_t *acquire_inode(uint32_t inode_num)
+{
+	pthread_mutex_lock(&inode_map_lock);
+	struct inode_map_node_t *node = inode_map_find(&inode_map, inode_num);
+	if (!node) {
+		// Nobody can be modifying an inode which isn't in the map
+		pthread_mutex_unlock(&inode_map_lock);
+		struct inode_t inode;
+		read_inode(fd, &fs, inode_num, &inode);
+		pthread_mutex_lock(&inode_map_lock);
+
+		node = inode_map_find(&inode_map, inode_num);
+		if (!node)
+			node = inode_map_insert(&inode_map, inode_num, inode_num, &inode);
+	}
+	++node->refs;
+	pthread_mutex_unlock(&inode_map_lock);
+	return node;
+}
+
+static void begin_op(void)
+{
+	if (fs.journal)
+		journal_start(fs.journal);
+}
+
+static void end_op(void)
+{
+	if (fs.journal)
+		journal_stop(fs.journal);
+}
+
+/*
+ * Orphans
+ *
+ * An inode whose last link is removed while the kernel still knows it or a
+ * file has it open stays allocated, as an orphan, until its node is dropped.
+ * A node only leaves the map while its inode is still allocated, so
+ * create_inode() never hands out the number of an inode in the map.
+ */
+struct orphan_t
+{
+	uint32_t inode_num;
+	struct inode_t inode;
+};
+
+/* Drop the node if neither the kernel nor any request or open file uses it anymore; inode_map_lock must be held
+ *
+ * returns: 1 if it was an orphan, which the caller must pass to remove_orphan() once the lock is released
+ */
+static int drop_unused(struct inode_map_node_t *node, struct orphan_t *orphan)
+{
+	// The root directory is never forgotten
+	if (node->nlookup > 0 || node->refs > 0 || node->open_files > 0 || node->inode_num == 0)
+		return 0;
+	const int is_orphan = node->orphan;
+	if (is_orphan) {
+		orphan->inode_num = node->inode_num;
+		orphan->inode = node->inode;
+	}
+	inode_map_remove(&inode_map, node->inode_num);
+	return is_orphan;
+}
+
+static void remove_orphan(struct orphan_t *orphan)
+{
+	begin_op();
+	remove_file(fd, &fs, orphan->inode_num, &orphan->inode);
+	write_main_block(fd, &fs);
+	end_op();
+}
+
+/* Mark an inode whose last link was removed as an orphan; the inode must be locked for writing */
+static void make_orphan(struct inode_map_node_t *node)
+{
+	pthread_mutex_lock(&inode_map_lock);
+	node->orphan = 1;
+	pthread_mutex_unlock(&inode_map_lock);
+}
+
+static void release_inode(struct inode_map_node_t *node)
+{
+	struct orphan_t orphan;
+	pthread_mutex_lock(&inode_map_lock);
+	EXPECT(node->refs > 0);
+	--node->refs;
+	const int removed = drop_unused(node, &orphan);
+	pthread_mutex_unlock(&inode_map_lock);
+	if (removed)
+		remove_orphan(&orphan);
+}
+
+static struct inode_map_node_t *acquire_fuse_inode(fuse_ino_t ino)
+{
+	return acquire_inode(FROM_FUSE_INO(ino));
+}
+
+/* Account for a new kernel reference to an inode, as done by replying with an entry
+ *
+ * inode is only used if the inode isn't in the map already.
+ */
+static void remember_inode(uint32_t inode_num, const struct inode_t *inode)
+{
+	pthread_mutex_lock(&inode_map_lock);
+	struct inode_map_node_t *node = inode_map_find(&inode_map, inode_num);
+	if (!node)
+		node = inode_map_insert(&inode_map, inode_num, inode_num, inode);
+	++node->nlookup;
+	pthread_mutex_unlock(&inode_map_lock);
+}
+
+static void forget_inode(fuse_ino_t ino, uint64_t nlookup)
+{
+	if (ino >= STATS_DIR_INO)
+		return;
+	uint32_t inode_num = FROM_FUSE_INO(ino);
+	struct orphan_t orphan;
+	int removed = 0;
+	pthread_mutex_lock(&inode_map_lock);
+	struct inode_map_node_t *node = inode_map_find(&inode_map, inode_num);
+	if (node) {
+		EXPECT(node->nlookup >= nlookup);
+		node->nlookup -= nlookup;
+		removed = drop_unused(node, &orphan);
+	}
+	pthread_mutex_unlock(&inode_map_lock);
+	if (removed)
+		remove_orphan(&orphan);
+}
+
+static void read_lock(struct inode_map_node_t *node)
+{
+	pthread_rwlock_rdlock(&node->lock);
+}
+
+static void write_lock(struct inode_map_node_t *node)
+{
+	pthread_rwlock_wrlock(&node->lock);
+}
+
+static void unlock(struct inode_map_node_t *node)
+{
+	pthread_rwlock_unlock(&node->lock);
+}
+
+/* Write-lock two distinct inodes at the same level, in inode number order */
+static void write_lock_pair(struct inode_map_node_t *a, struct inode_map_node_t *b)
+{
+	if (a->inode_num > b->inode_num) {
+		struct inode_map_node_t *t = a;
+		a = b;
+		b = t;
+	}
+	write_lock(a);
+	write_lock(b);
+}
+
+/*
+ * Kernel cache invalidation
+ *
+ * The kernel drops what it caches about the inodes a request changes by
+ * itself, so only changes it can't see are notified. The notifications are
+ * sent by a separate thread: sending one while the kernel waits for the
+ * reply to a request on the same inode may deadlock.
+ */
+#define INVAL_QUEUE_SIZE 256
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	fuse_ino_t inodes[INVAL_QUEUE_SIZE];
+	uint32_t head;
+	uint32_t count;
+	int stop;
+	pthread_t thread;
+} inval_queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void *inval_thread(void *data)
+{
+	pthread_mutex_lock(&inval_queue.lock);
+	for (;;) {
+		while (inval_queue.count == 0 && !inval_queue.stop)
+			pthread_cond_wait(&inval_queue.cond, &inval_queue.lock);
+		if (inval_queue.count == 0)
+			break;
+
+		fuse_ino_t ino = inval_queue.inodes[inval_queue.head];
+		inval_queue.head = (inval_queue.head + 1) % INVAL_QUEUE_SIZE;
+		--inval_queue.count;
+		pthread_cond_broadcast(&inval_queue.cond);
+		pthread_mutex_unlock(&inval_queue.lock);
+
+		// Fails with ENOENT if the kernel doesn't know the inode, which is fine
+		fuse_lowlevel_notify_inval_inode(session, ino, 0, 0);
+
+		pthread_mutex_lock(&inval_queue.lock);
+	}
+	pthread_mutex_unlock(&inval_queue.lock);
+	return NULL;
+}
+
+/* Make the kernel drop the cached attributes and data of an inode */
+static void invalidate_inode(uint32_t inode_num)
+{
+	const fuse_ino_t ino = TO_FUSE_INO(inode_num);
+	pthread_mutex_lock(&inval_queue.lock);
+	for (uint32_t i = 0; i < inval_queue.count; ++i) {
+		if (inval_queue.inodes[(inval_queue.head + i) % INVAL_QUEUE_SIZE] == ino) {
+			pthread_mutex_unlock(&inval_queue.lock);
+			return;
+		}
+	}
+	while (inval_queue.count == INVAL_QUEUE_SIZE)
+		pthread_cond_wait(&inval_queue.cond, &inval_queue.lock);
+	inval_queue.inodes[(inval_queue.head + inval_queue.count) % INVAL_QUEUE_SIZE] = ino;
+	++inval_queue.count;
+	pthread_cond_broadcast(&inval_queue.cond);
+	pthread_mutex_unlock(&inval_queue.lock);
+}
+
+static void start_inval_thread(void)
+{
+	inval_queue.stop = 0;
+	pthread_create(&inval_queue.thread, NULL, inval_thread, NULL);
+}
+
+/* Send the pending notifications and stop the thread */
+static void stop_inval_thread(void)
+{
+	pthread_mutex_lock(&inval_queue.lock);
+	inval_queue.stop = 1;
+	pthread_cond_broadcast(&inval_queue.cond);
+	pthread_mutex_unlock(&inval_queue.lock);
+	pthread_join(inval_queue.thread, NULL);
+}
+
+/*
+ * Readahead
+ *
+ * Each handle watches whether its reads follow each other. While they do,
+ * a window of data past the last read is prefetched into the page cache of
+ * the device, doubling with every sequential read up to --readahead and
+ * halving with every other read. The next window is requested once the
+ * reader is halfway through the previous one, so the device never idles.
+ * Mapping the window reads its indirect blocks, which happens on a separate
+ * thread so that readers don't wait for them.
+ */
+#define RA_QUEUE_SIZE 64
+#define RA_MIN_WINDOW (128 * 1024)
+
+struct ra_request_t
+{
+	struct inode_map_node_t *node; /* Holds a reference to the node */
+	uint64_t pos;
+	uint64_t len;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct ra_request_t requests[RA_QUEUE_SIZE];
+	uint32_t head;
+	uint32_t count;
+	int stop;
+	pthread_t thread;
+} ra_queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void prefetch(struct inode_map_node_t *node, uint64_t pos, uint64_t len)
+{
+	const uint32_t bs = fs.main_block.block_size;
+	const uint32_t max_extents = len / bs + 2;
+	struct data_extent_t *extents = (struct data_extent_t *)malloc(max_extents * sizeof(struct data_extent_t));
+
+	read_lock(node);
+	uint32_t count = 0;
+	if (pos < node->inode.size)
+		count = map_file_range(fd, &fs, &node->inode, pos, MIN(len, node->inode.size - pos),
+				extents, max_extents);
+	unlock(node);
+
+	// The blocks may be reused once the lock is dropped, which only wastes the hint
+	for (uint32_t i = 0; i < count; ++i)
+		if (extents[i].dev_pos != 0)
+			posix_fadvise(fd, extents[i].dev_pos, extents[i].len, POSIX_FADV_WILLNEED);
+	free(extents);
+}
+
+static void *ra_thread(void *data)
+{
+	pthread_mutex_lock(&ra_queue.lock);
+	for (;;) {
+		while (ra_queue.count == 0 && !ra_queue.stop)
+			pthread_cond_wait(&ra_queue.cond, &ra_queue.lock);
+		if (ra_queue.count == 0)
+			break;
+
+		struct ra_request_t r = ra_queue.requests[ra_queue.head];
+		ra_queue.head = (ra_queue.head + 1) % RA_QUEUE_SIZE;
+		--ra_queue.count;
+		const int stop = ra_queue.stop;
+		pthread_mutex_unlock(&ra_queue.lock);
+
+		// The remaining requests only have their references dropped at unmount
+		if (!stop)
+			prefetch(r.node, r.pos, r.len);
+		release_inode(r.node);
+
+		pthread_mutex_lock(&ra_queue.lock);
+	}
+	pthread_mutex_unlock(&ra_queue.lock);
+	return NULL;
+}
+
+/* Queue a range of a file for prefetching; dropped if the queue is full */
+static void queue_prefetch(uint32_t inode_num, uint64_t pos, uint64_t len)
+{
+	struct inode_map_node_t *node = acquire_inode(inode_num);
+	pthread_mutex_lock(&ra_queue.lock);
+	if (ra_queue.count == RA_QUEUE_SIZE || ra_queue.stop) {
+		pthread_mutex_unlock(&ra_queue.lock);
+		release_inode(node);
+		return;
+	}
+	struct ra_request_t *r = &ra_queue.requests[(ra_queue.head + ra_queue.count) % RA_QUEUE_SIZE];
+	r->node = node;
+	r->pos = pos;
+	r->len = len;
+	++ra_queue.count;
+	pthread_cond_signal(&ra_queue.cond);
+	pthread_mutex_unlock(&ra_queue.lock);
+}
+
+/* Update the access pattern of a handle with a read and prefetch what comes next */
+static void readahead_after_read(struct file_handle_t *fh, uint64_t pos, uint64_t len)
+{
+	const uint64_t max_window = options.readahead * 1024ULL;
+	if (max_window == 0)
+		return;
+
+	pthread_mutex_lock(&fh->lock);
+	const uint64_t end = pos + len;
+	if (pos == fh->next_pos) {
+		fh->ra_window = fh->ra_window == 0 ? MIN(RA_MIN_WINDOW, max_window) : MIN(2 * fh->ra_window, max_window);
+	} else {
+		fh->ra_window /= 2;
+		if (fh->ra_window < RA_MIN_WINDOW)
+			fh->ra_window = 0;
+		// Whatever was prefetched before is no longer ahead of the reader
+		fh->ra_end = 0;
+	}
+	fh->next_pos = end;
+
+	uint64_t ra_pos = 0, ra_len = 0;
+	if (fh->ra_window > 0 && fh->ra_end < end + fh->ra_window / 2) {
+		ra_pos = MAX(fh->ra_end, end);
+		ra_len = end + fh->ra_window - ra_pos;
+		fh->ra_end = ra_pos + ra_len;
+	}
+	pthread_mutex_unlock(&fh->lock);
+
+	if (ra_len > 0)
+		queue_prefetch(fh->inode_num, ra_pos, ra_len);
+}
+
+static void start_ra_thread(void)
+{
+	ra_queue.stop = 0;
+	pthread_create(&ra_queue.thread, NULL, ra_thread, NULL);
+}
+
+/* Drop the pending requests and stop the thread */
+static void stop_ra_thread(void)
+{
+	pthread_mutex_lock(&ra_queue.lock);
+	ra_queue.stop = 1;
+	pthread_cond_broadcast(&ra_queue.cond);
+	pthread_mutex_unlock(&ra_queue.lock);
+	pthread_join(ra_queue.thread, NULL);
+}
+
+/*
+ * Write combining
+ *
+ * Small writes that follow each other are gathered in a buffer per handle
+ * and written out together, in whole blocks where possible. The size of
+ * the file is updated right away, so only the data is held back: anything
+ * that reads the data of the file writes out the buffers of all handles
+ * first. Writing through one handle also writes out the buffers of the
+ * others, so that their order is kept.
+ */
+#define WRITE_BUFFER_SIZE (128 * 1024)
+#define MAX_BUFFERED_WRITE (WRITE_BUFFER_SIZE / 4)
+
+/* Write out the first len bytes buffered by a handle; the inode must be locked for writing
+ *
+ * The blocks it allocates are committed with the inode that maps them, in the same operation.
+ */
+static void write_out(struct inode_map_node_t *node, struct file_handle_t *fh, uint32_t len)
+{
+	inode_data_write(fd, &fs, &node->inode, fh->wbuf, len, fh->wpos);
+	write_inode(fd, &fs, node->inode_num, &node->inode);
+	write_main_block(fd, &fs);
+	memmove(fh->wbuf, fh->wbuf + len, fh->wlen - len);
+	fh->wpos += len;
+	fh->wlen -= len;
+	if (fh->wlen > 0)
+		return;
+
+	struct file_handle_t **link = &node->dirty_handles;
+	while (*link != fh)
+		link = &(*link)->next_dirty;
+	*link = fh->next_dirty;
+	fh->next_dirty = NULL;
+}
+
+/* Write out everything a handle buffered; the inode must be locked for writing */
+static void flush_handle(struct inode_map_node_t *node, struct file_handle_t *fh)
+{
+	if (fh->wlen > 0)
+		write_out(node, fh, fh->wlen);
+}
+
+/* Write out the buffers of all handles of an inode but `except`; the inode must be locked for writing */
+static void flush_inode_writes(struct inode_map_node_t *node, struct file_handle_t *except)
+{
+	struct file_handle_t *fh = node->dirty_handles;
+	while (fh) {
+		struct file_handle_t *next = fh->next_dirty;
+		if (fh != except)
+			flush_handle(node, fh);
+		fh = next;
+	}
+}
+
+/* Lock an inode for reading its data, writing out the buffered writes first */
+static void read_lock_flushed(struct inode_map_node_t *node)
+{
+	read_lock(node);
+	while (node->dirty_handles) {
+		unlock(node);
+		begin_op();
+		write_lock(node);
+		flush_inode_writes(node, NULL);
+		unlock(node);
+		end_op();
+		read_lock(node);
+	}
+}
+
+/* Add a small write to the buffer of a handle; the inode must be locked for writing
+ *
+ * returns: the number of bytes written; negative error number on failure
+ */
+static ssize_t buffer_write(struct inode_map_node_t *node, struct file_handle_t *fh,
+		struct fuse_bufvec *in_buf, uint64_t offset, size_t size)
+{
+	if (fh->wlen > 0 && offset != fh->wpos + fh->wlen)
+		flush_handle(node, fh);
+	if (fh->wlen + size > WRITE_BUFFER_SIZE) {
+		// Keep the partial block at the end, the next writes are likely to fill it
+		const uint32_t bs = fs.main_block.block_size;
+		const uint64_t aligned_end = (fh->wpos + fh->wlen) / bs * bs;
+		if (aligned_end > fh->wpos)
+			write_out(node, fh, aligned_end - fh->wpos);
+		if (fh->wlen + size > WRITE_BUFFER_SIZE)
+			write_out(node, fh, fh->wlen);
+	}
+
+	if (!fh->wbuf)
+		fh->wbuf = (uint8_t *)malloc(WRITE_BUFFER_SIZE);
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+	bufv.buf[0].mem = fh->wbuf + fh->wlen;
+	const ssize_t res = fuse_buf_copy(&bufv, in_buf, 0);
+	if (res <= 0)
+		return res;
+
+	if (fh->wlen == 0) {
+		fh->wpos = offset;
+		fh->next_dirty = node->dirty_handles;
+		node->dirty_handles = fh;
+	}
+	fh->wlen += res;
+	if (offset + res > node->inode.size) {
+		resize_file(fd, &fs, &node->inode, offset + res);
+		write_inode(fd, &fs, node->inode_num, &node->inode);
+		write_main_block(fd, &fs);
+	}
+	return res;
+}
+
+static int is_dir(const struct inode_t *inode)
+{
+	return (inode->mode & mode_ftype_mask) == mode_ftype_dir;
+}
+
+/* Whether the caller may allocate that many more data blocks: only root may
+ * take the reserved ones */
+static int has_space(fuse_req_t req, uint64_t blocks)
+{
+	const struct main_block_t *mb = &fs.main_block;
+	if (mb->reserved_blocks == 0 || fuse_req_ctx(req)->uid == 0)
+		return 1;
+	return mb->free_data_block_count >= mb->reserved_blocks + blocks;
+}
+
+/* Blocks a write needs past the end of the file */
+static uint64_t growth_blocks(const struct inode_t *inode, uint64_t pos, uint64_t len)
 {
+	const uint16_t bs = fs.main_block.block_size;
+	const uint64_t old_blocks = CEIL_DIV(inode->size, bs);
+	const uint64_t new_blocks = CEIL_DIV(pos + len, bs);
+	return new_blocks > old_blocks ? new_blocks - old_blocks : 0;
+}
+
+/* Compact a directory once `options.dir_compact` percent of it is slack
+ *
+ * Compaction moves the entries around, which would break the offsets of
+ * listings in progress, so it is deferred until the directory is closed.
+ * The directory must be locked for writing.
+ */
+static void maybe_compact_dir(struct inode_map_node_t *dir)
+{
+	// Small directories aren't worth it
+	if (options.dir_compact == 0 || dir->inode.size < 2 * (uint64_t)fs.main_block.block_size)
+		return;
+
+	pthread_mutex_lock(&inode_map_lock);
+	const int open = dir->open_dirs > 0;
+	if (open)
+		dir->compact_pending = 1;
+	pthread_mutex_unlock(&inode_map_lock);
+	if (open)
+		return;
+
+	// The kernel doesn't know that the directory shrank
+	if (dir_slack(fd, &fs, &dir->inode) * 100 >= dir->inode.size * options.dir_compact &&
+			compact_dir(fd, &fs, dir->inode_num, &dir->inode) > 0)
+		invalidate_inode(dir->inode_num);
+}
+
+static void fill_stat(uint32_t inode_num, const struct inode_t *inode, struct stat *stbuf)
+{
+	inode_stat(&fs, inode_num, inode, stbuf);
+	stbuf->st_ino = TO_FUSE_INO(inode_num);
+}
+
+static void fill_entry(uint32_t inode_num, const struct inode_t *inode, struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	e->ino = TO_FUSE_INO(inode_num);
+	// Inode numbers are reused, but a reused inode gets a new creation time
+	e->generation = inode->ctime;
+	e->attr_timeout = options.attr_timeout;
+	e->entry_timeout = options.entry_timeout;
+	fill_stat(inode_num, inode, &e->attr);
+}
+
+/* Reply with the entry of an inode and account for the kernel's new reference
+ *
+ * The inode must be locked.
+ */
+static void reply_entry(fuse_req_t req, struct inode_map_node_t *node)
+{
+	struct fuse_entry_param e;
+	fill_entry(node->inode_num, &node->inode, &e);
+	remember_inode(node->inode_num, &node->inode);
+	fuse_reply_entry(req, &e);
+}
+
+/* Check that `name` may be an entry of the directory `dir`, which must be locked
+ *
+ * returns: 0 on success; an errno value otherwise
+ */
+static int check_parent_dir(struct inode_map_node_t *dir, const char *name)
+{
+	if (!is_dir(&dir->inode))
+		return ENOTDIR;
+	// Removed, but still open
+	if (dir->inode.nlinks == 0)
+		return ENOENT;
+	if (strlen(name) > MAX_FILE_NAME_LENGTH)
+		return ENAMETOOLONG;
+	return 0;
+}
+
+/* Identifies the state of the device, so that directory filters saved at
+ * unmount are not used if something else modified it in the meantime */
+static uint64_t device_state_id(void)
+{
+	struct stat st;
+	uint64_t id = 0;
+	if (fstat(fd, &st) == 0)
+		id = (uint64_t)st.st_mtim.tv_sec * 1000000000u + st.st_mtim.tv_nsec;
+	id = id * 31 + fs.main_block.inode_count;
+	id = id * 31 + fs.main_block.free_data_block_count;
+	return id;
+}
+
+/* id: device_state_id() as the device was found, before mounting modified it */
+static void load_dir_filters(uint64_t id)
+{
+	FILE *f = fopen(options.bloom_file, "rb");
+	if (!f)
+		return;
+	if (dir_filter_map_load(&dir_filters, f, id) != 0)
+		fprintf(stderr, "Ignoring outdated or invalid directory filters in %s\n", options.bloom_file);
+	fclose(f);
+
+	// The filters go stale as soon as the filesystem is modified, so they are
+	// only saved back at a clean unmount
+	unlink(options.bloom_file);
+}
+
+static void save_dir_filters(void)
+{
+	FILE *f = fopen(options.bloom_file, "wb");
+	if (!f) {
+		perror("Failed to save directory filters");
+		return;
+	}
+	int err = dir_filter_map_save(&dir_filters, f, device_state_id());
+	if (fclose(f) != 0 || err) {
+		fprintf(stderr, "Failed to save directory filters\n");
+		unlink(options.bloom_file);
+	}
+}
+
+/* Write the counters as the stats file shows them
+ *
+ * A "name value" line for each counter, after a "version 1" line. Every
+ * counter is always there, 0 for disabled caches; counters are only ever
+ * added, so readers should go by name.
+ */
+static void print_stats(FILE *out)
+{
+	static const char *const core_names[STAT_CORE_COUNT] = {
+		"dev.reads", "dev.read_bytes", "dev.writes", "dev.write_bytes", "dev.syncs",
+		"alloc.scans", "alloc.scan_blocks", "journal.read_hits",
+	};
+	uint64_t totals[STATS_MAX];
+	stats_sum(totals);
+
+	fprintf(out, "version 1\n");
+	for (int op = 0; op < OP_COUNT; ++op) {
+		fprintf(out, "op.%s.calls %lu\n", op_names[op], (unsigned long)totals[OP_CALLS(op)]);
+		fprintf(out, "op.%s.bytes %lu\n", op_names[op], (unsigned long)totals[OP_BYTES(op)]);
+	}
+	for (int i = 0; i < STAT_CORE_COUNT; ++i)
+		fprintf(out, "%s %lu\n", core_names[i], (unsigned long)totals[i]);
+
+	// Kept by the caches and the journal themselves
+	const struct dentry_cache_t *dc = fs.dcache;
+	const struct dir_filter_map_t *df = fs.dfilters;
+	const struct journal_t *j = fs.journal;
+	fprintf(out, "dcache.hits %lu\n", dc ? (unsigned long)dc->hits : 0UL);
+	fprintf(out, "dcache.negative_hits %lu\n", dc ? (unsigned long)dc->negative_hits : 0UL);
+	fprintf(out, "dcache.misses %lu\n", dc ? (unsigned long)dc->misses : 0UL);
+	fprintf(out, "dfilter.builds %lu\n", df ? (unsigned long)df->builds : 0UL);
+	fprintf(out, "dfilter.negatives %lu\n", df ? (unsigned long)df->negatives : 0UL);
+	fprintf(out, "dfilter.false_positives %lu\n", df ? (unsigned long)df->false_positives : 0UL);
+	fprintf(out, "journal.commits %lu\n", j ? (unsigned long)j->commits : 0UL);
+	fprintf(out, "journal.committed_chunks %lu\n", j ? (unsigned long)j->committed_chunks : 0UL);
+	fprintf(out, "journal.checkpoints %lu\n", j ? (unsigned long)j->checkpoints : 0UL);
+}
+
+/*
+ * The stats directory
+ *
+ * /.myfs isn't in the listing of the root, and nothing can be created,
+ * removed or renamed in it or over it. Opening /.myfs/stats takes a
+ * snapshot of the counters, which reads of that handle return.
+ */
+static int is_virtual(fuse_ino_t ino)
+{
+	return ino >= STATS_DIR_INO;
+}
+
+static int is_virtual_name(fuse_ino_t parent, const char *name)
+{
+	return is_virtual(parent) || (parent == TO_FUSE_INO(0) && !strcmp(name, STATS_DIR_NAME));
+}
+
+static void virtual_stat(fuse_ino_t ino, struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = ino;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	if (ino == STATS_FILE_INO) {
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+	} else {
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+	}
+}
+
+static void virtual_entry(fuse_ino_t ino, struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	e->ino = ino;
+	e->attr_timeout = options.attr_timeout;
+	e->entry_timeout = options.entry_timeout;
+	virtual_stat(ino, &e->attr);
+}
+
+static void virtual_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fuse_ino_t ino = 0;
+	if (parent == TO_FUSE_INO(0))
+		ino = STATS_DIR_INO;
+	else if (parent == STATS_DIR_INO && !strcmp(name, STATS_FILE_NAME))
+		ino = STATS_FILE_INO;
+	if (ino == 0) {
+		fuse_reply_err(req, parent == STATS_DIR_INO ? ENOENT : ENOTDIR);
+		return;
+	}
+	struct fuse_entry_param e;
+	virtual_entry(ino, &e);
+	fuse_reply_entry(req, &e);
+}
+
+static void virtual_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, int plus)
+{
+	if (ino != STATS_DIR_INO) {
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	const char *names[] = { ".", "..", STATS_FILE_NAME };
+	const fuse_ino_t inos[] = { STATS_DIR_INO, TO_FUSE_INO(0), STATS_FILE_INO };
+	char *buf = (char *)malloc(size);
+	size_t used = 0;
+	for (off_t i = MAX(offset, 0); i < 3; ++i) {
+		struct fuse_entry_param e;
+		virtual_entry(inos[i], &e);
+		// "." and ".." are not looked up by the kernel
+		if (i < 2)
+			e.ino = 0;
+		const size_t len = plus ?
+			fuse_add_direntry_plus(req, buf + used, size - used, names[i], &e, i + 1) :
+			fuse_add_direntry(req, buf + used, size - used, names[i], &e.attr, i + 1);
+		if (len > size - used)
+			break;
+		used += len;
+	}
+	count_op_bytes(plus ? OP_READDIRPLUS : OP_READDIR, used);
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+/* Snapshot of the counters, fi->fh of an open stats file points to it */
+struct stats_snapshot_t
+{
+	char *text;
+	size_t len;
+};
+
+static void virtual_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	if (ino != STATS_FILE_INO) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	struct stats_snapshot_t *s = (struct stats_snapshot_t *)malloc(sizeof(struct stats_snapshot_t));
+	FILE *out = open_memstream(&s->text, &s->len);
+	print_stats(out);
+	fclose(out);
+	fi->fh = (uintptr_t)s;
+	// The file has no size; the kernel reads it until the end
+	fi->direct_io = 1;
+	fuse_reply_open(req, fi);
+}
+
+static void virtual_read(fuse_req_t req, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	const struct stats_snapshot_t *s = (const struct stats_snapshot_t *)(uintptr_t)fi->fh;
+	if ((uint64_t)offset >= s->len) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	const size_t len = MIN(size, s->len - offset);
+	count_op_bytes(OP_READ, len);
+	fuse_reply_buf(req, s->text + offset, len);
+}
+
+static void virtual_release(fuse_req_t req, struct fuse_file_info *fi)
+{
+	struct stats_snapshot_t *s = (struct stats_snapshot_t *)(uintptr_t)fi->fh;
+	free(s->text);
+	free(s);
+	fuse_reply_err(req, 0);
+}
+
+static void myfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+	if (conn->capable & FUSE_CAP_READDIRPLUS)
+		conn->want |= FUSE_CAP_READDIRPLUS;
+	// Let the kernel buffer writes in its page cache; it then owns the file
+	// sizes and modification times, which it sends back with setattr
+	if (options.writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+	// Move data between /dev/fuse and the device with splice() where possible
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+	// Both are capped by the library to what the kernel supports
+	conn->max_write = options.max_write * 1024;
+	conn->max_background = options.max_background;
+	conn->congestion_threshold = options.max_background * 3 / 4;
+
 	fd = open(options.devpath, O_RDWR);
 	if (fd == -1) {
 		perror("Failed to open device");
@@ -59,472 +1007,1302 @@ static void *myfs_init(struct fuse_conn_info *conn,
 	}
 
 	read_fsinfo(fd, &fs);
+	if (fs.main_block.features & ~MYFS_FEATURES_SUPPORTED) {
+		fprintf(stderr, "The filesystem uses unsupported features (0x%x)\n",
+				fs.main_block.features & ~MYFS_FEATURES_SUPPORTED);
+		exit(1);
+	}
+	const uint64_t state_id = device_state_id();
+	// Metadata committed before a crash is replayed here
+	if ((fs.main_block.features & MYFS_FEATURE_JOURNAL) &&
+			!journal_open(fd, &fs, options.commit_interval)) {
+		fprintf(stderr, "The journal is invalid\n");
+		exit(1);
+	}
+	// The counts and hints of the allocator are only up to date after a clean unmount
+	if (fs.main_block.state != MYFS_STATE_CLEAN) {
+		rescan_allocator(fd, &fs);
+		if (log)
+			fprintf(log, "not unmounted cleanly, rescanned the bitmaps\n");
+	}
+	write_fs_state(fd, &fs, MYFS_STATE_DIRTY);
+	if (options.grow) {
+		const uint64_t data_blocks = fs.main_block.data_block_count;
+		begin_op();
+		int err = grow_fs(fd, &fs, lseek(fd, 0, SEEK_END));
+		end_op();
+		if (!err && fs.journal)
+			err = journal_sync(fs.journal);
+		if (err)
+			fprintf(stderr, "Failed to grow the filesystem: %s\n", strerror(err));
+		else if (log)
+			fprintf(log, "grew from %lu to %lu data blocks\n", (unsigned long)data_blocks,
+					(unsigned long)fs.main_block.data_block_count);
+	}
 
 	inode_map_initialize(&inode_map);
+	start_inval_thread();
+	start_ra_thread();
 
-	return NULL;
+	// The kernel always holds a reference to the root directory
+	struct inode_t root_inode;
+	read_inode(fd, &fs, 0, &root_inode);
+	remember_inode(0, &root_inode);
+
+	if (options.dcache_size > 0) {
+		dentry_cache_initialize(&dentry_cache, options.dcache_size * 1024UL * 1024UL);
+		fs.dcache = &dentry_cache;
+	}
+
+	if (options.bloom_size > 0) {
+		dir_filter_map_initialize(&dir_filters, options.bloom_size * 1024UL * 1024UL);
+		fs.dfilters = &dir_filters;
+		if (options.bloom_file)
+			load_dir_filters(state_id);
+	}
 }
 
-static void myfs_destroy(void *private_data)
+static void remove_unmounted_orphan(struct inode_map_node_t *node, void *data)
 {
-	inode_map_destroy(&inode_map);
+	if (node->orphan)
+		remove_file(fd, &fs, node->inode_num, &node->inode);
 }
 
-static int myfs_getattr(const char *path, struct stat *stbuf,
-			 struct fuse_file_info *fi)
+static void myfs_destroy(void *userdata)
 {
-	memset(stbuf, 0, sizeof(struct stat));
+	if (log)
+		print_stats(log);
 
+	stop_ra_thread();
+	stop_inval_thread();
+	// The kernel doesn't forget the inodes it knows at unmount
+	inode_map_for_each(&inode_map, remove_unmounted_orphan, NULL);
+	inode_map_destroy(&inode_map);
+	if (fs.journal)
+		journal_close(fs.journal);
+	write_fs_state(fd, &fs, MYFS_STATE_CLEAN);
+
+	// Saved once nothing modifies the device anymore
+	if (fs.dfilters) {
+		if (options.bloom_file)
+			save_dir_filters();
+		dir_filter_map_destroy(fs.dfilters);
+		fs.dfilters = NULL;
+	}
+	if (fs.dcache) {
+		dentry_cache_destroy(fs.dcache);
+		fs.dcache = NULL;
+	}
+	close(fd);
+	fd = -1;
+}
+
+static void myfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	count_op(OP_LOOKUP);
+	if (is_virtual_name(parent, name)) {
+		virtual_lookup(req, parent, name);
+		return;
+	}
+	struct inode_map_node_t *dir = acquire_fuse_inode(parent);
+	read_lock(dir);
 	uint32_t inode_num;
-	struct inode_t in;
-	struct inode_t *inode = &in;
-
-	if (!strcmp(path, "/")) {
-		inode_num = 0;
-		read_inode(fd, &fs, 0, inode);
-	} else if (fi && fi->fh) {
-		inode_map_get(&inode_map, fi->fh, &inode_num, &inode);
-	} else if (!get_path_inode(fd, &fs, path, &inode_num, &in, NULL, NULL, NULL)) {
-		return -ENOENT;
-	}
-
-	uint16_t bs = fs.main_block.block_size;
-	uint32_t bcnt = CEIL_DIV(inode->size, bs);
-	const struct indirect_block_count_t indirect_bcnt =
-		calc_indirect_block_count(bs, bcnt);
-	uint64_t total_blocks = indirect_bcnt.total_indirect + bcnt;
-	total_blocks *= bs / 512;
-
-	struct timespec mtime = { .tv_sec = inode->mtime, .tv_nsec = 0 };
-	struct timespec ctime = { .tv_sec = inode->ctime, .tv_nsec = 0 };
-
-	mode_t mode = (inode->mode & mode_mask);
-	if ((inode->mode & mode_ftype_mask) == mode_ftype_dir)
-		mode |= S_IFDIR;
-	else //if (inode->mode & mode_ftype_mask == mode_ftype_file)
-		mode |= S_IFREG;
-	stbuf->st_ino = inode_num;
-	stbuf->st_mode = mode;
-	stbuf->st_nlink = inode->nlinks;
-	stbuf->st_uid = inode->uid;
-	stbuf->st_gid = inode->gid;
-	stbuf->st_size = inode->size;
-	stbuf->st_blksize = bs;
-	stbuf->st_blocks = total_blocks;
-	stbuf->st_atim = mtime;
-	stbuf->st_mtim = mtime;
-	stbuf->st_ctim = ctime;
+	int err = check_parent_dir(dir, name);
+	if (!err && !lookup_dir_entry(fd, &fs, dir->inode_num, &dir->inode, name, strlen(name), &inode_num))
+		err = ENOENT;
+	unlock(dir);
+	release_inode(dir);
+	if (err == ENOENT && options.negative_timeout > 0) {
+		// An entry with inode 0 lets the kernel cache that the name doesn't exist
+		struct fuse_entry_param e;
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = options.negative_timeout;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	if (err) {
+		fuse_reply_err(req, err);
+		return;
+	}
 
-	return 0;
+	struct inode_map_node_t *node = acquire_inode(inode_num);
+	read_lock(node);
+	reply_entry(req, node);
+	unlock(node);
+	release_inode(node);
 }
 
-static int myfs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+static void myfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
 {
-	uint32_t inode_num;
-	struct inode_t in;
-	struct inode_t *inode = &in;
+	count_op(OP_FORGET);
+	forget_inode(ino, nlookup);
+	fuse_reply_none(req);
+}
 
-	if (!strcmp(path, "/")) {
-		inode_num = 0;
-		read_inode(fd, &fs, inode_num, &in);
-	} else if (fi && fi->fh) {
-		inode_map_get(&inode_map, fi->fh, &inode_num, &inode);
-	} else if (!get_path_inode(fd, &fs, path, &inode_num, &in, NULL, NULL, NULL)) {
-		return -ENOENT;
-	}
+static void myfs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	count_op(OP_FORGET);
+	for (size_t i = 0; i < count; ++i)
+		forget_inode(forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
 
-	inode->mode &= ~0777;
-	inode->mode |= mode & 0777;
-	write_inode(fd, &fs, inode_num, inode);
+static void myfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	count_op(OP_GETATTR);
+	struct stat stbuf;
+	if (is_virtual(ino)) {
+		virtual_stat(ino, &stbuf);
+		fuse_reply_attr(req, &stbuf, options.attr_timeout);
+		return;
+	}
+	struct inode_map_node_t *node = acquire_fuse_inode(ino);
+	read_lock(node);
+	fill_stat(node->inode_num, &node->inode, &stbuf);
+	unlock(node);
+	release_inode(node);
+	fuse_reply_attr(req, &stbuf, options.attr_timeout);
+}
 
-	return 0;
+static void myfs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	count_op(OP_STATFS);
+	const struct main_block_t *mb = &fs.main_block;
+	struct statvfs st;
+	memset(&st, 0, sizeof(st));
+	st.f_bsize = mb->block_size;
+	st.f_frsize = mb->block_size;
+	st.f_blocks = mb->data_block_count;
+	st.f_bfree = mb->free_data_block_count;
+	st.f_bavail = mb->free_data_block_count > mb->reserved_blocks ?
+		mb->free_data_block_count - mb->reserved_blocks : 0;
+	st.f_files = mb->inode_count_limit;
+	st.f_ffree = mb->inode_count_limit - mb->inode_count;
+	st.f_favail = st.f_ffree;
+	st.f_namemax = MAX_FILE_NAME_LENGTH;
+	fuse_reply_statfs(req, &st);
 }
 
-static int myfs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi)
+static void myfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+		struct fuse_file_info *fi)
 {
-	uint32_t inode_num;
-	struct inode_t in;
-	struct inode_t *inode = &in;
+	count_op(OP_SETATTR);
+	if (is_virtual(ino)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	begin_op();
+	struct inode_map_node_t *node = acquire_fuse_inode(ino);
+	struct inode_t *inode = &node->inode;
+	write_lock(node);
+
+	if ((to_set & FUSE_SET_ATTR_SIZE) && is_dir(inode)) {
+		unlock(node);
+		release_inode(node);
+		end_op();
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
 
-	if (!strcmp(path, "/")) {
-		inode_num = 0;
-		read_inode(fd, &fs, inode_num, &in);
-	} else if (fi && fi->fh) {
-		inode_map_get(&inode_map, fi->fh, &inode_num, &inode);
-	} else if (!get_path_inode(fd, &fs, path, &inode_num, &in, NULL, NULL, NULL)) {
-		return -ENOENT;
+	if (to_set & FUSE_SET_ATTR_MODE) {
+		inode->mode &= ~0777;
+		inode->mode |= attr->st_mode & 0777;
 	}
 
-	inode->uid = uid;
-	inode->gid = gid;
-	write_inode(fd, &fs, inode_num, inode);
+	if (to_set & FUSE_SET_ATTR_UID)
+		inode->uid = attr->st_uid;
+	if (to_set & FUSE_SET_ATTR_GID)
+		inode->gid = attr->st_gid;
 
-	return 0;
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		flush_inode_writes(node, NULL);
+		resize_file(fd, &fs, inode, attr->st_size);
+		write_main_block(fd, &fs);
+	}
+
+	if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+		inode->mtime = time(NULL);
+	else if (to_set & FUSE_SET_ATTR_MTIME)
+		inode->mtime = attr->st_mtim.tv_sec;
+
+	write_inode(fd, &fs, node->inode_num, inode);
+
+	struct stat stbuf;
+	fill_stat(node->inode_num, inode, &stbuf);
+	unlock(node);
+	release_inode(node);
+	end_op();
+	fuse_reply_attr(req, &stbuf, options.attr_timeout);
 }
 
-static int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi,
-			 enum fuse_readdir_flags flags)
+/*
+ * Directory offsets
+ *
+ * The offset of an entry is the position of the next entry in the
+ * directory, so a listing can be resumed without reading the directory
+ * from the start. The positions of the entries are always past the
+ * directory header, which leaves the offsets below for "." and "..".
+ */
+#define DIR_OFFSET_DOT     1
+#define DIR_OFFSET_DOTDOT  2
+
+/* Number of entries whose inodes are read at once by readdirplus */
+#define READDIR_BATCH 64
+
+struct readdir_state
 {
-	filler(buf, ".", NULL, 0, 0);
-	filler(buf, "..", NULL, 0, 0);
+	fuse_req_t req;
+	int plus;
+	char *buf;
+	size_t size;
+	size_t used;
+	int full;
+
+	// Entries waiting for their inodes to be read (readdirplus)
+	uint32_t count;
+	uint32_t inode_nums[READDIR_BATCH];
+	uint64_t offsets[READDIR_BATCH];
+	char names[READDIR_BATCH][MAX_FILE_NAME_LENGTH + 1];
+};
 
-	uint32_t cur_inode_num;
-	struct inode_t cur_inode;
-	if (!get_path_inode(fd, &fs, path, &cur_inode_num, &cur_inode, NULL, NULL, NULL))
-		return -ENOENT;
+/* Add an entry to the reply buffer
+ *
+ * returns: 1 if it fit; 0 otherwise
+ */
+static int readdir_add(struct readdir_state *st, const char *name, uint32_t inode_num,
+		const struct inode_t *inode, off_t next_offset)
+{
+	const size_t rem = st->size - st->used;
+	size_t len;
+	if (st->plus) {
+		struct fuse_entry_param e;
+		if (inode) {
+			fill_entry(inode_num, inode, &e);
+		} else {
+			// "." and ".." are not looked up by the kernel
+			memset(&e, 0, sizeof(e));
+			e.attr.st_ino = TO_FUSE_INO(inode_num);
+			e.attr.st_mode = S_IFDIR;
+		}
+		len = fuse_add_direntry_plus(st->req, st->buf + st->used, rem, name, &e, next_offset);
+		if (len <= rem && inode)
+			remember_inode(inode_num, inode);
+	} else {
+		struct stat stbuf;
+		memset(&stbuf, 0, sizeof(stbuf));
+		stbuf.st_ino = TO_FUSE_INO(inode_num);
+		len = fuse_add_direntry(st->req, st->buf + st->used, rem, name, &stbuf, next_offset);
+	}
 
-	uint8_t buffer[fs.main_block.block_size];
-	uint64_t s = inode_data_read(fd, &fs, &cur_inode, buffer, sizeof(buffer), 0);
-	if (s == 0)
+	if (len > rem) {
+		st->full = 1;
 		return 0;
+	}
+	st->used += len;
+	return 1;
+}
 
-	uint32_t inodes_count;
-	uint16_t starting_pos;
-	util_read_u32(buffer, &inodes_count);
-	util_read_u16(buffer + 0x4, &starting_pos);
+/* Read the inodes of the batched entries and add them to the reply */
+static void readdir_flush(struct readdir_state *st)
+{
+	struct inode_t inodes[READDIR_BATCH];
+	read_inodes(fd, &fs, st->count, st->inode_nums, inodes);
+
+	for (uint32_t i = 0; i < st->count && !st->full; ++i) {
+		// Prefer the in-memory copy of inodes in use
+		pthread_mutex_lock(&inode_map_lock);
+		struct inode_map_node_t *node = inode_map_find(&inode_map, st->inode_nums[i]);
+		if (node)
+			++node->refs;
+		pthread_mutex_unlock(&inode_map_lock);
+
+		// Don't wait for inodes being modified, the directory is locked already
+		if (node && pthread_rwlock_tryrdlock(&node->lock) == 0) {
+			readdir_add(st, st->names[i], st->inode_nums[i], &node->inode, st->offsets[i]);
+			unlock(node);
+		} else {
+			readdir_add(st, st->names[i], st->inode_nums[i], &inodes[i], st->offsets[i]);
+		}
+		if (node)
+			release_inode(node);
+	}
+	st->count = 0;
+}
 
-	uint64_t file_pos = 0;
-	uint64_t pos = starting_pos + 0x6;
-	for (uint32_t i = 0; i < inodes_count; ++i) {
-		uint16_t name_len;
-		uint16_t entry_len;
+static int readdir_cb(void *data, uint32_t inode_num, const char *name, uint16_t name_len,
+		uint64_t pos, uint64_t next_pos)
+{
+	struct readdir_state *st = (struct readdir_state *)data;
 
-		EXPECT(pos < s); // TODO: Error handling
+	if (!st->plus) {
+		char n[MAX_FILE_NAME_LENGTH + 1];
+		memcpy(n, name, name_len);
+		n[name_len] = '\0';
+		return !readdir_add(st, n, inode_num, NULL, next_pos);
+	}
 
-		// Load next page if we're at the end of the buffer
-		if (pos + 8 > s) {
-			file_pos += pos;
-			pos = 0;
-			s = inode_data_read(fd, &fs, &cur_inode, buffer, sizeof(buffer), file_pos);
-		}
+	st->inode_nums[st->count] = inode_num;
+	st->offsets[st->count] = next_pos;
+	memcpy(st->names[st->count], name, name_len);
+	st->names[st->count][name_len] = '\0';
+	if (++st->count == READDIR_BATCH)
+		readdir_flush(st);
+	return st->full;
+}
 
-		// Read entry header
-		util_read_u16(buffer + pos + 0x4, &entry_len);
-		util_read_u16(buffer + pos + 0x6, &name_len);
-		EXPECT(name_len <= MAX_FILE_NAME_LENGTH); // TODO: error handling
+static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, int plus)
+{
+	count_op(plus ? OP_READDIRPLUS : OP_READDIR);
+	if (is_virtual(ino)) {
+		virtual_readdir(req, ino, size, offset, plus);
+		return;
+	}
+	struct inode_map_node_t *dir = acquire_fuse_inode(ino);
+	read_lock(dir);
+	if (!is_dir(&dir->inode)) {
+		unlock(dir);
+		release_inode(dir);
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
 
-		// Load next page if we're at the end of the buffer
-		if (pos + 8 + name_len > s) {
-			file_pos += pos;
-			pos = 0;
-			s = inode_data_read(fd, &fs, &cur_inode, buffer, sizeof(buffer), file_pos);
-		}
-		EXPECT(pos + 8 + name_len <= s);
+	struct readdir_state *st = (struct readdir_state *)malloc(sizeof(struct readdir_state));
+	st->req = req;
+	st->plus = plus;
+	st->buf = (char *)malloc(size);
+	st->size = size;
+	st->used = 0;
+	st->full = 0;
+	st->count = 0;
+
+	if (offset < DIR_OFFSET_DOT)
+		readdir_add(st, ".", dir->inode_num, NULL, DIR_OFFSET_DOT);
+	// We don't keep track of the parent directories
+	if (offset < DIR_OFFSET_DOTDOT && !st->full)
+		readdir_add(st, "..", dir->inode_num, NULL, DIR_OFFSET_DOTDOT);
+
+	if (!st->full) {
+		read_dir(fd, &fs, &dir->inode, offset <= DIR_OFFSET_DOTDOT ? 0 : offset, readdir_cb, st);
+		if (st->count > 0)
+			readdir_flush(st);
+	}
+	unlock(dir);
+	release_inode(dir);
+
+	count_op_bytes(plus ? OP_READDIRPLUS : OP_READDIR, st->used);
+	fuse_reply_buf(req, st->buf, st->used);
+	free(st->buf);
+	free(st);
+}
 
-		char name[MAX_FILE_NAME_LENGTH + 1];
-		memcpy(name, buffer + pos + 0x8, name_len);
-		name[name_len] = '\0';
-		filler(buf, name, NULL, 0, 0);
-		pos += entry_len;
+static void myfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	do_readdir(req, ino, size, offset, 0);
+}
+
+static void myfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+{
+	do_readdir(req, ino, size, offset, 1);
+}
+
+static void myfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	count_op(OP_OPENDIR);
+	if (is_virtual(ino)) {
+		if (ino == STATS_DIR_INO)
+			fuse_reply_open(req, fi);
+		else
+			fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	struct inode_map_node_t *dir = acquire_fuse_inode(ino);
+	read_lock(dir);
+	const int dir_ok = is_dir(&dir->inode);
+	unlock(dir);
+	if (!dir_ok) {
+		release_inode(dir);
+		fuse_reply_err(req, ENOTDIR);
+		return;
 	}
 
-	return 0;
+	// The handle keeps the node until releasedir
+	pthread_mutex_lock(&inode_map_lock);
+	++dir->open_dirs;
+	pthread_mutex_unlock(&inode_map_lock);
+	fi->fh = (uintptr_t)dir;
+	fuse_reply_open(req, fi);
 }
 
-static int myfs_open(const char *path, struct fuse_file_info *fi)
+static void myfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	uint32_t inode_num;
-	struct inode_t inode;
-	if (fi && !fi->fh) {
-		if (!get_path_inode(fd, &fs, path, &inode_num, &inode, NULL, NULL, NULL))
-			return -ENOENT;
-		fi->fh = file_key_counter;
-		inode_map_insert(&inode_map, file_key_counter, inode_num, &inode);
-		++file_key_counter;
+	count_op(OP_RELEASEDIR);
+	if (is_virtual(ino)) {
+		fuse_reply_err(req, 0);
+		return;
+	}
+	struct inode_map_node_t *dir = (struct inode_map_node_t *)(uintptr_t)fi->fh;
+
+	pthread_mutex_lock(&inode_map_lock);
+	EXPECT(dir->open_dirs > 0);
+	const int compact = (--dir->open_dirs == 0 && dir->compact_pending);
+	if (compact)
+		dir->compact_pending = 0;
+	pthread_mutex_unlock(&inode_map_lock);
+
+	if (compact) {
+		begin_op();
+		write_lock(dir);
+		maybe_compact_dir(dir);
+		unlock(dir);
+		write_main_block(fd, &fs);
+		end_op();
 	}
+	release_inode(dir);
+	fuse_reply_err(req, 0);
+}
 
-	return 0;
+static void myfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	count_op(OP_OPEN);
+	if (is_virtual(ino)) {
+		virtual_open(req, ino, fi);
+		return;
+	}
+	struct inode_map_node_t *node = acquire_fuse_inode(ino);
+	const uint32_t inode_num = node->inode_num;
+	read_lock(node);
+	const int dir = is_dir(&node->inode);
+	unlock(node);
+	// The node stays in the map while the file is open
+	if (!dir) {
+		pthread_mutex_lock(&inode_map_lock);
+		++node->open_files;
+		pthread_mutex_unlock(&inode_map_lock);
+	}
+	release_inode(node);
+	if (dir) {
+		fuse_reply_err(req, EISDIR);
+		return;
+	}
+
+	struct file_handle_t *fh = (struct file_handle_t *)malloc(sizeof(struct file_handle_t));
+	fh->inode_num = inode_num;
+	pthread_mutex_init(&fh->lock, NULL);
+	fh->next_pos = 0;
+	fh->ra_window = 0;
+	fh->ra_end = 0;
+	fh->wbuf = NULL;
+	fh->wlen = 0;
+	fh->next_dirty = NULL;
+	fi->fh = (uintptr_t)fh;
+	// Only this daemon modifies the device, so cached data stays valid
+	fi->keep_cache = options.keep_cache;
+	fuse_reply_open(req, fi);
 }
 
-static int myfs_release(const char *path, struct fuse_file_info *fi)
+static void myfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	if (fi && fi->fh) {
-		inode_map_remove(&inode_map, fi->fh);
-		return 0;
+	count_op(OP_RELEASE);
+	if (is_virtual(ino)) {
+		virtual_release(req, fi);
+		return;
 	}
-	return 0; // TODO: What error to return?
+	struct file_handle_t *fh = (struct file_handle_t *)(uintptr_t)fi->fh;
+	begin_op();
+	struct inode_map_node_t *node = acquire_inode(fh->inode_num);
+	write_lock(node);
+	flush_handle(node, fh);
+	unlock(node);
+	pthread_mutex_lock(&inode_map_lock);
+	EXPECT(node->open_files > 0);
+	--node->open_files;
+	pthread_mutex_unlock(&inode_map_lock);
+	// Removes the file if this was its last use as an orphan
+	release_inode(node);
+	end_op();
+
+	pthread_mutex_destroy(&fh->lock);
+	free(fh->wbuf);
+	free(fh);
+	fuse_reply_err(req, 0);
 }
 
-static int myfs_read(const char *path, char *buf, size_t size, off_t offset,
-		      struct fuse_file_info *fi)
+static void myfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	uint32_t inode_num;
-	struct inode_t in;
-	struct inode_t *inode = &in;
-	if (fi && fi->fh)
-		inode_map_get(&inode_map, fi->fh, &inode_num, &inode);
-	else if (!get_path_inode(fd, &fs, path, &inode_num, &in, NULL, NULL, NULL))
-		return -ENOENT;
+	count_op(OP_FLUSH);
+	if (is_virtual(ino)) {
+		fuse_reply_err(req, 0);
+		return;
+	}
+	struct file_handle_t *fh = (struct file_handle_t *)(uintptr_t)fi->fh;
+	begin_op();
+	struct inode_map_node_t *node = acquire_fuse_inode(ino);
+	write_lock(node);
+	flush_handle(node, fh);
+	unlock(node);
+	release_inode(node);
+	end_op();
+	fuse_reply_err(req, 0);
+}
 
-	return inode_data_read(fd, &fs, inode, (uint8_t *)buf, size, offset);
+static void myfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	count_op(OP_FSYNC);
+	if (is_virtual(ino)) {
+		fuse_reply_err(req, 0);
+		return;
+	}
+	begin_op();
+	struct inode_map_node_t *node = acquire_fuse_inode(ino);
+	write_lock(node);
+	flush_inode_writes(node, NULL);
+	unlock(node);
+	release_inode(node);
+	end_op();
+	// A commit flushes the data written before it too
+	if (fs.journal)
+		fuse_reply_err(req, journal_sync(fs.journal));
+	else
+		fuse_reply_err(req, fdatasync(fd) == -1 ? errno : 0);
+}
+
+/* Describe len bytes of a file at pos as buffers pointing at the device
+ *
+ * This lets the library splice the data between the device and the kernel
+ * without copying it. The range must be within the file. Holes are mapped
+ * to a buffer of zeros, returned in `zeros`.
+ * returns: a buffer vector to free() once used, along with `zeros`
+ */
+static struct fuse_bufvec *map_file_bufvec(const struct inode_t *inode, uint64_t pos, uint64_t len,
+		void **zeros)
+{
+	// Every block may be in a different place
+	const uint32_t bs = fs.main_block.block_size;
+	const uint32_t max_extents = len / bs + 2;
+	struct data_extent_t *extents = (struct data_extent_t *)malloc(max_extents * sizeof(struct data_extent_t));
+	const uint32_t count = map_file_range(fd, &fs, inode, pos, len, extents, max_extents);
+
+	struct fuse_bufvec *bufv = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec) +
+			count * sizeof(struct fuse_buf));
+	*bufv = FUSE_BUFVEC_INIT(0);
+	bufv->count = count;
+	uint64_t max_hole = 0;
+	for (uint32_t i = 0; i < count; ++i)
+		if (extents[i].dev_pos == 0)
+			max_hole = MAX(max_hole, extents[i].len);
+	*zeros = max_hole > 0 ? calloc(1, max_hole) : NULL;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		bufv->buf[i].size = extents[i].len;
+		if (extents[i].dev_pos == 0) {
+			bufv->buf[i].flags = 0;
+			bufv->buf[i].mem = *zeros;
+			bufv->buf[i].fd = -1;
+			bufv->buf[i].pos = 0;
+			continue;
+		}
+		bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+		bufv->buf[i].mem = NULL;
+		bufv->buf[i].fd = fd;
+		bufv->buf[i].pos = extents[i].dev_pos;
+	}
+	free(extents);
+	return bufv;
+}
+
+/* Count the device reads or writes the library makes for a vector from map_file_bufvec(), one per buffer */
+static void count_bufvec_io(const struct fuse_bufvec *bufv, int write)
+{
+	for (size_t i = 0; i < bufv->count; ++i) {
+		if (!(bufv->buf[i].flags & FUSE_BUF_IS_FD))
+			continue;
+		stats_add(write ? STAT_DEV_WRITES : STAT_DEV_READS, 1);
+		stats_add(write ? STAT_DEV_WRITE_BYTES : STAT_DEV_READ_BYTES, bufv->buf[i].size);
+	}
 }
 
-static int myfs_write(const char *path, const char *buf, size_t size, off_t offset,
+static void myfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
 		struct fuse_file_info *fi)
 {
-	uint32_t inode_num;
-	struct inode_t in;
-	struct inode_t *inode = &in;
-	if (fi && fi->fh)
-		inode_map_get(&inode_map, fi->fh, &inode_num, &inode);
-	else if (!get_path_inode(fd, &fs, path, &inode_num, &in, NULL, NULL, NULL))
-		return -ENOENT;
-
-	uint64_t bytes_written = inode_data_write(fd, &fs, inode, (uint8_t *)buf, size, offset);
-	write_inode(fd, &fs, inode_num, inode);
-	write_main_block(fd, &fs);
-	return bytes_written;
+	count_op(OP_READ);
+	if (is_virtual(ino)) {
+		virtual_read(req, size, offset, fi);
+		return;
+	}
+	struct inode_map_node_t *node = acquire_fuse_inode(ino);
+	read_lock_flushed(node);
+	uint64_t len = 0;
+	if ((uint64_t)offset < node->inode.size)
+		len = MIN(size, node->inode.size - offset);
+
+	if (len == 0) {
+		unlock(node);
+		release_inode(node);
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+
+	// The blocks must not be freed or reused until the data is sent
+	void *zeros;
+	struct fuse_bufvec *bufv = map_file_bufvec(&node->inode, offset, len, &zeros);
+	count_bufvec_io(bufv, 0);
+	count_op_bytes(OP_READ, len);
+	fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	unlock(node);
+	release_inode(node);
+	free(bufv);
+	free(zeros);
+
+	readahead_after_read((struct file_handle_t *)(uintptr_t)fi->fh, offset, len);
 }
 
-static int myfs_mknod(const char *path, mode_t mode, dev_t dev)
+static void myfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in_buf,
+		off_t offset, struct fuse_file_info *fi)
 {
-	struct fuse_context *context = fuse_get_context();
-	int len = strlen(path);
-	int i;
-	for (i = len - 1; i >= 0; --i)
-		if (path[i] == '/')
-			break;
-	char filename[len - i];
-	strncpy(filename, path + i + 1, len - i - 1);
-	filename[len - i - 1] = '\0';
-
-	uint32_t parent_inode_num;
-	struct inode_t parent_inode;
-	if (i != 0) {
-		char parent_path[i + 1];
-		strncpy(parent_path, path, i);
-		parent_path[i] = '\0';
-		if (!get_path_inode(fd, &fs, parent_path, &parent_inode_num, &parent_inode, NULL, NULL, NULL))
-			return -ENOENT;
-		if ((parent_inode.mode & mode_ftype_mask) != mode_ftype_dir)
-			return -ENOTDIR;
-	} else {
-		parent_inode_num = 0;
-		read_inode(fd, &fs, 0, &parent_inode);
+	const size_t size = fuse_buf_size(in_buf);
+	struct file_handle_t *fh = (struct file_handle_t *)(uintptr_t)fi->fh;
+	count_op(OP_WRITE);
+	if (is_virtual(ino)) {
+		fuse_reply_err(req, EBADF);
+		return;
 	}
+	begin_op();
+	struct inode_map_node_t *node = acquire_fuse_inode(ino);
+	write_lock(node);
+	if (!has_space(req, growth_blocks(&node->inode, offset, size))) {
+		unlock(node);
+		release_inode(node);
+		end_op();
+		fuse_reply_err(req, ENOSPC);
+		return;
+	}
+	flush_inode_writes(node, fh);
+	if (size < MAX_BUFFERED_WRITE) {
+		const ssize_t res = buffer_write(node, fh, in_buf, offset, size);
+		unlock(node);
+		release_inode(node);
+		end_op();
+		if (res < 0) {
+			fuse_reply_err(req, -res);
+		} else {
+			count_op_bytes(OP_WRITE, res);
+			fuse_reply_write(req, res);
+		}
+		return;
+	}
+	flush_handle(node, fh);
 
-	struct inode_t inode;
-	uint32_t inode_num;
-	initialize_inode(&inode, context->uid, context->gid, (mode & 0777) | mode_ftype_file);
-	create_inode(fd, &fs, &inode, &inode_num);
-	add_inode_to_dir(fd, &fs, parent_inode_num, &parent_inode, inode_num, &inode, filename);
+	// The data goes straight to the device, so every block must be allocated and not shared
+	prepare_file_write(fd, &fs, &node->inode, offset, size);
+
+	void *zeros;
+	struct fuse_bufvec *bufv = map_file_bufvec(&node->inode, offset, size, &zeros);
+	count_bufvec_io(bufv, 1);
+	ssize_t bytes_written = fuse_buf_copy(bufv, in_buf, 0);
+	free(bufv);
+	free(zeros);
+
+	write_inode(fd, &fs, node->inode_num, &node->inode);
+	unlock(node);
+	release_inode(node);
 	write_main_block(fd, &fs);
-	return 0;
+	end_op();
+	if (bytes_written < 0) {
+		fuse_reply_err(req, -bytes_written);
+	} else {
+		count_op_bytes(OP_WRITE, bytes_written);
+		fuse_reply_write(req, bytes_written);
+	}
 }
 
-static int myfs_mkdir(const char *path, mode_t mode)
+static void myfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info *fi)
 {
-	struct fuse_context *context = fuse_get_context();
-	int len = strlen(path);
-	int i;
-	for (i = len - 1; i >= 0; --i)
-		if (path[i] == '/')
-			break;
-	char filename[len - i];
-	strncpy(filename, path + i + 1, len - i - 1);
-	filename[len - i - 1] = '\0';
-
-	uint32_t parent_inode_num;
-	struct inode_t parent_inode;
-	if (i != 0) {
-		char parent_path[i + 1];
-		strncpy(parent_path, path, i);
-		parent_path[i] = '\0';
-		if (!get_path_inode(fd, &fs, parent_path, &parent_inode_num, &parent_inode, NULL, NULL, NULL))
-			return -ENOENT;
-		if ((parent_inode.mode & mode_ftype_mask) != mode_ftype_dir)
-			return -ENOTDIR;
-	} else {
-		parent_inode_num = 0;
-		read_inode(fd, &fs, 0, &parent_inode);
+	count_op(OP_LSEEK);
+	if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+		// The kernel handles the other kinds of seeks by itself
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	if (off < 0 || is_virtual(ino)) {
+		fuse_reply_err(req, ENXIO);
+		return;
 	}
 
-	struct inode_t inode;
-	uint32_t inode_num;
-	initialize_inode(&inode, context->uid, context->gid, (mode & 0777) | mode_ftype_dir);
-	create_inode(fd, &fs, &inode, &inode_num);
-	add_inode_to_dir(fd, &fs, parent_inode_num, &parent_inode, inode_num, &inode, filename);
+	struct inode_map_node_t *node = acquire_fuse_inode(ino);
+	read_lock_flushed(node);
+	const int64_t pos = seek_file_data(fd, &fs, &node->inode, off, whence == SEEK_HOLE);
+	unlock(node);
+	release_inode(node);
+	if (pos < 0)
+		fuse_reply_err(req, ENXIO);
+	else
+		fuse_reply_lseek(req, pos);
+}
+
+static void myfs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in, off_t off_in,
+		struct fuse_file_info *fi_in, fuse_ino_t ino_out, off_t off_out,
+		struct fuse_file_info *fi_out, size_t len, int flags)
+{
+	count_op(OP_COPY_FILE_RANGE);
+	if (flags != 0) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	// The kernel copies the stats file itself
+	if (is_virtual(ino_in) || is_virtual(ino_out)) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+
+	begin_op();
+	struct inode_map_node_t *src = acquire_fuse_inode(ino_in);
+	struct inode_map_node_t *dest = acquire_fuse_inode(ino_out);
+	if (src == dest)
+		write_lock(src);
+	else
+		write_lock_pair(src, dest);
+	flush_inode_writes(src, NULL);
+	flush_inode_writes(dest, NULL);
+
+	int err = 0;
+	uint64_t copied = 0;
+	if (is_dir(&src->inode) || is_dir(&dest->inode))
+		err = EISDIR;
+	// The kernel rejects overlapping ranges already
+	else if (src == dest && (uint64_t)off_in < (uint64_t)off_out + len && (uint64_t)off_out < (uint64_t)off_in + len)
+		err = EINVAL;
+	else if (!has_space(req, growth_blocks(&dest->inode, off_out, len)))
+		err = ENOSPC;
+	else
+		copied = inode_data_copy(fd, &fs, &src->inode, off_in, &dest->inode, off_out, len);
+
+	if (copied > 0)
+		write_inode(fd, &fs, dest->inode_num, &dest->inode);
+	unlock(src);
+	if (dest != src)
+		unlock(dest);
+	release_inode(src);
+	release_inode(dest);
+
+	if (err) {
+		end_op();
+		fuse_reply_err(req, err);
+		return;
+	}
 	write_main_block(fd, &fs);
+	end_op();
+	count_op_bytes(OP_COPY_FILE_RANGE, copied);
+	fuse_reply_write(req, copied);
+}
 
-	return 0;
+/* Whether the caller of a request may read a file, by its permission bits
+ *
+ * The kernel checks them for requests on a path, but not for inodes named by number.
+ */
+static int may_read(fuse_req_t req, const struct inode_t *inode)
+{
+	const struct fuse_ctx *context = fuse_req_ctx(req);
+	if (context->uid == 0)
+		return 1;
+	if (context->uid == inode->uid)
+		return (inode->mode & S_IRUSR) != 0;
+
+	int in_group = context->gid == inode->gid;
+	gid_t groups[64];
+	const int group_count = fuse_req_getgroups(req, 64, groups);
+	for (int i = 0; i < MIN(group_count, 64) && !in_group; ++i)
+		in_group = groups[i] == inode->gid;
+	return (inode->mode & (in_group ? S_IRGRP : S_IROTH)) != 0;
 }
 
-static int myfs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+static int do_clone(fuse_req_t req, struct inode_map_node_t *dest, fuse_ino_t src_ino)
 {
-	uint32_t inode_num;
-	struct inode_t in;
-	struct inode_t *inode = &in;
-	if (fi && fi->fh)
-		inode_map_get(&inode_map, fi->fh, &inode_num, &inode);
-	else if (!get_path_inode(fd, &fs, path, &inode_num, &in, NULL, NULL, NULL))
-		return -ENOENT;
-
-	if ((inode->mode & mode_ftype_mask) == mode_ftype_dir)
-		return -EISDIR;
-
-	resize_file(fd, &fs, inode, size);
-	write_inode(fd, &fs, inode_num, inode);
-	write_main_block(fd, &fs);
+	struct inode_map_node_t *src = acquire_fuse_inode(src_ino);
+	if (src == dest) {
+		release_inode(src);
+		return EINVAL;
+	}
 
-	return 0;
+	write_lock_pair(src, dest);
+	flush_inode_writes(src, NULL);
+	flush_inode_writes(dest, NULL);
+	int err;
+	if (src->inode.nlinks == 0)
+		err = EBADF;
+	else if (!may_read(req, &src->inode))
+		err = EACCES;
+	else if (is_dir(&src->inode) || is_dir(&dest->inode))
+		err = EISDIR;
+	else
+		err = clone_file(fd, &fs, &src->inode, &dest->inode);
+	if (!err) {
+		write_inode(fd, &fs, src->inode_num, &src->inode);
+		write_inode(fd, &fs, dest->inode_num, &dest->inode);
+	}
+	unlock(src);
+	unlock(dest);
+	release_inode(src);
+
+	if (!err) {
+		write_main_block(fd, &fs);
+		// The kernel may still hold the old data
+		invalidate_inode(dest->inode_num);
+	}
+	return err;
 }
 
-static int myfs_unlink(const char *path)
+static void myfs_ioctl(fuse_req_t req, fuse_ino_t ino, unsigned int cmd, void *arg,
+		struct fuse_file_info *fi, unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz)
 {
-	uint32_t inode_num, dir_inode_num;
-	struct inode_t inode, dir_inode;
-	if (!get_path_inode(fd, &fs, path, &inode_num, &inode, &dir_inode_num, &dir_inode, NULL))
-		return -ENOENT;
+	count_op(OP_IOCTL);
+	if (flags & FUSE_IOCTL_COMPAT) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+	if (is_virtual(ino)) {
+		fuse_reply_err(req, ENOTTY);
+		return;
+	}
 
-	if ((inode.mode & mode_ftype_mask) == mode_ftype_dir)
-		return -EISDIR;
+	switch (cmd) {
+	case MYFS_IOC_CLONE: {
+		if (in_bufsz != sizeof(uint64_t)) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		// The file is overwritten, as by a write through fi
+		if ((fi->flags & O_ACCMODE) == O_RDONLY) {
+			fuse_reply_err(req, EBADF);
+			return;
+		}
+		uint64_t src_ino;
+		memcpy(&src_ino, in_buf, sizeof(src_ino));
+		if (src_ino == 0 || is_virtual(src_ino) || FROM_FUSE_INO(src_ino) >= fs.main_block.inode_count_limit ||
+				!get_inode_state(fd, &fs, FROM_FUSE_INO(src_ino))) {
+			fuse_reply_err(req, EBADF);
+			return;
+		}
 
-	remove_inode_from_dir(fd, &fs, &dir_inode, inode_num, &inode);
-	write_inode(fd, &fs, dir_inode_num, &dir_inode);
-	write_main_block(fd, &fs);
+		begin_op();
+		struct inode_map_node_t *dest = acquire_fuse_inode(ino);
+		int err = do_clone(req, dest, src_ino);
+		release_inode(dest);
+		end_op();
+		if (err)
+			fuse_reply_err(req, err);
+		else
+			fuse_reply_ioctl(req, 0, NULL, 0);
+		break;
+	}
+	case MYFS_IOC_GROW: {
+		if (in_bufsz != sizeof(uint64_t)) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		const uid_t uid = fuse_req_ctx(req)->uid;
+		if (uid != 0 && uid != getuid()) {
+			fuse_reply_err(req, EPERM);
+			return;
+		}
+		uint64_t size;
+		memcpy(&size, in_buf, sizeof(size));
+		const uint64_t dev_size = lseek(fd, 0, SEEK_END);
+		if (size == 0)
+			size = dev_size;
+		if (size > dev_size) {
+			fuse_reply_err(req, ENOSPC);
+			return;
+		}
 
-	return 0;
+		begin_op();
+		int err = grow_fs(fd, &fs, size);
+		end_op();
+		// The new size only lasts once the main block is committed
+		if (!err && fs.journal)
+			err = journal_sync(fs.journal);
+		if (err)
+			fuse_reply_err(req, err);
+		else
+			fuse_reply_ioctl(req, 0, NULL, 0);
+		break;
+	}
+	default:
+		fuse_reply_err(req, ENOTTY);
+	}
 }
 
-static int myfs_rmdir(const char *path)
+/* Create a file or a directory named `name` in `parent` */
+static void make_node(fuse_req_t req, fuse_ino_t parent, const char *name, uint16_t mode)
 {
-	uint32_t inode_num, dir_inode_num;
-	struct inode_t inode, dir_inode;
-	if (!get_path_inode(fd, &fs, path, &inode_num, &inode, &dir_inode_num, &dir_inode, NULL))
-		return -ENOENT;
+	if (is_virtual_name(parent, name)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	begin_op();
+	struct inode_map_node_t *dir = acquire_fuse_inode(parent);
+	write_lock(dir);
+	uint32_t inode_num;
+	int err = check_parent_dir(dir, name);
+	if (!err && lookup_dir_entry(fd, &fs, dir->inode_num, &dir->inode, name, strlen(name), &inode_num))
+		err = EEXIST;
+	// The directory may need another block for the entry
+	if (!err && !has_space(req, 1))
+		err = ENOSPC;
+	if (err) {
+		unlock(dir);
+		release_inode(dir);
+		end_op();
+		fuse_reply_err(req, err);
+		return;
+	}
 
-	if ((inode.mode & mode_ftype_mask) == mode_ftype_file)
-		return -ENOTDIR;
+	// Nobody else knows about the new inode until it is added to the directory
+	const struct fuse_ctx *context = fuse_req_ctx(req);
+	struct inode_t inode;
+	initialize_inode(&inode, context->uid, context->gid, mode);
+	create_inode(fd, &fs, &inode, &inode_num);
+	add_inode_to_dir(fd, &fs, dir->inode_num, &dir->inode, inode_num, &inode, name);
 
-	remove_inode_from_dir(fd, &fs, &dir_inode, inode_num, &inode);
-	write_inode(fd, &fs, dir_inode_num, &dir_inode);
+	struct inode_map_node_t *node = acquire_inode(inode_num);
+	// See "Orphans": the number can't belong to a node still in the map
+	EXPECT(!node->orphan && node->inode.nlinks == 1);
+	unlock(dir);
+	release_inode(dir);
 	write_main_block(fd, &fs);
+	end_op();
 
-	return 0;
+	read_lock(node);
+	reply_entry(req, node);
+	unlock(node);
+	release_inode(node);
 }
 
-static int myfs_rename(const char *src, const char *dest, unsigned int flags)
+static void myfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
 {
-	if (flags == RENAME_EXCHANGE) {
-		uint32_t src_inode_num, dest_inode_num;
-		struct inode_t src_inode, dest_inode;
-		uint64_t src_offset, dest_offset;
-		if (!get_path_inode(fd, &fs, src, &src_inode_num, &src_inode, NULL, NULL, &src_offset) ||
-				!get_path_inode(fd, &fs, dest, &dest_inode_num, &dest_inode, NULL, NULL, &dest_offset))
-			return -ENOENT;
-		uint8_t buf[4];
-		util_write_u32(buf, dest_inode_num);
-		inode_data_write(fd, &fs, &src_inode, buf, 4, src_offset);
-		util_write_u32(buf, src_inode_num);
-		inode_data_write(fd, &fs, &dest_inode, buf, 4, dest_offset);
+	count_op(OP_MKNOD);
+	// Only regular files are supported
+	if (!S_ISREG(mode)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
 
-	} else {
-		uint32_t src_inode_num, src_dir_inode_num, dest_inode_num, dest_dir_inode_num;
-		struct inode_t src_inode, src_dir_inode, dest_inode, dest_dir_inode;
-
-		int src_len = strlen(src), dest_len = strlen(dest);
-		char src_dir[src_len + 1], dest_dir[src_len + 1];
-		char src_basename[513], dest_basename[513];
-		util_split_path(src, src_len, src_dir, src_basename);
-		util_split_path(dest, dest_len, dest_dir, dest_basename);
-
-		if (!get_path_inode(fd, &fs, src, &src_inode_num, &src_inode, &src_dir_inode_num, &src_dir_inode, NULL) ||
-				!get_path_inode(fd, &fs, dest_dir, &dest_dir_inode_num, &dest_dir_inode, NULL, NULL, NULL))
-			return -ENOENT;
-
-		int dest_exists = get_path_inode(fd, &fs, dest, &dest_inode_num, &dest_inode, NULL, NULL, NULL);
-		if (flags == RENAME_NOREPLACE && dest_exists)
-			return -EEXIST;
-
-		if (flags != RENAME_NOREPLACE && dest_exists) {
-			EXPECT(remove_inode_from_dir(fd, &fs, &dest_dir_inode, dest_inode_num, &dest_inode));
-			write_inode(fd, &fs, dest_dir_inode_num, &dest_dir_inode);
-		}
+	make_node(req, parent, name, (mode & 0777) | mode_ftype_file);
+}
+
+static void myfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	count_op(OP_MKDIR);
+	make_node(req, parent, name, (mode & 0777) | mode_ftype_dir);
+}
 
-		add_inode_to_dir(fd, &fs, dest_dir_inode_num, &dest_dir_inode, src_inode_num, &src_inode, dest_basename);
-		write_inode(fd, &fs, dest_dir_inode_num, &dest_dir_inode);
-		if (!remove_inode_from_dir(fd, &fs, &src_dir_inode, src_inode_num, &src_inode))
-			return -ENOENT;
-		write_inode(fd, &fs, src_dir_inode_num, &src_dir_inode);
+/* Remove the entry `name` from `parent`
+ *
+ * dir: whether the entry is expected to be a directory
+ */
+static void remove_node(fuse_req_t req, fuse_ino_t parent, const char *name, int dir)
+{
+	if (is_virtual_name(parent, name)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+	begin_op();
+	struct inode_map_node_t *parent_node = acquire_fuse_inode(parent);
+	write_lock(parent_node);
+	uint32_t inode_num;
+	int err = check_parent_dir(parent_node, name);
+	if (!err && !lookup_dir_entry(fd, &fs, parent_node->inode_num, &parent_node->inode, name, strlen(name), &inode_num))
+		err = ENOENT;
+	if (err) {
+		unlock(parent_node);
+		release_inode(parent_node);
+		end_op();
+		fuse_reply_err(req, err);
+		return;
 	}
-	write_main_block(fd, &fs);
 
-	return 0;
+	struct inode_map_node_t *node = acquire_inode(inode_num);
+	struct inode_t *inode = &node->inode;
+	write_lock(node);
+	if (dir && !is_dir(inode))
+		err = ENOTDIR;
+	else if (!dir && is_dir(inode))
+		err = EISDIR;
+	else if (dir && inode->size > 0)
+		err = ENOTEMPTY;
+
+	if (!err) {
+		remove_dir_entry(fd, &fs, parent_node->inode_num, &parent_node->inode, inode_num, inode);
+		if (inode->nlinks == 0)
+			make_orphan(node);
+		write_inode(fd, &fs, parent_node->inode_num, &parent_node->inode);
+		maybe_compact_dir(parent_node);
+	}
+	unlock(node);
+	release_inode(node);
+	unlock(parent_node);
+	release_inode(parent_node);
+
+	if (!err)
+		write_main_block(fd, &fs);
+	end_op();
+	fuse_reply_err(req, err);
 }
 
-static int myfs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
+static void myfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	uint32_t inode_num;
-	struct inode_t in;
-	struct inode_t *inode = &in;
-	if (fi && fi->fh)
-		inode_map_get(&inode_map, fi->fh, &inode_num, &inode);
-	else if (!get_path_inode(fd, &fs, path, &inode_num, &in, NULL, NULL, NULL))
-		return -ENOENT;
-
-	if (tv[1].tv_nsec == UTIME_NOW) {
-		inode->mtime = time(NULL);
-		write_inode(fd, &fs, inode_num, inode);
-	} else if (tv[1].tv_nsec != UTIME_OMIT) {
-		inode->mtime = tv[1].tv_sec;
-		write_inode(fd, &fs, inode_num, inode);
+	count_op(OP_UNLINK);
+	remove_node(req, parent, name, 0);
+}
+
+static void myfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	count_op(OP_RMDIR);
+	remove_node(req, parent, name, 1);
+}
+
+static int do_rename(struct inode_map_node_t *src_dir, const char *name,
+		struct inode_map_node_t *dest_dir, const char *newname, unsigned int flags)
+{
+	int err = check_parent_dir(src_dir, name);
+	if (!err)
+		err = check_parent_dir(dest_dir, newname);
+	if (err)
+		return err;
+
+	const uint16_t name_len = strlen(name), newname_len = strlen(newname);
+	uint32_t src_inode_num, dest_inode_num;
+	if (!lookup_dir_entry(fd, &fs, src_dir->inode_num, &src_dir->inode, name, name_len, &src_inode_num))
+		return ENOENT;
+	int dest_exists = lookup_dir_entry(fd, &fs, dest_dir->inode_num, &dest_dir->inode, newname, newname_len, &dest_inode_num);
+
+	// The kernel doesn't let a directory be moved into itself or replace one
+	// of its ancestors, but the inodes would deadlock if it did
+	if (src_inode_num == dest_dir->inode_num)
+		return EINVAL;
+	if (dest_exists && (dest_inode_num == src_dir->inode_num || dest_inode_num == dest_dir->inode_num))
+		return ENOTEMPTY;
+
+	if (flags & RENAME_EXCHANGE) {
+		if (!dest_exists)
+			return ENOENT;
+		exchange_dir_entries(fd, &fs, src_dir->inode_num, &src_dir->inode, name, name_len,
+				dest_dir->inode_num, &dest_dir->inode, newname, newname_len);
+		return 0;
 	}
 
-	return 0;
+	if (dest_exists && (flags & RENAME_NOREPLACE))
+		return EEXIST;
+
+	// Renaming a file to one of its own names does nothing
+	if (dest_exists && dest_inode_num == src_inode_num)
+		return 0;
+
+	struct inode_map_node_t *src = acquire_inode(src_inode_num);
+	struct inode_map_node_t *dest = NULL;
+	if (dest_exists) {
+		dest = acquire_inode(dest_inode_num);
+		write_lock_pair(src, dest);
+
+		if (is_dir(&dest->inode) && !is_dir(&src->inode))
+			err = EISDIR;
+		else if (!is_dir(&dest->inode) && is_dir(&src->inode))
+			err = ENOTDIR;
+		else if (is_dir(&dest->inode) && dest->inode.size > 0)
+			err = ENOTEMPTY;
+
+		if (!err) {
+			EXPECT(remove_dir_entry(fd, &fs, dest_dir->inode_num, &dest_dir->inode, dest_inode_num, &dest->inode));
+			if (dest->inode.nlinks == 0)
+				make_orphan(dest);
+			write_inode(fd, &fs, dest_dir->inode_num, &dest_dir->inode);
+			maybe_compact_dir(dest_dir);
+		}
+		unlock(dest);
+		release_inode(dest);
+	} else {
+		write_lock(src);
+	}
+
+	if (!err) {
+		add_inode_to_dir(fd, &fs, dest_dir->inode_num, &dest_dir->inode, src_inode_num, &src->inode, newname);
+		write_inode(fd, &fs, dest_dir->inode_num, &dest_dir->inode);
+		EXPECT(remove_dir_entry(fd, &fs, src_dir->inode_num, &src_dir->inode, src_inode_num, &src->inode));
+		write_inode(fd, &fs, src_dir->inode_num, &src_dir->inode);
+		maybe_compact_dir(src_dir);
+	}
+	unlock(src);
+	release_inode(src);
+	return err;
+}
+
+static void myfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	count_op(OP_RENAME);
+	if (flags & ~(RENAME_EXCHANGE | RENAME_NOREPLACE)) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+	if (is_virtual_name(parent, name) || is_virtual_name(newparent, newname)) {
+		fuse_reply_err(req, EPERM);
+		return;
+	}
+
+	begin_op();
+	// Within a directory both nodes are the same
+	struct inode_map_node_t *src_dir = acquire_fuse_inode(parent);
+	struct inode_map_node_t *dest_dir = acquire_fuse_inode(newparent);
+	if (src_dir == dest_dir)
+		write_lock(src_dir);
+	else
+		write_lock_pair(src_dir, dest_dir);
+
+	int err = do_rename(src_dir, name, dest_dir, newname, flags);
+
+	unlock(src_dir);
+	if (dest_dir != src_dir)
+		unlock(dest_dir);
+	release_inode(src_dir);
+	release_inode(dest_dir);
+
+	if (!err)
+		write_main_block(fd, &fs);
+	end_op();
+	fuse_reply_err(req, err);
 }
 
-static const struct fuse_operations myfs_oper = {
-	.init       = myfs_init,
-	.destroy    = myfs_destroy,
-	.getattr    = myfs_getattr,
-	.chmod      = myfs_chmod,
-	.chown      = myfs_chown,
-	.readdir    = myfs_readdir,
-	.open       = myfs_open,
-	.release    = myfs_release,
-	.read       = myfs_read,
-	.write      = myfs_write,
-	.mknod      = myfs_mknod,
-	.mkdir      = myfs_mkdir,
-	.truncate   = myfs_truncate,
-	.unlink     = myfs_unlink,
-	.rmdir      = myfs_rmdir,
-	.rename     = myfs_rename,
-	.utimens    = myfs_utimens,
+static const struct fuse_lowlevel_ops myfs_oper = {
+	.init         = myfs_init,
+	.destroy      = myfs_destroy,
+	.lookup       = myfs_lookup,
+	.forget       = myfs_forget,
+	.forget_multi = myfs_forget_multi,
+	.getattr      = myfs_getattr,
+	.setattr      = myfs_setattr,
+	.statfs       = myfs_statfs,
+	.readdir      = myfs_readdir,
+	.readdirplus  = myfs_readdirplus,
+	.opendir      = myfs_opendir,
+	.releasedir   = myfs_releasedir,
+	.open         = myfs_open,
+	.release      = myfs_release,
+	.flush        = myfs_flush,
+	.fsync        = myfs_fsync,
+	.read         = myfs_read,
+	.write_buf    = myfs_write_buf,
+	.copy_file_range = myfs_copy_file_range,
+	.ioctl        = myfs_ioctl,
+	.lseek        = myfs_lseek,
+	.mknod        = myfs_mknod,
+	.mkdir        = myfs_mkdir,
+	.unlink       = myfs_unlink,
+	.rmdir        = myfs_rmdir,
+	.rename       = myfs_rename,
 };
 
 int main(int argc, char *argv[])
 {
 	log = fopen("log", "w");
 
-	int ret;
+	int ret = 1;
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *se;
 
 	/* Set defaults -- we have to use strdup so that
 	   fuse_opt_parse can free the defaults if other
 	   values are specified */
 	options.devpath = NULL;
+	options.dcache_size = 16;
+	options.dir_compact = 50;
+	options.bloom_size = 8;
+	options.bloom_file = NULL;
+	options.attr_timeout = 1.0;
+	options.entry_timeout = 1.0;
+	options.negative_timeout = 0.0;
+	options.writeback = 0;
+	options.keep_cache = 0;
+	options.max_write = 1024;
+	options.max_background = 64;
+	options.readahead = 4096;
+	options.commit_interval = 5;
+	options.grow = 0;
 
 	/* Parse options */
 	if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
 		return 1;
+	if (fuse_parse_cmdline(&args, &opts) != 0)
+		return 1;
 
-	/* When --help is specified, first print our own file-system
-	   specific help text, then signal fuse_main to show
-	   additional help (by adding `--help` to the options again)
-	   without usage: line (by setting argv[0] to the empty
-	   string) */
-	if (options.show_help) {
-		assert(fuse_opt_add_arg(&args, "--help") == 0);
-		args.argv[0][0] = '\0';
+	if (opts.show_help) {
+		printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+		printf("File-system specific options:\n"
+		       "    --dev=<path>           Path to the device or image file\n"
+		       "    --dcache-size=<MiB>    Dentry cache size (default: 16; 0 disables it)\n"
+		       "    --dir-compact=<pct>    Compact directories once pct%% of them is unused\n"
+		       "                           (default: 50; 0 disables it)\n"
+		       "    --bloom-size=<MiB>     Memory for per-directory Bloom filters\n"
+		       "                           (default: 8; 0 disables them)\n"
+		       "    --bloom-file=<path>    Save the filters there at unmount and load them at mount\n"
+		       "    --attr-timeout=<s>     How long the kernel may cache attributes (default: 1)\n"
+		       "    --entry-timeout=<s>    How long the kernel may cache names (default: 1)\n"
+		       "    --negative-timeout=<s> How long the kernel may cache missing names (default: 0)\n"
+		       "    --writeback            Let the kernel cache writes\n"
+		       "    --keep-cache           Keep cached file data when files are reopened\n"
+		       "    --max-write=<KiB>      Largest write request (default: 1024)\n"
+		       "    --max-background=<n>   Most background requests in flight (default: 64)\n"
+		       "    --readahead=<KiB>      Largest window prefetched for sequential reads\n"
+		       "                           (default: 4096; 0 disables it)\n"
+		       "    --commit-interval=<s>  Longest time between commits of the journal\n"
+		       "                           (default: 5)\n"
+		       "    --grow                 Grow the filesystem to the size of the device\n"
+		       "\n");
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		ret = 0;
+		goto err_out1;
+	} else if (opts.show_version) {
+		printf("FUSE library version %s\n", fuse_pkgversion());
+		fuse_lowlevel_version();
+		ret = 0;
+		goto err_out1;
 	} else if (options.devpath == NULL) {
 		fprintf(stderr, "Device path expected\n");
-		return 1;
+		goto err_out1;
+	} else if (opts.mountpoint == NULL) {
+		fprintf(stderr, "Mount point expected\n");
+		goto err_out1;
 	}
 
-	ret = fuse_main(args.argc, args.argv, &myfs_oper, NULL);
+	se = fuse_session_new(&args, &myfs_oper, sizeof(myfs_oper), NULL);
+	if (se == NULL)
+		goto err_out1;
+	session = se;
+
+	if (fuse_set_signal_handlers(se) != 0)
+		goto err_out2;
+
+	if (fuse_session_mount(se, opts.mountpoint) != 0)
+		goto err_out3;
+
+	fuse_daemonize(opts.foreground);
+
+	if (opts.singlethread)
+		ret = fuse_session_loop(se) != 0;
+	else
+		ret = fuse_session_loop_mt(se, opts.clone_fd) != 0;
+
+	fuse_session_unmount(se);
+err_out3:
+	fuse_remove_signal_handlers(se);
+err_out2:
+	fuse_session_destroy(se);
+err_out1:
+	free(opts.mountpoint);
 	fuse_opt_free_args(&args);
-	fclose(log);
+	if (log)
+		fclose(log);
 	return ret;
 }
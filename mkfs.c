@@ -1,26 +1,66 @@
 #include "myfs.h"
+#include "libmyfs.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <sys/types.h>
-#include <sys/stat.h>
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s [-b block-size] [-i bytes-per-inode] [-m reserved-percent] <device>\n"
+			"\n"
+			"Make a new filesystem taking the whole device.\n"
+			"    -b    Block size, a power of 2 from %d to %d (default: 4096)\n"
+			"    -i    Device bytes per inode, at least the block size (default: 4096)\n"
+			"    -m    Percentage of the data blocks reserved for root (default: 0)\n"
+			, name, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+}
 
 int main(int argc, char **argv)
 {
-	if (argc != 2) {
+	struct libmyfs_params_t params;
+	libmyfs_default_params(&params);
+	long block_size = params.block_size;
+	long bytes_per_inode = params.bytes_per_inode;
+	long reserved_percent = params.reserved_percent;
+	int opt;
+	while ((opt = getopt(argc, argv, "b:i:m:")) != -1) {
+		switch (opt) {
+		case 'b':
+			block_size = atol(optarg);
+			break;
+		case 'i':
+			bytes_per_inode = atol(optarg);
+			break;
+		case 'm':
+			reserved_percent = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || block_size > MAX_BLOCK_SIZE || bytes_per_inode < 0 ||
+			reserved_percent < 0 || reserved_percent > 50) {
+		usage(argv[0]);
 		return 1;
 	}
+	params.block_size = block_size;
+	params.bytes_per_inode = bytes_per_inode;
+	params.reserved_percent = reserved_percent;
 
-	int fd = open(argv[1], O_WRONLY);
-	if (fd == -1) {
-		perror("Failed to open device:");
+	const int err = libmyfs_format(argv[optind], &params);
+	if (err == -EINVAL) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (err) {
+		fprintf(stderr, "Failed to make the filesystem: %s\n", strerror(-err));
 		return 1;
 	}
-
-	struct fsinfo_t fs;
-	write_blank_fs(fd, &fs);
 
 	return 0;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #define _XOPEN_SOURCE 500
 
 #include "myfs.h"
@@ -5,29 +6,41 @@
 
 #include "util.h"
 #include "helpers.h"
+#include "dentry_cache.h"
+#include "dir_filter.h"
+#include "journal.h"
+#include "stats.h"
 
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-
-void initialize_fsinfo(struct fsinfo_t *fs, uint64_t size)
+void initialize_fsinfo(struct fsinfo_t *fs, uint64_t size, const struct fs_params_t *params)
 {
-	const uint16_t block_size = 4096;
-	const uint32_t block_count = size / block_size;
-	const uint32_t block_count_2 = block_count - 2; // Reserve space for 2 main blocks
-
-	// Reserve space for the inode map and inode blocks
-	const uint32_t inode_count = size / 4096;
-	const uint32_t inode_map_block_count = CEIL_DIV(inode_count, 8 * block_size);
-	const uint32_t inodes_block_count = CEIL_DIV(inode_count * INODE_SIZE, block_size);
-	const uint32_t block_count_3 = block_count_2 - inode_map_block_count - inodes_block_count;
-
-	// Reserve space for the data blocks and data block map
-	const uint32_t data_block_count = (block_count_3 * 32) / 33;
+	const uint16_t block_size = params->block_size;
+	const uint64_t block_count = size / block_size;
+	const uint64_t block_count_2 = block_count - 2; // Reserve space for 2 main blocks
+	// Block IDs only take 32 bits when they can all be addressed with them
+	const uint32_t features = params->features | (block_count > UINT32_MAX ? MYFS_FEATURE_64BIT : 0);
+	const uint32_t inode_size = (features & MYFS_FEATURE_64BIT) ? INODE_SIZE_64BIT : INODE_SIZE;
+
+	// Reserve space for the inode map and inode blocks; inode numbers stay
+	// 32-bit, and the last one is never used
+	const uint32_t inode_count = MIN(size / params->bytes_per_inode, (uint64_t)UINT32_MAX - 1);
+	const uint64_t inode_map_block_count = CEIL_DIV(inode_count, 8 * block_size);
+	const uint64_t inodes_block_count = CEIL_DIV(inode_count * (uint64_t)inode_size, block_size);
+	// About 1% of the device for the journal, up to 32MiB
+	const uint32_t journal_blocks = (features & MYFS_FEATURE_JOURNAL) ?
+		MIN(MAX(block_count / 128, 64), 8192) : 0;
+	const uint64_t block_count_3 = block_count_2 - inode_map_block_count - inodes_block_count - journal_blocks;
+
+	// Reserve space for the data blocks and data block map (and the
+	// reference counts, which take less than the reserve)
+	const uint64_t data_block_count = (block_count_3 * 32) / 33;
 
 	struct main_block_t mb = {
 		.inode_count_limit = inode_count,
@@ -36,29 +49,65 @@ void initialize_fsinfo(struct fsinfo_t *fs, uint64_t size)
 		.data_block_count = data_block_count,
 		.free_data_block_count = data_block_count,
 		.block_size = block_size,
+		.magic = MYFS_MAGIC,
+		.features = features,
+		.journal_blocks = journal_blocks,
+		.state = MYFS_STATE_CLEAN,
+		.free_block_hint = 0,
+		.free_inode_hint = 0,
+		.reserved_blocks = data_block_count * params->reserved_percent / 100,
+		.layout_data_block_count = data_block_count,
+		.metadata_block = 0,
 	};
 
 	initialize_fsinfo_from_main_block(fs, &mb);
 }
 
+/* returns: the size of the main block on the device, which the inode bitmap follows */
+static uint32_t main_block_size(const struct main_block_t *mb)
+{
+	if (mb->magic != MYFS_MAGIC)
+		return MAIN_BLOCK_SIZE;
+	return (mb->features & MYFS_FEATURE_64BIT) ? MAIN_BLOCK_64BIT_SIZE : MAIN_BLOCK_EXT_SIZE;
+}
+
 void initialize_fsinfo_from_main_block(struct fsinfo_t *fs, const struct main_block_t *mb)
 {
 	const uint16_t bs = mb->block_size;
+	const int wide = mb->features & MYFS_FEATURE_64BIT;
 
 	const uint32_t inode_bitmap_blocks = CEIL_DIV(mb->inode_count_limit, (8 * bs));
-	const uint32_t data_bitmap_blocks = CEIL_DIV(mb->data_block_count, (8 * bs));
+	const uint64_t data_bitmap_blocks = CEIL_DIV(mb->layout_data_block_count, (8 * bs));
+	const uint64_t refcount_blocks = (mb->features & MYFS_FEATURE_REFLINK) ?
+		CEIL_DIV(mb->layout_data_block_count * 2, bs) : 0;
+	const uint32_t inode_size = wide ? INODE_SIZE_64BIT : INODE_SIZE;
 
-	const uint64_t inode_bitmap_pos = MAIN_BLOCK_SIZE;
+	const uint64_t inode_bitmap_pos = main_block_size(mb);
 	const uint64_t data_blocks_bitmap_pos = inode_bitmap_pos + inode_bitmap_blocks * (uint64_t)bs;
-	const uint64_t inodes_pos = data_blocks_bitmap_pos + data_bitmap_blocks * (uint64_t)bs;
-	const uint64_t blocks_pos = inodes_pos + mb->inode_count_limit * (uint64_t)INODE_SIZE;
+	const uint64_t refcounts_pos = data_blocks_bitmap_pos + data_bitmap_blocks * bs;
+	const uint64_t journal_pos = refcounts_pos + refcount_blocks * bs;
+	const uint64_t inodes_pos = journal_pos + mb->journal_blocks * (uint64_t)bs;
+	const uint64_t blocks_pos = inodes_pos + mb->inode_count_limit * (uint64_t)inode_size;
 
 	fs->main_block = *mb;
+	fs->inode_size = inode_size;
+	fs->pointer_size = wide ? 8 : 4;
 	fs->inode_bitmap_blocks = inode_bitmap_blocks;
 	fs->inode_bitmap_pos = inode_bitmap_pos;
 	fs->data_blocks_bitmap_pos = data_blocks_bitmap_pos;
+	fs->refcounts_pos = refcount_blocks > 0 ? refcounts_pos : 0;
+	fs->journal_pos = mb->journal_blocks > 0 ? journal_pos : 0;
 	fs->inodes_pos = inodes_pos;
 	fs->blocks_pos = blocks_pos;
+	if (mb->metadata_block != 0) {
+		fs->data_blocks_bitmap_pos = blocks_pos + mb->metadata_block * bs;
+		if (fs->refcounts_pos)
+			fs->refcounts_pos = fs->data_blocks_bitmap_pos + CEIL_DIV(mb->data_block_count, (8 * bs)) * bs;
+	}
+	fs->dcache = NULL;
+	fs->dfilters = NULL;
+	fs->journal = NULL;
+	pthread_mutex_init(&fs->alloc_lock, NULL);
 }
 
 void initialize_inode(struct inode_t *inode, uint32_t uid, uint32_t gid, uint16_t mode)
@@ -79,6 +128,34 @@ void initialize_inode(struct inode_t *inode, uint32_t uid, uint32_t gid, uint16_
 	*inode = i;
 }
 
+void inode_stat(const struct fsinfo_t *fs, uint32_t inode_num, const struct inode_t *inode, struct stat *st)
+{
+	memset(st, 0, sizeof(struct stat));
+
+	const uint16_t bs = fs->main_block.block_size;
+	uint64_t allocated = inode->blocks;
+	if (!(fs->main_block.features & MYFS_FEATURE_SPARSE))
+		allocated += calc_indirect_block_count(fs, inode->blocks).total_indirect;
+
+	st->st_ino = inode_num;
+	st->st_mode = (inode->mode & mode_mask) |
+		((inode->mode & mode_ftype_mask) == mode_ftype_dir ? S_IFDIR : S_IFREG);
+	st->st_nlink = inode->nlinks;
+	st->st_uid = inode->uid;
+	st->st_gid = inode->gid;
+	st->st_size = inode->size;
+	st->st_blksize = bs;
+	st->st_blocks = allocated * (bs / 512);
+	st->st_atim.tv_sec = inode->mtime;
+	st->st_mtim.tv_sec = inode->mtime;
+	st->st_ctim.tv_sec = inode->ctime;
+}
+
+uint64_t file_block_count(const struct fsinfo_t *fs, const struct inode_t *inode)
+{
+	return CEIL_DIV(inode->size, fs->main_block.block_size);
+}
+
 void clear_inode(struct inode_t *inode)
 {
 	struct inode_t i = {
@@ -95,164 +172,577 @@ void clear_inode(struct inode_t *inode)
 	*inode = i;
 }
 
-void write_main_block(int fd, const struct fsinfo_t *fs)
+uint64_t dev_read(int fd, const struct fsinfo_t *fs, void *buffer, uint64_t len, uint64_t pos)
+{
+	if (fs->journal)
+		return journal_read(fs->journal, (uint8_t *)buffer, len, pos);
+	return counted_pread(fd, buffer, len, pos);
+}
+
+void dev_write(int fd, const struct fsinfo_t *fs, const void *buffer, uint64_t len, uint64_t pos)
+{
+	if (fs->journal)
+		journal_write(fs->journal, (const uint8_t *)buffer, len, pos);
+	else
+		counted_pwrite(fd, buffer, len, pos);
+}
+
+/* returns: the size of the main block; the allocator lock must be held */
+static uint32_t encode_main_block(const struct fsinfo_t *fs, uint8_t buffer[MAIN_BLOCK_64BIT_SIZE])
 {
-	uint8_t buffer[MAIN_BLOCK_SIZE];
+	const struct main_block_t *mb = &fs->main_block;
+	memset(buffer, 0, MAIN_BLOCK_64BIT_SIZE);
 	uint8_t *b = buffer;
-	util_writeseq_u32(&b, fs->main_block.inode_count_limit);
-	util_writeseq_u32(&b, fs->main_block.inode_count);
-	util_writeseq_u32(&b, fs->main_block.block_count);
-	util_writeseq_u32(&b, fs->main_block.data_block_count);
-	util_writeseq_u32(&b, fs->main_block.free_data_block_count);
-	util_writeseq_u16(&b, fs->main_block.block_size);
+	util_writeseq_u32(&b, mb->inode_count_limit);
+	util_writeseq_u32(&b, mb->inode_count);
+	util_writeseq_u32(&b, (uint32_t)mb->block_count);
+	util_writeseq_u32(&b, (uint32_t)mb->data_block_count);
+	util_writeseq_u32(&b, (uint32_t)mb->free_data_block_count);
+	util_writeseq_u16(&b, mb->block_size);
+	// Legacy filesystems have their inode bitmap here
+	if (mb->magic == MYFS_MAGIC) {
+		util_writeseq_u32(&b, mb->magic);
+		util_writeseq_u32(&b, mb->features);
+		util_writeseq_u32(&b, mb->journal_blocks);
+		util_writeseq_u32(&b, mb->state);
+		util_writeseq_u32(&b, (uint32_t)mb->free_block_hint);
+		util_writeseq_u32(&b, mb->free_inode_hint);
+		util_writeseq_u32(&b, (uint32_t)mb->reserved_blocks);
+	}
+	if (mb->features & MYFS_FEATURE_64BIT) {
+		util_writeseq_u32(&b, mb->block_count >> 32);
+		util_writeseq_u32(&b, mb->data_block_count >> 32);
+		util_writeseq_u32(&b, mb->free_data_block_count >> 32);
+		util_writeseq_u32(&b, mb->free_block_hint >> 32);
+		util_writeseq_u32(&b, mb->reserved_blocks >> 32);
+	}
+	if (mb->features & MYFS_FEATURE_RESIZED) {
+		util_writeseq_u32(&b, (uint32_t)mb->layout_data_block_count);
+		util_writeseq_u32(&b, (uint32_t)mb->metadata_block);
+		if (mb->features & MYFS_FEATURE_64BIT) {
+			util_writeseq_u32(&b, mb->layout_data_block_count >> 32);
+			util_writeseq_u32(&b, mb->metadata_block >> 32);
+		}
+	}
+	return main_block_size(mb);
+}
 
+void write_main_block(int fd, struct fsinfo_t *fs)
+{
+	uint8_t buffer[MAIN_BLOCK_64BIT_SIZE];
+	pthread_mutex_lock(&fs->alloc_lock);
+	const uint32_t len = encode_main_block(fs, buffer);
 	// TODO: error checking
-	lseek(fd, 0, SEEK_SET);
-	write(fd, buffer, sizeof(buffer));
+	dev_write(fd, fs, buffer, len, 0);
+	pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+void write_fs_state(int fd, struct fsinfo_t *fs, uint32_t state)
+{
+	uint8_t buffer[MAIN_BLOCK_64BIT_SIZE];
+	pthread_mutex_lock(&fs->alloc_lock);
+	fs->main_block.state = state;
+	const uint32_t len = encode_main_block(fs, buffer);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	// Legacy filesystems have no room for the state and are always rescanned
+	if (fs->main_block.magic != MYFS_MAGIC)
+		return;
+	counted_pwrite(fd, buffer, len, 0);
+	counted_fdatasync(fd);
 }
 
 void write_inode(int fd, const struct fsinfo_t *fs, uint32_t inode_num, const struct inode_t *inode)
 {
 	uint64_t pos = fs->inodes_pos;
-	pos += (uint64_t)INODE_SIZE * inode_num;
-	uint8_t buffer[INODE_SIZE];
+	pos += (uint64_t)fs->inode_size * inode_num;
+	uint8_t buffer[INODE_SIZE_64BIT];
 
 	uint8_t *b = buffer;
 	util_writeseq_u64(&b, inode->ctime);
 	util_writeseq_u64(&b, inode->mtime);
 	util_writeseq_u64(&b, inode->size);
-	util_writeseq_u32(&b, inode->blocks);
-	for (int i = 0; i < INODE_BLKS; ++i)
-		util_writeseq_u32(&b, inode->blockpos[i]);
+	if (fs->pointer_size == 8) {
+		util_writeseq_u64(&b, inode->blocks);
+		for (int i = 0; i < INODE_BLKS; ++i)
+			util_writeseq_u64(&b, inode->blockpos[i]);
+	} else {
+		util_writeseq_u32(&b, (uint32_t)inode->blocks);
+		for (int i = 0; i < INODE_BLKS; ++i)
+			util_writeseq_u32(&b, (uint32_t)inode->blockpos[i]);
+	}
 	util_writeseq_u32(&b, inode->uid);
 	util_writeseq_u32(&b, inode->gid);
 	util_writeseq_u16(&b, inode->mode);
 	util_writeseq_u16(&b, inode->nlinks);
 
-	lseek(fd, pos, SEEK_SET);
-	write(fd, buffer, INODE_SIZE);
+	dev_write(fd, fs, buffer, fs->inode_size, pos);
+}
+
+/* Read the next u32 of a buffer into a u64 */
+static uint64_t readseq_u32_wide(uint8_t **b)
+{
+	uint32_t v;
+	util_readseq_u32(b, &v);
+	return v;
 }
 
 void read_fsinfo(int fd, struct fsinfo_t *fs)
 {
-	uint8_t buffer[MAIN_BLOCK_SIZE];
+	uint8_t buffer[MAIN_BLOCK_64BIT_SIZE];
 	// TODO: error checking
-	lseek(fd, 0, SEEK_SET);
-	read(fd, buffer, sizeof(buffer));
+	counted_pread(fd, buffer, sizeof(buffer), 0);
 
 	struct main_block_t mb;
 	uint8_t *b = buffer;
 	util_readseq_u32(&b, &mb.inode_count_limit);
 	util_readseq_u32(&b, &mb.inode_count);
-	util_readseq_u32(&b, &mb.block_count);
-	util_readseq_u32(&b, &mb.data_block_count);
-	util_readseq_u32(&b, &mb.free_data_block_count);
+	mb.block_count = readseq_u32_wide(&b);
+	mb.data_block_count = readseq_u32_wide(&b);
+	mb.free_data_block_count = readseq_u32_wide(&b);
 	util_readseq_u16(&b, &mb.block_size);
+	util_readseq_u32(&b, &mb.magic);
+	util_readseq_u32(&b, &mb.features);
+	util_readseq_u32(&b, &mb.journal_blocks);
+	util_readseq_u32(&b, &mb.state);
+	mb.free_block_hint = readseq_u32_wide(&b);
+	util_readseq_u32(&b, &mb.free_inode_hint);
+	mb.reserved_blocks = readseq_u32_wide(&b);
+	if (mb.magic == MYFS_MAGIC && (mb.features & MYFS_FEATURE_64BIT)) {
+		mb.block_count |= readseq_u32_wide(&b) << 32;
+		mb.data_block_count |= readseq_u32_wide(&b) << 32;
+		mb.free_data_block_count |= readseq_u32_wide(&b) << 32;
+		mb.free_block_hint |= readseq_u32_wide(&b) << 32;
+		mb.reserved_blocks |= readseq_u32_wide(&b) << 32;
+	}
+	mb.layout_data_block_count = mb.data_block_count;
+	mb.metadata_block = 0;
+	if (mb.magic == MYFS_MAGIC && (mb.features & MYFS_FEATURE_RESIZED)) {
+		mb.layout_data_block_count = readseq_u32_wide(&b);
+		mb.metadata_block = readseq_u32_wide(&b);
+		if (mb.features & MYFS_FEATURE_64BIT) {
+			mb.layout_data_block_count |= readseq_u32_wide(&b) << 32;
+			mb.metadata_block |= readseq_u32_wide(&b) << 32;
+		}
+	}
+	if (mb.magic != MYFS_MAGIC) {
+		// A legacy filesystem; what was read is its inode bitmap
+		mb.magic = 0;
+		mb.features = 0;
+		mb.state = MYFS_STATE_DIRTY;
+		mb.free_block_hint = 0;
+		mb.free_inode_hint = 0;
+		mb.reserved_blocks = 0;
+	}
+	if (!(mb.features & MYFS_FEATURE_JOURNAL))
+		mb.journal_blocks = 0;
 
 	initialize_fsinfo_from_main_block(fs, &mb);
 }
 
-void read_inode(int fd, const struct fsinfo_t *fs, uint32_t inode_num, struct inode_t *inode)
+static void decode_inode(const struct fsinfo_t *fs, const uint8_t *buffer, struct inode_t *inode)
 {
-	uint64_t pos = fs->inodes_pos;
-	pos += (uint64_t)INODE_SIZE * inode_num;
-	uint8_t buffer[INODE_SIZE];
-	lseek(fd, pos, SEEK_SET);
-	read(fd, buffer, INODE_SIZE);
-
-	uint8_t *b = buffer;
+	uint8_t *b = (uint8_t *)buffer;
 	util_readseq_u64(&b, &inode->ctime);
 	util_readseq_u64(&b, &inode->mtime);
 	util_readseq_u64(&b, &inode->size);
-	util_readseq_u32(&b, &inode->blocks);
-	for (int i = 0; i < INODE_BLKS; ++i)
-		util_readseq_u32(&b, &inode->blockpos[i]);
+	if (fs->pointer_size == 8) {
+		util_readseq_u64(&b, &inode->blocks);
+		for (int i = 0; i < INODE_BLKS; ++i)
+			util_readseq_u64(&b, &inode->blockpos[i]);
+	} else {
+		inode->blocks = readseq_u32_wide(&b);
+		for (int i = 0; i < INODE_BLKS; ++i)
+			inode->blockpos[i] = readseq_u32_wide(&b);
+	}
 	util_readseq_u32(&b, &inode->uid);
 	util_readseq_u32(&b, &inode->gid);
 	util_readseq_u16(&b, &inode->mode);
 	util_readseq_u16(&b, &inode->nlinks);
 }
 
-void write_blank_data_bitmap(int fd, const struct fsinfo_t *fs)
+void read_inode(int fd, const struct fsinfo_t *fs, uint32_t inode_num, struct inode_t *inode)
+{
+	uint64_t pos = fs->inodes_pos;
+	pos += (uint64_t)fs->inode_size * inode_num;
+	uint8_t buffer[INODE_SIZE_64BIT];
+	dev_read(fd, fs, buffer, fs->inode_size, pos);
+	decode_inode(fs, buffer, inode);
+}
+
+static int compare_inode_indices(const void *a, const void *b, void *inode_nums)
+{
+	uint32_t x = ((const uint32_t *)inode_nums)[*(const uint32_t *)a];
+	uint32_t y = ((const uint32_t *)inode_nums)[*(const uint32_t *)b];
+	return (x > y) - (x < y);
+}
+
+void read_inodes(int fd, const struct fsinfo_t *fs, uint32_t count, const uint32_t *inode_nums, struct inode_t *inodes)
+{
+	if (count == 0)
+		return;
+
+	// Visit the inodes in the order they appear in the inode table
+	uint32_t order[count];
+	for (uint32_t i = 0; i < count; ++i)
+		order[i] = i;
+	qsort_r(order, count, sizeof(uint32_t), compare_inode_indices, (void *)inode_nums);
+
+	// Inodes that are at most this far apart are read with a single read()
+	const uint32_t inode_size = fs->inode_size;
+	const uint32_t span = MAX(1, fs->main_block.block_size / inode_size);
+	uint8_t buffer[(uint64_t)span * inode_size];
+
+	uint32_t i = 0;
+	while (i < count) {
+		const uint32_t first = inode_nums[order[i]];
+		uint32_t j = i + 1;
+		while (j < count && inode_nums[order[j]] - first < span)
+			++j;
+
+		const uint32_t last = inode_nums[order[j - 1]];
+		const uint64_t len = (uint64_t)(last - first + 1) * inode_size;
+		dev_read(fd, fs, buffer, len, fs->inodes_pos + (uint64_t)inode_size * first);
+		for (; i < j; ++i)
+			decode_inode(fs, buffer + (uint64_t)(inode_nums[order[i]] - first) * inode_size, &inodes[order[i]]);
+	}
+}
+
+void read_inode_range(int fd, const struct fsinfo_t *fs, uint32_t first, uint32_t count, struct inode_t *inodes)
+{
+	const uint32_t inode_size = fs->inode_size;
+	uint8_t *buffer = (uint8_t *)malloc((uint64_t)count * inode_size);
+	dev_read(fd, fs, buffer, (uint64_t)count * inode_size, fs->inodes_pos + (uint64_t)inode_size * first);
+	for (uint32_t i = 0; i < count; ++i)
+		decode_inode(fs, buffer + (uint64_t)i * inode_size, &inodes[i]);
+	free(buffer);
+}
+
+/* Most zeros written at once by write_zeros() */
+#define ZERO_CHUNK (1024 * 1024)
+
+static void write_zeros(int fd, uint64_t pos, uint64_t len)
 {
-	const uint16_t block_size = fs->main_block.block_size;
-	uint8_t buffer[block_size];
-	memset(buffer, 0x00, block_size);
+	if (len == 0)
+		return;
+	uint8_t *buffer = (uint8_t *)calloc(1, MIN(len, ZERO_CHUNK));
+	while (len > 0) {
+		ssize_t w = counted_pwrite(fd, buffer, MIN(len, ZERO_CHUNK), pos);
+		if (w <= 0)
+			break;
+		pos += w;
+		len -= w;
+	}
+	free(buffer);
+}
 
-	const uint64_t begin_pos = fs->data_blocks_bitmap_pos;
-	const uint64_t end_pos = fs->inodes_pos;
-	uint64_t pos = begin_pos;
-	lseek(fd, pos, SEEK_SET);
-	while (pos < end_pos) {
-		uint64_t towrite = MIN(block_size, end_pos - pos);
-		uint64_t written = write(fd, buffer, towrite);
-		EXPECT(written > 0); // TODO: error checking
-		pos += written;
+void zero_device_range(int fd, uint64_t pos, uint64_t len)
+{
+	// Block devices only zero whole sectors
+	const uint64_t begin = CEIL_DIV(pos, 4096) * 4096;
+	const uint64_t end = (pos + len) / 4096 * 4096;
+	if (begin < end && (fallocate(fd, FALLOC_FL_ZERO_RANGE, begin, end - begin) == 0 ||
+			fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, begin, end - begin) == 0)) {
+		write_zeros(fd, pos, begin - pos);
+		write_zeros(fd, end, pos + len - end);
+	} else {
+		write_zeros(fd, pos, len);
 	}
 }
 
+/* Also clears the reference counts and the journal, which follow the bitmap */
+void write_blank_data_bitmap(int fd, const struct fsinfo_t *fs)
+{
+	zero_device_range(fd, fs->data_blocks_bitmap_pos, fs->inodes_pos - fs->data_blocks_bitmap_pos);
+}
+
 void write_blank_inode_bitmap(int fd, const struct fsinfo_t *fs)
 {
-	const uint32_t inode_count = fs->main_block.inode_count_limit;
-	const uint16_t block_size = fs->main_block.block_size;
-	const uint32_t inode_bitmap_blocks = inode_count / block_size
-		+ (inode_count % block_size != 0);
-	uint8_t buffer[block_size];
-	memset(buffer, 0x00, block_size);
-	// TODO: error checking
-	lseek(fd, MAIN_BLOCK_SIZE, SEEK_SET);
-	for (uint32_t i = 0; i < inode_bitmap_blocks; ++i)
-		write(fd, buffer, block_size);
+	zero_device_range(fd, fs->inode_bitmap_pos, fs->inode_bitmap_blocks * (uint64_t)fs->main_block.block_size);
 }
 
-void write_blank_fs(int fd, struct fsinfo_t *fs)
+void default_fs_params(struct fs_params_t *params, uint32_t features)
 {
-	size_t size = lseek(fd, 0, SEEK_END);
-	initialize_fsinfo(fs, size);
+	params->block_size = 4096;
+	params->bytes_per_inode = 4096;
+	params->reserved_percent = 0;
+	params->features = features;
+}
 
-	write_main_block(fd, fs);
+void write_blank_fs(int fd, struct fsinfo_t *fs, uint32_t features)
+{
+	struct fs_params_t params;
+	default_fs_params(&params, features);
+	format_fs(fd, fs, &params);
+}
+
+void format_fs(int fd, struct fsinfo_t *fs, const struct fs_params_t *params)
+{
+	const uint64_t size = lseek(fd, 0, SEEK_END);
+	initialize_fsinfo(fs, size, params);
+
+	// Only the bitmaps need to be zeroed: the inode table and the data
+	// blocks are read only where the bitmaps say they are in use
 	write_blank_inode_bitmap(fd, fs);
 	write_blank_data_bitmap(fd, fs);
+	if (params->features & MYFS_FEATURE_SPARSE) {
+		// Reserve data block 0, holes are read from it
+		const uint16_t bs = fs->main_block.block_size;
+		uint8_t buffer[bs];
+		memset(buffer, 0, bs);
+		counted_pwrite(fd, buffer, bs, fs->blocks_pos);
+		// The bitmap is blank, and mkfs opens the device write-only
+		const uint8_t first = 1;
+		counted_pwrite(fd, &first, 1, fs->data_blocks_bitmap_pos);
+		--fs->main_block.free_data_block_count;
+		fs->main_block.free_block_hint = 1;
+	}
+	journal_format(fd, fs);
 	write_root_directory(fd, fs);
+	write_main_block(fd, fs);
+}
+
+/* Bytes copied at once when the data bitmap and reference counts move */
+#define GROW_CHUNK (1024 * 1024)
+
+/* Set or clear the bits first to first + count - 1 of a bitmap, in the part of it from bit `from` in buffer */
+static void update_bits(uint8_t *buffer, uint64_t from, uint64_t len, uint64_t first, uint64_t count, int state)
+{
+	const uint64_t l = MAX(from, first), r = MIN(from + len, first + count);
+	for (uint64_t bit = l; bit < r; ++bit) {
+		if (state)
+			buffer[(bit - from) / 8] |= 1 << (bit % 8);
+		else
+			buffer[(bit - from) / 8] &= ~(1 << (bit % 8));
+	}
+}
+
+uint64_t metadata_block_count(const struct fsinfo_t *fs)
+{
+	const struct main_block_t *mb = &fs->main_block;
+	const uint16_t bs = mb->block_size;
+	if (mb->metadata_block == 0)
+		return 0;
+	return CEIL_DIV(mb->data_block_count, 8 * bs) +
+		((mb->features & MYFS_FEATURE_REFLINK) ? CEIL_DIV(mb->data_block_count * 2, bs) : 0);
+}
+
+int grow_fs(int fd, struct fsinfo_t *fs, uint64_t size)
+{
+	struct main_block_t *mb = &fs->main_block;
+	const uint16_t bs = mb->block_size;
+	if (mb->magic != MYFS_MAGIC)
+		return EOPNOTSUPP;
+	uint64_t block_count = size / bs;
+	if (!(mb->features & MYFS_FEATURE_64BIT))
+		block_count = MIN(block_count, UINT32_MAX);
+	if (block_count < mb->block_count)
+		return EINVAL;
+
+	// The data blocks take everything after the inode table
+	const uint64_t old_count = mb->data_block_count;
+	const uint64_t new_count = MAX(old_count, (block_count * bs - fs->blocks_pos) / bs);
+	if (new_count == old_count)
+		return 0;
+	const int reflink = mb->features & MYFS_FEATURE_REFLINK;
+	const uint64_t old_bitmap_blocks = CEIL_DIV(old_count, 8 * bs);
+	const uint64_t old_refcount_blocks = reflink ? CEIL_DIV(old_count * 2, bs) : 0;
+	const uint64_t new_bitmap_blocks = CEIL_DIV(new_count, 8 * bs);
+	const uint64_t new_refcount_blocks = reflink ? CEIL_DIV(new_count * 2, bs) : 0;
+	// The data bitmap and reference counts stay where they are while they fit
+	const uint64_t layout_count = mb->layout_data_block_count;
+	const int move = mb->metadata_block != 0 ?
+		new_bitmap_blocks > old_bitmap_blocks || new_refcount_blocks > old_refcount_blocks :
+		new_bitmap_blocks > CEIL_DIV(layout_count, 8 * bs) ||
+			(reflink && new_refcount_blocks > CEIL_DIV(layout_count * 2, bs));
+	const uint64_t meta_blocks = move ? new_bitmap_blocks + new_refcount_blocks : 0;
+	const uint64_t old_meta_blocks = move ? metadata_block_count(fs) : 0;
+	if (move && new_count - old_count <= meta_blocks)
+		return ENOSPC;
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	uint64_t bitmap_pos = fs->data_blocks_bitmap_pos;
+	uint64_t refcounts_pos = fs->refcounts_pos;
+	if (move) {
+		// To the beginning of the new space, where nothing refers to it until
+		// the main block does, so it is written directly
+		bitmap_pos = fs->blocks_pos + old_count * bs;
+		refcounts_pos = reflink ? bitmap_pos + new_bitmap_blocks * bs : 0;
+		uint8_t *buffer = (uint8_t *)malloc(GROW_CHUNK);
+		const uint64_t old_bytes = CEIL_DIV(old_count, 8);
+		for (uint64_t pos = 0; pos < new_bitmap_blocks * bs; pos += GROW_CHUNK) {
+			const uint64_t len = MIN(GROW_CHUNK, new_bitmap_blocks * bs - pos);
+			memset(buffer, 0, len);
+			if (pos < old_bytes)
+				dev_read(fd, fs, buffer, MIN(len, old_bytes - pos), fs->data_blocks_bitmap_pos + pos);
+			// Past the old blocks only the moved metadata is in use
+			update_bits(buffer, pos * 8, len * 8, old_count, new_count - old_count, 0);
+			update_bits(buffer, pos * 8, len * 8, old_count, meta_blocks, 1);
+			update_bits(buffer, pos * 8, len * 8, mb->metadata_block, old_meta_blocks, 0);
+			counted_pwrite(fd, buffer, len, bitmap_pos + pos);
+		}
+		if (reflink) {
+			for (uint64_t pos = 0; pos < old_count * 2; pos += GROW_CHUNK) {
+				const uint64_t len = MIN(GROW_CHUNK, old_count * 2 - pos);
+				dev_read(fd, fs, buffer, len, fs->refcounts_pos + pos);
+				counted_pwrite(fd, buffer, len, refcounts_pos + pos);
+			}
+			zero_device_range(fd, refcounts_pos + old_count * 2, new_refcount_blocks * bs - old_count * 2);
+		}
+		free(buffer);
+		counted_fdatasync(fd);
+		// The old place may be in the journal, and its blocks are free now
+		if (fs->journal && old_meta_blocks > 0)
+			journal_revoke(fs->journal, fs->data_blocks_bitmap_pos, old_meta_blocks * bs);
+	} else {
+		// The new blocks must be free, and not shared
+		const uint64_t first_byte = old_count / 8;
+		const uint64_t len = CEIL_DIV(new_count, 8) - first_byte;
+		uint8_t *buffer = (uint8_t *)malloc(MAX(len, (new_count - old_count) * 2));
+		dev_read(fd, fs, buffer, len, bitmap_pos + first_byte);
+		update_bits(buffer, first_byte * 8, len * 8, old_count, new_count - old_count, 0);
+		dev_write(fd, fs, buffer, len, bitmap_pos + first_byte);
+		if (reflink) {
+			memset(buffer, 0, (new_count - old_count) * 2);
+			dev_write(fd, fs, buffer, (new_count - old_count) * 2, refcounts_pos + old_count * 2);
+		}
+		free(buffer);
+	}
+
+	mb->reserved_blocks = (uint64_t)((double)mb->reserved_blocks * new_count / old_count);
+	mb->block_count = block_count;
+	mb->data_block_count = new_count;
+	mb->free_data_block_count += new_count - old_count - meta_blocks + old_meta_blocks;
+	mb->features |= MYFS_FEATURE_RESIZED;
+	if (move) {
+		mb->metadata_block = old_count;
+		fs->data_blocks_bitmap_pos = bitmap_pos;
+		fs->refcounts_pos = refcounts_pos;
+	}
+	uint8_t buffer[MAIN_BLOCK_64BIT_SIZE];
+	const uint32_t len = encode_main_block(fs, buffer);
+	dev_write(fd, fs, buffer, len, 0);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if (!fs->journal)
+		counted_fdatasync(fd);
+	return 0;
+}
+
+/* Set or clear a bit of one of the bitmaps; the caller must hold the allocator lock
+ *
+ * returns: the previous state of the bit
+ */
+static uint8_t update_bitmap(int fd, const struct fsinfo_t *fs, uint64_t bitmap_pos, uint64_t index, uint8_t state)
+{
+	uint64_t pos = bitmap_pos + index / 8;
+	uint8_t data;
+	dev_read(fd, fs, &data, 1, pos);
+	const uint8_t old = (data >> (index % 8)) & 1;
+	if (state)
+		data |= (1 << (index % 8));
+	else
+		data &= ~(1 << (index % 8));
+	if (old != state)
+		dev_write(fd, fs, &data, 1, pos);
+	return old;
+}
+
+/* Find the first clear bit of a bitmap at or after `from`, reading it a block at a time
+ *
+ * returns: its index; `count` if there is none
+ */
+static uint64_t find_clear_bit(int fd, const struct fsinfo_t *fs, uint64_t bitmap_pos, uint64_t count, uint64_t from)
+{
+	const uint16_t bs = fs->main_block.block_size;
+	uint8_t buffer[bs];
+	uint64_t index = from;
+	stats_add(STAT_ALLOC_SCANS, 1);
+	while (index < count) {
+		const uint64_t first_byte = index / 8;
+		const uint64_t len = MIN(bs, CEIL_DIV(count, 8) - first_byte);
+		dev_read(fd, fs, buffer, len, bitmap_pos + first_byte);
+		stats_add(STAT_ALLOC_SCAN_BLOCKS, 1);
+		for (uint64_t i = 0; i < len; ++i) {
+			if (buffer[i] == 0xFF)
+				continue;
+			for (int j = 0; j < 8; ++j) {
+				const uint64_t bit = (first_byte + i) * 8 + j;
+				if (bit >= index && bit < count && !(buffer[i] & (1 << j)))
+					return bit;
+			}
+		}
+		index = (first_byte + len) * 8;
+	}
+	return count;
+}
+
+void rescan_allocator(int fd, struct fsinfo_t *fs)
+{
+	const uint16_t bs = fs->main_block.block_size;
+	uint8_t buffer[bs];
+	uint64_t counts[2] = { 0, 0 };
+	uint64_t first_clear[2];
+	const uint64_t bitmap_pos[2] = { fs->inode_bitmap_pos, fs->data_blocks_bitmap_pos };
+	const uint64_t bit_count[2] = { fs->main_block.inode_count_limit, fs->main_block.data_block_count };
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	for (int m = 0; m < 2; ++m) {
+		first_clear[m] = bit_count[m];
+		const uint64_t bytes = CEIL_DIV(bit_count[m], 8);
+		for (uint64_t pos = 0; pos < bytes; pos += bs) {
+			const uint64_t len = MIN(bs, bytes - pos);
+			dev_read(fd, fs, buffer, len, bitmap_pos[m] + pos);
+			for (uint64_t i = 0; i < len; ++i) {
+				for (int j = 0; j < 8; ++j) {
+					const uint64_t bit = (pos + i) * 8 + j;
+					if (bit >= bit_count[m])
+						break;
+					if (buffer[i] & (1 << j))
+						++counts[m];
+					else if (first_clear[m] == bit_count[m])
+						first_clear[m] = bit;
+				}
+			}
+		}
+	}
+	fs->main_block.inode_count = counts[0];
+	fs->main_block.free_data_block_count = fs->main_block.data_block_count - counts[1];
+	fs->main_block.free_inode_hint = first_clear[0];
+	fs->main_block.free_block_hint = first_clear[1];
+	pthread_mutex_unlock(&fs->alloc_lock);
 }
 
 void create_inode(int fd, struct fsinfo_t *fs, const struct inode_t *inode, uint32_t *inode_num)
 {
+	pthread_mutex_lock(&fs->alloc_lock);
 	uint32_t ic = fs->main_block.inode_count_limit;
-	uint32_t i;
-	for (i = 0; i < ic; ++i)
-		if (get_inode_state(fd, fs, i) == 0)
-			break;
+	uint32_t i = find_clear_bit(fd, fs, fs->inode_bitmap_pos, ic, fs->main_block.free_inode_hint);
 	EXPECT_S(i != ic, "Failed to find free inode\n"); // TODO
 
-	set_inode_state(fd, fs, i, 1);
+	update_bitmap(fd, fs, fs->inode_bitmap_pos, i, 1);
+	++fs->main_block.inode_count;
+	fs->main_block.free_inode_hint = i + 1;
+	pthread_mutex_unlock(&fs->alloc_lock);
+
 	write_inode(fd, fs, i, inode);
 	*inode_num = i;
 }
 
-uint8_t get_block_state(int fd, struct fsinfo_t *fs, uint32_t block)
+uint8_t get_block_state(int fd, struct fsinfo_t *fs, uint64_t block)
 {
 	uint64_t pos = fs->data_blocks_bitmap_pos;
 	pos += block / 8;
 	uint8_t data;
-	lseek(fd, pos, SEEK_SET);
-	read(fd, &data, 1);
+	dev_read(fd, fs, &data, 1, pos);
 	return (data >> (block % 8)) & 1;
 }
 
-void set_block_state(int fd, struct fsinfo_t *fs, uint32_t block, uint8_t state)
+void set_block_state(int fd, struct fsinfo_t *fs, uint64_t block, uint8_t state)
 {
-	uint64_t pos = fs->data_blocks_bitmap_pos;
-	pos += block / 8;
-	uint8_t data;
-	lseek(fd, pos, SEEK_SET);
-	read(fd, &data, 1);
-	if (state)
-		data |= (1 << (block % 8));
-	else
-		data &= ~(1 << (block % 8));
-	lseek(fd, pos, SEEK_SET);
-	write(fd, &data, 1);
+	pthread_mutex_lock(&fs->alloc_lock);
+	update_bitmap(fd, fs, fs->data_blocks_bitmap_pos, block, state);
+	if (!state && block < fs->main_block.free_block_hint)
+		fs->main_block.free_block_hint = block;
+	pthread_mutex_unlock(&fs->alloc_lock);
 }
 
 uint8_t get_inode_state(int fd, struct fsinfo_t *fs, uint32_t inode)
@@ -260,45 +750,50 @@ uint8_t get_inode_state(int fd, struct fsinfo_t *fs, uint32_t inode)
 	uint64_t pos = fs->inode_bitmap_pos;
 	pos += inode / 8;
 	uint8_t data;
-	lseek(fd, pos, SEEK_SET);
-	read(fd, &data, 1);
+	dev_read(fd, fs, &data, 1, pos);
 	return (data >> (inode % 8)) & 1;
 }
 
 void set_inode_state(int fd, struct fsinfo_t *fs, uint32_t inode, uint8_t state)
 {
-	uint64_t pos = fs->inode_bitmap_pos;
-	pos += inode / 8;
-	uint8_t data;
-	lseek(fd, pos, SEEK_SET);
-	read(fd, &data, 1);
-	if (state)
-		data |= (1 << (inode % 8));
-	else
-		data &= ~(1 << (inode % 8));
-	lseek(fd, pos, SEEK_SET);
-	write(fd, &data, 1);
+	pthread_mutex_lock(&fs->alloc_lock);
+	if (update_bitmap(fd, fs, fs->inode_bitmap_pos, inode, state) != state) {
+		if (state)
+			++fs->main_block.inode_count;
+		else
+			--fs->main_block.inode_count;
+	}
+	if (!state && inode < fs->main_block.free_inode_hint)
+		fs->main_block.free_inode_hint = inode;
+	pthread_mutex_unlock(&fs->alloc_lock);
 }
 
 /* Allocate block_count blocks and write their IDs to out_blocks
  *
  * returns: number of blocks allocated; less than block_count if out of space
  */
-static uint32_t allocate_blocks(int fd, struct fsinfo_t *fs, uint32_t block_count, uint32_t *out_blocks)
+static uint64_t allocate_blocks(int fd, struct fsinfo_t *fs, uint64_t block_count, uint64_t *out_blocks)
 {
-	uint32_t allocated = 0;
+	uint64_t allocated = 0;
 
 	const uint16_t bs = fs->main_block.block_size;
 	const uint64_t bitmap_pos = fs->data_blocks_bitmap_pos;
+	const uint64_t bitmap_end = bitmap_pos + CEIL_DIV(fs->main_block.data_block_count, 8);
 	uint8_t buffer[bs];
-	uint64_t pos = bitmap_pos;
-	do {
+	pthread_mutex_lock(&fs->alloc_lock);
+	// Everything before the hint is in use
+	uint64_t pos = bitmap_pos + MIN(fs->main_block.free_block_hint, fs->main_block.data_block_count) / 8;
+	stats_add(STAT_ALLOC_SCANS, 1);
+	while (allocated < block_count && pos < bitmap_end) {
 		// Load a page
-		lseek(fd, pos, SEEK_SET);
-		uint64_t s = read(fd, buffer, bs);
+		uint64_t s = dev_read(fd, fs, buffer, MIN(bs, bitmap_end - pos), pos);
+		stats_add(STAT_ALLOC_SCAN_BLOCKS, 1);
+		// The bits past the last block of the last byte aren't blocks
+		if (pos + s == bitmap_end && fs->main_block.data_block_count % 8)
+			buffer[s - 1] |= 0xFF << (fs->main_block.data_block_count % 8);
 
-		uint32_t first_updated = (uint32_t)(-1);
-		uint32_t last_updated = first_updated - 1;
+		uint64_t first_updated = (uint64_t)(-1);
+		uint64_t last_updated = first_updated - 1;
 
 		// Traverse page
 		for (uint64_t i = 0; allocated < block_count && i < s; ++i) {
@@ -319,214 +814,577 @@ static uint32_t allocate_blocks(int fd, struct fsinfo_t *fs, uint32_t block_coun
 		}
 
 		// Update bytes
-		if (first_updated <= last_updated) {
-			lseek(fd, pos + first_updated, SEEK_SET);
-			write(fd, buffer + first_updated, last_updated - first_updated + 1);
-		}
+		if (first_updated <= last_updated)
+			dev_write(fd, fs, buffer + first_updated, last_updated - first_updated + 1, pos + first_updated);
 
 		pos += s;
-	} while (allocated < block_count);
+	}
 
+	if (allocated < block_count)
+		fs->main_block.free_block_hint = fs->main_block.data_block_count;
+	else if (allocated > 0)
+		fs->main_block.free_block_hint = out_blocks[allocated - 1] + 1;
 	fs->main_block.free_data_block_count -= allocated;
+	pthread_mutex_unlock(&fs->alloc_lock);
 
 	return allocated;
 }
 
-static void release_blocks(int fd, struct fsinfo_t *fs, uint32_t *blocks, uint32_t block_count)
+/* Allocate block_count contiguous blocks, in the first run of free blocks at or after `goal` long enough,
+ * or else in the first one before it
+ *
+ * returns: 1 and the first block of the run in *first; 0 if there is no such run
+ */
+static int allocate_run(int fd, struct fsinfo_t *fs, uint64_t block_count, uint64_t goal, uint64_t *first)
 {
-	if (block_count == 0)
-		return;
+	const uint16_t bs = fs->main_block.block_size;
+	const uint64_t bitmap_pos = fs->data_blocks_bitmap_pos;
+	const uint64_t total = fs->main_block.data_block_count;
+	uint8_t buffer[bs];
+	uint64_t start = total;
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	stats_add(STAT_ALLOC_SCANS, 1);
+	for (int pass = 0; pass < 2 && start == total; ++pass) {
+		uint64_t bit = pass == 0 ? MIN(goal, total) : 0;
+		uint64_t run = 0;
+		while (bit < total && run < block_count) {
+			const uint64_t first_byte = bit / 8;
+			const uint64_t len = MIN(bs, CEIL_DIV(total, 8) - first_byte);
+			dev_read(fd, fs, buffer, len, bitmap_pos + first_byte);
+			stats_add(STAT_ALLOC_SCAN_BLOCKS, 1);
+			const uint64_t end = MIN((first_byte + len) * 8, total);
+			while (bit < end && run < block_count) {
+				const uint8_t b = buffer[bit / 8 - first_byte];
+				// Whole bytes at once where they are all used or all free
+				if (bit % 8 == 0 && bit + 8 <= end && (b == 0xFF || (b == 0 && run + 8 <= block_count))) {
+					run = b ? 0 : run + 8;
+					bit += 8;
+					continue;
+				}
+				run = (b & (1 << (bit % 8))) ? 0 : run + 1;
+				++bit;
+			}
+		}
+		if (run == block_count)
+			start = bit - run;
+	}
+
+	if (start < total) {
+		const uint64_t end = start + block_count;
+		for (uint64_t bit = start; bit < end; ) {
+			const uint64_t first_byte = bit / 8;
+			const uint64_t len = MIN(bs, CEIL_DIV(end, 8) - first_byte);
+			dev_read(fd, fs, buffer, len, bitmap_pos + first_byte);
+			for (; bit < end && bit / 8 < first_byte + len; ++bit)
+				buffer[bit / 8 - first_byte] |= 1 << (bit % 8);
+			dev_write(fd, fs, buffer, len, bitmap_pos + first_byte);
+		}
+		if (fs->main_block.free_block_hint >= start && fs->main_block.free_block_hint < end)
+			fs->main_block.free_block_hint = end;
+		fs->main_block.free_data_block_count -= block_count;
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	*first = start;
+	return start < total;
+}
+
+/*
+ * Reference counts
+ *
+ * The table holds a u16 per data block with the number of references to it
+ * besides the first one, so blocks that aren't shared are 0, like blocks
+ * that are free. All functions here need fs->alloc_lock to be held.
+ */
+
+#define MAX_REFCOUNT 0xFFFF
+
+/* Load the reference counts of blocks[0] and of the following blocks whose
+ * counts are within one block of the table
+ *
+ * returns: the number of blocks loaded; the buffer holds the counts of blocks *left to *right
+ */
+static uint64_t load_refcounts(int fd, const struct fsinfo_t *fs, const uint64_t *blocks, uint64_t block_count,
+		uint8_t *buffer, uint64_t *left, uint64_t *right)
+{
+	const uint16_t bs = fs->main_block.block_size;
+	uint64_t l = blocks[0], r = blocks[0];
+	uint64_t i;
+	for (i = 1; i < block_count; ++i) {
+		uint64_t new_l = MIN(l, blocks[i]);
+		uint64_t new_r = MAX(r, blocks[i]);
+		if ((new_r - new_l + 1) * 2 > bs)
+			break;
+		l = new_l;
+		r = new_r;
+	}
+	dev_read(fd, fs, buffer, (r - l + 1) * 2, fs->refcounts_pos + l * (uint64_t)2);
+	*left = l;
+	*right = r;
+	return i;
+}
+
+static void store_refcounts(int fd, const struct fsinfo_t *fs, const uint8_t *buffer, uint64_t left, uint64_t right)
+{
+	dev_write(fd, fs, buffer, (right - left + 1) * 2, fs->refcounts_pos + left * (uint64_t)2);
+}
+
+/* Add a reference to each block
+ *
+ * returns: the number of blocks done; less than block_count if the count of
+ * the next one is at its maximum
+ */
+static uint64_t add_refcounts(int fd, struct fsinfo_t *fs, const uint64_t *blocks, uint64_t block_count)
+{
+	uint8_t buffer[fs->main_block.block_size];
+	uint64_t done = 0;
+	while (done < block_count) {
+		uint64_t left, right;
+		const uint64_t n = load_refcounts(fd, fs, blocks + done, block_count - done, buffer, &left, &right);
+		for (uint64_t i = 0; i < n; ++i) {
+			uint16_t c;
+			util_read_u16(buffer + (blocks[done + i] - left) * 2, &c);
+			if (c == MAX_REFCOUNT) {
+				// Store the ones done so far, so that the caller can undo them
+				store_refcounts(fd, fs, buffer, left, right);
+				return done + i;
+			}
+			util_write_u16(buffer + (blocks[done + i] - left) * 2, c + 1);
+		}
+		store_refcounts(fd, fs, buffer, left, right);
+		done += n;
+	}
+	return done;
+}
+
+/* Drop a reference to each block
+ *
+ * The blocks that had no other references are moved to the beginning of
+ * `blocks`; they are to be freed.
+ * returns: the number of such blocks
+ */
+static uint64_t drop_refcounts(int fd, struct fsinfo_t *fs, uint64_t *blocks, uint64_t block_count)
+{
+	uint8_t buffer[fs->main_block.block_size];
+	uint64_t done = 0, unused = 0;
+	while (done < block_count) {
+		uint64_t left, right;
+		const uint64_t n = load_refcounts(fd, fs, blocks + done, block_count - done, buffer, &left, &right);
+		int changed = 0;
+		for (uint64_t i = 0; i < n; ++i) {
+			const uint64_t b = blocks[done + i];
+			uint16_t c;
+			util_read_u16(buffer + (b - left) * 2, &c);
+			if (c > 0) {
+				util_write_u16(buffer + (b - left) * 2, c - 1);
+				changed = 1;
+			} else {
+				blocks[unused++] = b;
+			}
+		}
+		if (changed)
+			store_refcounts(fd, fs, buffer, left, right);
+		done += n;
+	}
+	return unused;
+}
 
+/* Clear the bitmap bits of blocks; fs->alloc_lock must be held */
+static void clear_block_bits(int fd, struct fsinfo_t *fs, const uint64_t *blocks, uint64_t block_count)
+{
 	const uint16_t bs = fs->main_block.block_size;
 	const uint64_t bitmap_pos = fs->data_blocks_bitmap_pos;
 	uint8_t buffer[bs];
-	uint32_t left, right;
-	uint32_t released = 0;
+	uint64_t left, right;
+	uint64_t released = 0;
 
 	while (released < block_count) {
 		left = right = (blocks[released] / 8);
-		uint32_t i;
+		uint64_t i;
 		for (i = released + 1; i < block_count; ++i) {
-			uint32_t loc = (blocks[i] / 8);
-			uint32_t new_left = MIN(left, loc);
-			uint32_t new_right = MAX(right, loc);
+			uint64_t loc = (blocks[i] / 8);
+			uint64_t new_left = MIN(left, loc);
+			uint64_t new_right = MAX(right, loc);
 			if (new_right - new_left + 1 > bs)
 				break;
 			left = new_left;
 			right = new_right;
 		}
-		lseek(fd, bitmap_pos + left, SEEK_SET);
-		read(fd, buffer, right - left + 1);
-		lseek(fd, bitmap_pos + left, SEEK_SET);
-		for (uint32_t j = released; j < i; ++j)
+		dev_read(fd, fs, buffer, right - left + 1, bitmap_pos + left);
+		for (uint64_t j = released; j < i; ++j)
 			buffer[blocks[j] / 8 - left] &= ~(1 << (blocks[j] % 8));
-		write(fd, buffer, right - left + 1);
+		dev_write(fd, fs, buffer, right - left + 1, bitmap_pos + left);
 		released = i;
 	}
 
+	for (uint64_t i = 0; i < block_count; ++i)
+		fs->main_block.free_block_hint = MIN(fs->main_block.free_block_hint, blocks[i]);
 	fs->main_block.free_data_block_count += block_count;
 }
 
-uint64_t inode_data_write(int fd, struct fsinfo_t *fs, struct inode_t *inode, const uint8_t *buffer, uint64_t len, uint64_t pos)
+void free_data_blocks(int fd, struct fsinfo_t *fs, const uint64_t *blocks, uint64_t block_count)
 {
-	if (len == 0)
-		return 0;
-
-	const uint32_t bsize = fs->main_block.block_size;
-	//const uint32_t block_count = fs->main_block.data_block_count;
-
-	if (pos + len > inode->size)
-		resize_file(fd, fs, inode, pos + len);
-
-	// Write the data
-	{
-		uint64_t total_towrite = len; // total number of bytes to write
-		uint64_t total_written = 0; // total number of byets written
-		const uint16_t c = bsize / 4; // blocks per indirect block
-		uint64_t cur_pos = pos;
-		while (cur_pos < pos + len) {
-			uint32_t file_block_id = cur_pos / bsize;
-			uint32_t block_id;
-			if (file_block_id < 12) {
-				// Dirrectly get the block id
-				block_id = inode->blockpos[file_block_id];
-			} else if (file_block_id < 12 + c) {
-				// Get the block id from a singly-indirect block
-				uint32_t b = inode->blockpos[12];
-				read_u32_from_block(fd, fs, b, file_block_id - 12, &block_id);
-			} else if (file_block_id < 12 + c + c*c) {
-				// Get the block id from a doubly-indirect block
-				uint32_t fb = file_block_id - 12 - c;
-
-				uint32_t b1 = inode->blockpos[13];
-				uint32_t off1 = fb / c;
-
-				uint32_t b2;
-				uint32_t off2 = fb % c;
-
-				read_u32_from_block(fd, fs, b1, off1, &b2);
-				read_u32_from_block(fd, fs, b2, off2, &block_id);
-			} else {
-				// Get the block id from a triply-indirect block
-				uint32_t fb = file_block_id - 12 - c - c*c;
-
-				uint32_t b1 = inode->blockpos[14];
-				uint32_t off1 = fb / (c*c);
+	pthread_mutex_lock(&fs->alloc_lock);
+	clear_block_bits(fd, fs, blocks, block_count);
+	pthread_mutex_unlock(&fs->alloc_lock);
+}
 
-				uint32_t b2;
-				uint32_t off2 = fb % (c*c) / c;
+/* shared: whether the blocks may be shared with other files */
+static void release_blocks(int fd, struct fsinfo_t *fs, uint64_t *blocks, uint64_t block_count, int shared)
+{
+	if (block_count == 0)
+		return;
 
-				uint32_t b3;
-				uint32_t off3 = fb % c;
+	const uint16_t bs = fs->main_block.block_size;
 
-				read_u32_from_block(fd, fs, b1, off1, &b2);
-				read_u32_from_block(fd, fs, b2, off2, &b3);
-				read_u32_from_block(fd, fs, b3, off3, &block_id);
-			}
-			uint64_t p = cur_pos % bsize;
-			uint64_t towrite = total_towrite;
-			uint64_t written = 0;
-			if (towrite > bsize - p)
-				towrite = bsize - p;
-			cur_pos += towrite;
-			total_towrite -= towrite;
-			while (towrite > 0) {
-				lseek(fd, fs->blocks_pos + block_id * (uint64_t)bsize + p, SEEK_SET);
-				uint64_t w = write(fd, buffer + total_written, towrite);
-				towrite -= w;
-				written += w;
-				total_written += w;
-			}
-		}
-		EXPECT_EQUAL(cur_pos, pos + len);
+	pthread_mutex_lock(&fs->alloc_lock);
+	// Blocks still used by other files only lose a reference
+	if (shared && fs->refcounts_pos)
+		block_count = drop_refcounts(fd, fs, blocks, block_count);
+	if (fs->journal) {
+		// They may have held metadata, which must not be written over their next user's data
+		for (uint64_t i = 0; i < block_count; ++i)
+			journal_revoke(fs->journal, fs->blocks_pos + blocks[i] * (uint64_t)bs, bs);
+		// Until the transaction is committed, a crash brings back their old owner,
+		// so they are only freed then
+		journal_free_blocks(fs->journal, blocks, block_count);
+	} else {
+		clear_block_bits(fd, fs, blocks, block_count);
 	}
-
-	// TODO: error checking
-	return len;
+	pthread_mutex_unlock(&fs->alloc_lock);
 }
 
-uint64_t inode_data_read(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint8_t *buffer, uint64_t len, uint64_t pos)
+/* Find where the ID of the file_block_id-th block of a file is stored
+ *
+ * returns: 1 if it is the index-th block ID in the indirect block *block_id;
+ * 0 if it is inode->blockpos[index]
+ */
+static int find_block_pointer(int fd, struct fsinfo_t *fs, const struct inode_t *inode, uint64_t file_block_id,
+		uint64_t *block_id, uint64_t *index)
 {
-	if (len == 0)
+	const uint64_t c = pointers_per_block(fs); // blocks per indirect block
+	if (file_block_id < 12) {
+		// Dirrectly get the block id
+		*index = file_block_id;
 		return 0;
+	} else if (file_block_id < 12 + c) {
+		// Get the block id from a singly-indirect block
+		*block_id = inode->blockpos[12];
+		*index = file_block_id - 12;
+	} else if (file_block_id < 12 + c + c*c) {
+		// Get the block id from a doubly-indirect block
+		uint64_t fb = file_block_id - 12 - c;
+
+		uint64_t b1 = inode->blockpos[13];
+		uint64_t off1 = fb / c;
+
+		read_pointer_from_block(fd, fs, b1, off1, block_id);
+		*index = fb % c;
+	} else {
+		// Get the block id from a triply-indirect block
+		uint64_t fb = file_block_id - 12 - c - c*c;
 
-	const uint32_t bsize = fs->main_block.block_size;
-
-	uint64_t fsize = inode->size;
-	if (pos >= fsize)
-		return 0;
-
-	if (pos + len > fsize)
-		len = fsize - pos;
-
-	// TODO: This is duplicated from inode_data_write()
-	// Read the data
-	{
-		uint64_t total_toread = len; // total number of bytes read
-		uint64_t total_readb = 0; // total number of byets to read
-		const uint16_t c = bsize / 4; // blocks per indirect block
-		uint64_t cur_pos = pos;
-		while (cur_pos < pos + len) {
-			uint32_t file_block_id = cur_pos / bsize;
-			uint32_t block_id;
-			if (file_block_id < 12) {
-				// Dirrectly get the block id
-				block_id = inode->blockpos[file_block_id];
-			} else if (file_block_id < 12 + c) {
-				// Get the block id from a singly-indirect block
-				uint32_t b = inode->blockpos[12];
-				read_u32_from_block(fd, fs, b, file_block_id - 12, &block_id);
-			} else if (file_block_id < 12 + c + c*c) {
-				// Get the block id from a doubly-indirect block
-				uint32_t fb = file_block_id - 12 - c;
-
-				uint32_t b1 = inode->blockpos[13];
-				uint32_t off1 = fb / c;
-
-				uint32_t b2;
-				uint32_t off2 = fb % c;
-
-				read_u32_from_block(fd, fs, b1, off1, &b2);
-				read_u32_from_block(fd, fs, b2, off2, &block_id);
-			} else {
-				// Get the block id from a triply-indirect block
-				uint32_t fb = file_block_id - 12 - c - c*c;
-
-				uint32_t b1 = inode->blockpos[14];
-				uint32_t off1 = fb / (c*c);
-
-				uint32_t b2;
-				uint32_t off2 = fb % (c*c) / c;
+		uint64_t b1 = inode->blockpos[14];
+		uint64_t off1 = fb / (c*c);
 
-				uint32_t b3;
-				uint32_t off3 = fb % c;
+		uint64_t b2;
+		uint64_t off2 = fb % (c*c) / c;
 
-				read_u32_from_block(fd, fs, b1, off1, &b2);
-				read_u32_from_block(fd, fs, b2, off2, &b3);
-				read_u32_from_block(fd, fs, b3, off3, &block_id);
-			}
-			uint64_t p = cur_pos % bsize;
-			uint64_t toread = total_toread;
-			uint64_t readb = 0;
-			if (toread > bsize - p)
-				toread = bsize - p;
-			cur_pos += toread;
-			total_toread -= toread;
-			while (toread > 0) {
-				lseek(fd, fs->blocks_pos + block_id * (uint64_t)bsize + p, SEEK_SET);
-				uint64_t r = read(fd, buffer + total_readb, toread);
-				toread -= r;
-				readb += r;
-				total_readb += r;
-			}
-		}
-		EXPECT_EQUAL(cur_pos, pos + len);
+		read_pointer_from_block(fd, fs, b1, off1, &b2);
+		read_pointer_from_block(fd, fs, b2, off2, block_id);
+		*index = fb % c;
 	}
-
-	return len;
+	return 1;
 }
 
-void add_inode_to_dir(int fd, struct fsinfo_t *fs, uint32_t dir_inode_num, struct inode_t *dir_inode, uint32_t entry_inode_num, struct inode_t *entry_inode, const char *entry_name)
+uint64_t get_file_block(int fd, struct fsinfo_t *fs, const struct inode_t *inode, uint64_t file_block_id)
+{
+	uint64_t b, index, block_id;
+	if (!find_block_pointer(fd, fs, inode, file_block_id, &b, &index))
+		return inode->blockpos[index];
+	read_pointer_from_block(fd, fs, b, index, &block_id);
+	return block_id;
+}
+
+static void set_file_block(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint64_t file_block_id, uint64_t block_id)
+{
+	uint64_t b, index;
+	if (find_block_pointer(fd, fs, inode, file_block_id, &b, &index))
+		write_pointer_to_block(fd, fs, b, index, block_id);
+	else
+		inode->blockpos[index] = block_id;
+}
+
+void read_file_blocks(int fd, struct fsinfo_t *fs, const struct inode_t *inode, uint64_t first, uint64_t count,
+		uint64_t *blocks)
+{
+	const uint16_t bs = fs->main_block.block_size;
+	const uint64_t c = pointers_per_block(fs); // blocks per indirect block
+	uint8_t buffer[bs];
+	for (uint64_t fb = first; fb < first + count; ++fb) {
+		if (fb < 12) {
+			blocks[fb - first] = inode->blockpos[fb];
+			continue;
+		}
+		// Every c blocks past the direct ones start a new indirect block
+		if ((fb - 12) % c == 0 || fb == first) {
+			uint64_t b, index;
+			find_block_pointer(fd, fs, inode, fb, &b, &index);
+			dev_read(fd, fs, buffer, bs, fs->blocks_pos + b * (uint64_t)bs);
+		}
+		blocks[fb - first] = decode_pointer(fs, buffer, (fb - 12) % c);
+	}
+}
+
+/* Point the blocks first to first + count - 1 of a file to `blocks`, writing each indirect block once
+ *
+ * The indirect blocks must already exist, except on sparse filesystems for
+ * the ranges that stay holes.
+ */
+static void write_file_blocks(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint64_t first, uint64_t count,
+		const uint64_t *blocks)
+{
+	const uint16_t bs = fs->main_block.block_size;
+	const uint64_t c = pointers_per_block(fs); // blocks per indirect block
+	const int sparse = fs->main_block.features & MYFS_FEATURE_SPARSE;
+	uint8_t buffer[bs];
+	uint64_t b = 0, index;
+	int dirty = 0;
+	for (uint64_t fb = first; fb < first + count; ++fb) {
+		if (fb < 12) {
+			inode->blockpos[fb] = blocks[fb - first];
+			continue;
+		}
+		if ((fb - 12) % c == 0 || fb == first) {
+			if (dirty)
+				dev_write(fd, fs, buffer, bs, fs->blocks_pos + b * (uint64_t)bs);
+			dirty = 0;
+			find_block_pointer(fd, fs, inode, fb, &b, &index);
+			if (!sparse || b != 0)
+				dev_read(fd, fs, buffer, bs, fs->blocks_pos + b * (uint64_t)bs);
+		}
+		if (sparse && b == 0) {
+			EXPECT_EQUAL(blocks[fb - first], 0);
+			continue;
+		}
+		if (decode_pointer(fs, buffer, (fb - 12) % c) != blocks[fb - first]) {
+			encode_pointer(fs, buffer, (fb - 12) % c, blocks[fb - first]);
+			dirty = 1;
+		}
+	}
+	if (dirty)
+		dev_write(fd, fs, buffer, bs, fs->blocks_pos + b * (uint64_t)bs);
+}
+
+uint32_t map_file_range(int fd, struct fsinfo_t *fs, const struct inode_t *inode, uint64_t pos, uint64_t len,
+		struct data_extent_t *extents, uint32_t max_extents)
+{
+	const uint32_t bsize = fs->main_block.block_size;
+	uint32_t count = 0;
+	uint64_t cur_pos = pos;
+	while (cur_pos < pos + len) {
+		const uint64_t block_id = get_file_block(fd, fs, inode, cur_pos / bsize);
+		const uint64_t p = cur_pos % bsize;
+		uint64_t n = bsize - p;
+		if (n > pos + len - cur_pos)
+			n = pos + len - cur_pos;
+
+		const int hole = block_id == 0 && (fs->main_block.features & MYFS_FEATURE_SPARSE);
+		const uint64_t dev_pos = hole ? 0 : fs->blocks_pos + block_id * (uint64_t)bsize + p;
+		if (count > 0 && (hole ? extents[count - 1].dev_pos == 0 :
+					extents[count - 1].dev_pos + extents[count - 1].len == dev_pos)) {
+			extents[count - 1].len += n;
+		} else {
+			if (count == max_extents)
+				break;
+			extents[count].dev_pos = dev_pos;
+			extents[count].len = n;
+			++count;
+		}
+		cur_pos += n;
+	}
+	return count;
+}
+
+/* Number of extents mapped at once by inode_data_read() and inode_data_write() */
+#define DATA_EXTENTS 16
+
+/* Directories are metadata and go through the journal, file data doesn't */
+static int is_metadata(const struct inode_t *inode)
+{
+	return (inode->mode & mode_ftype_mask) == mode_ftype_dir;
+}
+
+static uint64_t write_file_device(int fd, struct fsinfo_t *fs, const struct inode_t *inode,
+		const void *buffer, uint64_t len, uint64_t pos)
+{
+	if (!is_metadata(inode))
+		return counted_pwrite(fd, buffer, len, pos);
+	dev_write(fd, fs, buffer, len, pos);
+	return len;
+}
+
+static uint64_t read_file_device(int fd, struct fsinfo_t *fs, const struct inode_t *inode,
+		void *buffer, uint64_t len, uint64_t pos)
+{
+	return is_metadata(inode) ? dev_read(fd, fs, buffer, len, pos) : (uint64_t)counted_pread(fd, buffer, len, pos);
+}
+
+uint64_t inode_data_write(int fd, struct fsinfo_t *fs, struct inode_t *inode, const uint8_t *buffer, uint64_t len, uint64_t pos)
+{
+	if (len == 0)
+		return 0;
+
+	prepare_file_write(fd, fs, inode, pos, len);
+
+	// Write the data, one contiguous run of blocks at a time
+	uint64_t total_written = 0; // total number of byets written
+	while (total_written < len) {
+		struct data_extent_t extents[DATA_EXTENTS];
+		const uint32_t count = map_file_range(fd, fs, inode, pos + total_written, len - total_written,
+				extents, DATA_EXTENTS);
+		for (uint32_t i = 0; i < count; ++i) {
+			uint64_t written = 0;
+			while (written < extents[i].len) {
+				uint64_t w = write_file_device(fd, fs, inode, buffer + total_written, extents[i].len - written,
+						extents[i].dev_pos + written);
+				written += w;
+				total_written += w;
+			}
+		}
+	}
+	EXPECT_EQUAL(total_written, len);
+
+	// TODO: error checking
+	return len;
+}
+
+uint64_t inode_data_read(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint8_t *buffer, uint64_t len, uint64_t pos)
+{
+	if (len == 0)
+		return 0;
+
+	uint64_t fsize = inode->size;
+	if (pos >= fsize)
+		return 0;
+
+	if (pos + len > fsize)
+		len = fsize - pos;
+
+	// Read the data, one contiguous run of blocks at a time
+	uint64_t total_readb = 0; // total number of byets read
+	while (total_readb < len) {
+		struct data_extent_t extents[DATA_EXTENTS];
+		const uint32_t count = map_file_range(fd, fs, inode, pos + total_readb, len - total_readb,
+				extents, DATA_EXTENTS);
+		for (uint32_t i = 0; i < count; ++i) {
+			if (extents[i].dev_pos == 0) {
+				memset(buffer + total_readb, 0, extents[i].len);
+				total_readb += extents[i].len;
+				continue;
+			}
+			uint64_t readb = 0;
+			while (readb < extents[i].len) {
+				uint64_t r = read_file_device(fd, fs, inode, buffer + total_readb, extents[i].len - readb,
+						extents[i].dev_pos + readb);
+				readb += r;
+				total_readb += r;
+			}
+		}
+	}
+	EXPECT_EQUAL(total_readb, len);
+
+	return len;
+}
+
+/* Size of the pieces copied at once by inode_data_copy() */
+#define COPY_CHUNK (1024 * 1024)
+
+/* Copy len bytes within the device, which must not overlap */
+static void copy_device_range(int fd, uint64_t src_pos, uint64_t dest_pos, uint64_t len)
+{
+	// Let the kernel copy (or share) the data if the device is a file
+	while (len > 0) {
+		loff_t in = src_pos, out = dest_pos;
+		ssize_t r = copy_file_range(fd, &in, fd, &out, len, 0);
+		if (r <= 0)
+			break;
+		src_pos += r;
+		dest_pos += r;
+		len -= r;
+	}
+
+	// Block devices and older kernels don't support it
+	if (len > 0) {
+		uint8_t *buffer = (uint8_t *)malloc(MIN(len, COPY_CHUNK));
+		while (len > 0) {
+			ssize_t r = counted_pread(fd, buffer, MIN(len, COPY_CHUNK), src_pos);
+			if (r <= 0)
+				break;
+			uint64_t written = 0;
+			while (written < (uint64_t)r)
+				written += counted_pwrite(fd, buffer + written, r - written, dest_pos + written);
+			src_pos += r;
+			dest_pos += r;
+			len -= r;
+		}
+		free(buffer);
+	}
+}
+
+uint64_t inode_data_copy(int fd, struct fsinfo_t *fs, struct inode_t *src, uint64_t src_pos,
+		struct inode_t *dest, uint64_t dest_pos, uint64_t len)
+{
+	if (src_pos >= src->size)
+		return 0;
+	if (src_pos + len > src->size)
+		len = src->size - src_pos;
+	if (len == 0)
+		return 0;
+
+	// Allocate all the new blocks at once
+	prepare_file_write(fd, fs, dest, dest_pos, len);
+
+	const uint32_t max_extents = COPY_CHUNK / fs->main_block.block_size + 2;
+	struct data_extent_t *src_extents = (struct data_extent_t *)malloc(max_extents * sizeof(struct data_extent_t));
+	struct data_extent_t *dest_extents = (struct data_extent_t *)malloc(max_extents * sizeof(struct data_extent_t));
+
+	uint64_t copied = 0;
+	while (copied < len) {
+		const uint64_t n = MIN(len - copied, COPY_CHUNK);
+		const uint32_t src_count = map_file_range(fd, fs, src, src_pos + copied, n, src_extents, max_extents);
+		const uint32_t dest_count = map_file_range(fd, fs, dest, dest_pos + copied, n, dest_extents, max_extents);
+
+		// Copy the pieces where a source and a destination extent overlap
+		uint32_t si = 0, di = 0;
+		uint64_t soff = 0, doff = 0;
+		while (si < src_count && di < dest_count) {
+			const uint64_t m = MIN(src_extents[si].len - soff, dest_extents[di].len - doff);
+			if (src_extents[si].dev_pos == 0)
+				zero_device_range(fd, dest_extents[di].dev_pos + doff, m);
+			else
+				copy_device_range(fd, src_extents[si].dev_pos + soff, dest_extents[di].dev_pos + doff, m);
+			soff += m;
+			doff += m;
+			if (soff == src_extents[si].len) {
+				++si;
+				soff = 0;
+			}
+			if (doff == dest_extents[di].len) {
+				++di;
+				doff = 0;
+			}
+		}
+		copied += n;
+	}
+
+	free(src_extents);
+	free(dest_extents);
+	return len;
+}
+
+void add_inode_to_dir(int fd, struct fsinfo_t *fs, uint32_t dir_inode_num, struct inode_t *dir_inode, uint32_t entry_inode_num, struct inode_t *entry_inode, const char *entry_name)
 {
 	uint32_t entries_count = 0;
 	uint16_t starting_pos = 0;
@@ -538,10 +1396,11 @@ void add_inode_to_dir(int fd, struct fsinfo_t *fs, uint32_t dir_inode_num, struc
 	}
 
 	uint16_t name_len = strlen(entry_name);
-	uint16_t padding = 32;
+	uint16_t padding = DIR_ENTRY_PADDING;
 	uint16_t entry_len = name_len + padding + 10;
 
-	uint8_t buffer[MAX_FILE_NAME_LENGTH + 10];
+	uint8_t buffer[MAX_FILE_NAME_LENGTH + DIR_ENTRY_PADDING + 10];
+	memset(buffer + 0x8 + name_len, 0, padding);
 	util_write_u32(buffer + 0x0, entry_inode_num);
 	util_write_u16(buffer + 0x4, entry_len);
 	util_write_u16(buffer + entry_len - 0x2, entry_len);
@@ -564,9 +1423,98 @@ void add_inode_to_dir(int fd, struct fsinfo_t *fs, uint32_t dir_inode_num, struc
 
 	++entry_inode->nlinks;
 	write_inode(fd, fs, entry_inode_num, entry_inode);
+
+	if (fs->dcache)
+		dentry_cache_insert(fs->dcache, dir_inode_num, entry_name, name_len, entry_inode_num);
+	if (fs->dfilters)
+		dir_filter_add(fs->dfilters, dir_inode_num, entry_name, name_len);
 }
 
-int remove_inode_from_dir(int fd, struct fsinfo_t *fs, struct inode_t *dir_inode, uint32_t entry_inode_num, struct inode_t *entry_inode)
+static int dir_live_size_cb(void *data, uint32_t inode_num, const char *name, uint16_t name_len,
+		uint64_t pos, uint64_t next_pos)
+{
+	*(uint64_t *)data += name_len + 10;
+	return 0;
+}
+
+uint64_t dir_slack(int fd, struct fsinfo_t *fs, struct inode_t *dir_inode)
+{
+	if (dir_inode->size == 0)
+		return 0;
+
+	uint64_t live_size = 0x6;
+	read_dir(fd, fs, dir_inode, 0, dir_live_size_cb, &live_size);
+	EXPECT(live_size <= dir_inode->size);
+	return dir_inode->size - live_size;
+}
+
+struct compact_dir_data
+{
+	uint8_t *buffer;
+	uint64_t size;
+	uint32_t entries_count;
+	uint64_t skip_pos;
+};
+
+static int compact_dir_cb(void *data, uint32_t inode_num, const char *name, uint16_t name_len,
+		uint64_t pos, uint64_t next_pos)
+{
+	struct compact_dir_data *d = (struct compact_dir_data *)data;
+	if (pos == d->skip_pos)
+		return 0;
+
+	const uint16_t entry_len = name_len + 10;
+
+	uint8_t *entry = d->buffer + d->size;
+	util_write_u32(entry + 0x0, inode_num);
+	util_write_u16(entry + 0x4, entry_len);
+	util_write_u16(entry + 0x6, name_len);
+	memcpy(entry + 0x8, name, name_len);
+	util_write_u16(entry + entry_len - 0x2, entry_len);
+
+	d->size += entry_len;
+	++d->entries_count;
+	return 0;
+}
+
+/* Write the entries of a directory contiguously, leaving out the one at `skip_pos` */
+static void rewrite_dir(int fd, struct fsinfo_t *fs, uint32_t dir_inode_num, struct inode_t *dir_inode, uint64_t skip_pos)
+{
+	const uint64_t old_size = dir_inode->size;
+	// The dense directory is never larger than the current one
+	struct compact_dir_data d;
+	d.buffer = (uint8_t *)malloc(old_size);
+	d.size = 0x6;
+	d.entries_count = 0;
+	d.skip_pos = skip_pos;
+	read_dir(fd, fs, dir_inode, 0, compact_dir_cb, &d);
+	EXPECT(d.size <= old_size);
+
+	if (d.entries_count == 0) {
+		resize_file(fd, fs, dir_inode, 0);
+	} else {
+		util_write_u32(d.buffer, d.entries_count);
+		util_write_u16(d.buffer + 0x4, 0);
+		inode_data_write(fd, fs, dir_inode, d.buffer, d.size, 0);
+		resize_file(fd, fs, dir_inode, d.size);
+	}
+	write_inode(fd, fs, dir_inode_num, dir_inode);
+
+	free(d.buffer);
+}
+
+uint64_t compact_dir(int fd, struct fsinfo_t *fs, uint32_t dir_inode_num, struct inode_t *dir_inode)
+{
+	const uint64_t old_size = dir_inode->size;
+	if (old_size == 0)
+		return 0;
+
+	// There never is an entry at position 0, so nothing is left out
+	rewrite_dir(fd, fs, dir_inode_num, dir_inode, 0);
+	return old_size - dir_inode->size;
+}
+
+int remove_dir_entry(int fd, struct fsinfo_t *fs, uint32_t dir_inode_num, struct inode_t *dir_inode, uint32_t entry_inode_num, struct inode_t *entry_inode)
 {
 	uint32_t entries_count = 0;
 	uint16_t starting_pos = 0;
@@ -608,6 +1556,16 @@ int remove_inode_from_dir(int fd, struct fsinfo_t *fs, struct inode_t *dir_inode
 	if (!entry_found)
 		return 0;
 
+	// Remember the name of the entry, so that it can be invalidated in the dentry cache
+	// and removed from the directory's filter
+	char entry_name[MAX_FILE_NAME_LENGTH];
+	uint16_t entry_name_len = 0;
+	if (fs->dcache || fs->dfilters) {
+		inode_data_read(fd, fs, dir_inode, buffer, MIN(cur_entry_len, buffer_len), pos);
+		util_read_u16(buffer + 0x6, &entry_name_len);
+		memcpy(entry_name, buffer + 0x8, entry_name_len);
+	}
+
 	if (entries_count == 1) {
 		// If no more entries are left just empty the directory
 		resize_file(fd, fs, dir_inode, 0);
@@ -616,78 +1574,33 @@ int remove_inode_from_dir(int fd, struct fsinfo_t *fs, struct inode_t *dir_inode
 		// If we have to remove the last entry, just resize the directory
 		resize_file(fd, fs, dir_inode, pos);
 
-	} else {
-		uint16_t last_entry_len;
-		inode_data_read(fd, fs, dir_inode, buffer, 2, dir_inode->size - 2);
-		util_read_u16(buffer, &last_entry_len);
-
-		if (entry_index == 0) {
-			if (starting_pos + cur_entry_len >= last_entry_len) {
-				// Move the last entry to the begining
-
-				inode_data_read(fd, fs, dir_inode, buffer, last_entry_len,
-						dir_inode->size - last_entry_len);
-
-				// Extend the entry to fill the space to the next entry
-				uint16_t new_entry_len = starting_pos + cur_entry_len;
-				util_write_u16(buffer + 0x4, new_entry_len);
-				util_write_u16(buffer + last_entry_len - 0x2, new_entry_len);
-
-				inode_data_write(fd, fs, dir_inode, buffer, new_entry_len, 0x6);
-
-				// Resize the directory
-				resize_file(fd, fs, dir_inode, dir_inode->size - last_entry_len);
-
-				starting_pos = 0;
-
-			} else {
-				starting_pos += cur_entry_len;
-			}
-
+	} else if (entry_index == 0) {
+		// Entries are not moved around, so that the positions handed out by
+		// read_dir() stay valid, unless `starting_pos` would overflow
+		if (starting_pos + cur_entry_len > 0xFFFF) {
+			rewrite_dir(fd, fs, dir_inode_num, dir_inode, pos);
+		} else {
 			// Update `starting_pos`
-			util_write_u16(buffer, starting_pos);
+			util_write_u16(buffer, starting_pos + cur_entry_len);
 			inode_data_write(fd, fs, dir_inode, buffer, 2, 0x4);
+		}
 
-		} else {
-			// Get the size of the previous entry
-			uint16_t prev_entry_len;
-			inode_data_read(fd, fs, dir_inode, buffer, 2, pos - 0x2);
-			util_read_u16(buffer, &prev_entry_len);
-
-			uint64_t prev_entry_pos = pos - prev_entry_len;
-			uint16_t prev_entry_name_len;
-			inode_data_read(fd, fs, dir_inode, buffer, 2, prev_entry_pos + 0x6);
-			util_read_u16(buffer, &prev_entry_name_len);
-
-			uint16_t prev_padding = prev_entry_len - prev_entry_name_len - 0x8;
-
-			if (prev_padding + cur_entry_len >= last_entry_len + 32) { // TODO: do we need that 32?
-				uint32_t in;
-				uint8_t bu[4];
-				inode_data_read(fd, fs, dir_inode, buffer, 4, dir_inode->size - last_entry_len);
-				util_read_u32(bu, &in);
-				// Move the last entry
-				inode_data_read(fd, fs, dir_inode, buffer, last_entry_len,
-						dir_inode->size - last_entry_len);
-				inode_data_write(fd, fs, dir_inode, buffer, last_entry_len,
-						pos + cur_entry_len - last_entry_len);
-
-				// Resize the directory
-				resize_file(fd, fs, dir_inode, dir_inode->size - last_entry_len);
-
-				// Extend the previous entry
-				uint16_t new_len = prev_entry_len + cur_entry_len - last_entry_len;
-				util_write_u16(buffer, new_len);
-				inode_data_write(fd, fs, dir_inode, buffer, 2, prev_entry_pos + 0x4);
-				inode_data_write(fd, fs, dir_inode, buffer, 2, prev_entry_pos + new_len - 0x2);
+	} else {
+		// Get the size of the previous entry
+		uint16_t prev_entry_len;
+		inode_data_read(fd, fs, dir_inode, buffer, 2, pos - 0x2);
+		util_read_u16(buffer, &prev_entry_len);
 
-			} else {
-				// Extend the previous entry
-				uint16_t new_len = prev_entry_len + cur_entry_len;
-				util_write_u16(buffer, new_len);
-				inode_data_write(fd, fs, dir_inode, buffer, 2, prev_entry_pos + 0x4);
-				inode_data_write(fd, fs, dir_inode, buffer, 2, prev_entry_pos + new_len - 0x2);
-			}
+		uint64_t prev_entry_pos = pos - prev_entry_len;
+
+		if (prev_entry_len + cur_entry_len > 0xFFFF) {
+			rewrite_dir(fd, fs, dir_inode_num, dir_inode, pos);
+		} else {
+			// Extend the previous entry
+			uint16_t new_len = prev_entry_len + cur_entry_len;
+			util_write_u16(buffer, new_len);
+			inode_data_write(fd, fs, dir_inode, buffer, 2, prev_entry_pos + 0x4);
+			inode_data_write(fd, fs, dir_inode, buffer, 2, prev_entry_pos + new_len - 0x2);
 		}
 	}
 
@@ -697,12 +1610,23 @@ int remove_inode_from_dir(int fd, struct fsinfo_t *fs, struct inode_t *dir_inode
 		inode_data_write(fd, fs, dir_inode, buffer, 4, 0);
 	}
 
+	if (fs->dcache)
+		dentry_cache_insert(fs->dcache, dir_inode_num, entry_name, entry_name_len, DENTRY_NEGATIVE);
+	if (fs->dfilters)
+		dir_filter_remove(fs->dfilters, dir_inode_num, entry_name, entry_name_len);
+
+	--entry_inode->nlinks;
+	write_inode(fd, fs, entry_inode_num, entry_inode);
+	return 1;
+}
+
+int remove_inode_from_dir(int fd, struct fsinfo_t *fs, uint32_t dir_inode_num, struct inode_t *dir_inode, uint32_t entry_inode_num, struct inode_t *entry_inode)
+{
+	if (!remove_dir_entry(fd, fs, dir_inode_num, dir_inode, entry_inode_num, entry_inode))
+		return 0;
 	// Remove the file if no more hard links remain
-	if (--entry_inode->nlinks == 0)
+	if (entry_inode->nlinks == 0)
 		remove_file(fd, fs, entry_inode_num, entry_inode);
-	else
-		write_inode(fd, fs, entry_inode_num, entry_inode);
-
 	return 1;
 }
 
@@ -714,6 +1638,180 @@ void write_root_directory(int fd, struct fsinfo_t *fs)
 	write_inode(fd, fs, 0, &root_inode);
 }
 
+uint64_t read_dir(int fd, struct fsinfo_t *fs, struct inode_t *dir_inode, uint64_t pos, dir_entry_cb_t cb, void *data)
+{
+	const uint64_t size = dir_inode->size;
+	if (size == 0)
+		return 0;
+
+	uint8_t buffer[fs->main_block.block_size];
+	uint64_t buffer_pos = 0; // position of `buffer` in the directory
+	uint64_t s = inode_data_read(fd, fs, dir_inode, buffer, sizeof(buffer), 0);
+
+	uint16_t starting_pos;
+	util_read_u16(buffer + 0x4, &starting_pos);
+	const uint64_t first_pos = starting_pos + 0x6;
+
+	// Entries before `skip_until` are not reported. Removed entries leave their
+	// bytes behind inside the previous entry, so the header found at `pos` can't
+	// be trusted: walk the entries from the start to find the first one at or
+	// after `pos`.
+	uint64_t skip_until = 0;
+	if (pos > first_pos)
+		skip_until = pos;
+	pos = first_pos;
+
+	while (pos < size) {
+		uint32_t entry_inode_num;
+		uint16_t entry_len;
+		uint16_t name_len;
+
+		// Load next page if the entry header isn't in the buffer
+		if (pos < buffer_pos || pos + 8 > buffer_pos + s) {
+			buffer_pos = pos;
+			s = inode_data_read(fd, fs, dir_inode, buffer, sizeof(buffer), buffer_pos);
+		}
+		EXPECT(pos + 8 <= buffer_pos + s); // TODO: Error handling
+		if (pos + 8 > buffer_pos + s)
+			break;
+
+		// Read entry header
+		const uint8_t *entry = buffer + (pos - buffer_pos);
+		util_read_u32(entry, &entry_inode_num);
+		util_read_u16(entry + 0x4, &entry_len);
+		util_read_u16(entry + 0x6, &name_len);
+		EXPECT(name_len <= MAX_FILE_NAME_LENGTH && entry_len >= name_len + 10); // TODO: error handling
+		if (name_len > MAX_FILE_NAME_LENGTH || entry_len < name_len + 10)
+			break;
+
+		// Load next page if the name isn't in the buffer
+		if (pos + 8 + name_len > buffer_pos + s) {
+			buffer_pos = pos;
+			s = inode_data_read(fd, fs, dir_inode, buffer, sizeof(buffer), buffer_pos);
+			entry = buffer;
+		}
+		EXPECT(pos + 8 + name_len <= buffer_pos + s);
+
+		if (pos >= skip_until &&
+				cb(data, entry_inode_num, (const char *)(entry + 0x8), name_len, pos, pos + entry_len))
+			return pos;
+		pos += entry_len;
+	}
+
+	return size;
+}
+
+struct find_dir_entry_data
+{
+	const char *name;
+	uint16_t name_len;
+	uint32_t inode_num;
+	uint64_t offset;
+	int found;
+	struct dir_filter_t *filter; /* Filter being built, all names are added to it */
+};
+
+static int find_dir_entry_cb(void *data, uint32_t inode_num, const char *name, uint16_t name_len,
+		uint64_t pos, uint64_t next_pos)
+{
+	struct find_dir_entry_data *d = (struct find_dir_entry_data *)data;
+	if (d->filter)
+		dir_filter_add_name(d->filter, name, name_len);
+
+	if (name_len != d->name_len || memcmp(name, d->name, name_len) != 0)
+		return 0;
+
+	d->inode_num = inode_num;
+	d->offset = pos;
+	d->found = 1;
+	// Keep going if the whole directory has to be added to the filter
+	return d->filter == NULL;
+}
+
+/* Search the directory dir_inode for an entry named `name`
+ *
+ * If the directory has a filter, names it rules out are not searched for.
+ * Otherwise the filter is built, which takes a scan of the whole directory.
+ *
+ * offset, if not NULL, receives the position of the entry in the directory
+ * returns: 1 if found; 0 otherwise
+ */
+static int find_dir_entry(int fd, struct fsinfo_t *fs, uint32_t dir_inode_num, struct inode_t *dir_inode,
+		const char *name, uint16_t name_len, uint32_t *inode_num, uint64_t *offset)
+{
+	struct find_dir_entry_data d = {
+		.name = name,
+		.name_len = name_len,
+		.found = 0,
+		.filter = NULL,
+	};
+
+	int filtered = 0;
+	if (fs->dfilters && dir_inode->size > 0) {
+		const int r = dir_filter_check(fs->dfilters, dir_inode_num, name, name_len);
+		if (r == 0)
+			return 0;
+		filtered = (r == 1);
+		if (r < 0) {
+			uint8_t buf[4];
+			uint32_t entries_count;
+			inode_data_read(fd, fs, dir_inode, buf, 4, 0);
+			util_read_u32(buf, &entries_count);
+			d.filter = dir_filter_new(dir_inode_num, entries_count);
+		}
+	}
+
+	read_dir(fd, fs, dir_inode, 0, find_dir_entry_cb, &d);
+	if (d.filter)
+		dir_filter_publish(fs->dfilters, d.filter);
+	if (!d.found) {
+		if (filtered)
+			dir_filter_count_false_positive(fs->dfilters);
+		return 0;
+	}
+
+	*inode_num = d.inode_num;
+	if (offset)
+		*offset = d.offset;
+	return 1;
+}
+
+int lookup_dir_entry(int fd, struct fsinfo_t *fs, uint32_t dir_inode_num, struct inode_t *dir_inode,
+		const char *name, uint16_t name_len, uint32_t *inode_num)
+{
+	if (fs->dcache && dentry_cache_get(fs->dcache, dir_inode_num, name, name_len, inode_num))
+		return *inode_num != DENTRY_NEGATIVE;
+
+	int found = find_dir_entry(fd, fs, dir_inode_num, dir_inode, name, name_len, inode_num, NULL);
+	if (fs->dcache)
+		dentry_cache_insert(fs->dcache, dir_inode_num, name, name_len, found ? *inode_num : DENTRY_NEGATIVE);
+	return found;
+}
+
+int exchange_dir_entries(int fd, struct fsinfo_t *fs,
+		uint32_t dir1_inode_num, struct inode_t *dir1_inode, const char *name1, uint16_t name1_len,
+		uint32_t dir2_inode_num, struct inode_t *dir2_inode, const char *name2, uint16_t name2_len)
+{
+	uint32_t inode1_num, inode2_num;
+	uint64_t offset1, offset2;
+	if (!find_dir_entry(fd, fs, dir1_inode_num, dir1_inode, name1, name1_len, &inode1_num, &offset1) ||
+			!find_dir_entry(fd, fs, dir2_inode_num, dir2_inode, name2, name2_len, &inode2_num, &offset2))
+		return 0;
+
+	uint8_t buf[4];
+	util_write_u32(buf, inode2_num);
+	inode_data_write(fd, fs, dir1_inode, buf, 4, offset1);
+	util_write_u32(buf, inode1_num);
+	inode_data_write(fd, fs, dir2_inode, buf, 4, offset2);
+
+	if (fs->dcache) {
+		dentry_cache_insert(fs->dcache, dir1_inode_num, name1, name1_len, inode2_num);
+		dentry_cache_insert(fs->dcache, dir2_inode_num, name2, name2_len, inode1_num);
+	}
+
+	return 1;
+}
+
 int get_path_inode(int fd, struct fsinfo_t *fs, const char *path, uint32_t *inode_num, struct inode_t *inode, uint32_t *dir_inode_num, struct inode_t *dir_inode, uint64_t *offset)
 {
 	if (path[0] != '/')
@@ -725,11 +1823,13 @@ int get_path_inode(int fd, struct fsinfo_t *fs, const char *path, uint32_t *inod
 		return 1;
 	}
 
+	// Directory inodes are only read when their entries have to be searched,
+	// so a path that is fully resolved by the dentry cache costs a single inode read
 	uint32_t prev_inode_num = 0;
 	struct inode_t prev_inode;
+	int prev_inode_loaded = 0;
 	uint32_t cur_inode_num = 0;
 	struct inode_t cur_inode;
-	read_inode(fd, fs, cur_inode_num, &cur_inode);
 
 	// Parse `path`
 	int fname_begin = 1;
@@ -737,58 +1837,31 @@ int get_path_inode(int fd, struct fsinfo_t *fs, const char *path, uint32_t *inod
 		char c = path[fname_end];
 		if (c == '\0' || c == '/') {
 			// Search for a file named `path[fname_begin:fname_end]` in the current inode
-			prev_inode_num = cur_inode_num;
-			prev_inode = cur_inode;
-			uint8_t buffer[fs->main_block.block_size];
-			uint64_t s = inode_data_read(fd, fs, &cur_inode, buffer, sizeof(buffer), 0);
-			if (s == 0)
+			const char *name = path + fname_begin;
+			const int name_len = fname_end - fname_begin;
+			if (name_len > MAX_FILE_NAME_LENGTH)
 				return 0;
-			uint32_t inodes_count;
-			uint16_t starting_pos;
-			util_read_u32(buffer, &inodes_count);
-			util_read_u16(buffer + 0x4, &starting_pos);
-
-			uint64_t file_pos = 0;
-			uint64_t pos = starting_pos + 0x6;
-			int inode_found = 0;
-			for (uint32_t i = 0; i < inodes_count; ++i) {
-				uint16_t entry_len;
-				uint16_t name_len;
-				EXPECT(pos < s); // TODO: Error handling
-
-				// Load next page if we're at the end of the buffer
-				if (pos + 8 > s) {
-					file_pos += pos;
-					pos = 0;
-					s = inode_data_read(fd, fs, &cur_inode, buffer, sizeof(buffer), file_pos);
-				}
 
-				// Read entry header
-				util_read_u32(buffer + pos, &cur_inode_num);
-				util_read_u16(buffer + pos + 0x4, &entry_len);
-				util_read_u16(buffer + pos + 0x6, &name_len);
-				EXPECT(name_len <= MAX_FILE_NAME_LENGTH); // TODO: error handling
-
-				// Load next page if we're at the end of the buffer
-				if (pos + 8 + name_len > s) {
-					file_pos += pos;
-					pos = 0;
-					s = inode_data_read(fd, fs, &cur_inode, buffer, sizeof(buffer), file_pos);
-				}
-				EXPECT(pos + 8 + name_len <= s);
-
-				if (name_len == fname_end - fname_begin &&
-						strncmp((const char *)(buffer + pos + 0x8), path + fname_begin, name_len) == 0) {
-					read_inode(fd, fs, cur_inode_num, &cur_inode);
-					if (offset)
-						*offset = pos;
-					inode_found = 1;
-					break;
-				}
-				pos += entry_len;
+			prev_inode_num = cur_inode_num;
+			prev_inode_loaded = 0;
+
+			// The dentry cache doesn't know the entry offsets
+			const int want_offset = (offset && c == '\0');
+			if (want_offset || !fs->dcache ||
+					!dentry_cache_get(fs->dcache, prev_inode_num, name, name_len, &cur_inode_num)) {
+				read_inode(fd, fs, prev_inode_num, &prev_inode);
+				prev_inode_loaded = 1;
+				if ((prev_inode.mode & mode_ftype_mask) != mode_ftype_dir)
+					return 0;
+
+				if (!find_dir_entry(fd, fs, prev_inode_num, &prev_inode, name, name_len, &cur_inode_num,
+							want_offset ? offset : NULL))
+					cur_inode_num = DENTRY_NEGATIVE;
+				if (fs->dcache)
+					dentry_cache_insert(fs->dcache, prev_inode_num, name, name_len, cur_inode_num);
 			}
 
-			if (!inode_found)
+			if (cur_inode_num == DENTRY_NEGATIVE)
 				return 0;
 
 			fname_begin = fname_end + 1;
@@ -798,172 +1871,282 @@ int get_path_inode(int fd, struct fsinfo_t *fs, const char *path, uint32_t *inod
 		}
 	}
 
-	if (inode_num != 0) {
-		if (dir_inode_num)
-			*dir_inode_num = prev_inode_num;
-		if (dir_inode)
-			*dir_inode = prev_inode;
+	read_inode(fd, fs, cur_inode_num, &cur_inode);
+	if (dir_inode_num)
+		*dir_inode_num = prev_inode_num;
+	if (dir_inode) {
+		if (!prev_inode_loaded)
+			read_inode(fd, fs, prev_inode_num, &prev_inode);
+		*dir_inode = prev_inode;
 	}
 	*inode_num = cur_inode_num;
 	*inode = cur_inode;
 	return 1;
 }
 
-void resize_file(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint64_t size)
+/* Point blocks old_blocks to new_blocks of a file at data_blocks, using the
+ * newly allocated indirect_blocks for the pointers that don't fit in the inode */
+static void map_new_blocks(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint64_t old_blocks, uint64_t new_blocks,
+		const uint64_t *indirect_blocks, const uint64_t *data_blocks)
 {
-	// TODO: check max file size
-
-	const uint32_t bsize = fs->main_block.block_size;
-	const uint32_t old_blocks = inode->blocks;
-	const uint32_t new_blocks = CEIL_DIV(size, bsize);
-
 	const struct indirect_block_count_t old_indirect_bcnt =
-		calc_indirect_block_count(bsize, old_blocks);
+		calc_indirect_block_count(fs, old_blocks);
 	const struct indirect_block_count_t new_indirect_bcnt =
-		calc_indirect_block_count(bsize, new_blocks);
+		calc_indirect_block_count(fs, new_blocks);
+	const uint64_t indirect_blocks_allocated =
+		new_indirect_bcnt.total_indirect - old_indirect_bcnt.total_indirect;
+
+	const uint64_t c = pointers_per_block(fs); // blocks per indirect block
+	uint64_t ibptr = 0; // indirect block pointer
+	uint64_t dbptr = 0; // direct block pointer
+	for (uint64_t cur_block = old_blocks; cur_block < new_blocks; ++cur_block) {
+		uint64_t b = cur_block;
+		if (b < 12) {
+			// Set pointer to direct block
+			inode->blockpos[b] = data_blocks[dbptr++];
+		} else if (b < 12 + c) {
+			b -= 12;
+
+			uint64_t b1;
+			uint64_t off1 = b;
+
+			// If needed, set the pointer to the singly-indirect block
+			if (b == 0)
+				inode->blockpos[12] = indirect_blocks[ibptr++];
+			b1 = inode->blockpos[12];
+
+			// Set the pointer to the block
+			write_pointer_to_block(fd, fs, b1, off1, data_blocks[dbptr++]);
+		} else if (b < 12 + c + c*c) {
+			b -= 12 + c;
+
+			uint64_t b1;
+			uint64_t off1 = b / c;
+
+			uint64_t b2;
+			uint64_t off2 = b % c;
+
+			// If needed, set the pointer to the doubly-indirect block
+			if (b == 0)
+				inode->blockpos[13] = indirect_blocks[ibptr++];
+			b1 = inode->blockpos[13];
+
+			// If needed, set the pointer to the singly-indirect block
+			if (off2 == 0) {
+				b2 = indirect_blocks[ibptr++];
+				write_pointer_to_block(fd, fs, b1, off1, b2);
+			} else {
+				read_pointer_from_block(fd, fs, b1, off1, &b2);
+			}
+			// Set the pointer to the block
+			write_pointer_to_block(fd, fs, b2, off2, data_blocks[dbptr++]);
+		} else {
+			b -= 12 + c + c*c;
 
-	if (new_blocks > old_blocks) {
-		// Allocate the required blocks
+			uint64_t b1;
+			uint64_t off1 = b / (c*c);
 
-		// Number of blocks to alloc including indirect blocks
-		const uint32_t blocks_to_alloc =
-			new_indirect_bcnt.total_indirect - old_indirect_bcnt.total_indirect +
-			new_blocks - old_blocks;
+			uint64_t b2;
+			uint64_t off2 = (b % (c*c)) / c;
 
-		// TODO: try not to call malloc when possible
-		uint32_t *blocks = (uint32_t *)malloc(blocks_to_alloc * sizeof(uint32_t));
-		EXPECT_EQUAL(allocate_blocks(fd, fs, blocks_to_alloc, blocks), blocks_to_alloc);
-		const uint32_t indirect_blocks_allocated =
-			new_indirect_bcnt.total_indirect - old_indirect_bcnt.total_indirect;
-		const uint32_t *indirect_blocks = blocks;
-		const uint32_t *data_blocks = blocks + indirect_blocks_allocated;
+			uint64_t b3;
+			uint64_t off3 = b % c;
 
-		// Initialize the new indirect blocks
-		const uint16_t c = bsize / 4; // blocks per indirect block
-		uint32_t ibptr = 0; // indirect block pointer
-		uint32_t dbptr = 0; // direct block pointer
-		for (uint32_t cur_block = old_blocks; cur_block < new_blocks; ++cur_block) {
-			uint32_t b = cur_block;
-			if (b < 12) {
-				// Set pointer to direct block
-				inode->blockpos[b] = data_blocks[dbptr++];
-			} else if (b < 12 + c) {
-				b -= 12;
+			// If needed, set the pointer to the triply-indirect block
+			if (b == 0)
+				inode->blockpos[14] = indirect_blocks[ibptr++];
+			b1 = inode->blockpos[14];
 
-				uint32_t b1;
-				uint32_t off1 = b;
+			// If needed, set the pointer to the doubly-indirect block
+			if (b % (c*c) == 0) {
+				b2 = indirect_blocks[ibptr++];
+				write_pointer_to_block(fd, fs, b1, off1, b2);
+			} else {
+				read_pointer_from_block(fd, fs, b1, off1, &b2);
+			}
 
-				// If needed, set the pointer to the singly-indirect block
-				if (b == 0)
-					inode->blockpos[12] = indirect_blocks[ibptr++];
-				b1 = inode->blockpos[12];
+			// If needed, set the pointer to the singly-indirect block
+			if (b % c == 0) {
+				b3 = indirect_blocks[ibptr++];
+				write_pointer_to_block(fd, fs, b2, off2, b3);
+			} else {
+				read_pointer_from_block(fd, fs, b2, off2, &b3);
+			}
 
-				// Set the pointer to the block
-				write_u32_to_block(fd, fs, b1, off1, data_blocks[dbptr++]);
-			} else if (b < 12 + c + c*c) {
-				b -= 12 + c;
+			// Set the pointer to the block
+			write_pointer_to_block(fd, fs, b3, off3, data_blocks[dbptr++]);
+		}
+	}
+	EXPECT_EQUAL(ibptr, indirect_blocks_allocated);
+	EXPECT_EQUAL(dbptr, new_blocks - old_blocks);
+}
 
-				uint32_t b1;
-				uint32_t off1 = b / c;
+static void unshare_file_range(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint64_t pos, uint64_t len);
 
-				uint32_t b2;
-				uint32_t off2 = b % c;
+/* Zero the pointers of blocks `first` and up that are in indirect blocks the file keeps
+ *
+ * On sparse filesystems these must be holes when the file grows again.
+ */
+static void clear_block_pointers(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint64_t first)
+{
+	const uint16_t bs = fs->main_block.block_size;
+	const uint64_t c = pointers_per_block(fs); // blocks per indirect block
+	uint8_t zeros[bs];
+	memset(zeros, 0, bs);
+	// Zero the entries from index to the end of an indirect block
+	#define CLEAR_TAIL(block, index) \
+		{ if ((block) != 0 && (index) < c) \
+			dev_write(fd, fs, zeros, (c - (index)) * fs->pointer_size, \
+				fs->blocks_pos + (block) * bs + (index) * fs->pointer_size); }
+
+	for (uint64_t b = first; b < 12; ++b)
+		inode->blockpos[b] = 0;
+
+	if (first <= 12) {
+		inode->blockpos[12] = 0;
+	} else if (first < 12 + c) {
+		CLEAR_TAIL(inode->blockpos[12], first - 12);
+	}
 
-				// If needed, set the pointer to the doubly-indirect block
-				if (b == 0)
-					inode->blockpos[13] = indirect_blocks[ibptr++];
-				b1 = inode->blockpos[13];
-
-				// If needed, set the pointer to the singly-indirect block
-				if (off2 == 0) {
-					b2 = indirect_blocks[ibptr++];
-					write_u32_to_block(fd, fs, b1, off1, b2);
-				} else {
-					read_u32_from_block(fd, fs, b1, off1, &b2);
-				}
-				// Set the pointer to the block
-				write_u32_to_block(fd, fs, b2, off2, data_blocks[dbptr++]);
-			} else {
-				b -= 12 + c + c*c;
+	if (first <= 12 + c) {
+		inode->blockpos[13] = 0;
+	} else if (first < 12 + c + c*c) {
+		const uint64_t fb = first - 12 - c;
+		const uint64_t b1 = inode->blockpos[13];
+		uint64_t b2;
+		read_pointer_from_block(fd, fs, b1, fb / c, &b2);
+		if (fb % c > 0)
+			CLEAR_TAIL(b2, fb % c);
+		CLEAR_TAIL(b1, fb / c + (fb % c > 0));
+	}
 
-				uint32_t b1;
-				uint32_t off1 = b / (c*c);
+	if (first <= 12 + c + c*c) {
+		inode->blockpos[14] = 0;
+	} else {
+		const uint64_t fb = first - 12 - c - c*c;
+		const uint64_t b1 = inode->blockpos[14];
+		const uint64_t off1 = fb / (c*c), off2 = fb % (c*c) / c, off3 = fb % c;
+		uint64_t b2, b3;
+		read_pointer_from_block(fd, fs, b1, off1, &b2);
+		read_pointer_from_block(fd, fs, b2, off2, &b3);
+		if (off3 > 0)
+			CLEAR_TAIL(b3, off3);
+		if (fb % (c*c) > 0)
+			CLEAR_TAIL(b2, off2 + (off3 > 0));
+		CLEAR_TAIL(b1, off1 + (fb % (c*c) > 0));
+	}
+	#undef CLEAR_TAIL
+}
 
-				uint32_t b2;
-				uint32_t off2 = (b % (c*c)) / c;
+/* Zero the bytes of the last block past `size`, so that they read as zeros if the file grows again */
+static void zero_file_tail(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint64_t size)
+{
+	const uint32_t bsize = fs->main_block.block_size;
+	const uint64_t fb = size / bsize;
+	if (size % bsize == 0 || fb >= file_block_count(fs, inode))
+		return;
 
-				uint32_t b3;
-				uint32_t off3 = b % c;
+	unshare_file_range(fd, fs, inode, size, 1);
+	const uint64_t block_id = get_file_block(fd, fs, inode, fb);
+	if (block_id == 0)
+		return;
+	uint8_t zeros[bsize];
+	memset(zeros, 0, bsize);
+	write_file_device(fd, fs, inode, zeros, bsize - size % bsize,
+			fs->blocks_pos + block_id * (uint64_t)bsize + size % bsize);
+}
 
-				// If needed, set the pointer to the triply-indirect block
-				if (b == 0)
-					inode->blockpos[14] = indirect_blocks[ibptr++];
-				b1 = inode->blockpos[14];
-
-				// If needed, set the pointer to the doubly-indirect block
-				if (b % (c*c) == 0) {
-					b2 = indirect_blocks[ibptr++];
-					write_u32_to_block(fd, fs, b1, off1, b2);
-				} else {
-					read_u32_from_block(fd, fs, b1, off1, &b2);
-				}
+/* Remove the holes from a list of blocks
+ *
+ * returns: the number of blocks left
+ */
+static uint64_t drop_holes(uint64_t *blocks, uint64_t block_count)
+{
+	uint64_t n = 0;
+	for (uint64_t i = 0; i < block_count; ++i)
+		if (blocks[i] != 0)
+			blocks[n++] = blocks[i];
+	return n;
+}
 
-				// If needed, set the pointer to the singly-indirect block
-				if (b % c == 0) {
-					b3 = indirect_blocks[ibptr++];
-					write_u32_to_block(fd, fs, b2, off2, b3);
-				} else {
-					read_u32_from_block(fd, fs, b2, off2, &b3);
-				}
+void resize_file(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint64_t size)
+{
+	// TODO: check max file size
 
-				// Set the pointer to the block
-				write_u32_to_block(fd, fs, b3, off3, data_blocks[dbptr++]);
-			}
-		}
-		EXPECT_EQUAL(ibptr, indirect_blocks_allocated);
-		EXPECT_EQUAL(dbptr, new_blocks - old_blocks);
+	const uint32_t bsize = fs->main_block.block_size;
+	const uint64_t old_blocks = file_block_count(fs, inode);
+	const uint64_t new_blocks = CEIL_DIV(size, bsize);
+
+	const struct indirect_block_count_t old_indirect_bcnt =
+		calc_indirect_block_count(fs, old_blocks);
+	const struct indirect_block_count_t new_indirect_bcnt =
+		calc_indirect_block_count(fs, new_blocks);
+
+	const int sparse = fs->main_block.features & MYFS_FEATURE_SPARSE;
+	if (sparse && size < inode->size)
+		zero_file_tail(fd, fs, inode, size);
+
+	if (new_blocks > old_blocks && sparse) {
+		// The new blocks are holes until they are written
+	} else if (new_blocks > old_blocks) {
+		// Allocate the required blocks
+
+		// Number of blocks to alloc including indirect blocks
+		const uint64_t blocks_to_alloc =
+			new_indirect_bcnt.total_indirect - old_indirect_bcnt.total_indirect +
+			new_blocks - old_blocks;
+
+		// TODO: try not to call malloc when possible
+		uint64_t *blocks = (uint64_t *)malloc(blocks_to_alloc * sizeof(uint64_t));
+		EXPECT_EQUAL(allocate_blocks(fd, fs, blocks_to_alloc, blocks), blocks_to_alloc);
+		const uint64_t indirect_blocks_allocated =
+			new_indirect_bcnt.total_indirect - old_indirect_bcnt.total_indirect;
+		const uint64_t *indirect_blocks = blocks;
+		const uint64_t *data_blocks = blocks + indirect_blocks_allocated;
+
+		map_new_blocks(fd, fs, inode, old_blocks, new_blocks, indirect_blocks, data_blocks);
 
 		free(blocks);
 
 	} else if (new_blocks < old_blocks) {
 		// Number of blocks to release including indirect blocks
-		const uint32_t blocks_to_release =
+		const uint64_t blocks_to_release =
 			old_indirect_bcnt.total_indirect - new_indirect_bcnt.total_indirect +
 			old_blocks - new_blocks;
 
 		// TODO: try not to call malloc when possible
-		uint32_t *blocks = (uint32_t *)malloc(blocks_to_release * sizeof(uint32_t));
-		uint32_t bptr = 0;
+		uint64_t *blocks = (uint64_t *)malloc(blocks_to_release * sizeof(uint64_t));
+		uint64_t bptr = 0;
 
 
 		// Initialize the new indirect blocks
-		const uint16_t c = bsize / 4; // blocks per indirect block
-		for (uint32_t cur_block = old_blocks; cur_block-- > new_blocks; ) {
-			uint32_t b = cur_block;
+		const uint64_t c = pointers_per_block(fs); // blocks per indirect block
+		for (uint64_t cur_block = old_blocks; cur_block-- > new_blocks; ) {
+			uint64_t b = cur_block;
 			if (b < 12) {
 				// Release direct block
 				blocks[bptr++] = inode->blockpos[b];
 			} else if (b < 12 + c) {
 				b -= 12;
 
-				uint32_t b1 = inode->blockpos[12];
-				uint32_t off1 = b;
+				uint64_t b1 = inode->blockpos[12];
+				uint64_t off1 = b;
 
 				// If needed, release the singly-indirect block
 				if (b == 0)
 					blocks[bptr++] = b1;
 
 				// Release the direct block
-				read_u32_from_block(fd, fs, b1, off1, &blocks[bptr++]);
+				read_pointer_from_block(fd, fs, b1, off1, &blocks[bptr++]);
 			} else if (b < 12 + c + c*c) {
 				b -= 12 + c;
 
-				uint32_t b1 = inode->blockpos[13];
-				uint32_t off1 = b / c;
+				uint64_t b1 = inode->blockpos[13];
+				uint64_t off1 = b / c;
 
-				uint32_t b2;
-				uint32_t off2 = b % c;
-				read_u32_from_block(fd, fs, b1, off1, &b2);
+				uint64_t b2;
+				uint64_t off2 = b % c;
+				read_pointer_from_block(fd, fs, b1, off1, &b2);
 
 				// If needed, release the doubly-indirect block
 				if (b == 0)
@@ -974,20 +2157,20 @@ void resize_file(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint64_t si
 					blocks[bptr++] = b2;
 
 				// Release the direct block
-				read_u32_from_block(fd, fs, b2, off2, &blocks[bptr++]);
+				read_pointer_from_block(fd, fs, b2, off2, &blocks[bptr++]);
 			} else {
 				b -= 12 + c + c*c;
 
-				uint32_t b1 = inode->blockpos[14];
-				uint32_t off1 = b / (c*c);
+				uint64_t b1 = inode->blockpos[14];
+				uint64_t off1 = b / (c*c);
 
-				uint32_t b2;
-				uint32_t off2 = (b % (c*c)) / c;
-				read_u32_from_block(fd, fs, b1, off1, &b2);
+				uint64_t b2;
+				uint64_t off2 = (b % (c*c)) / c;
+				read_pointer_from_block(fd, fs, b1, off1, &b2);
 
-				uint32_t b3;
-				uint32_t off3 = b % c;
-				read_u32_from_block(fd, fs, b2, off2, &b3);
+				uint64_t b3;
+				uint64_t off3 = b % c;
+				read_pointer_from_block(fd, fs, b2, off2, &b3);
 
 				// If needed, release the triply-indirect block
 				if (b == 0)
@@ -1002,18 +2185,262 @@ void resize_file(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint64_t si
 					blocks[bptr++] = b3;
 
 				// Release the direct block
-				read_u32_from_block(fd, fs, b3, off3, &blocks[bptr++]);
+				read_pointer_from_block(fd, fs, b3, off3, &blocks[bptr++]);
 			}
 		}
 		EXPECT_EQUAL(bptr, blocks_to_release);
 
-		release_blocks(fd, fs, blocks, bptr);
+		if (sparse) {
+			bptr = drop_holes(blocks, bptr);
+			clear_block_pointers(fd, fs, inode, new_blocks);
+			inode->blocks -= MIN(inode->blocks, bptr);
+		}
+		release_blocks(fd, fs, blocks, bptr, inode->mode & mode_shared);
 
 		free(blocks);
 	}
 
 	inode->size = size;
-	inode->blocks = new_blocks;
+	if (!sparse)
+		inode->blocks = new_blocks;
+}
+
+/* Give any data block in the range that is shared with a clone its own copy */
+static void unshare_file_range(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint64_t pos, uint64_t len)
+{
+	if (!(inode->mode & mode_shared) || !fs->refcounts_pos || len == 0)
+		return;
+
+	const uint32_t bsize = fs->main_block.block_size;
+	const uint64_t first = pos / bsize;
+	const uint64_t last = MIN((pos + len - 1) / bsize + 1, file_block_count(fs, inode));
+	for (uint64_t fb = first; fb < last; ++fb) {
+		const uint64_t block_id = get_file_block(fd, fs, inode, fb);
+		if (block_id == 0 && (fs->main_block.features & MYFS_FEATURE_SPARSE))
+			continue;
+		uint8_t buf[2];
+		uint16_t refs;
+		pthread_mutex_lock(&fs->alloc_lock);
+		dev_read(fd, fs, buf, 2, fs->refcounts_pos + block_id * (uint64_t)2);
+		pthread_mutex_unlock(&fs->alloc_lock);
+		util_read_u16(buf, &refs);
+		if (refs == 0)
+			continue;
+
+		// Our reference keeps the block from being freed until it is copied
+		uint64_t new_block;
+		EXPECT_EQUAL(allocate_blocks(fd, fs, 1, &new_block), 1);
+		copy_device_range(fd, fs->blocks_pos + block_id * (uint64_t)bsize,
+				fs->blocks_pos + new_block * (uint64_t)bsize, bsize);
+		set_file_block(fd, fs, inode, fb, new_block);
+
+		// Frees the block if the other files dropped their references meanwhile
+		uint64_t old_block = block_id;
+		release_blocks(fd, fs, &old_block, 1, 1);
+	}
+}
+
+/* Blocks handed out by fill_holes() */
+struct block_pool_t
+{
+	uint64_t *blocks;
+	uint64_t count;
+	uint64_t used;
+};
+
+/* Take a block from the pool for a new indirect block, which starts empty */
+static uint64_t new_indirect_block(int fd, struct fsinfo_t *fs, struct block_pool_t *pool)
+{
+	const uint16_t bs = fs->main_block.block_size;
+	EXPECT(pool->used < pool->count);
+	const uint64_t block_id = pool->blocks[pool->used++];
+	uint8_t zeros[bs];
+	memset(zeros, 0, bs);
+	dev_write(fd, fs, zeros, bs, fs->blocks_pos + block_id * (uint64_t)bs);
+	return block_id;
+}
+
+/* Read the index-th pointer of an indirect block, filling it with a new indirect block if it is a hole */
+static uint64_t get_or_add_indirect(int fd, struct fsinfo_t *fs, uint64_t block_id, uint64_t index,
+		struct block_pool_t *pool)
+{
+	uint64_t b;
+	read_pointer_from_block(fd, fs, block_id, index, &b);
+	if (b == 0) {
+		b = new_indirect_block(fd, fs, pool);
+		write_pointer_to_block(fd, fs, block_id, index, b);
+	}
+	return b;
+}
+
+/* Like set_file_block(), but for a block in a hole, whose indirect blocks may be missing */
+static void set_hole_block(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint64_t file_block_id,
+		uint64_t block_id, struct block_pool_t *pool)
+{
+	const uint64_t c = pointers_per_block(fs); // blocks per indirect block
+	uint64_t b = file_block_id;
+	if (b < 12) {
+		inode->blockpos[b] = block_id;
+		return;
+	}
+
+	uint64_t leaf;
+	if (b < 12 + c) {
+		b -= 12;
+		if (inode->blockpos[12] == 0)
+			inode->blockpos[12] = new_indirect_block(fd, fs, pool);
+		leaf = inode->blockpos[12];
+	} else if (b < 12 + c + c*c) {
+		b -= 12 + c;
+		if (inode->blockpos[13] == 0)
+			inode->blockpos[13] = new_indirect_block(fd, fs, pool);
+		leaf = get_or_add_indirect(fd, fs, inode->blockpos[13], b / c, pool);
+	} else {
+		b -= 12 + c + c*c;
+		if (inode->blockpos[14] == 0)
+			inode->blockpos[14] = new_indirect_block(fd, fs, pool);
+		uint64_t b2 = get_or_add_indirect(fd, fs, inode->blockpos[14], b / (c*c), pool);
+		leaf = get_or_add_indirect(fd, fs, b2, b % (c*c) / c, pool);
+	}
+	write_pointer_to_block(fd, fs, leaf, b % c, block_id);
+}
+
+/* Allocate blocks for the holes in a range of a file, which must be within it */
+static void fill_holes(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint64_t pos, uint64_t len)
+{
+	if (!(fs->main_block.features & MYFS_FEATURE_SPARSE) || len == 0)
+		return;
+
+	const uint32_t bsize = fs->main_block.block_size;
+	const uint64_t c = pointers_per_block(fs); // blocks per indirect block
+	const uint64_t first = pos / bsize;
+	const uint64_t last = (pos + len - 1) / bsize + 1;
+
+	// Count the holes first, so that all blocks are allocated at once
+	uint64_t holes = 0;
+	for (uint64_t fb = first; fb < last; ++fb)
+		holes += get_file_block(fd, fs, inode, fb) == 0;
+	if (holes == 0)
+		return;
+
+	// Enough for any indirect blocks the holes may be missing; the rest is given back
+	const uint64_t indirect = holes / c + holes / (c * c) + 8;
+	struct block_pool_t pool;
+	pool.count = holes + indirect;
+	pool.blocks = (uint64_t *)malloc(pool.count * sizeof(uint64_t));
+	pool.used = 0;
+	EXPECT_EQUAL(allocate_blocks(fd, fs, pool.count, pool.blocks), pool.count);
+
+	uint8_t zeros[bsize];
+	memset(zeros, 0, bsize);
+	for (uint64_t fb = first; fb < last; ++fb) {
+		if (get_file_block(fd, fs, inode, fb) != 0)
+			continue;
+		EXPECT(pool.used < pool.count);
+		const uint64_t block_id = pool.blocks[pool.used++];
+		// The parts of the block that aren't going to be written must read as zeros
+		const uint64_t block_pos = (uint64_t)fb * bsize;
+		if (block_pos < pos || block_pos + bsize > pos + len)
+			write_file_device(fd, fs, inode, zeros, bsize, fs->blocks_pos + block_id * (uint64_t)bsize);
+		set_hole_block(fd, fs, inode, fb, block_id, &pool);
+	}
+	inode->blocks += pool.used;
+
+	release_blocks(fd, fs, pool.blocks + pool.used, pool.count - pool.used, 0);
+	free(pool.blocks);
+}
+
+void prepare_file_write(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint64_t pos, uint64_t len)
+{
+	// Blocks shared with clones are copied before being modified
+	unshare_file_range(fd, fs, inode, pos, len);
+	if (pos + len > inode->size)
+		resize_file(fd, fs, inode, pos + len);
+	fill_holes(fd, fs, inode, pos, len);
+}
+
+int64_t seek_file_data(int fd, struct fsinfo_t *fs, const struct inode_t *inode, uint64_t pos, int hole)
+{
+	if (pos >= inode->size)
+		return -1;
+	if (!(fs->main_block.features & MYFS_FEATURE_SPARSE))
+		return hole ? (int64_t)inode->size : (int64_t)pos;
+
+	const uint32_t bsize = fs->main_block.block_size;
+	const uint64_t c = pointers_per_block(fs); // blocks per indirect block
+	const uint64_t block_count = file_block_count(fs, inode);
+	uint64_t fb = pos / bsize;
+	while (fb < block_count) {
+		uint64_t b, index, block_id;
+		if (!find_block_pointer(fd, fs, inode, fb, &b, &index)) {
+			block_id = inode->blockpos[index];
+		} else if (b == 0) {
+			// A hole as big as a whole indirect block
+			if (hole)
+				break;
+			fb += c - index;
+			continue;
+		} else {
+			read_pointer_from_block(fd, fs, b, index, &block_id);
+		}
+		if ((block_id == 0) == hole)
+			break;
+		++fb;
+	}
+
+	if (fb >= block_count)
+		return hole ? (int64_t)inode->size : -1;
+	return MAX(pos, (uint64_t)fb * bsize);
+}
+
+int clone_file(int fd, struct fsinfo_t *fs, struct inode_t *src, struct inode_t *dest)
+{
+	if (!fs->refcounts_pos)
+		return EOPNOTSUPP;
+
+	resize_file(fd, fs, dest, 0);
+
+	const uint64_t block_count = file_block_count(fs, src);
+	const uint64_t indirect_count = calc_indirect_block_count(fs, block_count).total_indirect;
+	uint64_t *blocks = (uint64_t *)malloc((block_count + indirect_count + 1) * sizeof(uint64_t));
+	uint64_t *indirect_blocks = blocks + block_count;
+	read_file_blocks(fd, fs, src, 0, block_count, blocks);
+
+	// Holes have no reference counts
+	uint64_t *data_blocks = blocks;
+	uint64_t data_count = block_count;
+	if (fs->main_block.features & MYFS_FEATURE_SPARSE) {
+		data_blocks = (uint64_t *)malloc((block_count + 1) * sizeof(uint64_t));
+		memcpy(data_blocks, blocks, block_count * sizeof(uint64_t));
+		data_count = drop_holes(data_blocks, block_count);
+	}
+
+	int err = 0;
+	pthread_mutex_lock(&fs->alloc_lock);
+	const uint64_t shared = add_refcounts(fd, fs, data_blocks, data_count);
+	if (shared < data_count)
+		err = EMLINK;
+	else if (fs->main_block.free_data_block_count < indirect_count)
+		err = ENOSPC;
+	if (err)
+		drop_refcounts(fd, fs, data_blocks, shared);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if (data_blocks != blocks)
+		free(data_blocks);
+
+	if (!err) {
+		// Only the indirect blocks are new, the data blocks are the same
+		EXPECT_EQUAL(allocate_blocks(fd, fs, indirect_count, indirect_blocks), indirect_count);
+		map_new_blocks(fd, fs, dest, 0, block_count, indirect_blocks, blocks);
+		dest->size = src->size;
+		// Its indirect blocks map the holes too
+		dest->blocks = (fs->main_block.features & MYFS_FEATURE_SPARSE) ? data_count + indirect_count : block_count;
+		src->mode |= mode_shared;
+		dest->mode |= mode_shared;
+	}
+
+	free(blocks);
+	return err;
 }
 
 void remove_file(int fd, struct fsinfo_t *fs, uint32_t inode_num, struct inode_t *inode)
@@ -1023,5 +2450,159 @@ void remove_file(int fd, struct fsinfo_t *fs, uint32_t inode_num, struct inode_t
 	// This should free up all blocks
 	resize_file(fd, fs, inode, 0);
 
+	// The inode number may be reused, so forget about the (negative) entries of the directory
+	if (fs->dcache && (inode->mode & mode_ftype_mask) == mode_ftype_dir)
+		dentry_cache_remove_parent(fs->dcache, inode_num);
+	if (fs->dfilters && (inode->mode & mode_ftype_mask) == mode_ftype_dir)
+		dir_filter_drop(fs->dfilters, inode_num);
+
 	set_inode_state(fd, fs, inode_num, 0);
 }
+
+/* An indirect block of a file and the pointer to it */
+struct indirect_ref_t
+{
+	uint64_t block_id;
+	uint64_t parent;   /* Index in the list of the indirect block pointing to it; UINT64_MAX for the inode */
+	uint64_t index;    /* Index of the pointer in the parent, or in blockpos */
+	uint64_t first;    /* First file block it maps */
+	uint32_t depth;    /* 0 if it points to data blocks */
+};
+
+/* List the indirect blocks of a file, each after the one pointing to it
+ *
+ * returns: the number of blocks listed
+ */
+static uint64_t list_indirect_blocks(int fd, struct fsinfo_t *fs, const struct inode_t *inode,
+		struct indirect_ref_t *refs)
+{
+	const uint16_t bs = fs->main_block.block_size;
+	const uint64_t c = pointers_per_block(fs); // blocks per indirect block
+	const uint64_t firsts[3] = { 12, 12 + c, 12 + c + c*c };
+	const uint64_t block_count = file_block_count(fs, inode);
+	// Only sparse files can lack indirect blocks, block 0 is reserved for them
+	const int sparse = fs->main_block.features & MYFS_FEATURE_SPARSE;
+	uint8_t buffer[bs];
+	uint64_t n = 0;
+	for (uint32_t d = 0; d < 3; ++d) {
+		if (firsts[d] < block_count && (!sparse || inode->blockpos[12 + d] != 0)) {
+			const struct indirect_ref_t ref = { inode->blockpos[12 + d], UINT64_MAX, 12 + d, firsts[d], d };
+			refs[n++] = ref;
+		}
+	}
+	for (uint64_t i = 0; i < n; ++i) {
+		if (refs[i].depth == 0)
+			continue;
+		uint64_t span = c; // file blocks each of its pointers maps
+		for (uint32_t d = 1; d < refs[i].depth; ++d)
+			span *= c;
+		dev_read(fd, fs, buffer, bs, fs->blocks_pos + refs[i].block_id * (uint64_t)bs);
+		// Past the end of the file there may be stale pointers
+		for (uint64_t j = 0; j < c && refs[i].first + j * span < block_count; ++j) {
+			const uint64_t b = decode_pointer(fs, buffer, j);
+			if (sparse && b == 0)
+				continue;
+			const struct indirect_ref_t ref = { b, i, j, refs[i].first + j * span, refs[i].depth - 1 };
+			refs[n++] = ref;
+		}
+	}
+	return n;
+}
+
+/* Copy count blocks, through the journal for metadata */
+static void copy_file_blocks(int fd, struct fsinfo_t *fs, const struct inode_t *inode,
+		uint64_t src_block, uint64_t dest_block, uint64_t count)
+{
+	const uint16_t bs = fs->main_block.block_size;
+	const uint64_t src_pos = fs->blocks_pos + src_block * (uint64_t)bs;
+	const uint64_t dest_pos = fs->blocks_pos + dest_block * (uint64_t)bs;
+	const uint64_t len = count * bs;
+	if (!is_metadata(inode)) {
+		copy_device_range(fd, src_pos, dest_pos, len);
+		return;
+	}
+	uint8_t *buffer = (uint8_t *)malloc(MIN(len, COPY_CHUNK));
+	for (uint64_t done = 0; done < len; ) {
+		const uint64_t n = MIN(len - done, COPY_CHUNK);
+		dev_read(fd, fs, buffer, n, src_pos + done);
+		dev_write(fd, fs, buffer, n, dest_pos + done);
+		done += n;
+	}
+	free(buffer);
+}
+
+int defrag_file(int fd, struct fsinfo_t *fs, uint32_t inode_num, struct inode_t *inode, int indirect,
+		uint64_t *goal)
+{
+	const uint16_t bs = fs->main_block.block_size;
+	const uint64_t block_count = file_block_count(fs, inode);
+	if (block_count == 0 || ((inode->mode & mode_shared) && fs->refcounts_pos))
+		return 0;
+
+	const uint64_t indirect_max = calc_indirect_block_count(fs, block_count).total_indirect;
+	struct indirect_ref_t *refs = (struct indirect_ref_t *)malloc((indirect_max + 1) * sizeof(struct indirect_ref_t));
+	uint64_t *blocks = (uint64_t *)malloc(block_count * sizeof(uint64_t));
+	// The blocks moved, old and new: the indirect ones, then the data ones without the holes
+	uint64_t *old_blocks = (uint64_t *)malloc((indirect_max + block_count) * sizeof(uint64_t));
+	const uint64_t indirect_count = indirect ? list_indirect_blocks(fd, fs, inode, refs) : 0;
+	read_file_blocks(fd, fs, inode, 0, block_count, blocks);
+
+	const int sparse = fs->main_block.features & MYFS_FEATURE_SPARSE;
+	uint64_t moved = 0;
+	for (uint64_t i = 0; i < indirect_count; ++i)
+		old_blocks[moved++] = refs[i].block_id;
+	for (uint64_t i = 0; i < block_count; ++i)
+		if (!sparse || blocks[i] != 0)
+			old_blocks[moved++] = blocks[i];
+
+	uint64_t contiguous = 1;
+	while (contiguous < moved && old_blocks[contiguous] == old_blocks[contiguous - 1] + 1)
+		++contiguous;
+	uint64_t start;
+	int ret = 0;
+	if (moved == 0 || contiguous == moved) {
+		ret = 0;
+	} else if (!allocate_run(fd, fs, moved, *goal, &start)) {
+		ret = -1;
+	} else {
+		// The indirect blocks go first, each after the one pointing to it
+		uint8_t buffer[bs];
+		for (uint64_t i = 0; i < indirect_count; ++i) {
+			dev_read(fd, fs, buffer, bs, fs->blocks_pos + refs[i].block_id * (uint64_t)bs);
+			dev_write(fd, fs, buffer, bs, fs->blocks_pos + (start + i) * (uint64_t)bs);
+			if (refs[i].parent == UINT64_MAX)
+				inode->blockpos[refs[i].index] = start + i;
+			else
+				write_pointer_to_block(fd, fs, start + refs[i].parent, refs[i].index, start + i);
+		}
+
+		// Then the data, a run of contiguous old blocks at a time
+		uint64_t next = start + indirect_count;
+		for (uint64_t i = 0; i < block_count; ) {
+			if (sparse && blocks[i] == 0) {
+				++i;
+				continue;
+			}
+			uint64_t n = 1;
+			while (i + n < block_count && blocks[i + n] == blocks[i] + n)
+				++n;
+			copy_file_blocks(fd, fs, inode, blocks[i], next, n);
+			for (uint64_t j = 0; j < n; ++j)
+				blocks[i + j] = next++;
+			i += n;
+		}
+		// The data must be in place before anything points to it
+		counted_fdatasync(fd);
+		write_file_blocks(fd, fs, inode, 0, block_count, blocks);
+		write_inode(fd, fs, inode_num, inode);
+
+		release_blocks(fd, fs, old_blocks, moved, 0);
+		*goal = start + moved;
+		ret = 1;
+	}
+
+	free(old_blocks);
+	free(blocks);
+	free(refs);
+	return ret;
+}
@@ -4,6 +4,7 @@
 #define _XOPEN_SOURCE 500
 
 #include <stdint.h>
+#include <pthread.h>
 
 /*
  * Layout:
@@ -11,6 +12,8 @@
  * Main block;
  * Inode bitmap;
  * Data blocks bitmap
+ * Data block reference counts (reflink feature only);
+ * Metadata journal (journal feature only);
  * Inode 0,
  * Inode 1,
  * ...
@@ -22,36 +25,107 @@
  * -------------------
  */
 
-#define MAIN_BLOCK_SIZE 22
-#define INODE_SIZE 100
+#define MAIN_BLOCK_SIZE 22     /* Main block of filesystems without feature flags */
+#define MAIN_BLOCK_EXT_SIZE 64 /* Main block with a magic number and feature flags; the rest is reserved */
+#define MAIN_BLOCK_64BIT_SIZE 128 /* Extended main block followed by the high halves of the block counts */
+
+/* Written right after the legacy main block, where older filesystems have
+ * their inode bitmap. That always has the root inode allocated, so its first
+ * byte is odd and never matches the first byte of the magic number. */
+#define MYFS_MAGIC 0x46594D00u /* "\0MYF" */
+
+enum {
+	/* Data blocks may be shared between files and have reference counts */
+	MYFS_FEATURE_REFLINK = 1 << 0,
+	/* Block ID 0 in a file is a hole that reads as zeros; data block 0 is
+	 * reserved and kept zeroed, so holes can be read through */
+	MYFS_FEATURE_SPARSE  = 1 << 1,
+	/* Metadata is written to a journal before it goes to its place */
+	MYFS_FEATURE_JOURNAL = 1 << 2,
+	/* Block IDs and counts are 64-bit, for devices with more than 2^32 blocks;
+	 * inodes are INODE_SIZE_64BIT bytes and indirect blocks hold u64 IDs */
+	MYFS_FEATURE_64BIT   = 1 << 3,
+	/* The filesystem grew: the metadata regions keep the layout of
+	 * layout_data_block_count data blocks, and the data bitmap and reference
+	 * counts may have moved to data blocks starting at metadata_block */
+	MYFS_FEATURE_RESIZED = 1 << 4,
+};
+
+/* Whether a filesystem was unmounted cleanly; MYFS_STATE_DIRTY while mounted */
+enum {
+	MYFS_STATE_DIRTY = 0,
+	MYFS_STATE_CLEAN = 1,
+};
+
+/* Features this version of the code can handle */
+#define MYFS_FEATURES_SUPPORTED (MYFS_FEATURE_REFLINK | MYFS_FEATURE_SPARSE | MYFS_FEATURE_JOURNAL | MYFS_FEATURE_64BIT | \
+		MYFS_FEATURE_RESIZED)
+
+/* Features of new filesystems; 64-bit addressing is added when the device needs it */
+#define MYFS_FEATURES_DEFAULT (MYFS_FEATURE_REFLINK | MYFS_FEATURE_SPARSE | MYFS_FEATURE_JOURNAL)
+#define INODE_SIZE 100       /* Inode with 32-bit block IDs */
+#define INODE_SIZE_64BIT 164 /* Inode with 64-bit block IDs */
 
 #define MAX_FILE_NAME_LENGTH 512
 
+/* Unused bytes after the name of a newly added directory entry */
+#define DIR_ENTRY_PADDING 32
+
 enum {
 	mode_mask       = 0777,
 	mode_ftype_mask = 1 << 9,
 	mode_ftype_dir  = 0 << 9,
 	mode_ftype_file = 1 << 9,
+	mode_shared     = 1 << 10, /* The file may share data blocks with its clones */
 };
 
 struct main_block_t
 {
 	uint32_t inode_count_limit;
 	uint32_t inode_count;
-	uint32_t block_count;
-	uint32_t data_block_count;
-	uint32_t free_data_block_count;
+	uint64_t block_count;
+	uint64_t data_block_count;
+	uint64_t free_data_block_count;
 	uint16_t block_size;
+	uint32_t magic;    /* MYFS_MAGIC; 0 if the main block has no feature flags */
+	uint32_t features; /* MYFS_FEATURE_* */
+	uint32_t journal_blocks; /* Size of the journal; 0 without one */
+	/* Summaries the allocator relies on, besides the counts above; only
+	 * trusted after a clean unmount, and never stored on legacy filesystems */
+	uint32_t state;           /* MYFS_STATE_* */
+	uint64_t free_block_hint; /* No data block before it is free */
+	uint32_t free_inode_hint; /* No inode before it is free */
+	uint64_t reserved_blocks; /* Free data blocks only root may allocate */
+	/* Only stored with MYFS_FEATURE_RESIZED; data_block_count and 0 otherwise */
+	uint64_t layout_data_block_count; /* Data blocks the metadata regions were laid out for */
+	uint64_t metadata_block;  /* First data block holding the data bitmap, then the reference counts; 0 if in place */
 };
 
+struct dentry_cache_t;
+struct dir_filter_map_t;
+struct journal_t;
+
 struct fsinfo_t
 {
 	struct main_block_t main_block;
+	uint32_t inode_size;   /* INODE_SIZE, or INODE_SIZE_64BIT with 64-bit addressing */
+	uint32_t pointer_size; /* Bytes per block ID in indirect blocks: 4, or 8 with 64-bit addressing */
 	uint32_t inode_bitmap_blocks;
 	uint64_t inode_bitmap_pos;
 	uint64_t data_blocks_bitmap_pos;
+	uint64_t refcounts_pos; /* u16 per data block: references besides the first; 0 without reflink */
+	uint64_t journal_pos;   /* 0 without a journal */
 	uint64_t inodes_pos;
 	uint64_t blocks_pos;
+
+	struct dentry_cache_t *dcache; /* Optional dentry cache; NULL if not used */
+	struct dir_filter_map_t *dfilters; /* Optional per-directory Bloom filters; NULL if not used */
+	struct journal_t *journal; /* Open journal the metadata goes through; NULL if not used */
+
+	/* Protects the inode and data block bitmaps and the counters in main_block.
+	 * Everything else has to be synchronised by the caller: an inode must not
+	 * be modified while it is used by another thread. */
+	pthread_mutex_t alloc_lock;
 };
 
 /* Inode data structure
@@ -76,43 +150,239 @@ struct inode_t
 	uint32_t gid;      /* Group ID */
 	uint16_t mode;     /* File mode (lower 9 bits) and type (upper 7 bits) */
 	uint16_t nlinks;   /* Number of hard-links */
-	uint32_t blocks;   /* Number of allocated blocks */
-	uint32_t blockpos[INODE_BLKS]; /* data block IDs */
+	uint64_t blocks;   /* Number of allocated blocks: on sparse filesystems, the data and indirect
+	                    * blocks actually allocated; otherwise the data blocks the size spans */
+	uint64_t blockpos[INODE_BLKS]; /* data block IDs */
+};
+
+/* Geometry of a new filesystem */
+struct fs_params_t
+{
+	uint16_t block_size;       /* Power of 2 from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE */
+	uint32_t bytes_per_inode;  /* Device space per inode in the inode table */
+	uint32_t reserved_percent; /* Data blocks only root may allocate */
+	uint32_t features;         /* MYFS_FEATURE_* */
 };
 
-void initialize_fsinfo(struct fsinfo_t *fs, uint64_t size);
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 32768
+
+/* 4KiB blocks, an inode per block and no reserved blocks */
+void default_fs_params(struct fs_params_t *params, uint32_t features);
+
+void initialize_fsinfo(struct fsinfo_t *fs, uint64_t size, const struct fs_params_t *params);
 void initialize_fsinfo_from_main_block(struct fsinfo_t *fs, const struct main_block_t *mb);
 void initialize_inode(struct inode_t *inode, uint32_t uid, uint32_t gid, uint16_t mode);
 void clear_inode(struct inode_t *inode);
 
-void write_main_block(int fd, const struct fsinfo_t *fs);
+struct stat;
+/* Fill st with the attributes of an inode, st_ino being the inode number */
+void inode_stat(const struct fsinfo_t *fs, uint32_t inode_num, const struct inode_t *inode, struct stat *st);
+
+/* returns: the number of data blocks the size of a file spans, holes included */
+uint64_t file_block_count(const struct fsinfo_t *fs, const struct inode_t *inode);
+
+/* Read or write metadata on the device, through the journal if one is open
+ *
+ * File data is read and written directly.
+ * returns: number of bytes read
+ */
+uint64_t dev_read(int fd, const struct fsinfo_t *fs, void *buffer, uint64_t len, uint64_t pos);
+void dev_write(int fd, const struct fsinfo_t *fs, const void *buffer, uint64_t len, uint64_t pos);
+
+void write_main_block(int fd, struct fsinfo_t *fs);
+
+/* Set the state of the filesystem and write the main block in place, flushed
+ *
+ * Bypasses the journal, so that a crash always leaves the filesystem dirty.
+ */
+void write_fs_state(int fd, struct fsinfo_t *fs, uint32_t state);
+
+/* Count the allocated inodes and free data blocks from the bitmaps and find the first free ones
+ *
+ * Done on filesystems that weren't unmounted cleanly.
+ */
+void rescan_allocator(int fd, struct fsinfo_t *fs);
 void write_inode(int fd, const struct fsinfo_t *fs, uint32_t inode_num, const struct inode_t *inode);
 
 void read_fsinfo(int fd, struct fsinfo_t *fs);
 void read_inode(int fd, const struct fsinfo_t *fs, uint32_t inode_num, struct inode_t *inode);
 
+/* Read `count` inodes at once, coalescing reads of inodes close to each other in the inode table */
+void read_inodes(int fd, const struct fsinfo_t *fs, uint32_t count, const uint32_t *inode_nums, struct inode_t *inodes);
+
+/* Read the inodes first to first + count - 1 with a single read */
+void read_inode_range(int fd, const struct fsinfo_t *fs, uint32_t first, uint32_t count, struct inode_t *inodes);
+
+/* Zero a range of the device, without writing the zeros where the device or
+ * the filesystem holding the image can do it by itself */
+void zero_device_range(int fd, uint64_t pos, uint64_t len);
+
 void write_blank_data_bitmap(int fd, const struct fsinfo_t *fs);
 void write_blank_inode_bitmap(int fd, const struct fsinfo_t *fs);
-void write_blank_fs(int fd, struct fsinfo_t *fs);
+/* Make a new filesystem taking the whole device */
+void format_fs(int fd, struct fsinfo_t *fs, const struct fs_params_t *params);
+/* Same, with default_fs_params() */
+void write_blank_fs(int fd, struct fsinfo_t *fs, uint32_t features);
+
+/* Grow the filesystem to take `size` bytes of the device, which must be that big
+ *
+ * The new space becomes data blocks; the inode table keeps its size. When the
+ * data bitmap or the reference counts no longer fit in their place, they move
+ * to the beginning of the new space. Without 64-bit addressing, the filesystem
+ * grows to 2^32 - 1 blocks at most. Safe while the filesystem is in use.
+ * returns: 0 on success; EINVAL if it is bigger than size; ENOSPC if the new space
+ * doesn't even hold the moved metadata; EOPNOTSUPP on legacy filesystems
+ */
+int grow_fs(int fd, struct fsinfo_t *fs, uint64_t size);
+
+/* returns: the number of data blocks the data bitmap and reference counts
+ * take from main_block.metadata_block on; 0 if they are in their place */
+uint64_t metadata_block_count(const struct fsinfo_t *fs);
 
 void create_inode(int fd, struct fsinfo_t *fs, const struct inode_t *inode, uint32_t *inode_num);
 
 uint8_t get_inode_state(int fd, struct fsinfo_t *fs, uint32_t inode);
 void set_inode_state(int fd, struct fsinfo_t *fs, uint32_t inode, uint8_t state);
-uint8_t get_block_state(int fd, struct fsinfo_t *fs, uint32_t block);
-void set_block_state(int fd, struct fsinfo_t *fs, uint32_t block, uint8_t state);
+uint8_t get_block_state(int fd, struct fsinfo_t *fs, uint64_t block);
+void set_block_state(int fd, struct fsinfo_t *fs, uint64_t block, uint8_t state);
+/* Mark blocks free right away; used by the journal once the transaction that freed them is committed */
+void free_data_blocks(int fd, struct fsinfo_t *fs, const uint64_t *blocks, uint64_t block_count);
+
+/* returns: the data block holding the file_block_id-th block of the file */
+uint64_t get_file_block(int fd, struct fsinfo_t *fs, const struct inode_t *inode, uint64_t file_block_id);
+
+/* Read the IDs of the data blocks first to first + count - 1 of a file, loading each indirect block once
+ *
+ * The blocks must be within the file; holes are 0 on sparse filesystems.
+ */
+void read_file_blocks(int fd, struct fsinfo_t *fs, const struct inode_t *inode, uint64_t first, uint64_t count,
+		uint64_t *blocks);
+
+/* A run of file data that is contiguous on the device */
+struct data_extent_t
+{
+	uint64_t dev_pos; /* Position on the device; 0 for a hole */
+	uint64_t len;
+};
+
+/* Map len bytes of a file starting at pos to the device
+ *
+ * The range must be within the file. Adjacent blocks, and adjacent holes,
+ * are merged into one extent.
+ * returns: number of extents written to extents; if max_extents isn't enough,
+ * they only cover the beginning of the range
+ */
+uint32_t map_file_range(int fd, struct fsinfo_t *fs, const struct inode_t *inode, uint64_t pos, uint64_t len,
+		struct data_extent_t *extents, uint32_t max_extents);
 
 uint64_t inode_data_write(int fd, struct fsinfo_t *fs, struct inode_t *inode, const uint8_t *buffer, uint64_t len, uint64_t pos);
 uint64_t inode_data_read(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint8_t *buffer, uint64_t len, uint64_t pos);
 void resize_file(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint64_t size);
 
+/* Make a range of a file writable in place on the device
+ *
+ * Grows the file if the range ends past it, allocates blocks for the holes
+ * and gives blocks shared with clones their own copy. Must be called before
+ * writing file data to the device directly; inode_data_write() and
+ * inode_data_copy() do it themselves.
+ */
+void prepare_file_write(int fd, struct fsinfo_t *fs, struct inode_t *inode, uint64_t pos, uint64_t len);
+
+/* Find the next data (or hole) in a file, for SEEK_DATA and SEEK_HOLE
+ *
+ * The end of the file counts as a hole.
+ * returns: the position of the first data (hole) byte at or after pos; -1 if there is none
+ */
+int64_t seek_file_data(int fd, struct fsinfo_t *fs, const struct inode_t *inode, uint64_t pos, int hole);
+
+/* Make dest a copy of src that shares all its data blocks
+ *
+ * The old data of dest is dropped. Needs the reflink feature; no data is
+ * copied until one of the files is modified.
+ * returns: 0 on success; an errno value otherwise
+ */
+int clone_file(int fd, struct fsinfo_t *fs, struct inode_t *src, struct inode_t *dest);
+
+/* Copy len bytes of src starting at src_pos to dest at dest_pos, growing dest if needed
+ *
+ * The data is copied on the device without going through the caller. If src
+ * and dest are the same inode, the ranges must not overlap.
+ * returns: number of bytes copied; less than len if src ends before
+ */
+uint64_t inode_data_copy(int fd, struct fsinfo_t *fs, struct inode_t *src, uint64_t src_pos,
+		struct inode_t *dest, uint64_t dest_pos, uint64_t len);
+
 void remove_file(int fd, struct fsinfo_t *fs, uint32_t inode_num, struct inode_t *inode);
 
+/* Move the data blocks of a file to one run of free blocks, and write its inode
+ *
+ * With `indirect`, its indirect blocks are moved too, in front of the data.
+ * Holes stay holes. Files that may share blocks with clones are left alone,
+ * as moving them would copy the shared blocks. The run is looked for at or
+ * after *goal first, which is then set past it.
+ * returns: 1 if the file was moved; 0 if it was already contiguous or is
+ * shared; -1 if there is no free run long enough
+ */
+int defrag_file(int fd, struct fsinfo_t *fs, uint32_t inode_num, struct inode_t *inode, int indirect,
+		uint64_t *goal);
+
 void add_inode_to_dir(int fd, struct fsinfo_t *fs, uint32_t dir_inode_num, struct inode_t *dir_inode, uint32_t entry_inode_num, struct inode_t *entry_inode, const char *entry_name);
-int remove_inode_from_dir(int fd, struct fsinfo_t *fs, struct inode_t *dir_inode, uint32_t entry_inode_num, struct inode_t *entry_inode);
+/* Remove the entry of entry_inode_num from a directory and drop a link of the inode
+ *
+ * remove_dir_entry() leaves an inode without links allocated, for the
+ * caller to remove once nothing uses it; remove_inode_from_dir() removes it.
+ * returns: 1 if the entry was found; 0 otherwise
+ */
+int remove_dir_entry(int fd, struct fsinfo_t *fs, uint32_t dir_inode_num, struct inode_t *dir_inode, uint32_t entry_inode_num, struct inode_t *entry_inode);
+int remove_inode_from_dir(int fd, struct fsinfo_t *fs, uint32_t dir_inode_num, struct inode_t *dir_inode, uint32_t entry_inode_num, struct inode_t *entry_inode);
 
 void write_root_directory(int fd, struct fsinfo_t *fs);
 
+/* Called by read_dir() for each directory entry
+ *
+ * name is not null-terminated
+ * pos is the position of the entry in the directory and next_pos the position of the next one
+ * returns: nonzero to stop reading the directory
+ */
+typedef int (*dir_entry_cb_t)(void *data, uint32_t inode_num, const char *name, uint16_t name_len,
+		uint64_t pos, uint64_t next_pos);
+
+/* Call cb for the entries of a directory, starting with the one at `pos`
+ *
+ * pos is either 0 (the first entry) or a position previously reported by read_dir().
+ * If the directory has been modified since and there is no longer an entry at pos,
+ * reading continues with the first entry after it.
+ *
+ * returns: position of the entry cb stopped at; the size of the directory if cb never did
+ */
+uint64_t read_dir(int fd, struct fsinfo_t *fs, struct inode_t *dir_inode, uint64_t pos, dir_entry_cb_t cb, void *data);
+
+/* Number of bytes of a directory not used by its entries: padding and space left by removed entries */
+uint64_t dir_slack(int fd, struct fsinfo_t *fs, struct inode_t *dir_inode);
+
+/* Rewrite the entries of a directory contiguously and without padding, and shrink it
+ *
+ * Moves entries around, so positions reported by read_dir() before are no longer valid.
+ * returns: the number of bytes the directory shrank by
+ */
+uint64_t compact_dir(int fd, struct fsinfo_t *fs, uint32_t dir_inode_num, struct inode_t *dir_inode);
+
+/* Find the entry named `name` in a directory, consulting the dentry cache first
+ *
+ * returns: 1 if found; 0 otherwise
+ */
+int lookup_dir_entry(int fd, struct fsinfo_t *fs, uint32_t dir_inode_num, struct inode_t *dir_inode,
+		const char *name, uint16_t name_len, uint32_t *inode_num);
+
+/* Swap the inodes the entry `name1` in dir1 and the entry `name2` in dir2 refer to
+ *
+ * returns: 1 on success; 0 if either of the entries doesn't exist
+ */
+int exchange_dir_entries(int fd, struct fsinfo_t *fs,
+		uint32_t dir1_inode_num, struct inode_t *dir1_inode, const char *name1, uint16_t name1_len,
+		uint32_t dir2_inode_num, struct inode_t *dir2_inode, const char *name2, uint16_t name2_len);
+
 int get_path_inode(int fd, struct fsinfo_t *fs, const char *path, uint32_t *inode_num, struct inode_t *inode,
 		uint32_t *dir_inode_num, struct inode_t *dir_inode, uint64_t *offset);
 
@@ -0,0 +1,23 @@
+#ifndef MYFS_IOCTL_H_INCLUDED
+#define MYFS_IOCTL_H_INCLUDED
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/* Make the file a clone of another file on the same filesystem
+ *
+ * The argument is the inode number (st_ino) of the source file. The file
+ * shares all data blocks with the source until one of them is modified.
+ * The file must be open for writing, and the caller must have permission
+ * to read the source (EBADF and EACCES otherwise). FICLONE can't be used, as the kernel doesn't pass it to FUSE filesystems.
+ */
+#define MYFS_IOC_CLONE _IOW('m', 1, uint64_t)
+
+/* Grow the filesystem into space added at the end of its device
+ *
+ * The argument is the new size in bytes, or 0 for the whole device. Only
+ * root and the user running the filesystem may do it.
+ */
+#define MYFS_IOC_GROW _IOW('m', 2, uint64_t)
+
+#endif
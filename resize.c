@@ -0,0 +1,142 @@
+#include "myfs.h"
+#include "journal.h"
+#include "myfs_ioctl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s [-s size] <device>\n"
+			"       %s -m [-s size] <mount point>\n"
+			"\n"
+			"Grow a filesystem into space added at the end of its device.\n"
+			"    -s    New size in bytes, with an optional K, M, G or T suffix (default: the\n"
+			"          whole device); image files smaller than that are extended\n"
+			"    -m    Grow a mounted filesystem; its device must already have the space\n"
+			, name, name);
+}
+
+/* returns: the size in bytes; 0 if it isn't one */
+static uint64_t parse_size(const char *s)
+{
+	char *end;
+	uint64_t size = strtoull(s, &end, 10);
+	const char *units = "KMGT";
+	const char *unit = *end ? strchr(units, *end) : NULL;
+	if (unit) {
+		for (const char *u = units; u <= unit; ++u)
+			size *= 1024;
+		++end;
+	}
+	return *end ? 0 : size;
+}
+
+static int grow_mounted(const char *path, uint64_t size)
+{
+	int dir = open(path, O_RDONLY);
+	if (dir == -1) {
+		perror(path);
+		return 1;
+	}
+	struct statvfs before, after;
+	fstatvfs(dir, &before);
+	if (ioctl(dir, MYFS_IOC_GROW, &size) != 0) {
+		perror("Failed to grow the filesystem");
+		return 1;
+	}
+	fstatvfs(dir, &after);
+	printf("%lu -> %lu data blocks\n", (unsigned long)before.f_blocks, (unsigned long)after.f_blocks);
+	close(dir);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int mounted = 0;
+	uint64_t size = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "ms:")) != -1) {
+		switch (opt) {
+		case 'm':
+			mounted = 1;
+			break;
+		case 's':
+			size = parse_size(optarg);
+			if (size == 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (mounted)
+		return grow_mounted(argv[optind], size);
+
+	int fd = open(argv[optind], O_RDWR);
+	if (fd == -1) {
+		perror("Failed to open device:");
+		return 1;
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+	uint64_t dev_size = lseek(fd, 0, SEEK_END);
+	if (size > dev_size && S_ISREG(st.st_mode)) {
+		if (ftruncate(fd, size) != 0) {
+			perror("Failed to extend the image");
+			return 1;
+		}
+		dev_size = size;
+	}
+	if (size == 0)
+		size = dev_size;
+	if (size > dev_size) {
+		fprintf(stderr, "The device is only %lu bytes\n", (unsigned long)dev_size);
+		return 1;
+	}
+
+	struct fsinfo_t fs;
+	read_fsinfo(fd, &fs);
+	if (fs.main_block.features & ~MYFS_FEATURES_SUPPORTED) {
+		fprintf(stderr, "The filesystem uses unsupported features\n");
+		return 1;
+	}
+	// The bitmap may move, with what the journal holds for it
+	const int replayed = journal_replay(fd, &fs);
+	if (replayed < 0) {
+		fprintf(stderr, "The journal is invalid\n");
+		return 1;
+	}
+	if (replayed > 0)
+		read_fsinfo(fd, &fs);
+	if (fs.main_block.state != MYFS_STATE_CLEAN)
+		rescan_allocator(fd, &fs);
+	write_fs_state(fd, &fs, MYFS_STATE_DIRTY);
+
+	const uint64_t data_blocks = fs.main_block.data_block_count;
+	const int err = grow_fs(fd, &fs, size);
+	write_fs_state(fd, &fs, MYFS_STATE_CLEAN);
+	if (err) {
+		fprintf(stderr, "Failed to grow the filesystem: %s\n", strerror(err));
+		return 1;
+	}
+	printf("%lu -> %lu data blocks\n", (unsigned long)data_blocks, (unsigned long)fs.main_block.data_block_count);
+
+	close(fd);
+	return 0;
+}
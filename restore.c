@@ -0,0 +1,140 @@
+#include "myfs.h"
+#include "dump.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s <dump> <device>\n"
+			"\n"
+			"Write a filesystem dumped by dump.myfs to a device or image file, reading\n"
+			"the dump from the standard input if it is -. Image files are made sparse.\n"
+			, name);
+}
+
+static int read_all(FILE *in, uint8_t *data, uint64_t len)
+{
+	return len == 0 || fread(data, len, 1, in) == 1;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	FILE *in = stdin;
+	if (strcmp(argv[1], "-") != 0) {
+		in = fopen(argv[1], "rb");
+		if (!in) {
+			perror(argv[1]);
+			return 1;
+		}
+	}
+	setvbuf(in, NULL, _IOFBF, DUMP_CHUNK);
+
+	uint8_t header[DUMP_HEADER_SIZE];
+	uint64_t magic, size;
+	uint32_t version;
+	if (!read_all(in, header, sizeof(header))) {
+		fprintf(stderr, "Not a myfs dump\n");
+		return 1;
+	}
+	util_read_u64(header, &magic);
+	util_read_u32(header + 8, &version);
+	util_read_u64(header + 16, &size);
+	if (magic != DUMP_MAGIC || version != DUMP_VERSION) {
+		fprintf(stderr, "Not a myfs dump, or one of an unsupported version\n");
+		return 1;
+	}
+
+	int fd = open(argv[2], O_WRONLY | O_CREAT, 0644);
+	if (fd == -1) {
+		perror("Failed to open device:");
+		return 1;
+	}
+	// Image files start out as holes, other devices are zeroed where the dump has nothing
+	struct stat st;
+	fstat(fd, &st);
+	const int image = S_ISREG(st.st_mode);
+	if (image) {
+		if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0) {
+			perror("Failed to size the image");
+			return 1;
+		}
+	} else if ((uint64_t)lseek(fd, 0, SEEK_END) < size) {
+		fprintf(stderr, "The device is smaller than the dumped one (%lu bytes)\n", (unsigned long)size);
+		return 1;
+	}
+
+	uint8_t *buffer = (uint8_t *)malloc(DUMP_CHUNK);
+	uint64_t restored = 0, end = 0;
+	int ret = 1;
+	for (;;) {
+		uint8_t record[DUMP_RECORD_SIZE];
+		uint64_t pos, len;
+		if (!read_all(in, record, sizeof(record))) {
+			fprintf(stderr, "The dump is truncated\n");
+			break;
+		}
+		util_read_u64(record, &pos);
+		util_read_u64(record + 8, &len);
+		if (pos == DUMP_END) {
+			if (len != restored) {
+				fprintf(stderr, "The dump is inconsistent\n");
+				break;
+			}
+			if (!image)
+				zero_device_range(fd, end, size - end);
+			ret = 0;
+			break;
+		}
+		if (pos < end || pos + len > size) {
+			fprintf(stderr, "The dump is inconsistent\n");
+			break;
+		}
+		if (!image)
+			zero_device_range(fd, end, pos - end);
+
+		uint64_t done = 0;
+		while (done < len) {
+			const uint64_t n = MIN(len - done, DUMP_CHUNK);
+			if (!read_all(in, buffer, n))
+				break;
+			if (pwrite(fd, buffer, n, pos + done) != (ssize_t)n) {
+				perror("Failed to write to the device");
+				break;
+			}
+			done += n;
+		}
+		if (done < len) {
+			if (!ferror(in))
+				fprintf(stderr, "The dump is truncated\n");
+			break;
+		}
+		restored += len;
+		end = pos + len;
+	}
+
+	if (ret == 0 && fsync(fd) != 0) {
+		perror("Failed to write to the device");
+		ret = 1;
+	}
+	if (ret == 0)
+		fprintf(stderr, "%lu of %lu bytes restored\n", (unsigned long)restored, (unsigned long)size);
+
+	free(buffer);
+	close(fd);
+	if (in != stdin)
+		fclose(in);
+	return ret;
+}
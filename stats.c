@@ -0,0 +1,65 @@
+#define _XOPEN_SOURCE 500
+
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+struct stats_block_t
+{
+	uint64_t counters[STATS_MAX];
+	int in_use;                  /* Owned by a running thread */
+	struct stats_block_t *next;
+};
+
+_Thread_local uint64_t *stats_local = NULL;
+
+static struct stats_block_t *blocks = NULL;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+/* Called when a thread exits; its counts stay in the sums */
+static void release_block(void *data)
+{
+	struct stats_block_t *b = (struct stats_block_t *)data;
+	pthread_mutex_lock(&blocks_lock);
+	b->in_use = 0;
+	pthread_mutex_unlock(&blocks_lock);
+}
+
+static void create_thread_key(void)
+{
+	pthread_key_create(&thread_key, release_block);
+}
+
+uint64_t *stats_register_thread(void)
+{
+	pthread_once(&thread_key_once, create_thread_key);
+	pthread_mutex_lock(&blocks_lock);
+	struct stats_block_t *b = blocks;
+	while (b && b->in_use)
+		b = b->next;
+	if (!b) {
+		b = (struct stats_block_t *)calloc(1, sizeof(struct stats_block_t));
+		b->next = blocks;
+		blocks = b;
+	}
+	b->in_use = 1;
+	pthread_mutex_unlock(&blocks_lock);
+
+	pthread_setspecific(thread_key, b);
+	stats_local = b->counters;
+	return stats_local;
+}
+
+void stats_sum(uint64_t *totals)
+{
+	memset(totals, 0, STATS_MAX * sizeof(uint64_t));
+	pthread_mutex_lock(&blocks_lock);
+	for (struct stats_block_t *b = blocks; b; b = b->next)
+		for (int i = 0; i < STATS_MAX; ++i)
+			totals[i] += __atomic_load_n(&b->counters[i], __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&blocks_lock);
+}
@@ -0,0 +1,75 @@
+#ifndef STATS_H_INCLUDED
+#define STATS_H_INCLUDED
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+/* Event counters, kept per thread and summed when read
+ *
+ * Each thread adds to its own copy of the counters with plain loads and
+ * stores, so counting costs no more than an addition. stats_sum() adds up
+ * the copies of every thread that ever counted something, including those
+ * that have exited; the copy of an exited thread goes on with the next new
+ * one. Totals taken while other threads count may be a few events behind.
+ */
+enum {
+	/* System calls on the device, and the bytes they moved */
+	STAT_DEV_READS,
+	STAT_DEV_READ_BYTES,
+	STAT_DEV_WRITES,
+	STAT_DEV_WRITE_BYTES,
+	STAT_DEV_SYNCS,
+	/* Searches of the bitmaps for free inodes and blocks, and the bitmap blocks they read */
+	STAT_ALLOC_SCANS,
+	STAT_ALLOC_SCAN_BLOCKS,
+	/* Chunks of metadata read from the memory of the journal */
+	STAT_JOURNAL_HITS,
+
+	STAT_CORE_COUNT
+};
+
+/* Counters of each thread; those from STAT_CORE_COUNT on are for the program to use */
+#define STATS_MAX 128
+
+extern _Thread_local uint64_t *stats_local;
+
+/* Set up the counters of the calling thread */
+uint64_t *stats_register_thread(void);
+
+static inline void stats_add(unsigned int counter, uint64_t n)
+{
+	uint64_t *c = stats_local ? stats_local : stats_register_thread();
+	// Only this thread writes it; stats_sum() may read it at any time
+	__atomic_store_n(&c[counter], c[counter] + n, __ATOMIC_RELAXED);
+}
+
+/* Sum the counters of all threads into totals, which has STATS_MAX of them */
+void stats_sum(uint64_t *totals);
+
+/* pread(), pwrite() and fdatasync() on the device, counted */
+static inline ssize_t counted_pread(int fd, void *buffer, size_t len, off_t pos)
+{
+	const ssize_t r = pread(fd, buffer, len, pos);
+	stats_add(STAT_DEV_READS, 1);
+	if (r > 0)
+		stats_add(STAT_DEV_READ_BYTES, r);
+	return r;
+}
+
+static inline ssize_t counted_pwrite(int fd, const void *buffer, size_t len, off_t pos)
+{
+	const ssize_t r = pwrite(fd, buffer, len, pos);
+	stats_add(STAT_DEV_WRITES, 1);
+	if (r > 0)
+		stats_add(STAT_DEV_WRITE_BYTES, r);
+	return r;
+}
+
+static inline int counted_fdatasync(int fd)
+{
+	stats_add(STAT_DEV_SYNCS, 1);
+	return fdatasync(fd);
+}
+
+#endif
@@ -1,15 +1,26 @@
 #define _XOPEN_SOURCE 500
 
 #include "myfs.h"
+#include "util.h"
+#include "helpers.h"
+#include "dentry_cache.h"
+#include "dir_filter.h"
+#include "journal.h"
+#include "libmyfs.h"
+#include "stats.h"
 #include "asserts.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #define CMP_STRUCT(a, b) memcmp2(&a, &b, sizeof(a))
 
@@ -34,31 +45,85 @@ static void create_fs(uint64_t size)
 		exit(1);
 	}
 	ftruncate(fd, size);
-
-	struct fsinfo_t fs;
-	write_blank_fs(fd, &fs);
-
 	close(fd);
 
+	const int err = libmyfs_format(path, NULL);
+	if (err) {
+		fprintf(stderr, "Failed to format device: %s\n", strerror(-err));
+		exit(1);
+	}
+
 	file_size = size;
 }
 
+/*
+ * The tools are tested by running them, when they were built next to fstest
+ */
+static char tool_dir[4096] = "";
+
+static void find_tools(void)
+{
+	const ssize_t len = readlink("/proc/self/exe", tool_dir, sizeof(tool_dir) - 1);
+	tool_dir[MAX(len, 0)] = '\0';
+	char *slash = strrchr(tool_dir, '/');
+	if (slash)
+		*slash = '\0';
+}
+
+static int have_tool(const char *name)
+{
+	char tool[sizeof(tool_dir) + 64];
+	snprintf(tool, sizeof(tool), "%s/%s", tool_dir, name);
+	if (access(tool, X_OK) == 0)
+		return 1;
+	printf("%s not found, skipped\n", name);
+	return 0;
+}
+
+/* Run a shell command with the tools in PATH
+ *
+ * Its output, stderr included, goes to out, cut to out_size - 1 bytes.
+ * returns: its exit code; -1 if it didn't exit
+ */
+static int run_tool(char *out, size_t out_size, const char *format, ...)
+{
+	char command[2 * sizeof(tool_dir)];
+	int len = snprintf(command, sizeof(command), "{ PATH='%s':\"$PATH\"; ", tool_dir);
+	va_list args;
+	va_start(args, format);
+	len += vsnprintf(command + len, sizeof(command) - len, format, args);
+	va_end(args);
+	snprintf(command + len, sizeof(command) - len, "; } 2>&1");
+
+	FILE *p = popen(command, "r");
+	size_t used = 0, n;
+	while (used + 1 < out_size && (n = fread(out + used, 1, out_size - 1 - used, p)) > 0)
+		used += n;
+	out[used] = '\0';
+	// Leave nothing unread, or the command may block
+	char rest[256];
+	while (fread(rest, 1, sizeof(rest), p) > 0)
+		;
+	const int status = pclose(p);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
 static void print_fs_info(void)
 {
 	uint64_t wasted_bytes = file_size - fs.main_block.data_block_count * fs.main_block.block_size;
 	printf(
 			"Max number of inodes:      %u\n"
 			"Number of inodes:          %u\n"
-			"Total number of blocks:    %u\n"
-			"Number of usable blocks:   %u\n"
-			"Number of free blocks:     %u\n"
+			"Total number of blocks:    %lu\n"
+			"Number of usable blocks:   %lu\n"
+			"Number of free blocks:     %lu\n"
 			"Block size:                %hu\n"
 			"Reserved space:            %.2f%%\n"
 			, fs.main_block.inode_count_limit
 			, fs.main_block.inode_count
-			, fs.main_block.block_count
-			, fs.main_block.data_block_count
-			, fs.main_block.free_data_block_count
+			, (unsigned long)fs.main_block.block_count
+			, (unsigned long)fs.main_block.data_block_count
+			, (unsigned long)fs.main_block.free_data_block_count
 			, fs.main_block.block_size
 			, (100.0f * wasted_bytes) / file_size
 		  );
@@ -237,9 +302,378 @@ static void test_inode_read_write_random(uint32_t fsize)
 	free(data);
 }
 
+struct concurrent_file
+{
+	struct inode_t inode;
+	uint32_t num;
+	uint32_t seed;
+};
+
+static void *concurrent_write_thread(void *data)
+{
+	struct concurrent_file *f = (struct concurrent_file *)data;
+	uint8_t buf[3000];
+	// Grow the file in small pieces so that block allocations interleave
+	for (uint32_t i = 0; i < 100; ++i) {
+		for (uint32_t j = 0; j < sizeof(buf); ++j)
+			buf[j] = f->seed + i + j;
+		inode_data_write(fd, &fs, &f->inode, buf, sizeof(buf), (uint64_t)i * sizeof(buf));
+	}
+	write_inode(fd, &fs, f->num, &f->inode);
+	return NULL;
+}
+
+static void test_concurrent_writes(void)
+{
+	const int thread_count = 4;
+	struct concurrent_file files[thread_count];
+	pthread_t threads[thread_count];
+	const uint32_t free_blocks = fs.main_block.free_data_block_count;
+	for (int i = 0; i < thread_count; ++i) {
+		clear_inode(&files[i].inode);
+		create_inode(fd, &fs, &files[i].inode, &files[i].num);
+		files[i].seed = i * 17;
+	}
+	for (int i = 0; i < thread_count; ++i)
+		pthread_create(&threads[i], NULL, concurrent_write_thread, &files[i]);
+	for (int i = 0; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+
+	uint32_t used_blocks = 0;
+	for (int i = 0; i < thread_count; ++i) {
+		used_blocks += files[i].inode.blocks;
+		uint8_t buf[3000];
+		for (uint32_t p = 0; p < 100; ++p) {
+			inode_data_read(fd, &fs, &files[i].inode, buf, sizeof(buf), (uint64_t)p * sizeof(buf));
+			int ok = 1;
+			for (uint32_t j = 0; j < sizeof(buf) && ok; ++j)
+				ok = (buf[j] == (uint8_t)(files[i].seed + p + j));
+			EXPECT_S(ok, "Wrong content in file %d, piece %u", i, p);
+		}
+	}
+	// Every block was handed out once, to a single file
+	EXPECT(fs.main_block.free_data_block_count < free_blocks - used_blocks + 1);
+	for (int i = 0; i < thread_count; ++i)
+		remove_file(fd, &fs, files[i].num, &files[i].inode);
+	EXPECT_EQUAL(fs.main_block.free_data_block_count, free_blocks);
+}
+
+static void test_map_file_range(void)
+{
+	const uint32_t bs = fs.main_block.block_size;
+	const uint64_t size = 40 * (uint64_t)bs + 123;
+	struct inode_t inode;
+	uint32_t inode_num;
+	clear_inode(&inode);
+	create_inode(fd, &fs, &inode, &inode_num);
+	uint8_t *data = (uint8_t *)malloc(size);
+	for (uint64_t i = 0; i < size; ++i)
+		data[i] = i * 7 + 3;
+	inode_data_write(fd, &fs, &inode, data, size, 0);
+
+	// Unaligned at both ends and past the direct blocks
+	const uint64_t pos = 5 * (uint64_t)bs + 17, len = 30 * (uint64_t)bs + 50;
+	struct data_extent_t extents[64];
+	uint32_t count = map_file_range(fd, &fs, &inode, pos, len, extents, 64);
+	EXPECT(count > 0 && count <= 31);
+
+	uint64_t total = 0;
+	uint8_t *buf = (uint8_t *)malloc(len);
+	for (uint32_t i = 0; i < count; ++i) {
+		EXPECT(extents[i].dev_pos >= fs.blocks_pos);
+		pread(fd, buf + total, extents[i].len, extents[i].dev_pos);
+		total += extents[i].len;
+	}
+	EXPECT_EQUAL(total, len);
+	EXPECT(memcmp(buf, data + pos, len) == 0);
+
+	// Only the beginning is mapped when there is no room for all extents
+	count = map_file_range(fd, &fs, &inode, pos, len, extents, 1);
+	EXPECT_EQUAL(count, 1);
+	EXPECT(extents[0].len <= len);
+	pread(fd, buf, extents[0].len, extents[0].dev_pos);
+	EXPECT(memcmp(buf, data + pos, extents[0].len) == 0);
+
+	free(buf);
+	free(data);
+	remove_file(fd, &fs, inode_num, &inode);
+}
+
+static void test_inode_data_copy(void)
+{
+	const uint32_t bs = fs.main_block.block_size;
+	const uint64_t size = 3 * 1024 * 1024 + 77;
+	struct inode_t src, dest;
+	uint32_t src_num, dest_num;
+	clear_inode(&src);
+	clear_inode(&dest);
+	create_inode(fd, &fs, &src, &src_num);
+	create_inode(fd, &fs, &dest, &dest_num);
+
+	uint8_t *data = (uint8_t *)malloc(size);
+	for (uint64_t i = 0; i < size; ++i)
+		data[i] = i * 13 + i / 1000;
+	inode_data_write(fd, &fs, &src, data, size, 0);
+	inode_data_write(fd, &fs, &dest, data, bs, 0);
+
+	// Unaligned, so that the source and destination blocks don't line up
+	const uint64_t src_pos = 100, dest_pos = bs / 2;
+	EXPECT_EQUAL(inode_data_copy(fd, &fs, &src, src_pos, &dest, dest_pos, size), size - src_pos);
+	EXPECT_EQUAL(dest.size, dest_pos + size - src_pos);
+
+	uint8_t *buf = (uint8_t *)malloc(dest.size);
+	inode_data_read(fd, &fs, &dest, buf, dest.size, 0);
+	EXPECT(memcmp(buf, data, dest_pos) == 0);
+	EXPECT(memcmp(buf + dest_pos, data + src_pos, size - src_pos) == 0);
+
+	// Within a single file
+	EXPECT_EQUAL(inode_data_copy(fd, &fs, &src, 0, &src, size, 5000), 5000);
+	inode_data_read(fd, &fs, &src, buf, 5000, size);
+	EXPECT(memcmp(buf, data, 5000) == 0);
+
+	EXPECT_EQUAL(inode_data_copy(fd, &fs, &src, src.size, &dest, 0, 10), 0);
+
+	free(buf);
+	free(data);
+	remove_file(fd, &fs, src_num, &src);
+	remove_file(fd, &fs, dest_num, &dest);
+}
+
+static int file_content_is(struct inode_t *inode, const uint8_t *data, uint64_t size)
+{
+	if (inode->size != size)
+		return 0;
+	uint8_t *buf = (uint8_t *)malloc(size);
+	inode_data_read(fd, &fs, inode, buf, size, 0);
+	int ret = memcmp(buf, data, size) == 0;
+	free(buf);
+	return ret;
+}
+
+static void test_clone_file(void)
+{
+	const uint32_t bs = fs.main_block.block_size;
+	const uint64_t size = 2000 * (uint64_t)bs + 10;
+	struct inode_t src, dest, dest2;
+	uint32_t src_num, dest_num, dest2_num;
+	clear_inode(&src);
+	clear_inode(&dest);
+	clear_inode(&dest2);
+	create_inode(fd, &fs, &src, &src_num);
+	create_inode(fd, &fs, &dest, &dest_num);
+	create_inode(fd, &fs, &dest2, &dest2_num);
+
+	uint8_t *data = (uint8_t *)malloc(size);
+	for (uint64_t i = 0; i < size; ++i)
+		data[i] = i * 5 + i / 3000;
+	inode_data_write(fd, &fs, &src, data, size, 0);
+	// Dropped by the clone
+	inode_data_write(fd, &fs, &dest, data, 3 * bs, 0);
+
+	const uint32_t free_blocks = fs.main_block.free_data_block_count;
+	const uint32_t indirect = file_block_count(&fs, &src) > 12 ? 3 : 0; // 1 singly + 1 doubly + 1 singly
+	EXPECT_EQUAL(clone_file(fd, &fs, &src, &dest), 0);
+	EXPECT_EQUAL(clone_file(fd, &fs, &src, &dest2), 0);
+	// Only the new indirect blocks are allocated; dest gave its 3 blocks back
+	EXPECT_EQUAL(fs.main_block.free_data_block_count, free_blocks + 3 - 2 * indirect);
+	EXPECT(file_content_is(&dest, data, size));
+	EXPECT(file_content_is(&dest2, data, size));
+	EXPECT(get_file_block(fd, &fs, &src, 1500) == get_file_block(fd, &fs, &dest, 1500));
+
+	// Writing to a clone copies only the modified blocks
+	uint8_t patch[100];
+	memset(patch, 0xAB, sizeof(patch));
+	inode_data_write(fd, &fs, &dest, patch, sizeof(patch), 1500 * (uint64_t)bs - 50);
+	EXPECT_EQUAL(fs.main_block.free_data_block_count, free_blocks + 3 - 2 * indirect - 2);
+	EXPECT(file_content_is(&src, data, size));
+	EXPECT(file_content_is(&dest2, data, size));
+	memcpy(data + 1500 * (uint64_t)bs - 50, patch, sizeof(patch));
+	EXPECT(file_content_is(&dest, data, size));
+
+	// Blocks are freed once their last user is gone
+	src.nlinks = dest.nlinks = dest2.nlinks = 0;
+	remove_file(fd, &fs, src_num, &src);
+	remove_file(fd, &fs, dest_num, &dest);
+	EXPECT(!file_content_is(&dest2, data, size)); // dest2 keeps the original content
+	remove_file(fd, &fs, dest2_num, &dest2);
+	EXPECT_EQUAL(fs.main_block.free_data_block_count, free_blocks + 3 + CEIL_DIV(size, bs) + indirect);
+	free(data);
+}
+
+static void test_sparse_file(void)
+{
+	const uint32_t bs = fs.main_block.block_size;
+	const uint32_t c = bs / 4; // blocks per indirect block
+	struct inode_t inode;
+	uint32_t inode_num;
+	clear_inode(&inode);
+	create_inode(fd, &fs, &inode, &inode_num);
+
+	// Growing a file doesn't allocate anything
+	const uint32_t free_blocks = fs.main_block.free_data_block_count;
+	const uint64_t size = (12 + c + 3 * (uint64_t)c) * bs;
+	resize_file(fd, &fs, &inode, size);
+	EXPECT_EQUAL(fs.main_block.free_data_block_count, free_blocks);
+	EXPECT_EQUAL(inode.blocks, 0);
+	EXPECT_EQUAL(seek_file_data(fd, &fs, &inode, 0, 0), -1);
+	EXPECT_EQUAL(seek_file_data(fd, &fs, &inode, 0, 1), 0);
+
+	// Only the written block and its indirect blocks are allocated
+	uint8_t data[100];
+	memset(data, 0x5A, sizeof(data));
+	const uint64_t pos = size - 2 * (uint64_t)bs + 10;
+	inode_data_write(fd, &fs, &inode, data, sizeof(data), pos);
+	EXPECT_EQUAL(fs.main_block.free_data_block_count, free_blocks - 3);
+	EXPECT_EQUAL(inode.size, size);
+	// stat() reports only those
+	EXPECT_EQUAL(inode.blocks, 3);
+	struct stat st;
+	inode_stat(&fs, inode_num, &inode, &st);
+	EXPECT_EQUAL(st.st_blocks, 3 * (bs / 512));
+
+	uint8_t *buf = (uint8_t *)malloc(size);
+	inode_data_read(fd, &fs, &inode, buf, size, 0);
+	for (uint64_t i = 0; i < size; ++i)
+		EXPECT_EQUAL(buf[i], i >= pos && i < pos + sizeof(data) ? 0x5A : 0);
+
+	const uint64_t data_pos = size - 2 * (uint64_t)bs;
+	EXPECT_EQUAL(seek_file_data(fd, &fs, &inode, 0, 0), data_pos);
+	EXPECT_EQUAL(seek_file_data(fd, &fs, &inode, data_pos + 5, 0), data_pos + 5);
+	EXPECT_EQUAL(seek_file_data(fd, &fs, &inode, 0, 1), 0);
+	EXPECT_EQUAL(seek_file_data(fd, &fs, &inode, data_pos, 1), data_pos + bs);
+	EXPECT_EQUAL(seek_file_data(fd, &fs, &inode, data_pos + bs, 0), -1);
+	EXPECT_EQUAL(seek_file_data(fd, &fs, &inode, size, 1), -1);
+
+	// Data cut off by truncation doesn't come back when the file grows again
+	resize_file(fd, &fs, &inode, pos + 50);
+	resize_file(fd, &fs, &inode, size);
+	inode_data_read(fd, &fs, &inode, buf, size - pos, pos);
+	for (uint64_t i = 0; i < size - pos; ++i)
+		EXPECT_EQUAL(buf[i], i < 50 ? 0x5A : 0);
+
+	resize_file(fd, &fs, &inode, 0);
+	EXPECT_EQUAL(fs.main_block.free_data_block_count, free_blocks);
+	EXPECT_EQUAL(inode.blocks, 0);
+	free(buf);
+	remove_file(fd, &fs, inode_num, &inode);
+}
+
+/* returns: the number of runs of contiguous blocks of a file, holes apart */
+static uint64_t file_extent_count(struct inode_t *inode)
+{
+	const uint64_t block_count = file_block_count(&fs, inode);
+	uint64_t *blocks = (uint64_t *)malloc(block_count * sizeof(uint64_t));
+	read_file_blocks(fd, &fs, inode, 0, block_count, blocks);
+	uint64_t extents = 0, prev = 0;
+	for (uint64_t i = 0; i < block_count; ++i) {
+		if (blocks[i] != 0 && (extents == 0 || blocks[i] != prev + 1))
+			++extents;
+		prev = blocks[i];
+	}
+	free(blocks);
+	return extents;
+}
+
+static void test_defrag(void)
+{
+	const uint32_t bs = fs.main_block.block_size;
+	const uint32_t block_count = 300;
+	const uint64_t size = block_count * (uint64_t)bs;
+	struct inode_t a, b;
+	uint32_t a_num, b_num;
+	clear_inode(&a);
+	clear_inode(&b);
+	create_inode(fd, &fs, &a, &a_num);
+	create_inode(fd, &fs, &b, &b_num);
+	const uint64_t free_blocks = fs.main_block.free_data_block_count;
+
+	// Growing both files a block at a time interleaves their blocks
+	uint8_t *data_a = (uint8_t *)malloc(size);
+	uint8_t *data_b = (uint8_t *)malloc(size);
+	for (uint64_t i = 0; i < size; ++i) {
+		data_a[i] = i * 7 + i / 5000;
+		data_b[i] = i * 11 + 1;
+	}
+	for (uint32_t i = 0; i < block_count; ++i) {
+		inode_data_write(fd, &fs, &a, data_a + i * (uint64_t)bs, bs, i * (uint64_t)bs);
+		inode_data_write(fd, &fs, &b, data_b + i * (uint64_t)bs, bs, i * (uint64_t)bs);
+	}
+	// And a hole in the middle of b
+	resize_file(fd, &fs, &b, 100 * (uint64_t)bs);
+	resize_file(fd, &fs, &b, size);
+	memset(data_b + 100 * (uint64_t)bs, 0, size - 100 * (uint64_t)bs);
+	inode_data_write(fd, &fs, &b, data_b + 200 * (uint64_t)bs, bs, 200 * (uint64_t)bs);
+	EXPECT(file_extent_count(&a) > 1);
+
+	uint64_t goal = 0;
+	EXPECT_EQUAL(defrag_file(fd, &fs, a_num, &a, 0, &goal), 1);
+	EXPECT_EQUAL(file_extent_count(&a), 1);
+	EXPECT(file_content_is(&a, data_a, size));
+	EXPECT_EQUAL(defrag_file(fd, &fs, a_num, &a, 0, &goal), 0);
+
+	// Moving the indirect blocks too puts them right before the data
+	EXPECT_EQUAL(defrag_file(fd, &fs, b_num, &b, 1, &goal), 1);
+	EXPECT_EQUAL(file_extent_count(&b), 2);
+	EXPECT(file_content_is(&b, data_b, size));
+	EXPECT_EQUAL(b.blockpos[12] + 1, b.blockpos[0]);
+	EXPECT_EQUAL(defrag_file(fd, &fs, b_num, &b, 1, &goal), 0);
+	read_inode(fd, &fs, b_num, &b);
+	EXPECT(file_content_is(&b, data_b, size));
+
+	// Nothing is lost or leaked, and files that share blocks stay where they are
+	const uint64_t used = (fs.main_block.features & MYFS_FEATURE_SPARSE) ? 2 * block_count - 199 : 2 * block_count;
+	const uint64_t indirect = 2 * calc_indirect_block_count(&fs, block_count).total_indirect;
+	EXPECT_EQUAL(free_blocks - fs.main_block.free_data_block_count, used + indirect);
+	b.mode |= mode_shared;
+	if (fs.refcounts_pos)
+		EXPECT_EQUAL(defrag_file(fd, &fs, b_num, &b, 1, &goal), 0);
+
+	a.nlinks = b.nlinks = 0;
+	remove_file(fd, &fs, a_num, &a);
+	remove_file(fd, &fs, b_num, &b);
+	EXPECT_EQUAL(fs.main_block.free_data_block_count, free_blocks);
+	free(data_a);
+	free(data_b);
+}
+
+/* Filesystems made before the main block had a magic number must still be read */
+static void test_legacy_format(void)
+{
+	struct fsinfo_t legacy = fs;
+	legacy.main_block.magic = 0;
+	legacy.main_block.features = 0;
+	legacy.main_block.journal_blocks = 0;
+	initialize_fsinfo_from_main_block(&legacy, &legacy.main_block);
+	EXPECT_EQUAL(legacy.inode_bitmap_pos, MAIN_BLOCK_SIZE);
+	EXPECT_EQUAL(legacy.refcounts_pos, 0);
+	write_main_block(fd, &legacy);
+	write_blank_inode_bitmap(fd, &legacy);
+	write_blank_data_bitmap(fd, &legacy);
+	write_root_directory(fd, &legacy);
+
+	struct fsinfo_t read;
+	read_fsinfo(fd, &read);
+	EXPECT_EQUAL(read.main_block.magic, 0);
+	EXPECT_EQUAL(read.main_block.features, 0);
+	EXPECT_EQUAL(read.inode_bitmap_pos, MAIN_BLOCK_SIZE);
+	EXPECT_EQUAL(read.inodes_pos, legacy.inodes_pos);
+	EXPECT_EQUAL(get_inode_state(fd, &read, 0), 1);
+
+	struct inode_t src, dest;
+	clear_inode(&src);
+	clear_inode(&dest);
+	EXPECT_EQUAL(clone_file(fd, &read, &src, &dest), EOPNOTSUPP);
+
+	write_blank_fs(fd, &fs, MYFS_FEATURES_DEFAULT);
+	read_fsinfo(fd, &read);
+	EXPECT_EQUAL(read.main_block.magic, MYFS_MAGIC);
+	EXPECT_EQUAL(read.main_block.features, MYFS_FEATURES_DEFAULT);
+	EXPECT_EQUAL(read.inode_bitmap_pos, MAIN_BLOCK_EXT_SIZE);
+}
+
 static void test_get_path(void)
 {
-	write_blank_fs(fd, &fs);
+	write_blank_fs(fd, &fs, MYFS_FEATURES_DEFAULT);
 	struct inode_t root_inode;
 	read_inode(fd, &fs, 0, &root_inode);
 	struct inode_t inode[10];
@@ -269,7 +703,7 @@ static void test_get_path(void)
 
 static void test_remove_files(int file_count, int *remove_order)
 {
-	write_blank_fs(fd, &fs);
+	write_blank_fs(fd, &fs, MYFS_FEATURES_DEFAULT);
 	struct inode_t root_inode;
 	read_inode(fd, &fs, 0, &root_inode);
 	struct inode_t inode[file_count];
@@ -293,7 +727,7 @@ static void test_remove_files(int file_count, int *remove_order)
 
 	for (int j = 0; j < file_count; ++j) {
 		uint32_t removed = remove_order[j];
-		EXPECT_EQUAL(file_exists[removed], remove_inode_from_dir(fd, &fs, &root_inode, removed + 1, &inode[removed]));
+		EXPECT_EQUAL(file_exists[removed], remove_inode_from_dir(fd, &fs, 0, &root_inode, removed + 1, &inode[removed]));
 		write_inode(fd, &fs, 0, &root_inode);
 		file_exists[removed] = 0;
 
@@ -313,9 +747,315 @@ static void test_remove_files(int file_count, int *remove_order)
 	}
 }
 
+static void test_dentry_cache(void)
+{
+	write_blank_fs(fd, &fs, MYFS_FEATURES_DEFAULT);
+	struct dentry_cache_t dc;
+	// Small enough to force evictions
+	dentry_cache_initialize(&dc, 24 * (sizeof(struct dentry_cache_node_t) + 8));
+	fs.dcache = &dc;
+
+	struct inode_t root_inode;
+	read_inode(fd, &fs, 0, &root_inode);
+
+	uint32_t dir_num;
+	struct inode_t dir;
+	initialize_inode(&dir, 0, 0, 0755 | mode_ftype_dir);
+	create_inode(fd, &fs, &dir, &dir_num);
+	add_inode_to_dir(fd, &fs, 0, &root_inode, dir_num, &dir, "dir");
+
+	const int file_count = 16;
+	struct inode_t inode[file_count];
+	uint32_t numbers[file_count];
+	for (int i = 0; i < file_count; ++i) {
+		char path[64];
+		sprintf(path, "/dir/file-%d", i);
+		uint32_t inode_num;
+		struct inode_t in;
+		// Creates a negative entry
+		EXPECT_S(!get_path_inode(fd, &fs, path, &inode_num, &in, NULL, NULL, NULL), "File %s shouldn't exist", path);
+
+		initialize_inode(&inode[i], 0, 0, 0644 | mode_ftype_file);
+		create_inode(fd, &fs, &inode[i], &numbers[i]);
+		add_inode_to_dir(fd, &fs, dir_num, &dir, numbers[i], &inode[i], path + 5);
+
+		EXPECT_S(get_path_inode(fd, &fs, path, &inode_num, &in, NULL, NULL, NULL), "Failed to get inode for path %s", path);
+		EXPECT_EQUAL(inode_num, numbers[i]);
+	}
+	EXPECT(dc.used_bytes <= dc.max_bytes);
+
+	for (int i = 0; i < file_count; i += 2)
+		EXPECT(remove_inode_from_dir(fd, &fs, dir_num, &dir, numbers[i], &inode[i]));
+
+	for (int j = 0; j < 2; ++j) {
+		for (int i = 0; i < file_count; ++i) {
+			char path[64];
+			sprintf(path, "/dir/file-%d", i);
+			uint32_t inode_num, dir_inode_num;
+			struct inode_t in;
+			if (i % 2) {
+				EXPECT_S(get_path_inode(fd, &fs, path, &inode_num, &in, &dir_inode_num, NULL, NULL), "Failed to get inode for path %s", path);
+				EXPECT_EQUAL(inode_num, numbers[i]);
+				EXPECT_EQUAL(dir_inode_num, dir_num);
+			} else {
+				EXPECT_S(!get_path_inode(fd, &fs, path, &inode_num, &in, NULL, NULL, NULL), "File %s exists, but it should've been removed", path);
+			}
+		}
+	}
+	EXPECT(dc.hits > 0);
+	EXPECT(dc.negative_hits > 0);
+
+	fs.dcache = NULL;
+	dentry_cache_destroy(&dc);
+}
+
+static void test_dir_filter(void)
+{
+	write_blank_fs(fd, &fs, MYFS_FEATURES_DEFAULT);
+	struct dir_filter_map_t map;
+	dir_filter_map_initialize(&map, 1024 * 1024);
+	fs.dfilters = &map;
+
+	struct inode_t root_inode;
+	read_inode(fd, &fs, 0, &root_inode);
+
+	const int file_count = 200;
+	struct inode_t inode[file_count];
+	uint32_t numbers[file_count];
+	char name[64];
+	uint32_t inode_num;
+	for (int i = 0; i < file_count / 2; ++i) {
+		sprintf(name, "file-%d", i);
+		initialize_inode(&inode[i], 0, 0, 0644 | mode_ftype_file);
+		create_inode(fd, &fs, &inode[i], &numbers[i]);
+		add_inode_to_dir(fd, &fs, 0, &root_inode, numbers[i], &inode[i], name);
+	}
+
+	// The first search builds the filter
+	EXPECT(!lookup_dir_entry(fd, &fs, 0, &root_inode, "missing", 7, &inode_num));
+	EXPECT_EQUAL(map.builds, 1);
+	EXPECT(dir_filter_get(&map, 0) != NULL);
+
+	// The filter is kept up to date by adding and removing entries
+	for (int i = file_count / 2; i < file_count; ++i) {
+		sprintf(name, "file-%d", i);
+		initialize_inode(&inode[i], 0, 0, 0644 | mode_ftype_file);
+		create_inode(fd, &fs, &inode[i], &numbers[i]);
+		add_inode_to_dir(fd, &fs, 0, &root_inode, numbers[i], &inode[i], name);
+	}
+	for (int i = 0; i < file_count; i += 3)
+		EXPECT(remove_inode_from_dir(fd, &fs, 0, &root_inode, numbers[i], &inode[i]));
+
+	for (int i = 0; i < file_count; ++i) {
+		sprintf(name, "file-%d", i);
+		int found = lookup_dir_entry(fd, &fs, 0, &root_inode, name, strlen(name), &inode_num);
+		EXPECT_S(found == (i % 3 != 0), "Entry %s %s", name, found ? "found" : "not found");
+		if (found)
+			EXPECT_EQUAL(inode_num, numbers[i]);
+	}
+
+	// Most misses shouldn't read the directory
+	const uint64_t negatives = map.negatives;
+	for (int i = 0; i < 1000; ++i) {
+		sprintf(name, "other-%d", i);
+		EXPECT(!lookup_dir_entry(fd, &fs, 0, &root_inode, name, strlen(name), &inode_num));
+	}
+	EXPECT(map.negatives - negatives > 900);
+	EXPECT(dir_filter_false_positive_rate(&map) < 0.1);
+
+	// Save and load the filters
+	FILE *f = tmpfile();
+	EXPECT_EQUAL(dir_filter_map_save(&map, f, 42), 0);
+	struct dir_filter_map_t loaded;
+	dir_filter_map_initialize(&loaded, 1024 * 1024);
+	rewind(f);
+	EXPECT(dir_filter_map_load(&loaded, f, 43) != 0);
+	EXPECT(dir_filter_get(&loaded, 0) == NULL);
+	rewind(f);
+	EXPECT_EQUAL(dir_filter_map_load(&loaded, f, 42), 0);
+	fclose(f);
+
+	struct dir_filter_t *a = dir_filter_get(&map, 0), *b = dir_filter_get(&loaded, 0);
+	EXPECT(a != NULL && b != NULL);
+	if (a && b) {
+		EXPECT_EQUAL(a->count, b->count);
+		EXPECT_EQUAL(a->size, b->size);
+		EXPECT(memcmp(a->counters, b->counters, a->size) == 0);
+	}
+	dir_filter_map_destroy(&loaded);
+
+	fs.dfilters = NULL;
+	dir_filter_map_destroy(&map);
+}
+
+struct read_dir_page
+{
+	int seen[64];
+	uint32_t count;
+	uint64_t next_pos;
+};
+
+static int read_dir_page_cb(void *data, uint32_t inode_num, const char *name, uint16_t name_len,
+		uint64_t pos, uint64_t next_pos)
+{
+	struct read_dir_page *page = (struct read_dir_page *)data;
+	if (page->count == 7)
+		return 1;
+	++page->seen[inode_num - 1];
+	++page->count;
+	page->next_pos = next_pos;
+	return 0;
+}
+
+static void test_read_dir(void)
+{
+	write_blank_fs(fd, &fs, MYFS_FEATURES_DEFAULT);
+	struct inode_t root_inode;
+	read_inode(fd, &fs, 0, &root_inode);
+
+	const int file_count = 64;
+	struct inode_t inode[file_count];
+	uint32_t numbers[file_count];
+	for (int i = 0; i < file_count; ++i) {
+		char name[64];
+		sprintf(name, "file-with-a-longer-name-%d", i);
+		initialize_inode(&inode[i], i, i, 0644 | mode_ftype_file);
+		create_inode(fd, &fs, &inode[i], &numbers[i]);
+		EXPECT_EQUAL(numbers[i], i + 1);
+		add_inode_to_dir(fd, &fs, 0, &root_inode, numbers[i], &inode[i], name);
+	}
+
+	// Read the directory in pages, removing some entries that were already seen
+	struct read_dir_page page;
+	memset(&page, 0, sizeof(page));
+	uint64_t pos = 0;
+	int removed = 0;
+	while (pos < root_inode.size) {
+		page.count = 0;
+		read_dir(fd, &fs, &root_inode, pos, read_dir_page_cb, &page);
+		if (page.count == 0)
+			break;
+		pos = page.next_pos;
+		if (removed < file_count && page.seen[removed]) {
+			EXPECT(remove_inode_from_dir(fd, &fs, 0, &root_inode, numbers[removed], &inode[removed]));
+			removed += 3;
+		}
+	}
+	for (int i = 0; i < file_count; ++i)
+		EXPECT_S(page.seen[i] == 1, "Entry %d was seen %d times", i, page.seen[i]);
+
+	// Batched inode reads should match single ones
+	uint32_t nums[] = { 40, 2, 17, 3, 64, 1, 2 };
+	const uint32_t count = sizeof(nums) / sizeof(nums[0]);
+	struct inode_t inodes[count];
+	read_inodes(fd, &fs, count, nums, inodes);
+	for (uint32_t i = 0; i < count; ++i) {
+		struct inode_t in;
+		read_inode(fd, &fs, nums[i], &in);
+		EXPECT_EQUAL(inodes[i].uid, nums[i] - 1);
+		EXPECT_EQUAL(inodes[i].uid, in.uid);
+		EXPECT_EQUAL(inodes[i].mode, in.mode);
+	}
+
+	struct inode_t range[64];
+	read_inode_range(fd, &fs, 1, 64, range);
+	for (uint32_t i = 0; i < 64; ++i)
+		EXPECT_EQUAL(range[i].uid, i);
+
+	// Removing the entry a read resumes at must not bring it back
+	write_blank_fs(fd, &fs, MYFS_FEATURES_DEFAULT);
+	read_inode(fd, &fs, 0, &root_inode);
+	for (int i = 0; i < 10; ++i) {
+		char name[64];
+		sprintf(name, "file-%d", i);
+		initialize_inode(&inode[i], i, i, 0644 | mode_ftype_file);
+		create_inode(fd, &fs, &inode[i], &numbers[i]);
+		add_inode_to_dir(fd, &fs, 0, &root_inode, numbers[i], &inode[i], name);
+	}
+	memset(&page, 0, sizeof(page));
+	read_dir(fd, &fs, &root_inode, 0, read_dir_page_cb, &page);
+	EXPECT_EQUAL(page.count, 7);
+	EXPECT(remove_inode_from_dir(fd, &fs, 0, &root_inode, numbers[7], &inode[7]));
+	page.count = 0;
+	read_dir(fd, &fs, &root_inode, page.next_pos, read_dir_page_cb, &page);
+	EXPECT_EQUAL(page.count, 2);
+	EXPECT_EQUAL(page.seen[7], 0);
+
+	// The same for the first entry
+	memset(&page, 0, sizeof(page));
+	page.count = 7; // stop at the first entry
+	pos = read_dir(fd, &fs, &root_inode, 0, read_dir_page_cb, &page);
+	EXPECT(remove_inode_from_dir(fd, &fs, 0, &root_inode, numbers[0], &inode[0]));
+	page.count = 0;
+	read_dir(fd, &fs, &root_inode, pos, read_dir_page_cb, &page);
+	EXPECT_EQUAL(page.count, 7);
+	EXPECT_EQUAL(page.seen[0], 0);
+	EXPECT_EQUAL(page.seen[1], 1);
+}
+
+static void test_compact_dir(void)
+{
+	write_blank_fs(fd, &fs, MYFS_FEATURES_DEFAULT);
+	struct inode_t root_inode;
+	read_inode(fd, &fs, 0, &root_inode);
+
+	// With long names, removing entries from the front makes `starting_pos` overflow
+	const int file_count = 300;
+	struct inode_t inode[file_count];
+	uint32_t numbers[file_count];
+	char name[256];
+	for (int i = 0; i < file_count; ++i) {
+		sprintf(name, "%0200d", i);
+		initialize_inode(&inode[i], i, i, 0644 | mode_ftype_file);
+		create_inode(fd, &fs, &inode[i], &numbers[i]);
+		add_inode_to_dir(fd, &fs, 0, &root_inode, numbers[i], &inode[i], name);
+	}
+	const uint64_t full_size = root_inode.size;
+
+	// Remove the first 280 entries, then every second of the remaining ones
+	for (int i = 0; i < 280; ++i)
+		EXPECT(remove_inode_from_dir(fd, &fs, 0, &root_inode, numbers[i], &inode[i]));
+	for (int i = 280; i < file_count; i += 2)
+		EXPECT(remove_inode_from_dir(fd, &fs, 0, &root_inode, numbers[i], &inode[i]));
+	EXPECT(root_inode.size < full_size);
+
+	const uint32_t free_blocks = fs.main_block.free_data_block_count;
+	const uint64_t size = root_inode.size;
+	const uint64_t slack = dir_slack(fd, &fs, &root_inode);
+	EXPECT(slack > 0);
+	EXPECT_EQUAL(compact_dir(fd, &fs, 0, &root_inode), slack);
+	EXPECT_EQUAL(root_inode.size, size - slack);
+	EXPECT_EQUAL(root_inode.size, 0x6 + 10 * (200 + 10));
+	EXPECT_EQUAL(dir_slack(fd, &fs, &root_inode), 0);
+	EXPECT(fs.main_block.free_data_block_count >= free_blocks);
+
+	{
+		struct inode_t in;
+		read_inode(fd, &fs, 0, &in);
+		EXPECT_EQUAL(in.size, root_inode.size);
+		EXPECT_EQUAL(in.blocks, root_inode.blocks);
+	}
+
+	for (int i = 0; i < file_count; ++i) {
+		uint32_t inode_num;
+		sprintf(name, "%0200d", i);
+		int found = lookup_dir_entry(fd, &fs, 0, &root_inode, name, strlen(name), &inode_num);
+		EXPECT_S(found == (i >= 280 && i % 2 == 1), "Entry %d %s", i, found ? "found" : "not found");
+		if (found)
+			EXPECT_EQUAL(inode_num, numbers[i]);
+	}
+
+	// Entries can still be added and removed
+	EXPECT(remove_inode_from_dir(fd, &fs, 0, &root_inode, numbers[281], &inode[281]));
+	add_inode_to_dir(fd, &fs, 0, &root_inode, numbers[0], &inode[0], "new");
+	uint32_t inode_num;
+	EXPECT(lookup_dir_entry(fd, &fs, 0, &root_inode, "new", 3, &inode_num));
+	EXPECT_EQUAL(inode_num, numbers[0]);
+}
+
 static void test_hard_links(void)
 {
-	write_blank_fs(fd, &fs);
+	write_blank_fs(fd, &fs, MYFS_FEATURES_DEFAULT);
 	struct inode_t root_inode;
 	read_inode(fd, &fs, 0, &root_inode);
 
@@ -333,22 +1073,902 @@ static void test_hard_links(void)
 
 	uint32_t inode_num;
 	struct inode_t inode;
+	clear_inode(&inode);
 	create_inode(fd, &fs, &inode, &inode_num);
 	add_inode_to_dir(fd, &fs, n1, &i1, inode_num, &inode, "f1");
 	add_inode_to_dir(fd, &fs, n2, &i2, inode_num, &inode, "f2");
 	add_inode_to_dir(fd, &fs, n3, &i3, inode_num, &inode, "f3");
 
-	EXPECT(remove_inode_from_dir(fd, &fs, &i1, inode_num, &inode));
-	EXPECT(!remove_inode_from_dir(fd, &fs, &i1, inode_num, &inode));
+	EXPECT(remove_inode_from_dir(fd, &fs, n1, &i1, inode_num, &inode));
+	EXPECT(!remove_inode_from_dir(fd, &fs, n1, &i1, inode_num, &inode));
 
-	EXPECT(remove_inode_from_dir(fd, &fs, &i2, inode_num, &inode));
-	EXPECT(!remove_inode_from_dir(fd, &fs, &i2, inode_num, &inode));
+	EXPECT(remove_inode_from_dir(fd, &fs, n2, &i2, inode_num, &inode));
+	EXPECT(!remove_inode_from_dir(fd, &fs, n2, &i2, inode_num, &inode));
 
-	EXPECT(remove_inode_from_dir(fd, &fs, &i3, inode_num, &inode));
-	EXPECT(!remove_inode_from_dir(fd, &fs, &i3, inode_num, &inode));
+	EXPECT(remove_inode_from_dir(fd, &fs, n3, &i3, inode_num, &inode));
+	EXPECT(!remove_inode_from_dir(fd, &fs, n3, &i3, inode_num, &inode));
 
 	EXPECT(inode.nlinks == 0);
 	EXPECT(get_inode_state(fd, &fs, inode_num) == 0);
+
+	// An orphan keeps its inode and blocks until it is removed
+	const uint32_t free_blocks = fs.main_block.free_data_block_count;
+	uint8_t data[3000] = { 5 };
+	clear_inode(&inode);
+	create_inode(fd, &fs, &inode, &inode_num);
+	add_inode_to_dir(fd, &fs, n1, &i1, inode_num, &inode, "f1");
+	inode_data_write(fd, &fs, &inode, data, sizeof(data), 0);
+	EXPECT(remove_dir_entry(fd, &fs, n1, &i1, inode_num, &inode));
+	EXPECT(inode.nlinks == 0);
+	EXPECT(get_inode_state(fd, &fs, inode_num) == 1);
+	EXPECT(fs.main_block.free_data_block_count < free_blocks);
+	remove_file(fd, &fs, inode_num, &inode);
+	EXPECT(get_inode_state(fd, &fs, inode_num) == 0);
+	EXPECT_EQUAL(fs.main_block.free_data_block_count, free_blocks);
+}
+
+static void test_fs_state(void)
+{
+	write_blank_fs(fd, &fs, MYFS_FEATURES_DEFAULT);
+	EXPECT_EQUAL(fs.main_block.state, MYFS_STATE_CLEAN);
+	write_fs_state(fd, &fs, MYFS_STATE_DIRTY);
+
+	struct inode_t root_inode, a, b;
+	uint32_t na, nb;
+	read_inode(fd, &fs, 0, &root_inode);
+	clear_inode(&a);
+	clear_inode(&b);
+	create_inode(fd, &fs, &a, &na);
+	create_inode(fd, &fs, &b, &nb);
+	add_inode_to_dir(fd, &fs, 0, &root_inode, na, &a, "a");
+	add_inode_to_dir(fd, &fs, 0, &root_inode, nb, &b, "b");
+	uint8_t data[3000];
+	memset(data, 0x33, sizeof(data));
+	for (int i = 0; i < 5; ++i)
+		inode_data_write(fd, &fs, &a, data, sizeof(data), i * sizeof(data));
+	inode_data_write(fd, &fs, &b, data, sizeof(data), 0);
+	write_inode(fd, &fs, na, &a);
+	write_inode(fd, &fs, nb, &b);
+	EXPECT_EQUAL(fs.main_block.inode_count, 3);
+
+	// Freed inodes and blocks are found again
+	const uint32_t old_block_hint = fs.main_block.free_block_hint;
+	EXPECT(remove_inode_from_dir(fd, &fs, 0, &root_inode, na, &a));
+	EXPECT_EQUAL(fs.main_block.free_inode_hint, na);
+	const uint32_t block_hint = fs.main_block.free_block_hint;
+	EXPECT(block_hint < old_block_hint);
+	write_main_block(fd, &fs);
+
+	struct fsinfo_t read;
+	read_fsinfo(fd, &read);
+	EXPECT_EQUAL(read.main_block.state, MYFS_STATE_DIRTY);
+	EXPECT_EQUAL(read.main_block.free_block_hint, block_hint);
+
+	// What a dirty mount does
+	const struct main_block_t expected = fs.main_block;
+	read.main_block.inode_count = 0;
+	read.main_block.free_data_block_count = 0;
+	read.main_block.free_block_hint = 0;
+	read.main_block.free_inode_hint = 0;
+	rescan_allocator(fd, &read);
+	EXPECT_EQUAL(read.main_block.inode_count, expected.inode_count);
+	EXPECT_EQUAL(read.main_block.free_data_block_count, expected.free_data_block_count);
+	EXPECT_EQUAL(read.main_block.free_block_hint, expected.free_block_hint);
+	EXPECT_EQUAL(read.main_block.free_inode_hint, expected.free_inode_hint);
+
+	uint32_t n;
+	struct inode_t c;
+	clear_inode(&c);
+	create_inode(fd, &fs, &c, &n);
+	EXPECT_EQUAL(n, na);
+	set_inode_state(fd, &fs, n, 0);
+
+	write_fs_state(fd, &fs, MYFS_STATE_CLEAN);
+	read_fsinfo(fd, &read);
+	EXPECT_EQUAL(read.main_block.state, MYFS_STATE_CLEAN);
+	EXPECT_EQUAL(read.main_block.inode_count, fs.main_block.inode_count);
+}
+
+/* Copy the device as it is now, as if the machine crashed */
+static int crash_copy(const char *copy_path)
+{
+	int copy = open(copy_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	EXPECT(copy != -1);
+	const uint32_t len = 1024 * 1024;
+	uint8_t *buf = (uint8_t *)malloc(len);
+	ssize_t r;
+	for (uint64_t pos = 0; (r = pread(fd, buf, len, pos)) > 0; pos += r)
+		pwrite(copy, buf, r, pos);
+	free(buf);
+	return copy;
+}
+
+static void test_journal(void)
+{
+	write_blank_fs(fd, &fs, MYFS_FEATURES_DEFAULT);
+	EXPECT(fs.journal_pos > 0);
+	EXPECT(journal_open(fd, &fs, 60) != NULL);
+
+	uint32_t dir_num, file_num;
+	struct inode_t root_inode, dir, file;
+	journal_start(fs.journal);
+	read_inode(fd, &fs, 0, &root_inode);
+	clear_inode(&dir);
+	dir.mode = mode_ftype_dir;
+	clear_inode(&file);
+	create_inode(fd, &fs, &dir, &dir_num);
+	add_inode_to_dir(fd, &fs, 0, &root_inode, dir_num, &dir, "dir");
+	create_inode(fd, &fs, &file, &file_num);
+	add_inode_to_dir(fd, &fs, dir_num, &dir, file_num, &file, "file");
+	write_main_block(fd, &fs);
+	journal_stop(fs.journal);
+	EXPECT_EQUAL(journal_sync(fs.journal), 0);
+	EXPECT_EQUAL(fs.journal->commits, 1);
+
+	// The changes are only in the journal so far
+	char copy_path[256];
+	snprintf(copy_path, sizeof(copy_path), "%s.crash", path);
+	int copy = crash_copy(copy_path);
+	struct fsinfo_t copy_fs;
+	read_fsinfo(copy, &copy_fs);
+	EXPECT_EQUAL(get_inode_state(copy, &copy_fs, dir_num), 0);
+
+	EXPECT_EQUAL(journal_replay(copy, &copy_fs), 1);
+	read_fsinfo(copy, &copy_fs);
+	EXPECT_EQUAL(copy_fs.main_block.inode_count, fs.main_block.inode_count);
+	uint32_t inode_num;
+	struct inode_t inode;
+	EXPECT(get_path_inode(copy, &copy_fs, "/dir/file", &inode_num, &inode, NULL, NULL, NULL));
+	EXPECT_EQUAL(inode_num, file_num);
+	// Nothing is replayed twice
+	EXPECT_EQUAL(journal_replay(copy, &copy_fs), 0);
+	close(copy);
+	unlink(copy_path);
+
+	// A block freed by the running transaction isn't given to another file
+	// before it is committed. File data is written in place, like main.c does.
+	const uint32_t bs = fs.main_block.block_size;
+	uint8_t old_data[bs], new_data[bs];
+	memset(old_data, 0x5A, bs);
+	memset(new_data, 0xA5, bs);
+	journal_start(fs.journal);
+	prepare_file_write(fd, &fs, &file, 0, bs);
+	write_inode(fd, &fs, file_num, &file);
+	journal_stop(fs.journal);
+	const uint64_t old_block = get_file_block(fd, &fs, &file, 0);
+	pwrite(fd, old_data, bs, fs.blocks_pos + old_block * bs);
+	EXPECT_EQUAL(journal_sync(fs.journal), 0);
+
+	uint32_t other_num;
+	struct inode_t other;
+	journal_start(fs.journal);
+	resize_file(fd, &fs, &file, 0);
+	write_inode(fd, &fs, file_num, &file);
+	clear_inode(&other);
+	create_inode(fd, &fs, &other, &other_num);
+	prepare_file_write(fd, &fs, &other, 0, bs);
+	write_inode(fd, &fs, other_num, &other);
+	journal_stop(fs.journal);
+	const uint64_t new_block = get_file_block(fd, &fs, &other, 0);
+	EXPECT(new_block != old_block);
+	pwrite(fd, new_data, bs, fs.blocks_pos + new_block * bs);
+
+	copy = crash_copy(copy_path);
+	read_fsinfo(copy, &copy_fs);
+	journal_replay(copy, &copy_fs);
+	read_fsinfo(copy, &copy_fs);
+	read_inode(copy, &copy_fs, file_num, &inode);
+	EXPECT_EQUAL(inode.size, bs);
+	uint8_t buf[bs];
+	inode_data_read(copy, &copy_fs, &inode, buf, bs, 0);
+	EXPECT(memcmp(buf, old_data, bs) == 0);
+	close(copy);
+	unlink(copy_path);
+
+	journal_close(fs.journal);
+	EXPECT_EQUAL(get_block_state(fd, &fs, old_block), 0);
+	EXPECT(fs.journal == NULL);
+	read_fsinfo(fd, &fs);
+	EXPECT(get_path_inode(fd, &fs, "/dir/file", &inode_num, &inode, NULL, NULL, NULL));
+	EXPECT_EQUAL(journal_replay(fd, &fs), 0);
+}
+
+static int same_main_block(const struct main_block_t *a, const struct main_block_t *b)
+{
+	return a->inode_count_limit == b->inode_count_limit && a->inode_count == b->inode_count &&
+		a->block_count == b->block_count && a->data_block_count == b->data_block_count &&
+		a->free_data_block_count == b->free_data_block_count && a->block_size == b->block_size &&
+		a->magic == b->magic && a->features == b->features && a->journal_blocks == b->journal_blocks &&
+		a->state == b->state && a->free_block_hint == b->free_block_hint &&
+		a->free_inode_hint == b->free_inode_hint && a->reserved_blocks == b->reserved_blocks &&
+		a->layout_data_block_count == b->layout_data_block_count && a->metadata_block == b->metadata_block;
+}
+
+static void test_geometry(void)
+{
+	struct fs_params_t params;
+	default_fs_params(&params, MYFS_FEATURES_DEFAULT);
+	params.block_size = 1024;
+	params.bytes_per_inode = 16384;
+	params.reserved_percent = 5;
+	format_fs(fd, &fs, &params);
+	const uint64_t size = lseek(fd, 0, SEEK_END);
+	EXPECT_EQUAL(fs.main_block.block_size, 1024);
+	EXPECT_EQUAL(fs.main_block.inode_count_limit, size / 16384);
+	EXPECT_EQUAL(fs.main_block.reserved_blocks, fs.main_block.data_block_count * 5 / 100);
+	EXPECT(fs.blocks_pos + (uint64_t)fs.main_block.data_block_count * 1024 <= size);
+
+	struct fsinfo_t read;
+	read_fsinfo(fd, &read);
+	EXPECT(same_main_block(&read.main_block, &fs.main_block));
+
+	// Enough data to need double indirect blocks
+	struct inode_t root_inode, inode;
+	uint32_t inode_num;
+	read_inode(fd, &fs, 0, &root_inode);
+	clear_inode(&inode);
+	create_inode(fd, &fs, &inode, &inode_num);
+	add_inode_to_dir(fd, &fs, 0, &root_inode, inode_num, &inode, "f");
+	const uint32_t len = 512 * 1024;
+	uint8_t *data = (uint8_t *)malloc(len);
+	uint8_t *back = (uint8_t *)malloc(len);
+	for (uint32_t i = 0; i < len; ++i)
+		data[i] = i * 7 + i / 1024;
+	EXPECT_EQUAL(inode_data_write(fd, &fs, &inode, data, len, 100), len);
+	write_inode(fd, &fs, inode_num, &inode);
+	read_inode(fd, &fs, inode_num, &inode);
+	EXPECT_EQUAL(inode_data_read(fd, &fs, &inode, back, len, 100), len);
+	EXPECT(!memcmp(data, back, len));
+	free(data);
+	free(back);
+}
+
+static void test_64bit(void)
+{
+	struct fs_params_t params;
+	default_fs_params(&params, MYFS_FEATURES_DEFAULT | MYFS_FEATURE_64BIT);
+	params.block_size = 1024;
+	format_fs(fd, &fs, &params);
+	EXPECT_EQUAL(fs.inode_size, INODE_SIZE_64BIT);
+	EXPECT_EQUAL(fs.pointer_size, 8);
+	EXPECT_EQUAL(fs.inode_bitmap_pos, MAIN_BLOCK_64BIT_SIZE);
+
+	// The high halves of the counts survive a round trip
+	struct fsinfo_t read;
+	const struct main_block_t saved = fs.main_block;
+	fs.main_block.block_count += 3ULL << 32;
+	fs.main_block.reserved_blocks += 5ULL << 32;
+	write_main_block(fd, &fs);
+	read_fsinfo(fd, &read);
+	EXPECT(same_main_block(&read.main_block, &fs.main_block));
+	fs.main_block = saved;
+	write_main_block(fd, &fs);
+
+	// Enough data for doubly-indirect blocks, which hold half as many IDs
+	struct inode_t root_inode, inode;
+	uint32_t inode_num;
+	read_inode(fd, &fs, 0, &root_inode);
+	clear_inode(&inode);
+	create_inode(fd, &fs, &inode, &inode_num);
+	add_inode_to_dir(fd, &fs, 0, &root_inode, inode_num, &inode, "f");
+	const uint64_t free_blocks = fs.main_block.free_data_block_count;
+	const uint32_t len = 256 * 1024;
+	uint8_t *data = (uint8_t *)malloc(len);
+	uint8_t *back = (uint8_t *)malloc(len);
+	for (uint32_t i = 0; i < len; ++i)
+		data[i] = i * 13 + i / 1024;
+	EXPECT_EQUAL(inode_data_write(fd, &fs, &inode, data, len, 0), len);
+	EXPECT(inode.blockpos[13] != 0);
+	write_inode(fd, &fs, inode_num, &inode);
+	read_inode(fd, &fs, inode_num, &inode);
+	EXPECT_EQUAL(file_block_count(&fs, &inode), len / 1024);
+	EXPECT_EQUAL(inode_data_read(fd, &fs, &inode, back, len, 0), len);
+	EXPECT(!memcmp(data, back, len));
+
+	// A singly-indirect block of 128 IDs, and a doubly-indirect one with another below it
+	const struct indirect_block_count_t indirect = calc_indirect_block_count(&fs, len / 1024);
+	EXPECT_EQUAL(indirect.singly_indirect, 2);
+	EXPECT_EQUAL(indirect.doubly_indirect, 1);
+	EXPECT_EQUAL(free_blocks - fs.main_block.free_data_block_count, len / 1024 + indirect.total_indirect);
+	EXPECT_EQUAL(inode.blocks, len / 1024 + indirect.total_indirect);
+
+	resize_file(fd, &fs, &inode, 0);
+	EXPECT_EQUAL(fs.main_block.free_data_block_count, free_blocks);
+	EXPECT(remove_inode_from_dir(fd, &fs, 0, &root_inode, inode_num, &inode));
+	write_inode(fd, &fs, 0, &root_inode);
+	write_main_block(fd, &fs);
+	free(data);
+	free(back);
+}
+
+/* Grow the filesystem and check the allocator agrees with the bitmap */
+static void grow_and_check(uint64_t size)
+{
+	ftruncate(fd, size);
+	const uint64_t old_count = fs.main_block.data_block_count;
+	const uint64_t old_free = fs.main_block.free_data_block_count;
+	const uint64_t old_meta = metadata_block_count(&fs);
+	EXPECT_EQUAL(grow_fs(fd, &fs, size), 0);
+	EXPECT(fs.main_block.features & MYFS_FEATURE_RESIZED);
+	EXPECT_EQUAL(fs.main_block.data_block_count, (size - fs.blocks_pos) / fs.main_block.block_size);
+	EXPECT_EQUAL(fs.main_block.free_data_block_count - old_free,
+			fs.main_block.data_block_count - old_count - metadata_block_count(&fs) + old_meta);
+
+	struct fsinfo_t read;
+	read_fsinfo(fd, &read);
+	EXPECT(same_main_block(&read.main_block, &fs.main_block));
+	EXPECT_EQUAL(read.data_blocks_bitmap_pos, fs.data_blocks_bitmap_pos);
+	EXPECT_EQUAL(read.refcounts_pos, fs.refcounts_pos);
+	EXPECT_EQUAL(read.inodes_pos, fs.inodes_pos);
+	EXPECT_EQUAL(read.blocks_pos, fs.blocks_pos);
+	const uint64_t free_blocks = fs.main_block.free_data_block_count;
+	rescan_allocator(fd, &fs);
+	EXPECT_EQUAL(fs.main_block.free_data_block_count, free_blocks);
+}
+
+static void test_grow(void)
+{
+	const uint64_t size = lseek(fd, 0, SEEK_END);
+	struct fs_params_t params;
+	default_fs_params(&params, MYFS_FEATURES_DEFAULT);
+	params.block_size = 1024;
+	format_fs(fd, &fs, &params);
+	const uint64_t layout_count = fs.main_block.data_block_count;
+	const uint64_t inodes_pos = fs.inodes_pos;
+
+	struct inode_t src, dest, big;
+	uint32_t src_num, dest_num, big_num;
+	clear_inode(&src);
+	clear_inode(&dest);
+	clear_inode(&big);
+	create_inode(fd, &fs, &src, &src_num);
+	create_inode(fd, &fs, &dest, &dest_num);
+	create_inode(fd, &fs, &big, &big_num);
+	const uint64_t len = 300 * 1024;
+	uint8_t *data = (uint8_t *)malloc(len);
+	for (uint64_t i = 0; i < len; ++i)
+		data[i] = i * 3 + i / 7000;
+	inode_data_write(fd, &fs, &src, data, len, 0);
+	EXPECT_EQUAL(clone_file(fd, &fs, &src, &dest), 0);
+
+	// The data bitmap and reference counts move out of their place, which is left as it was
+	grow_and_check(size + 4 * 1024 * 1024);
+	EXPECT_EQUAL(fs.main_block.layout_data_block_count, layout_count);
+	EXPECT_EQUAL(fs.main_block.metadata_block, layout_count);
+	EXPECT_EQUAL(fs.inodes_pos, inodes_pos);
+	EXPECT(file_content_is(&src, data, len));
+	EXPECT(file_content_is(&dest, data, len));
+
+	// The new space can be used, and shared blocks are still shared
+	uint8_t *big_data = (uint8_t *)malloc(15 * 1024 * 1024);
+	memset(big_data, 0x3C, 15 * 1024 * 1024);
+	EXPECT_EQUAL(inode_data_write(fd, &fs, &big, big_data, 15 * 1024 * 1024, 0), 15 * 1024 * 1024);
+	EXPECT(get_file_block(fd, &fs, &big, 15 * 1024 - 1) >= layout_count);
+	const uint64_t free_blocks = fs.main_block.free_data_block_count;
+	data[5] = ~data[5];
+	inode_data_write(fd, &fs, &dest, data + 5, 1, 5);
+	EXPECT_EQUAL(fs.main_block.free_data_block_count, free_blocks - 1);
+	EXPECT(file_content_is(&dest, data, len));
+
+	// Growing again frees where they were moved before; a few blocks more may fit there
+	const uint64_t metadata_block = fs.main_block.metadata_block;
+	grow_and_check(size + 8 * 1024 * 1024);
+	EXPECT(fs.main_block.metadata_block > metadata_block);
+	EXPECT(!get_block_state(fd, &fs, metadata_block));
+	grow_and_check(size + 8 * 1024 * 1024 + 2048);
+	EXPECT(file_content_is(&dest, data, len));
+	data[5] = ~data[5];
+	EXPECT(file_content_is(&src, data, len));
+
+	// It never shrinks
+	EXPECT_EQUAL(grow_fs(fd, &fs, size), EINVAL);
+
+	free(data);
+	free(big_data);
+	ftruncate(fd, size);
+}
+
+struct library_reader
+{
+	struct libmyfs_t *lfs;
+	uint32_t inode_num;
+	const uint8_t *data;
+	uint64_t len;
+	int ok;
+};
+
+static void *library_read_thread(void *arg)
+{
+	struct library_reader *r = (struct library_reader *)arg;
+	uint8_t buf[5000];
+	r->ok = 1;
+	for (uint64_t pos = 0; pos < r->len && r->ok; pos += sizeof(buf)) {
+		const int64_t n = libmyfs_read(r->lfs, r->inode_num, buf, sizeof(buf), pos);
+		r->ok = n == (int64_t)MIN(sizeof(buf), r->len - pos) && memcmp(buf, r->data + pos, n) == 0;
+	}
+	return NULL;
+}
+
+static int library_dir_cb(void *data, const char *name, uint32_t inode_num)
+{
+	EXPECT(!strcmp(name, "file"));
+	++*(int *)data;
+	return 0;
+}
+
+/* Fill a file with data of its own, made from seed */
+static void write_test_file(uint32_t inode_num, struct inode_t *inode, uint32_t seed, uint64_t len)
+{
+	uint8_t *data = (uint8_t *)malloc(len);
+	for (uint64_t i = 0; i < len; ++i)
+		data[i] = seed * 13 + i + i / 251;
+	inode_data_write(fd, &fs, inode, data, len, 0);
+	write_inode(fd, &fs, inode_num, inode);
+	free(data);
+}
+
+/* Whether a file has the data write_test_file() gave it */
+static int check_test_file(uint32_t inode_num, uint32_t seed, uint64_t len)
+{
+	struct inode_t inode;
+	read_inode(fd, &fs, inode_num, &inode);
+	if (inode.size != len)
+		return 0;
+	uint8_t *data = (uint8_t *)malloc(len);
+	inode_data_read(fd, &fs, &inode, data, len, 0);
+	int ok = 1;
+	for (uint64_t i = 0; i < len && ok; ++i)
+		ok = data[i] == (uint8_t)(seed * 13 + i + i / 251);
+	free(data);
+	return ok;
+}
+
+static void test_fsck(void)
+{
+	if (!have_tool("fsck.myfs"))
+		return;
+	write_blank_fs(fd, &fs, MYFS_FEATURES_DEFAULT);
+	struct inode_t root, dir;
+	uint32_t dir_num;
+	read_inode(fd, &fs, 0, &root);
+	initialize_inode(&dir, 0, 0, 0755 | mode_ftype_dir);
+	create_inode(fd, &fs, &dir, &dir_num);
+	add_inode_to_dir(fd, &fs, 0, &root, dir_num, &dir, "d");
+	const int file_count = 60;
+	const uint64_t len = 3000;
+	uint32_t nums[file_count];
+	for (int i = 0; i < file_count; ++i) {
+		struct inode_t inode;
+		char name[16];
+		sprintf(name, "f%d", i);
+		initialize_inode(&inode, 0, 0, 0644 | mode_ftype_file);
+		create_inode(fd, &fs, &inode, &nums[i]);
+		add_inode_to_dir(fd, &fs, dir_num, &dir, nums[i], &inode, name);
+		write_test_file(nums[i], &inode, i, len);
+	}
+	write_main_block(fd, &fs);
+	EXPECT_EQUAL(dir_num, 1);
+
+	char out[16384];
+	EXPECT_EQUAL(run_tool(out, sizeof(out), "fsck.myfs %s", path), 0);
+
+	// A damaged inode bitmap marks the directory and its first files free; they are taken back
+	// with all they refer to, and nothing is taken for unreferenced
+	const uint8_t damaged = 0x01;
+	pwrite(fd, &damaged, 1, fs.inode_bitmap_pos);
+	EXPECT_EQUAL(run_tool(out, sizeof(out), "fsck.myfs %s", path), 4);
+	EXPECT(strstr(out, "inode 1 is in 1 directories but marked free\n"));
+	EXPECT(strstr(out, "inode 7 is in 1 directories but marked free\n"));
+	EXPECT(!strstr(out, "not in any directory"));
+	EXPECT_EQUAL(run_tool(out, sizeof(out), "fsck.myfs -y %s", path), 1);
+	EXPECT(strstr(out, "inode 1 is in 1 directories but marked free (fixed)"));
+	EXPECT(strstr(out, "7 problems, 0 left"));
+	EXPECT_EQUAL(run_tool(out, sizeof(out), "fsck.myfs %s", path), 0);
+	read_fsinfo(fd, &fs);
+	EXPECT_EQUAL(fs.main_block.inode_count, file_count + 2);
+	for (int i = 0; i < file_count; ++i) {
+		EXPECT_S(get_inode_state(fd, &fs, nums[i]), "File %d was freed", i);
+		EXPECT_S(check_test_file(nums[i], i, len), "Wrong content in file %d", i);
+	}
+
+	// A block marked free, wrong links, a wrong block count and an inode in no directory
+	struct inode_t inode;
+	read_inode(fd, &fs, nums[0], &inode);
+	const uint64_t block = inode.blockpos[0];
+	uint8_t bits;
+	pread(fd, &bits, 1, fs.data_blocks_bitmap_pos + block / 8);
+	bits &= ~(1 << (block % 8));
+	pwrite(fd, &bits, 1, fs.data_blocks_bitmap_pos + block / 8);
+	read_inode(fd, &fs, nums[1], &inode);
+	inode.nlinks = 3;
+	write_inode(fd, &fs, nums[1], &inode);
+	read_inode(fd, &fs, nums[3], &inode);
+	const uint64_t used_blocks = inode.blocks;
+	inode.blocks += 5;
+	write_inode(fd, &fs, nums[3], &inode);
+	uint32_t orphan_num;
+	initialize_inode(&inode, 0, 0, 0644 | mode_ftype_file);
+	inode.nlinks = 1;
+	create_inode(fd, &fs, &inode, &orphan_num);
+	write_test_file(orphan_num, &inode, 100, 20000);
+	write_main_block(fd, &fs);
+	const uint64_t free_blocks = fs.main_block.free_data_block_count;
+
+	EXPECT_EQUAL(run_tool(out, sizeof(out), "fsck.myfs -y %s", path), 1);
+	char expected[128];
+	sprintf(expected, "block %lu is used but marked free (fixed)", (unsigned long)block);
+	EXPECT(strstr(out, expected));
+	sprintf(expected, "inode %u has 3 links but is in 1 directories (fixed)", nums[1]);
+	EXPECT(strstr(out, expected));
+	sprintf(expected, "inode %u is not in any directory (fixed)", orphan_num);
+	EXPECT(strstr(out, expected));
+	sprintf(expected, "inode %u: counts %lu blocks but uses %lu (fixed)", nums[3],
+			(unsigned long)used_blocks + 5, (unsigned long)used_blocks);
+	EXPECT(strstr(out, expected));
+	EXPECT_EQUAL(run_tool(out, sizeof(out), "fsck.myfs %s", path), 0);
+	read_fsinfo(fd, &fs);
+	EXPECT(get_block_state(fd, &fs, block));
+	read_inode(fd, &fs, nums[1], &inode);
+	EXPECT_EQUAL(inode.nlinks, 1);
+	read_inode(fd, &fs, nums[3], &inode);
+	EXPECT_EQUAL(inode.blocks, used_blocks);
+	EXPECT(!get_inode_state(fd, &fs, orphan_num));
+	EXPECT(fs.main_block.free_data_block_count > free_blocks);
+	EXPECT(check_test_file(nums[0], 0, len));
+
+	// A free inode that isn't valid can't be taken back, so inodes in no directory
+	// and blocks no inode uses may be what it refers to, and are kept
+	initialize_inode(&inode, 0, 0, 0644 | mode_ftype_file);
+	inode.nlinks = 1;
+	create_inode(fd, &fs, &inode, &orphan_num);
+	read_inode(fd, &fs, nums[2], &inode);
+	const uint64_t lost_block = inode.blockpos[0];
+	inode.mode = 0xFFFF;
+	write_inode(fd, &fs, nums[2], &inode);
+	set_inode_state(fd, &fs, nums[2], 0);
+	write_main_block(fd, &fs);
+	EXPECT_EQUAL(run_tool(out, sizeof(out), "fsck.myfs -y %s", path), 4);
+	sprintf(expected, "inode %u is free but in 1 directories\n", nums[2]);
+	EXPECT(strstr(out, expected));
+	sprintf(expected, "inode %u is not in any directory\n", orphan_num);
+	EXPECT(strstr(out, expected));
+	sprintf(expected, "block %lu is marked used but no inode uses it\n", (unsigned long)lost_block);
+	EXPECT(strstr(out, expected));
+	EXPECT(get_inode_state(fd, &fs, orphan_num));
+	EXPECT(get_block_state(fd, &fs, lost_block));
+}
+
+/* Skip a JSON value, checking its syntax
+ *
+ * returns: the end of the value; NULL if it isn't valid
+ */
+static const char *skip_json(const char *p)
+{
+	while (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r')
+		++p;
+	if (*p == '{' || *p == '[') {
+		const char close = *p == '{' ? '}' : ']';
+		const int object = *p == '{';
+		++p;
+		while (*p == ' ' || *p == '\n')
+			++p;
+		if (*p == close)
+			return p + 1;
+		for (;;) {
+			if (object) {
+				while (*p == ' ' || *p == '\n')
+					++p;
+				if (*p != '"' || !(p = skip_json(p)))
+					return NULL;
+				while (*p == ' ' || *p == '\n')
+					++p;
+				if (*p++ != ':')
+					return NULL;
+			}
+			if (!(p = skip_json(p)))
+				return NULL;
+			while (*p == ' ' || *p == '\n')
+				++p;
+			if (*p == close)
+				return p + 1;
+			if (*p++ != ',')
+				return NULL;
+		}
+	}
+	if (*p == '"') {
+		for (++p; *p != '"'; ++p)
+			if (*p == '\0' || (*p == '\\' && *++p == '\0'))
+				return NULL;
+		return p + 1;
+	}
+	if (!strncmp(p, "true", 4) || !strncmp(p, "null", 4))
+		return p + 4;
+	if (!strncmp(p, "false", 5))
+		return p + 5;
+	char *end;
+	strtod(p, &end);
+	return end != p ? end : NULL;
+}
+
+static int is_json(const char *text)
+{
+	const char *end = skip_json(text);
+	while (end && (*end == ' ' || *end == '\n'))
+		++end;
+	return end && *end == '\0';
+}
+
+static void test_fsinfo(void)
+{
+	if (!have_tool("fsinfo"))
+		return;
+	write_blank_fs(fd, &fs, MYFS_FEATURES_DEFAULT);
+
+	// a and b take turns allocating a block each, so that each block is an
+	// extent of its own; c takes a run after them, and b is removed
+	const uint16_t bs = fs.main_block.block_size;
+	struct inode_t a, b, c;
+	uint32_t a_num, b_num, c_num;
+	initialize_inode(&a, 0, 0, 0644 | mode_ftype_file);
+	b = c = a;
+	a.nlinks = b.nlinks = c.nlinks = 1;
+	create_inode(fd, &fs, &a, &a_num);
+	create_inode(fd, &fs, &b, &b_num);
+	create_inode(fd, &fs, &c, &c_num);
+	uint8_t *data = (uint8_t *)calloc(8, bs);
+	for (int i = 0; i < 10; ++i) {
+		inode_data_write(fd, &fs, &a, data, bs, (uint64_t)i * bs);
+		inode_data_write(fd, &fs, &b, data, bs, (uint64_t)i * bs);
+	}
+	inode_data_write(fd, &fs, &c, data, 8 * bs, 0);
+	free(data);
+	for (int i = 0; i < 10; ++i)
+		EXPECT_EQUAL(a.blockpos[i], 1 + 2 * i);
+	EXPECT_EQUAL(c.blockpos[7], 28);
+	write_inode(fd, &fs, a_num, &a);
+	write_inode(fd, &fs, c_num, &c);
+	b.nlinks = 0;
+	remove_file(fd, &fs, b_num, &b);
+	write_main_block(fd, &fs);
+
+	// 10 single blocks between those of a, and the rest after c
+	const uint64_t largest = fs.main_block.data_block_count - 29;
+	const int largest_class = 63 - __builtin_clzll(largest);
+	char out[16384], expected[256];
+	EXPECT_EQUAL(run_tool(out, sizeof(out), "fsinfo -a %s", path), 0);
+	EXPECT(strstr(out, "Free extents:              11\n"));
+	sprintf(expected, "Largest free extent:       %lu blocks\n", (unsigned long)largest);
+	EXPECT(strstr(out, expected));
+	EXPECT(strstr(out, "    1 block                10\n"));
+	sprintf(expected, "%lu-%lu blocks", 1UL << largest_class, (2UL << largest_class) - 1);
+	EXPECT(strstr(out, expected));
+	EXPECT(strstr(out, "Files with data:           2\n"));
+	EXPECT(strstr(out, "Fragmented files:          1\n"));
+	EXPECT(strstr(out, "File extents:              11\n"));
+	sprintf(expected, "    inode %-16u 10 extents, 10 blocks\n", a_num);
+	EXPECT(strstr(out, expected));
+
+	EXPECT_EQUAL(run_tool(out, sizeof(out), "fsinfo -a -j %s", path), 0);
+	EXPECT(is_json(out));
+	EXPECT(strstr(out, "\"free_space\": {\n    \"extents\": 11,\n"));
+	sprintf(expected, "\"largest_extent\": %lu,", (unsigned long)largest);
+	EXPECT(strstr(out, expected));
+	EXPECT(strstr(out, "{ \"min_blocks\": 1, \"max_blocks\": 1, \"extents\": 10 }"));
+	sprintf(expected, "{ \"min_blocks\": %lu, \"max_blocks\": %lu, \"extents\": 1 }",
+			1UL << largest_class, (2UL << largest_class) - 1);
+	EXPECT(strstr(out, expected));
+	EXPECT(strstr(out, "\"fragmented\": 1,"));
+	sprintf(expected, "{ \"inode\": %u, \"extents\": 10, \"blocks\": 10 }", a_num);
+	EXPECT(strstr(out, expected));
+
+	// Without -a
+	EXPECT_EQUAL(run_tool(out, sizeof(out), "fsinfo -j %s", path), 0);
+	EXPECT(is_json(out));
+	EXPECT(!strstr(out, "free_space"));
+	EXPECT(!is_json("{ \"a\": 1, }"));
+	EXPECT(!is_json("{ \"a\": [1, 2 }"));
+}
+
+/* Whether a file of a restored copy has the content of the same file here */
+static int same_file(struct libmyfs_t *copy, uint32_t inode_num)
+{
+	struct inode_t inode;
+	read_inode(fd, &fs, inode_num, &inode);
+	struct stat st;
+	if (libmyfs_stat(copy, inode_num, &st) != 0 || (uint64_t)st.st_size != inode.size)
+		return 0;
+	uint8_t *a = (uint8_t *)malloc(inode.size + 1), *b = (uint8_t *)malloc(inode.size + 1);
+	inode_data_read(fd, &fs, &inode, a, inode.size, 0);
+	const int same = libmyfs_read(copy, inode_num, b, inode.size, 0) == (int64_t)inode.size &&
+		memcmp(a, b, inode.size) == 0;
+	free(a);
+	free(b);
+	return same;
+}
+
+static void test_dump(void)
+{
+	if (!have_tool("dump.myfs") || !have_tool("restore.myfs") || !have_tool("fsck.myfs"))
+		return;
+	write_blank_fs(fd, &fs, MYFS_FEATURES_DEFAULT);
+	struct inode_t root, dir, inode;
+	uint32_t dir_num, nums[4];
+	read_inode(fd, &fs, 0, &root);
+	initialize_inode(&dir, 0, 0, 0755 | mode_ftype_dir);
+	create_inode(fd, &fs, &dir, &dir_num);
+	add_inode_to_dir(fd, &fs, 0, &root, dir_num, &dir, "d");
+	const uint64_t sizes[4] = { 1, 5000, 300 * 1024, 2 * 1024 * 1024 };
+	for (int i = 0; i < 4; ++i) {
+		char name[16];
+		sprintf(name, "f%d", i);
+		initialize_inode(&inode, 0, 0, 0644 | mode_ftype_file);
+		create_inode(fd, &fs, &inode, &nums[i]);
+		add_inode_to_dir(fd, &fs, dir_num, &dir, nums[i], &inode, name);
+		write_test_file(nums[i], &inode, i, sizes[i]);
+	}
+	// With a hole in the middle
+	uint8_t tail[100];
+	memset(tail, 0xAB, sizeof(tail));
+	inode_data_write(fd, &fs, &inode, tail, sizeof(tail), 6 * 1024 * 1024);
+	write_inode(fd, &fs, nums[3], &inode);
+	write_fs_state(fd, &fs, MYFS_STATE_CLEAN);
+
+	char dump[4096], copies[2][4096], out[4096];
+	snprintf(dump, sizeof(dump), "%s.dump", path);
+	snprintf(copies[0], sizeof(copies[0]), "%s.copy", path);
+	snprintf(copies[1], sizeof(copies[1]), "%s.copy2", path);
+	EXPECT_EQUAL(run_tool(out, sizeof(out), "dump.myfs %s %s", path, dump), 0);
+	EXPECT_EQUAL(run_tool(out, sizeof(out), "restore.myfs %s %s", dump, copies[0]), 0);
+	EXPECT_EQUAL(run_tool(out, sizeof(out), "dump.myfs %s - | restore.myfs - %s", path, copies[1]), 0);
+
+	const uint64_t size = lseek(fd, 0, SEEK_END);
+	for (int c = 0; c < 2; ++c) {
+		struct stat st;
+		EXPECT_EQUAL(stat(copies[c], &st), 0);
+		EXPECT_EQUAL(st.st_size, size);
+		// Only what the files and metadata use is written
+		EXPECT_S((uint64_t)st.st_blocks * 512 < size / 2, "Copy %d isn't sparse: %lu bytes allocated",
+				c, (unsigned long)st.st_blocks * 512);
+		EXPECT_EQUAL(run_tool(out, sizeof(out), "fsck.myfs %s", copies[c]), 0);
+
+		struct libmyfs_t *copy;
+		const int err = libmyfs_open(copies[c], LIBMYFS_RDONLY, &copy);
+		EXPECT_EQUAL(err, 0);
+		if (err)
+			continue;
+		uint32_t n;
+		EXPECT_EQUAL(libmyfs_lookup(copy, "/d/f3", &n), 0);
+		EXPECT_EQUAL(n, nums[3]);
+		for (int i = 0; i < 4; ++i)
+			EXPECT_S(same_file(copy, nums[i]), "File %d differs in copy %d", i, c);
+		EXPECT_EQUAL(libmyfs_close(copy), 0);
+		unlink(copies[c]);
+	}
+
+	// A truncated dump is refused
+	EXPECT_EQUAL(truncate(dump, 5000), 0);
+	EXPECT(run_tool(out, sizeof(out), "restore.myfs %s %s", dump, copies[0]) != 0);
+	EXPECT(strstr(out, "The dump is truncated"));
+	unlink(dump);
+	unlink(copies[0]);
+}
+
+static void *stats_thread(void *data)
+{
+	for (int i = 0; i < 1000; ++i)
+		stats_add(STAT_CORE_COUNT, 1);
+	return NULL;
+}
+
+static void test_stats(void)
+{
+	uint64_t before[STATS_MAX], after[STATS_MAX];
+	stats_sum(before);
+
+	// Device I/O of the core is counted with the bytes it moved
+	struct inode_t inode;
+	uint32_t num;
+	uint8_t buf[5000];
+	memset(buf, 7, sizeof(buf));
+	clear_inode(&inode);
+	create_inode(fd, &fs, &inode, &num);
+	inode_data_write(fd, &fs, &inode, buf, sizeof(buf), 0);
+	inode_data_read(fd, &fs, &inode, buf, sizeof(buf), 0);
+	stats_sum(after);
+	EXPECT(after[STAT_DEV_WRITES] > before[STAT_DEV_WRITES]);
+	EXPECT(after[STAT_DEV_WRITE_BYTES] >= before[STAT_DEV_WRITE_BYTES] + sizeof(buf));
+	EXPECT(after[STAT_DEV_READ_BYTES] >= before[STAT_DEV_READ_BYTES] + sizeof(buf));
+	EXPECT(after[STAT_ALLOC_SCANS] > before[STAT_ALLOC_SCANS]);
+	remove_file(fd, &fs, num, &inode);
+
+	// The counts of threads stay after they exit, and their counters are reused
+	const int thread_count = 4;
+	for (int round = 0; round < 2; ++round) {
+		pthread_t threads[thread_count];
+		for (int i = 0; i < thread_count; ++i)
+			pthread_create(&threads[i], NULL, stats_thread, NULL);
+		for (int i = 0; i < thread_count; ++i)
+			pthread_join(threads[i], NULL);
+	}
+	stats_sum(after);
+	EXPECT_EQUAL(after[STAT_CORE_COUNT] - before[STAT_CORE_COUNT], 2 * thread_count * 1000);
+}
+
+static void test_library(void)
+{
+	EXPECT_EQUAL(libmyfs_format(path, NULL), 0);
+	struct libmyfs_t *lfs;
+	EXPECT_EQUAL(libmyfs_open(path, LIBMYFS_RDWR, &lfs), 0);
+
+	uint32_t dir_num, file_num, n;
+	EXPECT_EQUAL(libmyfs_create(lfs, "/dir", S_IFDIR | 0755, &dir_num), 0);
+	EXPECT_EQUAL(libmyfs_create(lfs, "/dir/file", S_IFREG | 0644, &file_num), 0);
+	EXPECT_EQUAL(libmyfs_create(lfs, "/dir/file", S_IFREG | 0644, NULL), -EEXIST);
+	EXPECT_EQUAL(libmyfs_create(lfs, "/none/file", S_IFREG | 0644, NULL), -ENOENT);
+	EXPECT_EQUAL(libmyfs_create(lfs, "/dir/file/x", S_IFREG | 0644, NULL), -ENOTDIR);
+	EXPECT_EQUAL(libmyfs_lookup(lfs, "/dir/file", &n), 0);
+	EXPECT_EQUAL(n, file_num);
+	EXPECT_EQUAL(libmyfs_lookup(lfs, "/dir/none", &n), -ENOENT);
+
+	const uint64_t len = 200 * 1024;
+	uint8_t *data = (uint8_t *)malloc(len);
+	for (uint64_t i = 0; i < len; ++i)
+		data[i] = i * 7 + i / 5000;
+	EXPECT_EQUAL(libmyfs_write(lfs, file_num, data, 70000, 0), 70000);
+	EXPECT_EQUAL(libmyfs_write(lfs, file_num, data + 70000, len - 70000, 70000), len - 70000);
+	EXPECT_EQUAL(libmyfs_write(lfs, dir_num, data, 1, 0), -EISDIR);
+	struct stat st;
+	EXPECT_EQUAL(libmyfs_stat_path(lfs, "/dir/file", &st), 0);
+	EXPECT(S_ISREG(st.st_mode));
+	EXPECT_EQUAL(st.st_ino, file_num);
+	EXPECT_EQUAL(st.st_size, len);
+	EXPECT_EQUAL(libmyfs_stat(lfs, dir_num, &st), 0);
+	EXPECT(S_ISDIR(st.st_mode));
+	EXPECT_EQUAL(libmyfs_stat(lfs, fs.main_block.inode_count_limit - 1, &st), -ENOENT);
+
+	// Reads are short at the end of the file, and may run at the same time
+	uint8_t buf[100];
+	EXPECT_EQUAL(libmyfs_read(lfs, file_num, buf, sizeof(buf), len - 10), 10);
+	EXPECT_EQUAL(libmyfs_read(lfs, file_num, buf, sizeof(buf), len), 0);
+	const int thread_count = 4;
+	struct library_reader readers[thread_count];
+	pthread_t threads[thread_count];
+	for (int i = 0; i < thread_count; ++i) {
+		readers[i] = (struct library_reader){ .lfs = lfs, .inode_num = file_num, .data = data, .len = len };
+		pthread_create(&threads[i], NULL, library_read_thread, &readers[i]);
+	}
+	for (int i = 0; i < thread_count; ++i) {
+		pthread_join(threads[i], NULL);
+		EXPECT(readers[i].ok);
+	}
+
+	int entries = 0;
+	EXPECT_EQUAL(libmyfs_readdir(lfs, dir_num, library_dir_cb, &entries), 0);
+	EXPECT_EQUAL(entries, 1);
+	EXPECT_EQUAL(libmyfs_readdir(lfs, file_num, library_dir_cb, &entries), -ENOTDIR);
+	EXPECT_EQUAL(libmyfs_sync(lfs), 0);
+	EXPECT_EQUAL(libmyfs_close(lfs), 0);
+
+	// Everything is in place once it is closed
+	read_fsinfo(fd, &fs);
+	EXPECT_EQUAL(fs.main_block.state, MYFS_STATE_CLEAN);
+	EXPECT_EQUAL(libmyfs_open(path, LIBMYFS_RDONLY, &lfs), 0);
+	struct library_reader reader = { .lfs = lfs, .inode_num = file_num, .data = data, .len = len };
+	library_read_thread(&reader);
+	EXPECT(reader.ok);
+	EXPECT_EQUAL(libmyfs_write(lfs, file_num, data, 1, 0), -EROFS);
+	EXPECT_EQUAL(libmyfs_create(lfs, "/dir/other", S_IFREG | 0644, NULL), -EROFS);
+	EXPECT_EQUAL(libmyfs_close(lfs), 0);
+
+	// The core functions work on the device of a handle
+	EXPECT_EQUAL(libmyfs_open(path, LIBMYFS_RDONLY, &lfs), 0);
+	struct inode_t inode;
+	read_inode(libmyfs_device_fd(lfs), libmyfs_fsinfo(lfs), file_num, &inode);
+	EXPECT_EQUAL(inode.size, len);
+	EXPECT_EQUAL(libmyfs_fsinfo(lfs)->main_block.inode_count, fs.main_block.inode_count);
+	EXPECT_EQUAL(libmyfs_close(lfs), 0);
+
+	free(data);
 }
 
 int main(int argc, char **argv)
@@ -369,6 +1989,7 @@ int main(int argc, char **argv)
 	int short_test = !strcmp(argv[2], "short");
 
 	path = argv[1];
+	find_tools();
 
 	printf("=== Creating filesystem ===\n");
 	create_fs(short_test ? 16*1024*1024 : 2UL*1024*1024*1024);
@@ -415,6 +2036,27 @@ int main(int argc, char **argv)
 	printf("=== Test random file write() ===\n");
 	test_inode_read_write_random(short_test ? 50000 : 16*1024*1024);
 
+	printf("=== Test map_file_range() ===\n");
+	test_map_file_range();
+
+	printf("=== Test inode_data_copy() ===\n");
+	test_inode_data_copy();
+
+	printf("=== Test clone_file() ===\n");
+	test_clone_file();
+
+	printf("=== Test sparse files ===\n");
+	test_sparse_file();
+
+	printf("=== Test defragmentation ===\n");
+	test_defrag();
+
+	printf("=== Test legacy format ===\n");
+	test_legacy_format();
+
+	printf("=== Test concurrent writes ===\n");
+	test_concurrent_writes();
+
 	printf("=== Test get_path_inode() ===\n");
 	test_get_path();
 
@@ -428,9 +2070,51 @@ int main(int argc, char **argv)
 		test_remove_files(10, order);
 	}
 
+	printf("=== Test read_dir() ===\n");
+	test_read_dir();
+
+	printf("=== Test directory compaction ===\n");
+	test_compact_dir();
+
+	printf("=== Test directory filters ===\n");
+	test_dir_filter();
+
+	printf("=== Test dentry cache ===\n");
+	test_dentry_cache();
+
 	printf("=== Test hard links ===\n");
 	test_hard_links();
 
+	printf("=== Test clean unmount state ===\n");
+	test_fs_state();
+
+	printf("=== Test journal ===\n");
+	test_journal();
+
+	printf("=== Test non-default geometry ===\n");
+	test_geometry();
+
+	printf("=== Test 64-bit addressing ===\n");
+	test_64bit();
+
+	printf("=== Test growing the filesystem ===\n");
+	test_grow();
+
+	printf("=== Test libmyfs ===\n");
+	test_library();
+
+	printf("=== Test fsck.myfs ===\n");
+	test_fsck();
+
+	printf("=== Test fsinfo ===\n");
+	test_fsinfo();
+
+	printf("=== Test dump.myfs and restore.myfs ===\n");
+	test_dump();
+
+	printf("=== Test stats counters ===\n");
+	test_stats();
+
 	close(fd);
 
 	return 0;
@@ -6,6 +6,9 @@
 // ceil(A/B)
 #define CEIL_DIV(A, B) ((A)/(B) + ((A)%(B) != 0))
 
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
 #if LITTLE_ENDIAN == 1
 
 static inline void util_write_u16(uint8_t *out, uint16_t v)